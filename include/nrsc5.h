@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// IQ samples pushed to the decoder are 8-bit unsigned pairs at this rate
+#define NRSC5_SAMPLE_RATE 1488375
+// decoded audio is interleaved 16-bit stereo at this rate
+#define NRSC5_AUDIO_RATE 44100
+
+enum
+{
+    NRSC5_EVENT_SYNC,
+    NRSC5_EVENT_LOST_SYNC,
+    NRSC5_EVENT_MER,
+    NRSC5_EVENT_BER,
+    NRSC5_EVENT_HDC,
+    NRSC5_EVENT_AUDIO,
+    NRSC5_EVENT_ID3,
+    NRSC5_EVENT_SIS,
+    NRSC5_EVENT_AAS_FILE
+};
+
+typedef struct
+{
+    unsigned int event;
+    union
+    {
+        struct
+        {
+            float lower;
+            float upper;
+        } mer;
+        struct
+        {
+            float cber;
+        } ber;
+        // an HDC audio PDU, for every program carried by the station
+        struct
+        {
+            unsigned int program;
+            const uint8_t *data;
+            unsigned int count;
+        } hdc;
+        // PCM decoded from the programs added to the decoder
+        struct
+        {
+            unsigned int program;
+            const int16_t *data;
+            unsigned int count;
+        } audio;
+        // fields are NULL when missing from the tag
+        struct
+        {
+            unsigned int program;
+            const char *title;
+            const char *artist;
+            const char *album;
+            const char *genre;
+        } id3;
+        // fields are NULL (or NAN for the location) until they have been received
+        struct
+        {
+            const char *country_code;
+            int fcc_facility_id;
+            const char *name;
+            const char *long_name;
+            const char *slogan;
+            const char *message;
+            const char *alert;
+            float latitude;
+            float longitude;
+            int altitude;
+        } sis;
+        struct
+        {
+            unsigned int port;
+            const char *name;
+            uint32_t type;
+            const uint8_t *data;
+            unsigned int size;
+        } aas_file;
+    };
+} nrsc5_event_t;
+
+// events are only valid during the call, which may come from a decoder thread
+typedef void (*nrsc5_callback_t)(const nrsc5_event_t *evt, void *opaque);
+
+typedef struct nrsc5_t nrsc5_t;
+
+// open a decoder for the station centered on the samples, returns 0 on success
+int nrsc5_open(nrsc5_t **pst, unsigned int program);
+// also decode audio for another program, before any samples are pushed
+int nrsc5_add_program(nrsc5_t *st, unsigned int program);
+void nrsc5_set_callback(nrsc5_t *st, nrsc5_callback_t callback, void *opaque);
+// length is in bytes, two per sample, and must be a multiple of four
+void nrsc5_push_samples(nrsc5_t *st, const uint8_t *samples, unsigned int length);
+// decode everything pushed so far and release the decoder
+void nrsc5_close(nrsc5_t *st);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,9 +18,14 @@
 
 #include "acquire.h"
 #include "defines.h"
+#include "fft.h"
 #include "input.h"
+#include "metrics.h"
+#include "mixer.h"
 
 #define FILTER_DELAY 15
+// samples either way of the last lock searched for the cyclic prefix while sync tracks a fade
+#define TRACK_WINDOW (CP / 4)
 
 static float filter_taps[] = {
     -0.000685643230099231,
@@ -60,7 +65,7 @@ static float filter_taps[] = {
 void acquire_process(acquire_t *st)
 {
     float complex max_v = 0, phase_increment;
-    float angle, angle_diff, angle_factor, max_mag = -1.0f;
+    float angle, angle_diff, angle_factor;
     int samperr = 0;
     unsigned int i, j, keep;
     unsigned int mink = 0, maxk = FFTCP;
@@ -80,76 +85,101 @@ void acquire_process(acquire_t *st)
     }
     else
     {
-        cint16_t y;
-        for (i = 0; i < FFTCP * (ACQUIRE_SYMBOLS + 1); i++)
+        const cint16_t *y = st->filtered;
+        int64_t v_r = 0, v_i = 0;
+        double max_mag = -1.0;
+
+        // the symbols stay where they were, unless the sample clocks drift apart
+        if (st->input->sync.tracking)
         {
-            fir_q15_execute(st->filter, &st->in_buffer[i], &y);
-            st->buffer[i] = cq15_to_cf(y);
+            mink = FFTCP / 2 + FILTER_DELAY - TRACK_WINDOW;
+            maxk = FFTCP / 2 + FILTER_DELAY + TRACK_WINDOW;
         }
 
-        memset(st->sums, 0, sizeof(float complex) * FFTCP);
-        for (i = mink; i < maxk + CP; ++i)
+        fir_q15_execute_block(st->filter, st->in_buffer, st->filtered, FFTCP * (ACQUIRE_SYMBOLS + 1));
+
+        // correlate each sample with the one a symbol later, exactly in
+        // integers so the sliding sum below does not accumulate error
+        for (i = 0; i < FFTCP; ++i)
         {
+            int64_t sum_r = 0, sum_i = 0;
             for (j = 0; j < ACQUIRE_SYMBOLS; ++j)
-                st->sums[i] += st->buffer[i + j * FFTCP] * conjf(st->buffer[i + j * FFTCP + FFT]);
+            {
+                cint16_t a = y[i + j * FFTCP], b = y[i + j * FFTCP + FFT];
+                sum_r += (int32_t) a.r * b.r + (int64_t) a.i * b.i;
+                sum_i += (int32_t) a.i * b.r - (int64_t) a.r * b.i;
+            }
+            st->sums_r[i] = sum_r;
+            st->sums_i[i] = sum_i;
         }
 
+        // slide a cyclic prefix length window over the correlation
+        for (j = 0; j < CP; ++j)
+        {
+            v_r += st->sums_r[(mink + j) % FFTCP];
+            v_i += st->sums_i[(mink + j) % FFTCP];
+        }
         for (i = mink; i < maxk - 1; ++i)
         {
-            float mag;
-            float complex v = 0;
+            double mag;
 
-            for (j = 0; j < CP; ++j)
-                v += st->sums[(i + j) % FFTCP];
+            if (i > mink)
+            {
+                v_r += st->sums_r[(i + CP - 1) % FFTCP] - st->sums_r[i - 1];
+                v_i += st->sums_i[(i + CP - 1) % FFTCP] - st->sums_i[i - 1];
+            }
 
-            mag = normf(v);
+            mag = (double) v_r * v_r + (double) v_i * v_i;
             if (mag > max_mag)
             {
                 max_mag = mag;
-                max_v = v;
+                max_v = CMPLXF(v_r, v_i);
                 samperr = (i + FFTCP - FILTER_DELAY) % FFTCP;
             }
         }
 
+        // the frequency is held during a fade, the correlation is mostly noise
         angle_diff = cargf(max_v * cexpf(I * -st->prev_angle));
-        angle_factor = (st->prev_angle) ? 0.25 : 1.0;
+        angle_factor = st->input->sync.tracking ? 0 : (st->prev_angle) ? 0.25 : 1.0;
         angle = st->prev_angle + (angle_diff * angle_factor);
         st->prev_angle = angle;
     }
 
-    for (i = 0; i < FFTCP * (ACQUIRE_SYMBOLS + 1); i++)
-        st->buffer[i] = cq15_to_cf(st->in_buffer[i]);
-
     sync_adjust(&st->input->sync, FFTCP / 2 - samperr);
     angle -= 2 * M_PI * st->cfo;
 
     st->phase *= cexpf(-(FFTCP / 2 - samperr) * angle / FFT * I);
 
-    phase_increment = cexpf(angle / FFT * I);
+    // the frequency correction within a symbol is the same for all of them,
+    // so it is combined with the pulse shape and the Q15 scale
+    for (i = 0; i < FFTCP; ++i)
+        st->mix_weights[i] = st->shape[i] / 32767.0f * cexpf(i * angle / FFT * I);
+    phase_increment = cexpf(FFTCP * angle / FFT * I);
+
     for (i = 0; i < ACQUIRE_SYMBOLS; ++i)
     {
-        int j;
-        for (j = 0; j < FFTCP; ++j)
-        {
-            float complex sample = st->phase * st->buffer[i * FFTCP + j + samperr];
-            if (j < CP)
-                st->fftin[j] = st->shape[j] * sample;
-            else if (j < FFT)
-                st->fftin[j] = sample;
-            else
-                st->fftin[j - FFT] += st->shape[j] * sample;
-
-            st->phase *= phase_increment;
-        }
+        const cint16_t *x = &st->in_buffer[i * FFTCP + samperr];
+        float complex *fftin = &st->fftbuf[i * FFT];
+
+        // the cyclic suffix is added onto the start of the symbol
+        mixer_execute(st->mixer, x, st->mix_weights, st->phase, fftin, FFT, 0);
+        mixer_execute(st->mixer, x + FFT, st->mix_weights + FFT, st->phase, fftin, CP, 1);
+
+        st->phase *= phase_increment;
         st->phase /= cabsf(st->phase);
+    }
 
-        fftwf_execute(st->fft);
-        fftshift(st->fftout, FFT);
-        sync_push(&st->input->sync, st->fftout);
+    // nothing that sync does with a symbol affects the rest of the window,
+    // so all of them are transformed at once
+    fftwf_execute(st->fft);
+    for (i = 0; i < ACQUIRE_SYMBOLS; ++i)
+    {
+        st->input->sync.position = st->input->position - st->idx + i * FFTCP + samperr;
+        sync_push(&st->input->sync, &st->fftbuf[i * FFT]);
     }
 
+    // the input ring keeps the last samples in place for the next window
     keep = FFTCP + (FFTCP / 2 - samperr);
-    memmove(&st->in_buffer[0], &st->in_buffer[st->idx - keep], sizeof(cint16_t) * keep);
     st->idx = keep;
 }
 
@@ -162,6 +192,7 @@ void acquire_cfo_adjust(acquire_t *st, int cfo)
 
     st->cfo += cfo;
     hz = st->cfo * 744187.5 / FFT;
+    metrics_set(METRICS_CFO, hz);
 
     if (st->input->center)
         log_info("CFO: %f Hz (%d ppm)", hz, (int)round(hz * 1e6 / st->input->center));
@@ -169,34 +200,42 @@ void acquire_cfo_adjust(acquire_t *st, int cfo)
         log_info("CFO: %f Hz", hz);
 }
 
-unsigned int acquire_push(acquire_t *st, cint16_t *buf, unsigned int length)
+unsigned int acquire_push(acquire_t *st, const cint16_t *buf, unsigned int length)
 {
     unsigned int needed = FFTCP - st->idx % FFTCP;
 
     if (length < needed)
         return 0;
 
-    memcpy(&st->in_buffer[st->idx], buf, sizeof(cint16_t) * needed);
+    st->in_buffer = buf;
     st->idx += needed;
 
     return needed;
 }
 
-void acquire_init(acquire_t *st, input_t *input)
+void acquire_reset(acquire_t *st)
 {
-    int i;
-
-    st->input = input;
-    st->filter = firdecim_q15_create(filter_taps, sizeof(filter_taps) / sizeof(filter_taps[0]));
-    st->in_buffer = malloc(sizeof(cint16_t) * FFTCP * (ACQUIRE_SYMBOLS + 1));
-    st->buffer = malloc(sizeof(float complex) * FFTCP * (ACQUIRE_SYMBOLS + 1));
-    st->sums = malloc(sizeof(float complex) * (FFTCP + CP));
     st->idx = 0;
     st->prev_angle = 0;
     st->phase = 1;
     st->cfo = 0;
+}
+
+void acquire_init(acquire_t *st, input_t *input)
+{
+    int i;
 
-    st->shape = malloc(sizeof(float) * FFTCP);
+    st->input = input;
+    st->filter = firdecim_q15_create(filter_taps, sizeof(filter_taps) / sizeof(filter_taps[0]));
+    st->in_buffer = NULL;
+    st->filtered = input_alloc(input, sizeof(cint16_t) * FFTCP * (ACQUIRE_SYMBOLS + 1));
+    st->sums_r = input_alloc(input, sizeof(int64_t) * FFTCP);
+    st->sums_i = input_alloc(input, sizeof(int64_t) * FFTCP);
+    acquire_reset(st);
+
+    st->shape = input_alloc(input, sizeof(float) * FFTCP);
+    st->mix_weights = input_alloc(input, sizeof(float complex) * FFTCP);
+    st->mixer = mixer_select_kernel();
     for (i = 0; i < FFTCP; ++i)
     {
         // Pulse shaping window function
@@ -208,7 +247,12 @@ void acquire_init(acquire_t *st, input_t *input)
             st->shape[i] = cosf(M_PI / 2 * (i - FFT) / CP);
     }
 
-    st->fftin = malloc(sizeof(float complex) * FFT);
-    st->fftout = malloc(sizeof(float complex) * FFT);
-    st->fft = fftwf_plan_dft_1d(FFT, st->fftin, st->fftout, FFTW_FORWARD, 0);
+    st->fftbuf = input_alloc(input, sizeof(float complex) * FFT * ACQUIRE_SYMBOLS);
+    st->fft = fft_plan_many_dft_1d(FFT, ACQUIRE_SYMBOLS, st->fftbuf, st->fftbuf, FFTW_FORWARD);
+}
+
+void acquire_free(acquire_t *st)
+{
+    fft_destroy_plan(st->fft);
+    firdecim_q15_free(st->filter);
 }
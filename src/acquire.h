@@ -1,6 +1,7 @@
 #pragma once
 
 #include <complex.h>
+#include <stdint.h>
 #include <fftw3.h>
 #include "firdecim_q15.h"
 
@@ -8,12 +9,18 @@ typedef struct
 {
     struct input_t *input;
     firdecim_q15 filter;
-    cint16_t *in_buffer;
-    float complex *buffer;
-    float complex *sums;
-    float complex *fftin;
-    float complex *fftout;
+    const cint16_t *in_buffer;
+    // filtered samples and their correlation, only used before sync
+    cint16_t *filtered;
+    int64_t *sums_r;
+    int64_t *sums_i;
+    // ACQUIRE_SYMBOLS consecutive symbols, transformed in place
+    float complex *fftbuf;
     float *shape;
+    // shape and frequency correction of each sample in a symbol
+    float complex *mix_weights;
+    // index into the mixer kernels, chosen when acquisition is initialized
+    int mixer;
     fftwf_plan fft;
 
     unsigned int idx;
@@ -24,5 +31,9 @@ typedef struct
 
 void acquire_process(acquire_t *st);
 void acquire_cfo_adjust(acquire_t *st, int cfo);
-unsigned int acquire_push(acquire_t *st, cint16_t *buf, unsigned int length);
+// buf holds the st->idx samples already pushed followed by length new ones, and is read in place
+unsigned int acquire_push(acquire_t *st, const cint16_t *buf, unsigned int length);
 void acquire_init(acquire_t *st, struct input_t *input);
+// drop the samples held and the frequency estimate, as after acquire_init
+void acquire_reset(acquire_t *st);
+void acquire_free(acquire_t *st);
@@ -0,0 +1,117 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "arena.h"
+#include "defines.h"
+
+#define ARENA_ALIGN 64
+#define HUGE_PAGE_SIZE (2 << 20)
+
+#ifdef HAVE_MMAP
+static void *map_arena(size_t size, int hugepages, int *granted)
+{
+    void *p;
+
+    *granted = 0;
+#ifdef MAP_HUGETLB
+    // pages reserved by the administrator, all of them taken up front
+    if (hugepages)
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            *granted = 2;
+            return p;
+        }
+    }
+#endif
+
+#ifdef MAP_NORESERVE
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    if (hugepages && madvise(p, size, MADV_HUGEPAGE) == 0)
+        *granted = 1;
+#endif
+    return p;
+}
+#endif
+
+void arena_init(arena_t *st, size_t size, int hugepages)
+{
+    memset(st, 0, sizeof(*st));
+    if (hugepages)
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+    st->size = size;
+
+#ifdef HAVE_MMAP
+    st->base = map_arena(size, hugepages, &st->hugepages);
+    st->mapped = st->base != NULL;
+#endif
+    if (st->base == NULL)
+        st->base = aligned_alloc(ARENA_ALIGN, (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+    if (st->base == NULL)
+        FATAL_EXIT("Unable to allocate %zu bytes of receiver buffers.", size);
+}
+
+void *arena_alloc(arena_t *st, size_t size)
+{
+    size_t offset;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+#ifdef USE_THREADS
+    offset = atomic_fetch_add(&st->used, size);
+#else
+    offset = st->used;
+    st->used += size;
+#endif
+    if (offset + size > st->size)
+        FATAL_EXIT("Receiver buffers exceed the arena of %zu bytes.", st->size);
+    return st->base + offset;
+}
+
+size_t arena_used(arena_t *st)
+{
+#ifdef USE_THREADS
+    return atomic_load(&st->used);
+#else
+    return st->used;
+#endif
+}
+
+void arena_free(arena_t *st)
+{
+#ifdef HAVE_MMAP
+    if (st->mapped)
+    {
+        munmap(st->base, st->size);
+        return;
+    }
+#endif
+    free(st->base);
+}
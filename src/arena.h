@@ -0,0 +1,37 @@
+#pragma once
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef USE_THREADS
+#include <stdatomic.h>
+#endif
+
+/*
+ * A single reservation that the buffers living as long as a receiver are
+ * carved from. Nothing is returned to it before arena_free. Mapped arenas
+ * only take memory for the pages that are touched, so the reservation can
+ * cover the largest service mode while smaller ones cost less.
+ */
+typedef struct
+{
+    uint8_t *base;
+    size_t size;
+#ifdef USE_THREADS
+    // buffers of channels that are only decoded once they appear are taken from the stage threads
+    atomic_size_t used;
+#else
+    size_t used;
+#endif
+    int mapped;
+    // backed by huge pages: 0 not, 1 transparent if the kernel agrees, 2 reserved
+    int hugepages;
+} arena_t;
+
+void arena_init(arena_t *st, size_t size, int hugepages);
+// aligned to a cache line, fatal once the arena is exhausted
+void *arena_alloc(arena_t *st, size_t size);
+size_t arena_used(arena_t *st);
+void arena_free(arena_t *st);
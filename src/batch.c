@@ -0,0 +1,312 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "batch.h"
+#include "defines.h"
+
+// decimated samples in an L1 block and frame
+#define BLOCK_SAMPLES (BLKSZ * FFTCP)
+#define FRAME_SAMPLES (16 * BLOCK_SAMPLES)
+// nominal length of a segment, fewer frames if the file would not keep every thread busy
+#define SEGMENT_FRAMES 40
+// decoded before the nominal start, to acquire, skip the partial first
+// frame and fill the P3 interleaver
+#define OVERLAP_FRAMES 4
+// decoded after the nominal end, so the blocks before the next segment are output
+#define TAIL_FRAMES 1
+
+enum
+{
+    RECORD_MARK,
+    RECORD_PACKET
+};
+
+typedef struct
+{
+    // decimated positions of the nominal start and of the first sample read
+    uint64_t begin, origin;
+    // samples read from the file
+    uint64_t first, count;
+
+    // marks and packets in the order they were output
+    uint8_t *records;
+    size_t len, capacity;
+    int done;
+} segment_t;
+
+typedef struct
+{
+    const char *name;
+    iq_format_t format;
+    double rate;
+    input_t *model;
+
+    segment_t *segments;
+    unsigned int num_segments;
+    atomic_uint next;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} batch_t;
+
+static void append(segment_t *seg, const void *data, size_t len)
+{
+    if (seg->len + len > seg->capacity)
+    {
+        seg->capacity = (seg->len + len) * 2;
+        seg->records = realloc(seg->records, seg->capacity);
+    }
+    memcpy(seg->records + seg->len, data, len);
+    seg->len += len;
+}
+
+static void capture_mark(void *arg, uint64_t position)
+{
+    segment_t *seg = arg;
+    uint8_t type = RECORD_MARK;
+
+    position += seg->origin;
+    append(seg, &type, 1);
+    append(seg, &position, sizeof(position));
+}
+
+static void capture_packet(void *arg, const uint8_t *data, unsigned int len, unsigned int program)
+{
+    segment_t *seg = arg;
+    uint8_t header[2] = { RECORD_PACKET, program };
+    uint32_t len32 = len;
+
+    append(seg, header, 2);
+    append(seg, &len32, sizeof(len32));
+    append(seg, data, len);
+}
+
+static void push_q15(const cint16_t *buf, unsigned int count, void *arg)
+{
+    input_push_q15(arg, buf, count);
+}
+
+static void decode_segment(batch_t *st, segment_t *seg)
+{
+    input_t *input = calloc(1, sizeof(input_t));
+    output_t *output = calloc(1, sizeof(output_t));
+    iqfile_t file;
+
+    if (iqfile_open(&file, st->name, st->format, st->rate) != 0)
+        FATAL_EXIT("Unable to open input file.");
+    iqfile_set_range(&file, seg->first, seg->count);
+
+    // packets are captured, the output is only there for the program
+    output_init_callback(output);
+    input_init(input, output, 0, st->model->outputs[0]->program, NULL);
+    input_copy_settings(input, st->model);
+    input_set_capture(input, capture_packet, capture_mark, seg);
+
+    iqfile_read(&file, input_cb, push_q15, input);
+    input_finish(input);
+
+    input_free(input);
+    output_free(output);
+    free(output);
+    free(input);
+    iqfile_close(&file);
+}
+
+static void *batch_worker(void *arg)
+{
+    batch_t *st = arg;
+    unsigned int i;
+
+    while ((i = atomic_fetch_add(&st->next, 1)) < st->num_segments)
+    {
+        decode_segment(st, &st->segments[i]);
+
+        pthread_mutex_lock(&st->mutex);
+        st->segments[i].done = 1;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->mutex);
+    }
+
+    return NULL;
+}
+
+static void wait_segment(batch_t *st, segment_t *seg)
+{
+    pthread_mutex_lock(&st->mutex);
+    while (!seg->done)
+        pthread_cond_wait(&st->cond, &st->mutex);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+// position of the first block at or after the nominal start, UINT64_MAX if there is none
+static uint64_t first_mark(const segment_t *seg)
+{
+    size_t off = 0;
+
+    while (off < seg->len)
+    {
+        uint32_t len;
+        uint64_t position;
+
+        if (seg->records[off] == RECORD_MARK)
+        {
+            memcpy(&position, &seg->records[off + 1], sizeof(position));
+            if (position >= seg->begin)
+                return position;
+            off += 1 + sizeof(position);
+        }
+        else
+        {
+            memcpy(&len, &seg->records[off + 2], sizeof(len));
+            off += 2 + sizeof(len) + len;
+        }
+    }
+    return UINT64_MAX;
+}
+
+// output the packets of the blocks from from up to to
+static void output_segment(batch_t *st, const segment_t *seg, uint64_t from, uint64_t to)
+{
+    uint64_t position = UINT64_MAX;
+    size_t off = 0;
+
+    while (off < seg->len)
+    {
+        uint8_t program;
+        uint32_t len;
+
+        if (seg->records[off] == RECORD_MARK)
+        {
+            memcpy(&position, &seg->records[off + 1], sizeof(position));
+            off += 1 + sizeof(position);
+            continue;
+        }
+
+        program = seg->records[off + 1];
+        memcpy(&len, &seg->records[off + 2], sizeof(len));
+        off += 2 + sizeof(len);
+
+        if (position >= from && position < to)
+        {
+            uint8_t *data = &seg->records[off];
+
+            if (program == INPUT_PROGRAM_AAS)
+            {
+                output_aas_push(st->model->output, data, len);
+            }
+            else
+            {
+                for (unsigned int i = 0; i < st->model->num_outputs; i++)
+                    output_push(st->model->outputs[i], data, len, program);
+            }
+        }
+        off += len;
+    }
+}
+
+int batch_decode(const char *name, iq_format_t format, double rate, unsigned int jobs, input_t *model)
+{
+    // file samples per decimated sample
+    double ratio = rate ? 2 * rate / 1488375 : 2;
+    uint64_t samples, total, from = 0;
+    unsigned int frames, segment_frames, i;
+    pthread_t *threads;
+    iqfile_t file;
+    batch_t st;
+
+    if (iqfile_open(&file, name, format, rate) != 0)
+        return 1;
+    samples = iqfile_samples(&file);
+    iqfile_close(&file);
+    if (samples == 0)
+        return 1;
+
+    total = samples / ratio;
+    frames = (total + FRAME_SAMPLES - 1) / FRAME_SAMPLES;
+    segment_frames = (frames + jobs - 1) / jobs;
+    if (segment_frames > SEGMENT_FRAMES)
+        segment_frames = SEGMENT_FRAMES;
+    if (segment_frames < 2 * OVERLAP_FRAMES)
+        segment_frames = 2 * OVERLAP_FRAMES;
+
+    st.name = name;
+    st.format = format;
+    st.rate = rate;
+    st.model = model;
+    st.num_segments = (frames + segment_frames - 1) / segment_frames;
+    st.segments = calloc(st.num_segments, sizeof(segment_t));
+    atomic_init(&st.next, 0);
+    pthread_mutex_init(&st.mutex, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    for (i = 0; i < st.num_segments; i++)
+    {
+        segment_t *seg = &st.segments[i];
+        uint64_t begin = (uint64_t) i * segment_frames * FRAME_SAMPLES;
+        uint64_t start = begin > OVERLAP_FRAMES * FRAME_SAMPLES ? begin - OVERLAP_FRAMES * FRAME_SAMPLES : 0;
+        uint64_t end = begin + (uint64_t) (segment_frames + TAIL_FRAMES) * FRAME_SAMPLES;
+
+        // whole pairs of samples, as they are decimated
+        seg->first = (uint64_t) llround(start * ratio) & ~1ULL;
+        seg->count = ((uint64_t) llround(end * ratio) - seg->first) & ~1ULL;
+        seg->begin = begin;
+        seg->origin = llround(seg->first / ratio);
+    }
+
+    if (jobs > st.num_segments)
+        jobs = st.num_segments;
+    log_info("Decoding %u segments of %.1f s on %u threads", st.num_segments,
+             (double) segment_frames * FRAME_SAMPLES / 744187.5, jobs);
+
+    threads = malloc(sizeof(pthread_t) * jobs);
+    for (i = 0; i < jobs; i++)
+        pthread_create(&threads[i], NULL, batch_worker, &st);
+
+    for (i = 0; i < st.num_segments; i++)
+    {
+        segment_t *seg = &st.segments[i];
+        uint64_t to = UINT64_MAX, next = UINT64_MAX;
+
+        wait_segment(&st, seg);
+        if (i + 1 < st.num_segments)
+        {
+            wait_segment(&st, &st.segments[i + 1]);
+            next = first_mark(&st.segments[i + 1]);
+            // the same block decoded by both segments differs by a few samples
+            if (next != UINT64_MAX)
+                to = next - BLOCK_SAMPLES / 2;
+        }
+
+        output_segment(&st, seg, from, to);
+        free(seg->records);
+        seg->records = NULL;
+        from = next;
+    }
+
+    for (i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_cond_destroy(&st.cond);
+    pthread_mutex_destroy(&st.mutex);
+    free(st.segments);
+    return 0;
+}
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "input.h"
+#include "iqfile.h"
+
+/*
+ * Decode a sample file in overlapping segments, each on its own input and
+ * thread, and push their packets to the outputs of model in order. Each
+ * segment starts with the first L1 block it decoded after its nominal start,
+ * and the blocks before that come from the previous segment, so the packets
+ * of the overlap are only output once. Returns nonzero if the file cannot
+ * be memory-mapped.
+ */
+int batch_decode(const char *name, iq_format_t format, double rate, unsigned int jobs, input_t *model);
@@ -0,0 +1,371 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decodes a recording and synthetic inputs as fast as possible and reports
+ * the throughput and latency of each stage of the receive chain as JSON.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conv.h"
+#include "cpu.h"
+#include "defines.h"
+#include "firdecim_q15.h"
+#include "input.h"
+#include "mixer.h"
+#include "timing.h"
+
+// bytes passed to input_cb at once, as read from a file by nrsc5
+#define BENCH_CHUNK (512 * 1024)
+// seconds of signal in an L1 frame, the period of the P1 channel
+#define FRAME_SECONDS (FFTCP * BLKSZ * 16 * 2.0 / NRSC5_SAMPLE_RATE)
+
+static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+
+typedef struct
+{
+    FILE *fp;
+    int runs;
+} report_t;
+
+typedef struct
+{
+    input_t input;
+    output_t adts;
+    output_t audio;
+} receiver_t;
+
+static uint8_t *load_samples(const char *name, size_t *length)
+{
+    size_t len = strlen(name), capacity = 64 * 1024 * 1024, used = 0, n;
+    uint8_t *buf = malloc(capacity);
+    int compressed = len > 3 && strcmp(name + len - 3, ".xz") == 0;
+    FILE *fp;
+
+    if (compressed)
+    {
+        char *cmd = malloc(len + 16);
+
+        sprintf(cmd, "xz -dc '%s'", name);
+        fp = popen(cmd, "r");
+        free(cmd);
+    }
+    else
+    {
+        fp = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+    }
+    if (fp == NULL)
+        FATAL_EXIT("Unable to open samples input: %s", name);
+
+    while ((n = fread(buf + used, 1, capacity - used, fp)) > 0)
+    {
+        used += n;
+        if (used == capacity)
+        {
+            capacity *= 2;
+            if ((buf = realloc(buf, capacity)) == NULL)
+                FATAL_EXIT("Unable to allocate %zu bytes for the samples.", capacity);
+        }
+    }
+
+    if (compressed ? pclose(fp) != 0 : (fp != stdin && fclose(fp) != 0))
+        FATAL_EXIT("Unable to read samples input: %s", name);
+
+    // whole samples only, I and Q of two input samples at a time like nrsc5
+    *length = used & ~3;
+    return buf;
+}
+
+// u8 IQ noise, the sum of four uniform values centered on 127
+static uint8_t *noise_samples(double seconds, size_t *length)
+{
+    size_t i, len = (size_t) (seconds * NRSC5_SAMPLE_RATE) * 2 & ~3;
+    uint8_t *buf = malloc(len);
+    uint32_t x = 0x12345678;
+
+    for (i = 0; i < len; i++)
+    {
+        int sum = 0, j;
+
+        for (j = 0; j < 4; j++)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            sum += x & 0x3f;
+        }
+        buf[i] = sum + 1;
+    }
+
+    *length = len;
+    return buf;
+}
+
+static void report_begin(report_t *r)
+{
+    fprintf(r->fp, "{\n  \"revision\": \"%s\",\n", GIT_COMMIT_HASH);
+    fprintf(r->fp, "  \"cpu_features\": \"%s\",\n", cpu_features_str());
+    fprintf(r->fp, "  \"kernels\": { \"conv\": \"%s\", \"firdecim\": \"%s\", \"mixer\": \"%s\" },\n",
+            nrsc5_conv_kernel_name(), firdecim_q15_kernel_name(), mixer_kernel_name());
+#ifdef USE_THREADS
+    fprintf(r->fp, "  \"threads\": true,\n");
+#else
+    fprintf(r->fp, "  \"threads\": false,\n");
+#endif
+    fprintf(r->fp, "  \"runs\": [");
+    r->runs = 0;
+}
+
+static void report_end(report_t *r)
+{
+    fprintf(r->fp, "\n  ]\n}\n");
+}
+
+// stages timed since the last timing_reset, with signal_seconds of input
+static void report_run(report_t *r, const char *name, double signal_seconds, double wall_seconds)
+{
+    timing_stats_t stats;
+    unsigned int i, j, n = 0;
+
+    fprintf(r->fp, "%s\n    {\n", r->runs++ ? "," : "");
+    fprintf(r->fp, "      \"name\": \"%s\",\n", name);
+    fprintf(r->fp, "      \"signal_seconds\": %.3f,\n", signal_seconds);
+    fprintf(r->fp, "      \"wall_seconds\": %.3f,\n", wall_seconds);
+    fprintf(r->fp, "      \"realtime\": %.2f,\n", signal_seconds / wall_seconds);
+    fprintf(r->fp, "      \"stages\": {");
+
+    for (i = 0; i < TIMING_STAGES; i++)
+    {
+        timing_get(i, &stats);
+        if (stats.count == 0)
+            continue;
+
+        fprintf(r->fp, "%s\n        \"%s\": {", n++ ? "," : "", timing_stage_name(i));
+        fprintf(r->fp, " \"calls\": %llu,", (unsigned long long) stats.count);
+        fprintf(r->fp, " \"total_ms\": %.3f,", stats.total / 1e6);
+        fprintf(r->fp, " \"calls_per_second\": %.1f,", stats.count / (stats.total / 1e9));
+        fprintf(r->fp, " \"realtime\": %.2f,", signal_seconds / (stats.total / 1e9));
+        fprintf(r->fp, " \"mean_us\": %.3f,", stats.total / 1e3 / stats.count);
+        fprintf(r->fp, " \"min_us\": %.3f,", stats.min / 1e3);
+        for (j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]); j++)
+            fprintf(r->fp, " \"%s_us\": %.3f,", percentile_names[j], timing_percentile(i, percentiles[j]) / 1e3);
+        fprintf(r->fp, " \"max_us\": %.3f }", stats.max / 1e3);
+    }
+
+    fprintf(r->fp, "%s}\n    }", n ? "\n      " : "");
+}
+
+// decode samples on a fresh receiver with both ADTS and decoded audio outputs
+static void decode_samples(const uint8_t *buf, size_t length, unsigned int program, unsigned int viterbi_8bit)
+{
+    receiver_t *rx = calloc(1, sizeof(receiver_t));
+    size_t i;
+
+    output_init_adts(&rx->adts, "/dev/null");
+    input_init(&rx->input, &rx->adts, 0, program, NULL);
+#ifdef USE_FAAD2
+    output_init_callback(&rx->audio);
+    input_add_output(&rx->input, &rx->audio, program);
+#endif
+    decode_set_viterbi_8bit(&rx->input.decode, viterbi_8bit);
+
+    for (i = 0; i < length; i += BENCH_CHUNK)
+        input_cb((uint8_t *) buf + i, length - i < BENCH_CHUNK ? length - i : BENCH_CHUNK, &rx->input);
+
+    input_finish(&rx->input);
+    input_free(&rx->input);
+    output_free(&rx->adts);
+#ifdef USE_FAAD2
+    output_free(&rx->audio);
+#endif
+    free(rx);
+}
+
+static void bench_samples(report_t *r, const char *name, const uint8_t *buf, size_t length,
+                          unsigned int count, unsigned int program, unsigned int viterbi_8bit)
+{
+    uint64_t start;
+    unsigned int i;
+
+    timing_reset();
+    start = timing_now();
+    for (i = 0; i < count; i++)
+        decode_samples(buf, length, program, viterbi_8bit);
+    report_run(r, name, count * length / 2.0 / NRSC5_SAMPLE_RATE, (timing_now() - start) / 1e9);
+}
+
+// Viterbi decoders alone on random soft bits, as many L1 frames as count
+static void bench_viterbi(report_t *r, const char *name, unsigned int count, int metric)
+{
+    struct vdecoder *p1 = nrsc5_conv_alloc_p1(CONV_WINDOW_DEFAULT, metric);
+    struct vdecoder *pids = nrsc5_conv_alloc_pids(metric);
+    struct vdecoder *p3 = nrsc5_conv_alloc_p3(metric);
+    int8_t *in = malloc(P1_FRAME_LEN * 3);
+    uint8_t *out = malloc(P1_FRAME_LEN);
+    uint64_t start, t;
+    uint32_t x = 0x9e3779b9;
+    unsigned int i, j;
+
+    for (i = 0; i < P1_FRAME_LEN * 3; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        in[i] = (int8_t) (x % 255 - 127);
+    }
+
+    timing_reset();
+    start = timing_now();
+    for (i = 0; i < count; i++)
+    {
+        t = timing_start();
+        nrsc5_conv_decode_p1(p1, in, out);
+        timing_stop(TIMING_VITERBI_P1, t);
+
+        for (j = 0; j < 16; j++)
+        {
+            t = timing_start();
+            nrsc5_conv_decode_pids(pids, in, out);
+            timing_stop(TIMING_VITERBI_PIDS, t);
+        }
+
+        // P3 frames of the widest service mode, two blocks apart
+        for (j = 0; j < 8; j++)
+        {
+            t = timing_start();
+            nrsc5_conv_decode_p3(p3, in, out);
+            timing_stop(TIMING_VITERBI_P3, t);
+        }
+    }
+    report_run(r, name, count * FRAME_SECONDS, (timing_now() - start) / 1e9);
+
+    nrsc5_conv_free(p1);
+    nrsc5_conv_free(pids);
+    nrsc5_conv_free(p3);
+    free(in);
+    free(out);
+}
+
+static void help(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-l log-level] [-o json-output] [-n iterations] [-p program] [-s noise-seconds] [-f viterbi-frames] [-d feature[,feature...]] [-8] [-S] [samples-input[.xz]]\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int count = 1, program = 0, frames = 32, viterbi_8bit = 0, synthetic = 1;
+    double noise_seconds = 8;
+    const char *output_name = NULL;
+    report_t report;
+    uint8_t *buf;
+    size_t length;
+    char *feature;
+    int opt;
+
+    // the decoder's messages would be timed with it, only failures are shown
+    log_set_level(LOG_FATAL);
+
+    while ((opt = getopt(argc, argv, "l:o:n:p:s:f:d:8S")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            log_set_level(atoi(optarg));
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            program = atoi(optarg);
+            break;
+        case 's':
+            noise_seconds = strtod(optarg, NULL);
+            break;
+        case 'f':
+            frames = atoi(optarg);
+            break;
+        case 'd':
+            for (feature = strtok(optarg, ","); feature; feature = strtok(NULL, ","))
+            {
+                if (cpu_feature_flag(feature) == 0)
+                {
+                    log_fatal("Unknown CPU feature: %s", feature);
+                    return 1;
+                }
+                cpu_disable(cpu_feature_flag(feature));
+            }
+            break;
+        case '8':
+            viterbi_8bit = DECODE_CHANNEL_P1 | DECODE_CHANNEL_PIDS | DECODE_CHANNEL_P3;
+            break;
+        case 'S':
+            synthetic = 0;
+            break;
+        default:
+            help(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc - 1 || (optind == argc && !synthetic))
+    {
+        help(argv[0]);
+        return 1;
+    }
+
+    report.fp = output_name ? fopen(output_name, "w") : stdout;
+    if (report.fp == NULL)
+        FATAL_EXIT("Unable to open JSON output: %s", output_name);
+
+    timing_enable(1);
+    report_begin(&report);
+
+    if (optind < argc)
+    {
+        buf = load_samples(argv[optind], &length);
+        bench_samples(&report, "recording", buf, length, count, program, viterbi_8bit);
+        free(buf);
+    }
+
+    if (synthetic)
+    {
+        if (noise_seconds > 0)
+        {
+            buf = noise_samples(noise_seconds, &length);
+            bench_samples(&report, "noise", buf, length, 1, program, viterbi_8bit);
+            free(buf);
+        }
+        if (frames > 0)
+        {
+            bench_viterbi(&report, "viterbi16", frames, CONV_METRIC_16);
+            bench_viterbi(&report, "viterbi8", frames, CONV_METRIC_8);
+        }
+    }
+
+    report_end(&report);
+    if (report.fp != stdout)
+        fclose(report.fp);
+    return 0;
+}
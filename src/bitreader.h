@@ -2,48 +2,105 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 
 typedef struct
 {
-    unsigned int byte;
+    // the next bits of the stream, starting at the most significant bit
+    uint64_t cache;
     unsigned int bits;
-    uint8_t *buf;
-    uint8_t *end;
+    const uint8_t *begin;
+    const uint8_t *buf;
+    const uint8_t *end;
+    // set when more bits are read than the buffer holds, or by the parser
+    // when the stream is invalid; missing bits read as zero
+    int error;
 } bitreader_t;
 
-static inline void br_init(bitreader_t *br, uint8_t *buf, unsigned int length)
+static inline void br_init(bitreader_t *br, const uint8_t *buf, unsigned int length)
 {
-    br->byte = 0;
+    br->cache = 0;
     br->bits = 0;
+    br->begin = buf;
     br->buf = buf;
     br->end = buf + length;
+    br->error = 0;
 }
 
-static inline unsigned int br_read1bit(bitreader_t *br)
+static inline void br_refill(bitreader_t *br)
+{
+    if (br->end - br->buf >= 8)
+    {
+        uint64_t v;
+        unsigned int n = (64 - br->bits) >> 3;
+
+        memcpy(&v, br->buf, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        // the bits past the whole bytes are the ones the next refill loads
+        br->cache |= v >> br->bits;
+        br->buf += n;
+        br->bits += n * 8;
+    }
+    else
+    {
+        while (br->bits <= 56 && br->buf != br->end)
+        {
+            br->cache |= (uint64_t) *br->buf++ << (56 - br->bits);
+            br->bits += 8;
+        }
+    }
+}
+
+// bits is at most 32
+static inline unsigned int br_peekbits(bitreader_t *br, unsigned int bits)
+{
+    assert(bits <= 32);
+    if (bits == 0)
+        return 0;
+    if (br->bits < bits)
+        br_refill(br);
+    return br->cache >> (64 - bits);
+}
+
+// bits is at most 32
+static inline void br_skipbits(bitreader_t *br, unsigned int bits)
 {
-    if (br->bits == 0)
+    if (br->bits < bits)
     {
-        assert(br->buf != br->end);
-        br->byte = *br->buf++;
-        br->bits = 8;
+        br_refill(br);
+        if (br->bits < bits)
+        {
+            br->error = 1;
+            br->cache = 0;
+            br->bits = 0;
+            return;
+        }
     }
-    br->byte <<= 1;
-    br->bits--;
-    return !!(br->byte & 0x100);
+    br->cache <<= bits;
+    br->bits -= bits;
 }
 
 static inline unsigned int br_readbits(bitreader_t *br, unsigned int bits)
 {
-    unsigned int i, val = 0;
-    for (i = 0; i < bits; ++i)
-        val = (val << 1) | br_read1bit(br);
+    unsigned int val = br_peekbits(br, bits);
+    br_skipbits(br, bits);
     return val;
 }
 
-static inline unsigned int br_peekbits(bitreader_t *br, unsigned int bits)
+static inline unsigned int br_read1bit(bitreader_t *br)
 {
-    bitreader_t tmp = *br;
-    unsigned int val = br_readbits(br, bits);
-    *br = tmp;
-    return val;
+    return br_readbits(br, 1);
+}
+
+static inline unsigned int br_bits_left(const bitreader_t *br)
+{
+    return br->bits + (br->end - br->buf) * 8;
+}
+
+// position of the next bit, counted from the start of the buffer
+static inline unsigned int br_tell(const bitreader_t *br)
+{
+    return (br->buf - br->begin) * 8 - br->bits;
 }
@@ -1,38 +1,102 @@
 #pragma once
 
+#include <assert.h>
 #include <stdint.h>
+#include <string.h>
 
 typedef struct
 {
-    unsigned int byte;
+    // bits not yet written, in the lowest bits
+    uint64_t cache;
     unsigned int bits;
-    uint8_t *buf, *begin;
+    uint8_t *buf, *begin, *end;
+    // set when the buffer was too small, the bytes that did not fit are dropped
+    int error;
 } bitwriter_t;
 
-static inline void bw_init(bitwriter_t *bw, uint8_t *buf)
+static inline void bw_init(bitwriter_t *bw, uint8_t *buf, unsigned int size)
 {
-    bw->byte = 0;
+    bw->cache = 0;
     bw->bits = 0;
     bw->buf = buf;
     bw->begin = buf;
+    bw->end = buf + size;
+    bw->error = 0;
 }
 
-static inline void bw_add1bit(bitwriter_t *bw, unsigned int bit)
+// bits is at most 32, higher bits of value are ignored
+static inline void bw_addbits(bitwriter_t *bw, unsigned int value, unsigned int bits)
 {
-    bw->byte = (bw->byte << 1) | (!!bit);
-    if (++bw->bits == 8)
+    assert(bits <= 32);
+    bw->cache = (bw->cache << bits) | (value & (uint32_t) ((1ULL << bits) - 1));
+    bw->bits += bits;
+    while (bw->bits >= 8)
     {
-        *bw->buf++ = bw->byte;
-        bw->byte = 0;
-        bw->bits = 0;
+        bw->bits -= 8;
+        if (bw->buf != bw->end)
+            *bw->buf++ = bw->cache >> bw->bits;
+        else
+            bw->error = 1;
     }
 }
 
-static inline void bw_addbits(bitwriter_t *bw, unsigned int value, unsigned int bits)
+static inline void bw_add1bit(bitwriter_t *bw, unsigned int bit)
 {
-    unsigned int i;
-    for (i = 0; i < bits; ++i)
-        bw_add1bit(bw, value & (1 << (bits - i - 1)));
+    bw_addbits(bw, !!bit, 1);
+}
+
+// n is at most 8, the bits are read from at most two bytes
+static inline unsigned int bw_peek_src(const uint8_t *src, unsigned int pos, unsigned int n)
+{
+    unsigned int v = src[0] << 8;
+    if (pos + n > 8)
+        v |= src[1];
+    return (v >> (16 - pos - n)) & ((1 << n) - 1);
+}
+
+// append bits of src starting at bit pos, no byte past the last bit is read
+static inline void bw_copybits(bitwriter_t *bw, const uint8_t *src, unsigned int pos, unsigned int bits)
+{
+    unsigned int n, bytes;
+
+    src += pos >> 3;
+    pos &= 7;
+
+    // complete the partial byte in the cache
+    n = (8 - bw->bits) & 7;
+    if (n > bits)
+        n = bits;
+    if (n)
+    {
+        bw_addbits(bw, bw_peek_src(src, pos, n), n);
+        pos += n;
+        src += pos >> 3;
+        pos &= 7;
+        bits -= n;
+    }
+
+    // the output is byte aligned now, unless all bits are used
+    bytes = bits >> 3;
+    if (bytes > (unsigned int) (bw->end - bw->buf))
+    {
+        bytes = bw->end - bw->buf;
+        bw->error = 1;
+    }
+    if (pos == 0)
+    {
+        memcpy(bw->buf, src, bytes);
+    }
+    else
+    {
+        for (unsigned int i = 0; i < bytes; i++)
+            bw->buf[i] = (src[i] << pos) | (src[i + 1] >> (8 - pos));
+    }
+    bw->buf += bytes;
+    src += bytes;
+
+    n = bits & 7;
+    if (n)
+        bw_addbits(bw, bw_peek_src(src, pos, n), n);
 }
 
 static unsigned int bw_flush(bitwriter_t *bw)
@@ -0,0 +1,227 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "defines.h"
+
+/*
+ * One line per frequency, with the fields that are known as key=value:
+ *
+ *   90100000 gain=297 cnr=21.4 cfo=-3 psmi=1 layout=8/0:96,0:0,0:0,0:0 sis=US:12345 ports=5100:512:3:64:0,...
+ */
+#define CACHE_LINE_LEN 2048
+
+void cache_entry_init(cache_entry_t *entry, long frequency)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->frequency = frequency;
+    entry->gain = INT_MIN;
+    entry->psmi = -1;
+}
+
+static void parse_layout(cache_entry_t *entry, const char *value)
+{
+    unsigned int width, mode[4], length[4], i;
+
+    if (sscanf(value, "%u/%u:%u,%u:%u,%u:%u,%u:%u", &width, &mode[0], &length[0], &mode[1], &length[1],
+               &mode[2], &length[2], &mode[3], &length[3]) != 9)
+        return;
+
+    entry->have_layout = 1;
+    entry->sync_width = width;
+    for (i = 0; i < 4; i++)
+    {
+        entry->ccc_mode[i] = mode[i];
+        entry->ccc_length[i] = length[i];
+    }
+}
+
+static void parse_sis(cache_entry_t *entry, const char *value)
+{
+    char country[3];
+    unsigned int id;
+
+    if (sscanf(value, "%2[^:]:%u", country, &id) != 2)
+        return;
+
+    // spaces are written as underscores to keep the line in tokens
+    for (int i = 0; country[i]; i++)
+        if (country[i] == '_')
+            country[i] = ' ';
+    strcpy(entry->country_code, country);
+    entry->fcc_facility_id = id;
+}
+
+static void parse_ports(cache_entry_t *entry, const char *value)
+{
+    const char *p = value;
+
+    entry->num_ports = 0;
+    while (*p && entry->num_ports < CACHE_MAX_PORTS)
+    {
+        unsigned int port, pkt_size, type, sdt, program;
+        cache_port_t *out;
+        int n;
+
+        if (sscanf(p, "%u:%u:%u:%u:%u%n", &port, &pkt_size, &type, &sdt, &program, &n) != 5 || port == 0)
+            break;
+
+        out = &entry->ports[entry->num_ports++];
+        out->port = port;
+        out->pkt_size = pkt_size;
+        out->type = type;
+        out->service_data_type = sdt;
+        out->program = program;
+
+        p += n;
+        if (*p != ',')
+            break;
+        p++;
+    }
+}
+
+static int parse_line(cache_entry_t *entry, char *line)
+{
+    char *token, *end;
+
+    token = strtok(line, " \t\r\n");
+    if (token == NULL || strtol(token, &end, 10) != entry->frequency || *end != 0)
+        return 1;
+
+    cache_entry_init(entry, entry->frequency);
+    while ((token = strtok(NULL, " \t\r\n")) != NULL)
+    {
+        char *value = strchr(token, '=');
+
+        if (value == NULL)
+            continue;
+        *value++ = 0;
+
+        // unknown keys are skipped, for files written by other versions
+        if (strcmp(token, "gain") == 0)
+            entry->gain = atoi(value);
+        else if (strcmp(token, "cnr") == 0)
+            entry->cnr = strtof(value, NULL);
+        else if (strcmp(token, "cfo") == 0)
+            entry->cfo = atoi(value);
+        else if (strcmp(token, "psmi") == 0)
+            entry->psmi = atoi(value);
+        else if (strcmp(token, "layout") == 0)
+            parse_layout(entry, value);
+        else if (strcmp(token, "sis") == 0)
+            parse_sis(entry, value);
+        else if (strcmp(token, "ports") == 0)
+            parse_ports(entry, value);
+    }
+    return 0;
+}
+
+int cache_load(const char *path, cache_entry_t *entry)
+{
+    char line[CACHE_LINE_LEN];
+    FILE *fp = fopen(path, "r");
+    int found = 1;
+
+    if (fp == NULL)
+        return 1;
+
+    while (found != 0 && fgets(line, sizeof(line), fp) != NULL)
+        found = parse_line(entry, line);
+    fclose(fp);
+    return found;
+}
+
+static void write_entry(FILE *fp, const cache_entry_t *entry)
+{
+    unsigned int i;
+
+    fprintf(fp, "%ld", entry->frequency);
+    if (entry->gain != INT_MIN)
+        fprintf(fp, " gain=%d cnr=%.1f", entry->gain, entry->cnr);
+    fprintf(fp, " cfo=%d", entry->cfo);
+    if (entry->psmi >= 0)
+        fprintf(fp, " psmi=%d", entry->psmi);
+    if (entry->have_layout)
+    {
+        fprintf(fp, " layout=%u/", entry->sync_width);
+        for (i = 0; i < 4; i++)
+            fprintf(fp, "%s%u:%u", i ? "," : "", entry->ccc_mode[i], entry->ccc_length[i]);
+    }
+    if (entry->fcc_facility_id)
+    {
+        char country[3];
+
+        strcpy(country, entry->country_code);
+        for (i = 0; country[i]; i++)
+            if (country[i] == ' ')
+                country[i] = '_';
+        fprintf(fp, " sis=%s:%u", country[0] ? country : "__", entry->fcc_facility_id);
+    }
+    for (i = 0; i < entry->num_ports; i++)
+    {
+        const cache_port_t *port = &entry->ports[i];
+        fprintf(fp, "%s%u:%u:%u:%u:%u", i ? "," : " ports=", port->port, port->pkt_size, port->type,
+                port->service_data_type, port->program);
+    }
+    fprintf(fp, "\n");
+}
+
+int cache_save(const char *path, const cache_entry_t *entry)
+{
+    char line[CACHE_LINE_LEN];
+    char *tmp_path = malloc(strlen(path) + 5);
+    FILE *in, *out;
+    int err;
+
+    // written next to the cache and renamed, so an interrupted save leaves the old one
+    sprintf(tmp_path, "%s.tmp", path);
+    out = fopen(tmp_path, "w");
+    if (out == NULL)
+    {
+        free(tmp_path);
+        return 1;
+    }
+
+    in = fopen(path, "r");
+    if (in)
+    {
+        while (fgets(line, sizeof(line), in) != NULL)
+        {
+            char *end;
+
+            if (strtol(line, &end, 10) == entry->frequency && end != line)
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    write_entry(out, entry);
+
+    err = ferror(out);
+    err |= fclose(out) != 0;
+    if (err == 0)
+        err = rename(tmp_path, path) != 0;
+    if (err)
+        remove(tmp_path);
+    free(tmp_path);
+    return err;
+}
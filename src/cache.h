@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define CACHE_MAX_PORTS 32
+
+typedef struct
+{
+    uint16_t port;
+    uint16_t pkt_size;
+    uint8_t type;
+    unsigned int service_data_type;
+    unsigned int program;
+} cache_port_t;
+
+/*
+ * What was learned about the station on a frequency, to start from it the
+ * next time. Every field is a hint that the decoder checks against the
+ * signal, so a stale entry only costs the time it would have saved.
+ */
+typedef struct
+{
+    long frequency;
+
+    // tuner gain in tenths of a dB, INT_MIN if unknown, and the CNR it gave in dB
+    int gain;
+    float cnr;
+    // carrier offset in FFT bins
+    int cfo;
+    // -1 if unknown
+    int psmi;
+
+    // layout of the fixed data subchannels announced by the CCC
+    int have_layout;
+    unsigned int sync_width;
+    uint16_t ccc_mode[4];
+    uint16_t ccc_length[4];
+
+    // SIS station identity, zero if unknown
+    char country_code[3];
+    unsigned int fcc_facility_id;
+
+    unsigned int num_ports;
+    cache_port_t ports[CACHE_MAX_PORTS];
+} cache_entry_t;
+
+void cache_entry_init(cache_entry_t *entry, long frequency);
+// returns 0 if the file has an entry for entry->frequency, which is then filled in
+int cache_load(const char *path, cache_entry_t *entry);
+// replace the line of entry->frequency, returns 0 on success
+int cache_save(const char *path, const cache_entry_t *entry);
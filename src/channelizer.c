@@ -0,0 +1,124 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "channelizer.h"
+
+#define WINDOW_SIZE 4096
+#define TAPS_PER_PHASE 16
+// renormalize the mixer to keep rounding errors from changing its magnitude
+#define ROTATION_RENORM 1024
+
+void channelizer_init(channelizer_t *st, unsigned int decim, double offset)
+{
+    unsigned int i;
+
+    st->decim = decim;
+    st->ntaps = TAPS_PER_PHASE * decim;
+    st->taps = malloc(sizeof(float) * st->ntaps);
+    st->window_r = calloc(sizeof(float), WINDOW_SIZE + st->ntaps);
+    st->window_i = calloc(sizeof(float), WINDOW_SIZE + st->ntaps);
+    st->idx = st->ntaps - 1;
+    st->phase = 0;
+
+    // windowed sinc low-pass with its cutoff at the output Nyquist frequency
+    for (i = 0; i < st->ntaps; i++)
+    {
+        double t = i - (st->ntaps - 1) / 2.0;
+        double w = 0.42 - 0.5 * cos(2 * M_PI * i / (st->ntaps - 1)) + 0.08 * cos(4 * M_PI * i / (st->ntaps - 1));
+        double h = (t == 0) ? 1.0 / decim : sin(M_PI * t / decim) / (M_PI * t);
+        st->taps[i] = h * w;
+    }
+
+    st->rotation = 1;
+    st->rotation_step = cexpf(-2 * M_PI * offset / (1488375.0 * decim) * I);
+    st->rotation_count = 0;
+    st->have_pending = 0;
+}
+
+void channelizer_free(channelizer_t *st)
+{
+    free(st->window_i);
+    free(st->window_r);
+    free(st->taps);
+}
+
+static cint16_t filter(channelizer_t *st, unsigned int start)
+{
+    const float *r = &st->window_r[start], *i = &st->window_i[start];
+    float sum_r = 0, sum_i = 0;
+    cint16_t y;
+
+    for (unsigned int k = 0; k < st->ntaps; k++)
+    {
+        sum_r += r[k] * st->taps[k];
+        sum_i += i[k] * st->taps[k];
+    }
+
+    // same scale and conjugation as input_cb applies to u8 samples
+    y.r = lrintf(fminf(fmaxf(sum_r * 64, -32768), 32767));
+    y.i = lrintf(fminf(fmaxf(-sum_i * 64, -32768), 32767));
+    return y;
+}
+
+unsigned int channelizer_execute(channelizer_t *st, const uint8_t *x, unsigned int n, cint16_t *y)
+{
+    unsigned int i, count = 0;
+
+    if (st->have_pending)
+    {
+        y[count++] = st->pending;
+        st->have_pending = 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        float complex v = CMPLXF(x[i * 2] - 127.0f, x[i * 2 + 1] - 127.0f) * st->rotation;
+
+        st->rotation *= st->rotation_step;
+        if (++st->rotation_count == ROTATION_RENORM)
+        {
+            st->rotation /= cabsf(st->rotation);
+            st->rotation_count = 0;
+        }
+
+        st->window_r[st->idx] = crealf(v);
+        st->window_i[st->idx] = cimagf(v);
+        st->idx++;
+
+        if (++st->phase == st->decim)
+        {
+            y[count++] = filter(st, st->idx - st->ntaps);
+            st->phase = 0;
+        }
+
+        if (st->idx == WINDOW_SIZE + st->ntaps)
+        {
+            memmove(st->window_r, &st->window_r[WINDOW_SIZE + 1], sizeof(float) * (st->ntaps - 1));
+            memmove(st->window_i, &st->window_i[WINDOW_SIZE + 1], sizeof(float) * (st->ntaps - 1));
+            st->idx = st->ntaps - 1;
+        }
+    }
+
+    if (count % 2)
+    {
+        st->pending = y[--count];
+        st->have_pending = 1;
+    }
+
+    return count;
+}
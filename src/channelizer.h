@@ -0,0 +1,32 @@
+#pragma once
+
+#include <complex.h>
+#include <stdint.h>
+
+#include "defines.h"
+
+/*
+ * Mix one station of a wideband u8 IQ capture down to baseband, filter it
+ * and decimate it to the 1488375 Hz rate read from a single-station RTL-SDR.
+ */
+typedef struct
+{
+    unsigned int decim;
+    unsigned int ntaps;
+    float *taps;
+    // mixed input samples, split into real and imaginary parts
+    float *window_r, *window_i;
+    unsigned int idx, phase;
+
+    float complex rotation, rotation_step;
+    unsigned int rotation_count;
+
+    // an odd output waiting for its pair
+    int have_pending;
+    cint16_t pending;
+} channelizer_t;
+
+void channelizer_init(channelizer_t *st, unsigned int decim, double offset);
+void channelizer_free(channelizer_t *st);
+// channelize n complex u8 samples into y, which must hold n / decim + 2 samples; returns an even number of outputs
+unsigned int channelizer_execute(channelizer_t *st, const uint8_t *x, unsigned int n, cint16_t *y);
@@ -28,8 +28,33 @@ struct lte_conv_code {
 	int term;
 };
 
-int nrsc5_conv_decode_p1(const int8_t *in, uint8_t *out);
-int nrsc5_conv_decode_pids(const int8_t *in, uint8_t *out);
-int nrsc5_conv_decode_p3(const int8_t *in, uint8_t *out);
+/*
+ * Default wrap-around window for P1 (pre-roll and traceback depth in bits)
+ */
+#define CONV_WINDOW_DEFAULT	(16 * 7)
+
+/*
+ * Path metric precision. 8-bit metrics quantize the soft input to a few
+ * levels, but fit twice as many states in a SIMD register and store path
+ * decisions as single bits.
+ */
+enum {
+	CONV_METRIC_16,
+	CONV_METRIC_8,
+};
+
+struct vdecoder;
+
+struct vdecoder *nrsc5_conv_alloc_p1(int window, int metric);
+struct vdecoder *nrsc5_conv_alloc_pids(int metric);
+struct vdecoder *nrsc5_conv_alloc_p3(int metric);
+void nrsc5_conv_free(struct vdecoder *dec);
+
+int nrsc5_conv_decode_p1(struct vdecoder *dec, const int8_t *in, uint8_t *out);
+int nrsc5_conv_decode_pids(struct vdecoder *dec, const int8_t *in, uint8_t *out);
+int nrsc5_conv_decode_p3(struct vdecoder *dec, const int8_t *in, uint8_t *out);
+
+/* Name of the butterfly kernel selected for this CPU */
+const char *nrsc5_conv_kernel_name(void);
 
 #endif /* _CONV_H_ */
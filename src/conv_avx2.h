@@ -0,0 +1,278 @@
+/*
+ * Viterbi decoder for convolutional codes - Intel AVX2
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Kernels in this file are compiled for AVX2 with a function attribute
+ * rather than global compiler flags, so the same binary runs on machines
+ * without AVX2. They must only be called after checking the CPU at runtime.
+ */
+
+#include <stdint.h>
+#include <immintrin.h>
+
+/*
+ * Pack three soft inputs and a zero pad into a 64-bit value in registers.
+ * Building a 16-bit array from separate stores and reloading it as one
+ * vector stalls on store forwarding, which dominates the kernel latency.
+ */
+#ifndef AVX_PACK_N3
+#define AVX_PACK_N3(V) \
+	((uint64_t) (uint16_t) (V)[0] | \
+	 (uint64_t) (uint16_t) (V)[1] << 16 | \
+	 (uint64_t) (uint16_t) (V)[2] << 32)
+#endif
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+/*
+ * Sixteen-wide Viterbi butterfly
+ *
+ * Same operation as SSE_BUTTERFLY on 256-bit YMM registers.
+ *
+ * Input:
+ * M0 - Path metrics 0 (packed 16-bit integers)
+ * M1 - Path metrics 1 (packed 16-bit integers)
+ * M2 - Branch metrics (packed 16-bit integers)
+ *
+ * Output:
+ * M2 - Selected and accumulated path metrics 0
+ * M4 - Selected and accumulated path metrics 1
+ * M3 - Path selections 0
+ * M1 - Path selections 1
+ */
+#define AVX2_BUTTERFLY(M0,M1,M2,M3,M4) \
+{ \
+	M3 = _mm256_adds_epi16(M0, M2); \
+	M4 = _mm256_subs_epi16(M1, M2); \
+	M0 = _mm256_subs_epi16(M0, M2); \
+	M1 = _mm256_adds_epi16(M1, M2); \
+	M2 = _mm256_max_epi16(M3, M4); \
+	M3 = _mm256_cmpgt_epi16(M3, M4); \
+	M4 = _mm256_max_epi16(M0, M1); \
+	M1 = _mm256_cmpgt_epi16(M0, M1); \
+}
+
+/*
+ * Deinterleaving K = 7
+ *
+ * Take 32 interleaved 16-bit integers in two registers and split them into
+ * one register of even elements and one of odd elements. The byte shuffle
+ * only operates within 128-bit lanes, so each lane is first split into even
+ * and odd halves, the 64-bit quarters are regrouped so that the low lane
+ * holds even and the high lane odd elements, and the lanes of the two
+ * inputs are finally combined.
+ *
+ * Input:
+ * M0:1 - Packed 16-bit integers
+ *
+ * Output:
+ * M2:3 - Even and odd packed 16-bit integers
+ */
+#define AVX2_DEINTERLEAVE_K7(M0,M1,M2,M3) \
+{ \
+	M2 = _mm256_set_epi8(15, 14, 11, 10, 7, 6, 3, 2, \
+			     13, 12, 9, 8, 5, 4, 1, 0, \
+			     15, 14, 11, 10, 7, 6, 3, 2, \
+			     13, 12, 9, 8, 5, 4, 1, 0); \
+	M0 = _mm256_shuffle_epi8(M0, M2); \
+	M1 = _mm256_shuffle_epi8(M1, M2); \
+	M0 = _mm256_permute4x64_epi64(M0, _MM_SHUFFLE(3, 1, 2, 0)); \
+	M1 = _mm256_permute4x64_epi64(M1, _MM_SHUFFLE(3, 1, 2, 0)); \
+	M2 = _mm256_permute2x128_si256(M0, M1, 0x20); \
+	M3 = _mm256_permute2x128_si256(M0, M1, 0x31); \
+}
+
+/*
+ * Generate branch metrics N = 4
+ *
+ * Compute 16 branch metrics from trellis outputs and input values. The
+ * horizontal adds work within 128-bit lanes, which leaves pairs of metrics
+ * out of order; a final 32-bit permute restores state order.
+ *
+ * Input:
+ * M0:3 - 16 x 4 packed 16-bit trellis outputs
+ * M4   - Expanded and packed 16-bit input value
+ *
+ * Output:
+ * M5   - 16 computed 16-bit branch metrics
+ */
+#define AVX2_BRANCH_METRIC_N4(M0,M1,M2,M3,M4,M5) \
+{ \
+	M0 = _mm256_sign_epi16(M4, M0); \
+	M1 = _mm256_sign_epi16(M4, M1); \
+	M2 = _mm256_sign_epi16(M4, M2); \
+	M3 = _mm256_sign_epi16(M4, M3); \
+	M0 = _mm256_hadds_epi16(M0, M1); \
+	M1 = _mm256_hadds_epi16(M2, M3); \
+	M5 = _mm256_hadds_epi16(M0, M1); \
+	M5 = _mm256_permutevar8x32_epi32(M5, \
+			_mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)); \
+}
+
+/*
+ * Normalize state metrics K = 7
+ *
+ * Subtract the smallest of 64 path metrics from all of them. The sums are
+ * signed, so bias them before the unsigned minpos and remove the bias from
+ * the result.
+ *
+ * Input:
+ * M0:3 - Path metrics 0:3 (packed 16-bit integers)
+ *
+ * Output:
+ * M0:3 - Normalized path metrics 0:3
+ */
+#define AVX2_NORMALIZE_K7(M0,M1,M2,M3,M4,M5) \
+{ \
+	__m128i _min, _bias = _mm_set1_epi16(INT16_MIN); \
+	M4 = _mm256_min_epi16(M0, M1); \
+	M5 = _mm256_min_epi16(M2, M3); \
+	M4 = _mm256_min_epi16(M4, M5); \
+	_min = _mm_min_epi16(_mm256_castsi256_si128(M4), \
+			     _mm256_extracti128_si256(M4, 1)); \
+	_min = _mm_minpos_epu16(_mm_xor_si128(_min, _bias)); \
+	_min = _mm_xor_si128(_min, _bias); \
+	M4 = _mm256_broadcastw_epi16(_min); \
+	M0 = _mm256_subs_epi16(M0, M4); \
+	M1 = _mm256_subs_epi16(M1, M4); \
+	M2 = _mm256_subs_epi16(M2, M4); \
+	M3 = _mm256_subs_epi16(M3, M4); \
+}
+
+/*
+ * Combined BMU/PMU (K=7, N=3 and N=4)
+ *
+ * Compute branch metrics followed by path metrics for the 64-state trellis
+ * with 16 butterflies per register. Memory is accessed unaligned since
+ * trellis buffers are only guaranteed 16-byte alignment.
+ */
+AVX2_TARGET
+static void _avx2_metrics_k7_n4(uint64_t val, const int16_t *out,
+				int16_t *sums, int16_t *paths, int norm)
+{
+	__m256i m0, m1, m2, m3, m4, m5, m6, m7;
+	__m256i m8, m9, m10, m11;
+
+	/* (PMU) Load accumulated path matrics */
+	m0 = _mm256_loadu_si256((__m256i *) &sums[0]);
+	m1 = _mm256_loadu_si256((__m256i *) &sums[16]);
+	m2 = _mm256_loadu_si256((__m256i *) &sums[32]);
+	m3 = _mm256_loadu_si256((__m256i *) &sums[48]);
+
+	/* (PMU) Deinterleave into even and odd packed registers */
+	AVX2_DEINTERLEAVE_K7(m0, m1, m8, m9)
+	AVX2_DEINTERLEAVE_K7(m2, m3, m10, m11)
+
+	/* (BMU) Broadcast packed 16-bit input values */
+	m7 = _mm256_set1_epi64x(val);
+
+	/* (BMU) Load and compute branch metrics */
+	m0 = _mm256_loadu_si256((__m256i *) &out[0]);
+	m1 = _mm256_loadu_si256((__m256i *) &out[16]);
+	m2 = _mm256_loadu_si256((__m256i *) &out[32]);
+	m3 = _mm256_loadu_si256((__m256i *) &out[48]);
+
+	AVX2_BRANCH_METRIC_N4(m0, m1, m2, m3, m7, m4)
+
+	m0 = _mm256_loadu_si256((__m256i *) &out[64]);
+	m1 = _mm256_loadu_si256((__m256i *) &out[80]);
+	m2 = _mm256_loadu_si256((__m256i *) &out[96]);
+	m3 = _mm256_loadu_si256((__m256i *) &out[112]);
+
+	AVX2_BRANCH_METRIC_N4(m0, m1, m2, m3, m7, m5)
+
+	/* (PMU) Butterflies: 0-15 */
+	AVX2_BUTTERFLY(m8, m9, m4, m0, m1)
+
+	_mm256_storeu_si256((__m256i *) &paths[0], m0);
+	_mm256_storeu_si256((__m256i *) &paths[32], m9);
+
+	/* (PMU) Butterflies: 16-31 */
+	AVX2_BUTTERFLY(m10, m11, m5, m2, m3)
+
+	_mm256_storeu_si256((__m256i *) &paths[16], m2);
+	_mm256_storeu_si256((__m256i *) &paths[48], m11);
+
+	if (norm)
+		AVX2_NORMALIZE_K7(m4, m5, m1, m3, m6, m7)
+
+	_mm256_storeu_si256((__m256i *) &sums[0], m4);
+	_mm256_storeu_si256((__m256i *) &sums[16], m5);
+	_mm256_storeu_si256((__m256i *) &sums[32], m1);
+	_mm256_storeu_si256((__m256i *) &sums[48], m3);
+}
+
+static void gen_metrics_k7_n3_avx2(const int8_t *val, const int16_t *out,
+				   int16_t *sums, int16_t *paths, int norm)
+{
+	_avx2_metrics_k7_n4(AVX_PACK_N3(val), out, sums, paths, norm);
+}
+
+/* See SSE_SELECT8 */
+#define AVX2_SELECT8(M0,M1,M2) \
+{ \
+	M0 = _mm256_sub_epi8(M0, M1); \
+	M2 = _mm256_cmpgt_epi8(M0, _mm256_setzero_si256()); \
+	M0 = _mm256_add_epi8(M1, _mm256_and_si256(M0, M2)); \
+}
+
+/*
+ * Combined BMU/PMU with 8-bit path metrics (K=7, N=3)
+ *
+ * All 32 butterflies fit in one register. The byte shuffle splits even and
+ * odd states within each 128-bit lane, and a 64-bit permute restores the
+ * butterfly order across lanes.
+ */
+AVX2_TARGET
+static void gen_metrics8_k7_n3_avx2(const int8_t *val, const int8_t *out,
+				    int8_t *sums, uint64_t *paths)
+{
+	__m256i m0, m1, m2, m3, m4, m5;
+	uint64_t p0, p1;
+
+	/* (PMU) Load accumulated path metrics and split even and odd states */
+	m4 = _mm256_set_epi8(15, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 0,
+			     15, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 0);
+	m0 = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *) &sums[0]), m4);
+	m1 = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *) &sums[32]), m4);
+	m2 = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(m0, m1), 0xd8);
+	m3 = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(m0, m1), 0xd8);
+
+	/* (BMU) Branch metrics */
+	m4 = _mm256_add_epi8(_mm256_add_epi8(
+		_mm256_sign_epi8(_mm256_set1_epi8(val[0]),
+				 _mm256_loadu_si256((__m256i *) &out[0])),
+		_mm256_sign_epi8(_mm256_set1_epi8(val[1]),
+				 _mm256_loadu_si256((__m256i *) &out[64]))),
+		_mm256_sign_epi8(_mm256_set1_epi8(val[2]),
+				 _mm256_loadu_si256((__m256i *) &out[128])));
+
+	/* (PMU) Butterflies: 0-31 */
+	m0 = _mm256_add_epi8(m2, m4);
+	m1 = _mm256_sub_epi8(m3, m4);
+	AVX2_SELECT8(m0, m1, m5)
+	p0 = (uint32_t) _mm256_movemask_epi8(m5);
+	_mm256_storeu_si256((__m256i *) &sums[0], m0);
+
+	m0 = _mm256_sub_epi8(m2, m4);
+	m1 = _mm256_add_epi8(m3, m4);
+	AVX2_SELECT8(m0, m1, m5)
+	p1 = (uint32_t) _mm256_movemask_epi8(m5);
+	_mm256_storeu_si256((__m256i *) &sums[32], m0);
+
+	*paths = ~(p0 | p1 << 32);
+}
@@ -0,0 +1,200 @@
+/*
+ * Viterbi decoder for convolutional codes - Intel AVX-512BW
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * As with the AVX2 kernels, these are compiled with a function attribute
+ * and must only be called after checking the CPU at runtime.
+ */
+
+#include <stdint.h>
+#include <immintrin.h>
+
+/*
+ * Pack three soft inputs and a zero pad into a 64-bit value in registers.
+ * See conv_avx2.h.
+ */
+#ifndef AVX_PACK_N3
+#define AVX_PACK_N3(V) \
+	((uint64_t) (uint16_t) (V)[0] | \
+	 (uint64_t) (uint16_t) (V)[1] << 16 | \
+	 (uint64_t) (uint16_t) (V)[2] << 32)
+#endif
+
+#define AVX512_TARGET __attribute__((target("avx2,avx512f,avx512bw")))
+
+/* Word indices selecting even and odd states from a pair of registers */
+static const int16_t avx512_even_idx[32] __attribute__((aligned(64))) = {
+	 0,  2,  4,  6,  8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30,
+	32, 34, 36, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62,
+};
+
+static const int16_t avx512_odd_idx[32] __attribute__((aligned(64))) = {
+	 1,  3,  5,  7,  9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31,
+	33, 35, 37, 39, 41, 43, 45, 47, 49, 51, 53, 55, 57, 59, 61, 63,
+};
+
+/*
+ * Generate branch metrics N = 4
+ *
+ * Compute 8 branch metrics from 32 trellis outputs. Pairs of products are
+ * summed by the multiply-add, the two pairs of each state are folded into
+ * the low half of a 64-bit element, and the results are narrowed to 16-bit.
+ *
+ * Input:
+ * M0 - 8 x 4 packed 16-bit trellis outputs
+ * M1 - Expanded and packed 16-bit input value
+ *
+ * Output:
+ * X0 - 8 computed 16-bit branch metrics
+ */
+#define AVX512_BRANCH_METRIC_N4(M0,M1,X0) \
+{ \
+	M0 = _mm512_madd_epi16(M0, M1); \
+	M0 = _mm512_add_epi32(M0, _mm512_srli_epi64(M0, 32)); \
+	X0 = _mm512_cvtepi64_epi16(M0); \
+}
+
+/*
+ * Combined BMU/PMU (K=7, N=3 and N=4)
+ *
+ * Compute branch metrics followed by path metrics for the 64-state trellis.
+ * All 32 butterflies fit in a single register, so one butterfly step covers
+ * the whole trellis.
+ */
+AVX512_TARGET
+static void _avx512_metrics_k7_n4(uint64_t val, const int16_t *out,
+				  int16_t *sums, int16_t *paths, int norm)
+{
+	__m512i m0, m1, m2, m3, m4, m5, m6;
+	__m128i x0, x1, x2, x3;
+	__m256i y0;
+
+	/* (PMU) Load accumulated path matrics */
+	m0 = _mm512_loadu_si512((void *) &sums[0]);
+	m1 = _mm512_loadu_si512((void *) &sums[32]);
+
+	/* (PMU) Deinterleave into even and odd packed registers */
+	m2 = _mm512_permutex2var_epi16(m0,
+			_mm512_load_si512((void *) avx512_even_idx), m1);
+	m3 = _mm512_permutex2var_epi16(m0,
+			_mm512_load_si512((void *) avx512_odd_idx), m1);
+
+	/* (BMU) Broadcast packed 16-bit input values */
+	m6 = _mm512_set1_epi64(val);
+
+	/* (BMU) Load and compute branch metrics */
+	m0 = _mm512_loadu_si512((void *) &out[0]);
+	AVX512_BRANCH_METRIC_N4(m0, m6, x0)
+	m0 = _mm512_loadu_si512((void *) &out[32]);
+	AVX512_BRANCH_METRIC_N4(m0, m6, x1)
+	m0 = _mm512_loadu_si512((void *) &out[64]);
+	AVX512_BRANCH_METRIC_N4(m0, m6, x2)
+	m0 = _mm512_loadu_si512((void *) &out[96]);
+	AVX512_BRANCH_METRIC_N4(m0, m6, x3)
+
+	/* (BMU) Combine as a tree to keep the dependency chain short */
+	y0 = _mm256_inserti128_si256(_mm256_castsi128_si256(x0), x1, 1);
+	m4 = _mm512_castsi256_si512(
+		_mm256_inserti128_si256(_mm256_castsi128_si256(x2), x3, 1));
+	m4 = _mm512_inserti64x4(_mm512_castsi256_si512(y0),
+				_mm512_castsi512_si256(m4), 1);
+
+	/* (PMU) Butterflies: 0-31 */
+	m0 = _mm512_adds_epi16(m2, m4);
+	m1 = _mm512_subs_epi16(m3, m4);
+	m5 = _mm512_subs_epi16(m2, m4);
+	m6 = _mm512_adds_epi16(m3, m4);
+
+	m2 = _mm512_max_epi16(m0, m1);
+	m3 = _mm512_max_epi16(m5, m6);
+
+	_mm512_storeu_si512((void *) &paths[0],
+			    _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(m0, m1)));
+	_mm512_storeu_si512((void *) &paths[32],
+			    _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(m5, m6)));
+
+	/* Signed horizontal minimum, see AVX2_NORMALIZE_K7 */
+	if (norm) {
+		m0 = _mm512_min_epi16(m2, m3);
+		y0 = _mm256_min_epi16(_mm512_castsi512_si256(m0),
+				      _mm512_extracti64x4_epi64(m0, 1));
+		x0 = _mm_min_epi16(_mm256_castsi256_si128(y0),
+				   _mm256_extracti128_si256(y0, 1));
+		x1 = _mm_set1_epi16(INT16_MIN);
+		x0 = _mm_minpos_epu16(_mm_xor_si128(x0, x1));
+		x0 = _mm_xor_si128(x0, x1);
+		m0 = _mm512_broadcastw_epi16(x0);
+		m2 = _mm512_subs_epi16(m2, m0);
+		m3 = _mm512_subs_epi16(m3, m0);
+	}
+
+	_mm512_storeu_si512((void *) &sums[0], m2);
+	_mm512_storeu_si512((void *) &sums[32], m3);
+}
+
+static void gen_metrics_k7_n3_avx512(const int8_t *val, const int16_t *out,
+				     int16_t *sums, int16_t *paths, int norm)
+{
+	_avx512_metrics_k7_n4(AVX_PACK_N3(val), out, sums, paths, norm);
+}
+
+/*
+ * Combined BMU/PMU with 8-bit path metrics (K=7, N=3)
+ *
+ * Both halves of all 32 butterflies fit in a single register: the low half
+ * adds the branch metrics to the even states and the high half subtracts
+ * them, using the negated outputs. The compare mask is the packed path
+ * selection of all 64 states. See gen_metrics8_k7_n3 for the wrapping
+ * comparison.
+ */
+AVX512_TARGET
+static void gen_metrics8_k7_n3_avx512(const int8_t *val, const int8_t *out,
+				      int8_t *sums, uint64_t *paths)
+{
+	__m512i m0, m1, m2, m3, m4;
+	__mmask64 k0, k1, k2;
+
+	/* (PMU) Split even and odd states, then repeat them for both halves */
+	m4 = _mm512_broadcast_i32x4(_mm_set_epi8(15, 13, 11, 9, 7, 5, 3, 1,
+						 14, 12, 10, 8, 6, 4, 2, 0));
+	m0 = _mm512_shuffle_epi8(_mm512_loadu_si512((void *) sums), m4);
+	m1 = _mm512_permutexvar_epi64(_mm512_set_epi64(6, 4, 2, 0, 6, 4, 2, 0), m0);
+	m2 = _mm512_permutexvar_epi64(_mm512_set_epi64(7, 5, 3, 1, 7, 5, 3, 1), m0);
+
+	/* (BMU) Branch metrics, negating the inputs where the output is -1 */
+	m0 = _mm512_loadu_si512((void *) &out[0]);
+	m3 = _mm512_loadu_si512((void *) &out[64]);
+	m4 = _mm512_loadu_si512((void *) &out[128]);
+	k0 = _mm512_movepi8_mask(m0);
+	k1 = _mm512_movepi8_mask(m3);
+	k2 = _mm512_movepi8_mask(m4);
+	m0 = _mm512_set1_epi8(val[0]);
+	m3 = _mm512_set1_epi8(val[1]);
+	m4 = _mm512_set1_epi8(val[2]);
+	m0 = _mm512_mask_sub_epi8(m0, k0, _mm512_setzero_si512(), m0);
+	m3 = _mm512_mask_sub_epi8(m3, k1, _mm512_setzero_si512(), m3);
+	m4 = _mm512_mask_sub_epi8(m4, k2, _mm512_setzero_si512(), m4);
+	m0 = _mm512_add_epi8(_mm512_add_epi8(m0, m3), m4);
+
+	/* (PMU) Butterflies: 0-31 */
+	m1 = _mm512_add_epi8(m1, m0);
+	m2 = _mm512_sub_epi8(m2, m0);
+	k0 = _mm512_cmpgt_epi8_mask(_mm512_sub_epi8(m1, m2), _mm512_setzero_si512());
+	_mm512_storeu_si512((void *) sums, _mm512_mask_blend_epi8(k0, m2, m1));
+
+	*paths = ~(uint64_t) k0;
+}
@@ -32,12 +32,20 @@
 #include "defines.h"
 #include "conv.h"
 
-#if defined(HAVE_SSE3)
+#include "cpu.h"
+#include "conv_gen.h"
+
+#ifdef HAVE_SSSE3_TARGET
 #include "conv_sse.h"
-#elif defined(HAVE_NEON)
+#endif
+#ifdef HAVE_AVX2_TARGET
+#include "conv_avx2.h"
+#endif
+#ifdef HAVE_AVX512BW_TARGET
+#include "conv_avx512.h"
+#endif
+#ifdef HAVE_NEON
 #include "conv_neon.h"
-#else
-#include "conv_gen.h"
 #endif
 
 #define PARITY(X) __builtin_parity(X)
@@ -60,12 +68,16 @@ struct vstate {
  * sums       - Accumulated path metrics
  * outputs    - Trellis ouput values
  * vals       - Input value that led to each state
+ * sums8      - Accumulated 8-bit path metrics
+ * outputs8   - Butterfly outputs for 8-bit metrics, see gen_metrics8_k7_n3
  */
 struct vtrellis {
 	int num_states;
 	int16_t *sums;
 	int16_t *outputs;
 	uint8_t *vals;
+	int8_t *sums8;
+	int8_t *outputs8;
 };
 
 /*
@@ -76,9 +88,13 @@ struct vtrellis {
  * len       - Horizontal length of trellis
  * recursive - Set to '1' if the code is recursive
  * intrvl    - Normalization interval
+ * window    - Pre-roll and traceback depth (0 for full-length decoding)
+ * rows      - Number of allocated path rows
  * trellis   - Trellis object
  * punc      - Puncturing sequence
  * paths     - Trellis paths
+ * bits      - Packed trellis paths for 8-bit metrics, NULL otherwise
+ * quant     - Soft input quantized for 8-bit metrics
  */
 struct vdecoder {
 	int n;
@@ -86,12 +102,18 @@ struct vdecoder {
 	int len;
 	int recursive;
 	int intrvl;
+	int window;
+	int rows;
 	struct vtrellis *trellis;
 	int *punc;
 	int16_t **paths;
+	uint64_t *bits;
+	int8_t *quant;
 
 	void (*metric_func)(const int8_t *, const int16_t *,
 			    int16_t *, int16_t *, int);
+	void (*metric8_func)(const int8_t *, const int8_t *,
+			     int8_t *, uint64_t *);
 };
 
 /*
@@ -105,13 +127,38 @@ struct vdecoder {
 
 static int16_t *vdec_malloc(size_t n)
 {
-#if defined(HAVE_SSE3) && !defined(__APPLE__)
+#if !defined(__APPLE__)
 	return (int16_t *) memalign(SSE_ALIGN, sizeof(int16_t) * n);
 #else
 	return (int16_t *) malloc(sizeof(int16_t) * n);
 #endif
 }
 
+static int8_t *vdec_malloc8(size_t n)
+{
+#if !defined(__APPLE__)
+	return (int8_t *) memalign(SSE_ALIGN, n);
+#else
+	return (int8_t *) malloc(n);
+#endif
+}
+
+/*
+ * 8-bit path metrics
+ *
+ * The soft input of each frame is quantized to +/-CONV8_SOFT_MAX, bounding
+ * the K=7, N=3 branch metrics to +/-9. Any state
+ * can be reached from the best one in K - 1 steps, so path metrics stay
+ * within 6 * 18 = 108 of each other and two candidates within 126. Their
+ * 8-bit differences never overflow and no normalization is needed.
+ *
+ * Flushed codes give state zero a head start that stays within the same
+ * bound over the first K - 1 steps.
+ */
+#define CONV8_SOFT_MAX	3
+#define CONV8_SOFT_MEAN	2
+#define CONV8_START	16
+
 /* Left shift and mask for finding the previous state */
 static unsigned vstate_lshift(unsigned reg, int k, int val)
 {
@@ -194,6 +241,8 @@ static void free_trellis(struct vtrellis *trellis)
 	if (!trellis)
 		return;
 
+	free(trellis->outputs8);
+	free(trellis->sums8);
 	free(trellis->vals);
 	free(trellis->outputs);
 	free(trellis->sums);
@@ -210,9 +259,10 @@ static void free_trellis(struct vtrellis *trellis)
  * is used by the butterfly operation in the forward recursion, so only one
  * set of N outputs is required per state variable.
  */
-static struct vtrellis *generate_trellis(const struct lte_conv_code *code)
+static struct vtrellis *generate_trellis(const struct lte_conv_code *code,
+					 int metric)
 {
-	int i;
+	int i, j;
 	struct vtrellis *trellis;
 	int16_t *out;
 
@@ -238,6 +288,21 @@ static struct vtrellis *generate_trellis(const struct lte_conv_code *code)
 			gen_state_info(code, &trellis->vals[i], i, out);
 	}
 
+	/* One row per output, with the negated outputs after the butterflies */
+	if (metric == CONV_METRIC_8) {
+		trellis->sums8 = vdec_malloc8(ns);
+		trellis->outputs8 = vdec_malloc8(3 * ns);
+		if (!trellis->sums8 || !trellis->outputs8)
+			goto fail;
+
+		for (i = 0; i < ns / 2; i++) {
+			for (j = 0; j < 3; j++) {
+				trellis->outputs8[j * ns + i] = trellis->outputs[olen * i + j];
+				trellis->outputs8[j * ns + ns / 2 + i] = -trellis->outputs[olen * i + j];
+			}
+		}
+	}
+
 	return trellis;
 fail:
 	free_trellis(trellis);
@@ -256,12 +321,42 @@ static void reset_decoder(struct vdecoder *dec, int term)
 {
 	int ns = dec->trellis->num_states;
 
+	if (dec->bits) {
+		memset(dec->trellis->sums8, 0, ns);
+		if (term != CONV_TERM_TAIL_BITING)
+			dec->trellis->sums8[0] = CONV8_START;
+		return;
+	}
+
 	memset(dec->trellis->sums, 0, sizeof(int16_t) * ns);
 
 	if (term != CONV_TERM_TAIL_BITING)
 		dec->trellis->sums[0] = INT8_MAX * dec->n * dec->k;
 }
 
+/* Path selection at a trellis row, 1 for the odd predecessor */
+static inline unsigned path_bit(struct vdecoder *dec, int row, unsigned state)
+{
+	if (dec->bits)
+		return (dec->bits[row] >> state) & 1;
+
+	return dec->paths[row][state] + 1;
+}
+
+/*
+ * Accumulated path metric of a state. Wrapping 8-bit metrics are only
+ * meaningful relative to each other, so they are taken relative to state
+ * zero and offset to stay positive.
+ */
+static inline int state_sum(struct vdecoder *dec, unsigned state)
+{
+	if (dec->bits)
+		return (int8_t) (dec->trellis->sums8[state] -
+				 dec->trellis->sums8[0]) + 128;
+
+	return dec->trellis->sums[state];
+}
+
 static int _traceback(struct vdecoder *dec,
 		       unsigned state, uint8_t *out, int len)
 {
@@ -269,7 +364,7 @@ static int _traceback(struct vdecoder *dec,
 	unsigned path;
 
 	for (i = len - 1; i >= 0; i--) {
-		path = dec->paths[i][state] + 1;
+		path = path_bit(dec, i, state);
 		out[i] = dec->trellis->vals[state];
 		state = vstate_lshift(state, dec->k, path);
 	}
@@ -284,7 +379,7 @@ static void _traceback_rec(struct vdecoder *dec,
 	unsigned path;
 
 	for (i = len - 1; i >= 0; i--) {
-		path = dec->paths[i][state] + 1;
+		path = path_bit(dec, i, state);
 		out[i] = path ^ dec->trellis->vals[state];
 		state = vstate_lshift(state, dec->k, path);
 	}
@@ -304,7 +399,7 @@ static int traceback(struct vdecoder *dec, uint8_t *out, int term, int len)
 
 	if (term == CONV_TERM_TAIL_BITING) {
 		for (i = 0; i < dec->trellis->num_states; i++) {
-			sum = dec->trellis->sums[i];
+			sum = state_sum(dec, i);
 			if (sum > max) {
 				max_p = max;
 				max = sum;
@@ -315,7 +410,7 @@ static int traceback(struct vdecoder *dec, uint8_t *out, int term, int len)
 			return -EPROTO;
 	} else {
 		for (i = dec->len - 1; i >= len; i--) {
-			path = dec->paths[i][state] + 1;
+			path = path_bit(dec, i, state);
 			state = vstate_lshift(state, dec->k, path);
 		}
 	}
@@ -332,14 +427,101 @@ static int traceback(struct vdecoder *dec, uint8_t *out, int term, int len)
 	return max - max_p;
 }
 
-/* Release decoder object */
+/* Find the state with the largest accumulated path metric */
+static unsigned best_state(struct vdecoder *dec)
+{
+	int i, max = INT16_MIN;
+	unsigned state = 0;
+
+	for (i = 0; i < dec->trellis->num_states; i++) {
+		if (state_sum(dec, i) > max) {
+			max = state_sum(dec, i);
+			state = i;
+		}
+	}
+
+	return state;
+}
+
+/*
+ * Sliding-window traceback
+ *
+ * Trace back from trellis position 'last' to 'first' through the circular
+ * path memory, writing decoded bits only for positions below 'end'.
+ */
+static void _traceback_window(struct vdecoder *dec, unsigned state,
+			      uint8_t *out, int last, int first, int end)
+{
+	int i;
+	unsigned path;
+
+	for (i = last; i >= first; i--) {
+		path = path_bit(dec, i % dec->rows, state);
+		if (i < end)
+			out[i] = dec->trellis->vals[state];
+		state = vstate_lshift(state, dec->k, path);
+	}
+}
+
+/*
+ * Butterfly kernels, widest first. The generic kernel is always available
+ * and terminates the list.
+ */
+typedef void (*metric_func_t)(const int8_t *, const int16_t *,
+			      int16_t *, int16_t *, int);
+typedef void (*metric8_func_t)(const int8_t *, const int8_t *,
+			       int8_t *, uint64_t *);
+
+static const struct {
+	const char *name;
+	unsigned int features;
+	metric_func_t metrics_k7_n3;
+	metric8_func_t metrics8_k7_n3;
+} metric_kernels[] = {
+#ifdef HAVE_AVX512BW_TARGET
+	{ "avx512bw", CPU_AVX512BW, gen_metrics_k7_n3_avx512,
+	  gen_metrics8_k7_n3_avx512 },
+#endif
+#ifdef HAVE_AVX2_TARGET
+	{ "avx2", CPU_AVX2, gen_metrics_k7_n3_avx2, gen_metrics8_k7_n3_avx2 },
+#endif
+#ifdef HAVE_SSSE3_TARGET
+	{ "ssse3", CPU_SSSE3, gen_metrics_k7_n3_sse, gen_metrics8_k7_n3_sse },
+#endif
+#ifdef HAVE_NEON
+	{ "neon", CPU_NEON, gen_metrics_k7_n3_neon, gen_metrics8_k7_n3_neon },
+#endif
+	{ "generic", 0, gen_metrics_k7_n3, gen_metrics8_k7_n3 },
+};
+
+/* Select the widest kernel supported by the running CPU */
+static int select_metric_kernel(void)
+{
+	unsigned int features = cpu_features();
+	int i = 0;
+
+	while ((metric_kernels[i].features & features) !=
+	       metric_kernels[i].features)
+		i++;
+
+	return i;
+}
+
+const char *nrsc5_conv_kernel_name(void)
+{
+	return metric_kernels[select_metric_kernel()].name;
+}
+
 static void free_vdec(struct vdecoder *dec)
 {
 	if (!dec)
 		return;
 
-	free(dec->paths[0]);
+	if (dec->paths)
+		free(dec->paths[0]);
 	free(dec->paths);
+	free(dec->bits);
+	free(dec->quant);
 	free_trellis(dec->trellis);
 	free(dec);
 }
@@ -350,9 +532,10 @@ static void free_vdec(struct vdecoder *dec)
  * Subtract the constraint length K on the normalization interval to
  * accommodate the initialization path metric at state zero.
  */
-static struct vdecoder *alloc_vdec(const struct lte_conv_code *code)
+static struct vdecoder *alloc_vdec(const struct lte_conv_code *code,
+				   int window, int metric)
 {
-	int i, ns;
+	int i, ns, kernel;
 	struct vdecoder *dec;
 
 	ns = NUM_STATES(code->k);
@@ -362,6 +545,9 @@ static struct vdecoder *alloc_vdec(const struct lte_conv_code *code)
 	dec->k = code->k;
 	dec->recursive = code->rgen ? 1 : 0;
 	dec->intrvl = INT16_MAX / (dec->n * INT8_MAX) - dec->k;
+	kernel = select_metric_kernel();
+	dec->metric_func = metric_kernels[kernel].metrics_k7_n3;
+	dec->metric8_func = metric_kernels[kernel].metrics8_k7_n3;
 
     assert(dec->n == 3);
     assert(dec->k == 7);
@@ -371,13 +557,36 @@ static struct vdecoder *alloc_vdec(const struct lte_conv_code *code)
 	else
 		dec->len = code->len;
 
-	dec->trellis = generate_trellis(code);
+	/*
+	 * Windowed decoding only needs path memory for the traceback depth
+	 * plus one output block, and only applies to tail-biting codes that
+	 * are long enough to wrap around.
+	 */
+	if (code->term == CONV_TERM_TAIL_BITING &&
+	    window > 0 && window < dec->len) {
+		dec->window = window;
+		dec->rows = 2 * window;
+	} else {
+		dec->window = 0;
+		dec->rows = dec->len;
+	}
+
+	dec->trellis = generate_trellis(code, metric);
 	if (!dec->trellis)
 		goto fail;
 
-	dec->paths = (int16_t **) malloc(sizeof(int16_t *) * dec->len);
-	dec->paths[0] = vdec_malloc(ns * dec->len);
-	for (i = 1; i < dec->len; i++)
+	/* A single 64-bit word holds the selections of a row */
+	if (metric == CONV_METRIC_8) {
+		dec->bits = (uint64_t *) malloc(sizeof(uint64_t) * dec->rows);
+		dec->quant = vdec_malloc8(dec->n * dec->len);
+		if (!dec->bits || !dec->quant)
+			goto fail;
+		return dec;
+	}
+
+	dec->paths = (int16_t **) malloc(sizeof(int16_t *) * dec->rows);
+	dec->paths[0] = vdec_malloc(ns * dec->rows);
+	for (i = 1; i < dec->rows; i++)
 		dec->paths[i] = &dec->paths[0][i * ns];
 
 	return dec;
@@ -386,6 +595,55 @@ fail:
 	return NULL;
 }
 
+/* Advance the trellis by one symbol, storing the selections in a path row */
+static inline void step(struct vdecoder *dec, const int8_t *seq, int row,
+			int norm)
+{
+	struct vtrellis *trellis = dec->trellis;
+
+	if (dec->bits)
+		dec->metric8_func(seq, trellis->outputs8, trellis->sums8,
+				  &dec->bits[row]);
+	else
+		dec->metric_func(seq, trellis->outputs, trellis->sums,
+				 dec->paths[row], norm);
+}
+
+/*
+ * Scale the soft input so its mean magnitude becomes CONV8_SOFT_MEAN, and
+ * clip it to CONV8_SOFT_MAX. Scaling by the largest magnitude instead would
+ * leave most symbols on the lowest level whenever a few stand out.
+ */
+static const int8_t *quantize(struct vdecoder *dec, const int8_t *in)
+{
+	int i, v, scale, n = dec->n * dec->len;
+	int8_t level[256];
+	long sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += abs(in[i]);
+
+	/* Anything past 1 << 23 clips every non-zero input anyway */
+	if (sum == 0 || ((long) CONV8_SOFT_MEAN * n << 16) / sum > (1 << 23))
+		scale = 1 << 23;
+	else
+		scale = ((long) CONV8_SOFT_MEAN * n << 16) / sum;
+
+	for (i = INT8_MIN; i <= INT8_MAX; i++) {
+		v = (i * scale + (1 << 15)) >> 16;
+		if (v > CONV8_SOFT_MAX)
+			v = CONV8_SOFT_MAX;
+		else if (v < -CONV8_SOFT_MAX)
+			v = -CONV8_SOFT_MAX;
+		level[(uint8_t) i] = v;
+	}
+
+	for (i = 0; i < n; i++)
+		dec->quant[i] = level[(uint8_t) in[i]];
+
+	return dec->quant;
+}
+
 /*
  * Forward trellis recursion
  *
@@ -396,100 +654,137 @@ fail:
 static void _conv_decode(struct vdecoder *dec, const int8_t *seq, int len)
 {
 	int i;
-	struct vtrellis *trellis = dec->trellis;
 
-	for (i = 0; i < dec->len; i++) {
-		gen_metrics_k7_n3(&seq[dec->n * i],
-				 trellis->outputs,
-				 trellis->sums,
-				 dec->paths[i],
-				 !(i % dec->intrvl));
-	}
+	for (i = 0; i < dec->len; i++)
+		step(dec, &seq[dec->n * i], i, !(i % dec->intrvl));
 }
 
-int nrsc5_conv_decode_p1(const int8_t *in, uint8_t *out)
+/*
+ * Wrap-around tail-biting recursion
+ *
+ * Pre-roll the trellis over the last 'window' symbols of the frame so that
+ * the path metrics settle near the encoder starting state, then run a single
+ * pass over the frame with sliding-window traceback. The recursion continues
+ * 'window' symbols past the end of the frame, wrapping to the start, so the
+ * final bits see the same traceback depth as the rest of the frame.
+ */
+static void _conv_decode_wrap(struct vdecoder *dec, const int8_t *seq,
+			      uint8_t *out, int len)
 {
-	const struct lte_conv_code code = {
-		.n = 3,
-		.k = 7,
-		.len = P1_FRAME_LEN,
-		.gen = { 0133, 0171, 0165 },
-		.term = CONV_TERM_TAIL_BITING,
-	};
-	int rc;
-
-	struct vdecoder *vdec = alloc_vdec(&code);
-	if (!vdec)
-		return -EFAULT;
+	int i, pos, norm = 0, decided = 0;
+	int depth = dec->window;
+
+	/* Pre-roll decisions are never traced back; reuse the first row */
+	for (i = len - depth; i < len; i++)
+		step(dec, &seq[dec->n * i], 0, !(norm++ % dec->intrvl));
+
+	for (pos = 0; pos < len + depth; pos++) {
+		step(dec, &seq[dec->n * (pos % len)], pos % dec->rows,
+		     !(norm++ % dec->intrvl));
+
+		/* Path memory is full, release the oldest block */
+		if (pos + 1 - decided == dec->rows) {
+			_traceback_window(dec, best_state(dec), out, pos,
+					  decided, decided + dec->rows - depth);
+			decided += dec->rows - depth;
+		}
+	}
 
-	reset_decoder(vdec, code.term);
+	_traceback_window(dec, best_state(dec), out, pos - 1, decided, len);
+}
 
-	/* Propagate through the trellis with interval normalization */
-	_conv_decode(vdec, in, code.len);
+static const struct lte_conv_code code_p1 = {
+	.n = 3,
+	.k = 7,
+	.len = P1_FRAME_LEN,
+	.gen = { 0133, 0171, 0165 },
+	.term = CONV_TERM_TAIL_BITING,
+};
 
-	if (code.term == CONV_TERM_TAIL_BITING)
-		_conv_decode(vdec, in, code.len);
+static const struct lte_conv_code code_pids = {
+	.n = 3,
+	.k = 7,
+	.len = PIDS_FRAME_LEN,
+	.gen = { 0133, 0171, 0165 },
+	.term = CONV_TERM_TAIL_BITING,
+};
 
-	rc = traceback(vdec, out, code.term, code.len);
+static const struct lte_conv_code code_p3 = {
+	.n = 3,
+	.k = 7,
+	.len = P3_FRAME_LEN,
+	.gen = { 0133, 0171, 0165 },
+	.term = CONV_TERM_TAIL_BITING,
+};
 
-	free_vdec(vdec);
-	return rc;
+/*
+ * Decoder contexts
+ *
+ * The trellis and path memory only depend on the code, so a decoder is
+ * allocated once per logical channel and reused for every frame. Decoding
+ * with an existing context performs no heap allocations.
+ *
+ * A non-zero P1 window selects wrap-around tail-biting decoding with
+ * bounded path memory. A zero window keeps the full-length two pass
+ * decoder. CONV_METRIC_8 selects 8-bit path metrics for the context.
+ */
+struct vdecoder *nrsc5_conv_alloc_p1(int window, int metric)
+{
+	return alloc_vdec(&code_p1, window, metric);
 }
 
-int nrsc5_conv_decode_pids(const int8_t *in, uint8_t *out)
+struct vdecoder *nrsc5_conv_alloc_pids(int metric)
 {
-	const struct lte_conv_code code = {
-		.n = 3,
-		.k = 7,
-		.len = PIDS_FRAME_LEN,
-		.gen = { 0133, 0171, 0165 },
-		.term = CONV_TERM_TAIL_BITING,
-	};
-	int rc;
-
-	struct vdecoder *vdec = alloc_vdec(&code);
-	if (!vdec)
-		return -EFAULT;
-
-	reset_decoder(vdec, code.term);
-
-	/* Propagate through the trellis with interval normalization */
-	_conv_decode(vdec, in, code.len);
-
-	if (code.term == CONV_TERM_TAIL_BITING)
-		_conv_decode(vdec, in, code.len);
+	return alloc_vdec(&code_pids, 0, metric);
+}
 
-	rc = traceback(vdec, out, code.term, code.len);
+struct vdecoder *nrsc5_conv_alloc_p3(int metric)
+{
+	return alloc_vdec(&code_p3, 0, metric);
+}
 
-	free_vdec(vdec);
-	return rc;
+/* Release decoder object */
+void nrsc5_conv_free(struct vdecoder *dec)
+{
+	free_vdec(dec);
 }
 
-int nrsc5_conv_decode_p3(const int8_t *in, uint8_t *out)
+static int conv_decode(struct vdecoder *dec, const struct lte_conv_code *code,
+		       const int8_t *in, uint8_t *out)
 {
-	const struct lte_conv_code code = {
-		.n = 3,
-		.k = 7,
-		.len = P3_FRAME_LEN,
-		.gen = { 0133, 0171, 0165 },
-		.term = CONV_TERM_TAIL_BITING,
-	};
-	int rc;
-
-	struct vdecoder *vdec = alloc_vdec(&code);
-	if (!vdec)
+	if (!dec)
 		return -EFAULT;
 
-	reset_decoder(vdec, code.term);
+	reset_decoder(dec, code->term);
+
+	if (dec->bits)
+		in = quantize(dec, in);
+
+	if (dec->window) {
+		_conv_decode_wrap(dec, in, out, code->len);
+		return 0;
+	}
 
 	/* Propagate through the trellis with interval normalization */
-	_conv_decode(vdec, in, code.len);
+	_conv_decode(dec, in, code->len);
 
-	if (code.term == CONV_TERM_TAIL_BITING)
-		_conv_decode(vdec, in, code.len);
+	if (code->term == CONV_TERM_TAIL_BITING)
+		_conv_decode(dec, in, code->len);
 
-	rc = traceback(vdec, out, code.term, code.len);
+	return traceback(dec, out, code->term, code->len);
+}
+
+int nrsc5_conv_decode_p1(struct vdecoder *dec, const int8_t *in, uint8_t *out)
+{
+	return conv_decode(dec, &code_p1, in, out);
+}
 
-	free_vdec(vdec);
-	return rc;
+int nrsc5_conv_decode_pids(struct vdecoder *dec, const int8_t *in, uint8_t *out)
+{
+	return conv_decode(dec, &code_pids, in, out);
+}
+
+int nrsc5_conv_decode_p3(struct vdecoder *dec, const int8_t *in, uint8_t *out)
+{
+	return conv_decode(dec, &code_p3, in, out);
 }
@@ -184,3 +184,44 @@ static void gen_metrics_k7_n4(const int8_t *seq, const int16_t *out,
 	_gen_branch_metrics_n4(64, seq, out, metrics);
 	_gen_path_metrics(64, sums, metrics, paths, norm);
 }
+
+/*
+ * 8-bit path metric unit (K=7, N=3)
+ *
+ * Path metrics wrap around instead of being normalized, and two metrics are
+ * compared by the sign of their 8-bit difference, which is exact while they
+ * are less than 128 apart. Row j of the outputs holds output j of the 32
+ * butterflies, followed by its negation. Decisions are packed one bit per
+ * state, set when the odd predecessor was selected.
+ */
+static void gen_metrics8_k7_n3(const int8_t *seq, const int8_t *out,
+			       int8_t *sums, uint64_t *paths)
+{
+	int i;
+	uint8_t s0, s1, m, a, b, c, d;
+	uint8_t new_sums[64], sel[64];
+	uint64_t bits = 0;
+
+	/* Branchless so the compiler can vectorize it */
+	for (i = 0; i < 32; i++) {
+		s0 = sums[2 * i + 0];
+		s1 = sums[2 * i + 1];
+		m = seq[0] * out[i] + seq[1] * out[64 + i] + seq[2] * out[128 + i];
+
+		a = s0 + m;
+		b = s1 - m;
+		c = s0 - m;
+		d = s1 + m;
+
+		sel[i] = (int8_t) (a - b) <= 0;
+		sel[i + 32] = (int8_t) (c - d) <= 0;
+		new_sums[i] = sel[i] ? b : a;
+		new_sums[i + 32] = sel[i + 32] ? d : c;
+	}
+
+	for (i = 0; i < 64; i++)
+		bits |= (uint64_t) sel[i] << i;
+
+	memcpy(sums, new_sums, sizeof(new_sums));
+	*paths = bits;
+}
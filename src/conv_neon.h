@@ -164,7 +164,7 @@ __always_inline static void _neon_metrics_k7_n4(const int16_t *val, const int16_
     vst1q_s16(&sums[56], m11);
 }
 
-static inline void gen_metrics_k7_n3(const int8_t *val, const int16_t *out,
+static inline void gen_metrics_k7_n3_neon(const int8_t *val, const int16_t *out,
 		       int16_t *sums, int16_t *paths, int norm)
 {
 	const int16_t _val[4] = { val[0], val[1], val[2], 0 };
@@ -172,10 +172,70 @@ static inline void gen_metrics_k7_n3(const int8_t *val, const int16_t *out,
 	_neon_metrics_k7_n4(_val, out, sums, paths, norm);
 }
 
-static inline void gen_metrics_k7_n4(const int8_t *val, const int16_t *out,
+static inline void gen_metrics_k7_n4_neon(const int8_t *val, const int16_t *out,
 		       int16_t *sums, int16_t *paths, int norm)
 {
 	const int16_t _val[4] = { val[0], val[1], val[2], val[3] };
 
 	_neon_metrics_k7_n4(_val, out, sums, paths, norm);
 }
+
+/*
+ * Select the larger of two wrapping 8-bit path metrics and pack the
+ * selections, set where A was larger, into a 16-bit mask. See
+ * gen_metrics8_k7_n3 for the comparison.
+ */
+static inline uint64_t neon_select8(int8x16_t a, int8x16_t b, int8x16_t *sel)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t gt = vcgtq_s8(vsubq_s8(a, b), vdupq_n_s8(0));
+    uint8x16_t w = vandq_u8(gt, vld1q_u8(weights));
+    uint8x8_t p = vpadd_u8(vget_low_u8(w), vget_high_u8(w));
+
+    p = vpadd_u8(p, p);
+    p = vpadd_u8(p, p);
+    *sel = vbslq_s8(gt, a, b);
+    return vget_lane_u16(vreinterpret_u16_u8(p), 0);
+}
+
+/*
+ * Combined BMU/PMU with 8-bit path metrics (K=7, N=3)
+ *
+ * 16 butterflies per register, as in gen_metrics8_k7_n3_sse.
+ */
+static inline void gen_metrics8_k7_n3_neon(const int8_t *val, const int8_t *out,
+		       int8_t *sums, uint64_t *paths)
+{
+    int8x16x2_t lo, hi;
+    int8x16_t q0, q1, q2, m0, m1, s;
+    uint64_t bits;
+
+	/* (PMU) Load accumulated path metrics and split even and odd states */
+    lo = vuzpq_s8(vld1q_s8(&sums[0]), vld1q_s8(&sums[16]));
+    hi = vuzpq_s8(vld1q_s8(&sums[32]), vld1q_s8(&sums[48]));
+
+	/* (BMU) Branch metrics of butterflies 0-15 and 16-31 */
+    q0 = vdupq_n_s8(val[0]);
+    q1 = vdupq_n_s8(val[1]);
+    q2 = vdupq_n_s8(val[2]);
+    m0 = vmulq_s8(q0, vld1q_s8(&out[0]));
+    m0 = vmlaq_s8(m0, q1, vld1q_s8(&out[64]));
+    m0 = vmlaq_s8(m0, q2, vld1q_s8(&out[128]));
+    m1 = vmulq_s8(q0, vld1q_s8(&out[16]));
+    m1 = vmlaq_s8(m1, q1, vld1q_s8(&out[80]));
+    m1 = vmlaq_s8(m1, q2, vld1q_s8(&out[144]));
+
+	/* (PMU) Butterflies: 0-31 */
+    bits = neon_select8(vaddq_s8(lo.val[0], m0), vsubq_s8(lo.val[1], m0), &s);
+    vst1q_s8(&sums[0], s);
+    bits |= neon_select8(vaddq_s8(hi.val[0], m1), vsubq_s8(hi.val[1], m1), &s) << 16;
+    vst1q_s8(&sums[16], s);
+    bits |= neon_select8(vsubq_s8(lo.val[0], m0), vaddq_s8(lo.val[1], m0), &s) << 32;
+    vst1q_s8(&sums[32], s);
+    bits |= neon_select8(vsubq_s8(hi.val[0], m1), vaddq_s8(hi.val[1], m1), &s) << 48;
+    vst1q_s8(&sums[48], s);
+
+    *paths = ~bits;
+}
@@ -25,6 +25,12 @@
 #define __always_inline
 #endif
 
+/*
+ * Compiled for SSSE3 with a function attribute and selected at runtime, so
+ * the rest of the program does not need SSE compiler flags.
+ */
+#define SSE_TARGET __attribute__((target("ssse3")))
+
 #include <stdint.h>
 #include <emmintrin.h>
 #include <tmmintrin.h>
@@ -305,7 +311,7 @@
  * preserved and read and written into the same memory location. Normalize
  * sums if requires.
  */
-__always_inline void _sse_metrics_k5_n2(const int16_t *val,
+SSE_TARGET __always_inline void _sse_metrics_k5_n2(const int16_t *val,
 					const int16_t *out,
 					int16_t *sums,
 					int16_t *paths,
@@ -352,7 +358,7 @@ __always_inline void _sse_metrics_k5_n2(const int16_t *val,
  * than 1/4. Normally only rates 1/3 and 1/4 are used as there is a
  * dedicated implementation of rate 1/2.
  */
-__always_inline void _sse_metrics_k5_n4(const int16_t *val,
+SSE_TARGET __always_inline void _sse_metrics_k5_n4(const int16_t *val,
 					const int16_t *out,
 					int16_t *sums,
 					int16_t *paths,
@@ -397,7 +403,7 @@ __always_inline void _sse_metrics_k5_n4(const int16_t *val,
  * metrics requires usage of the full SSE register file, so separate sums
  * before computing branch metrics to avoid register spilling.
  */
-__always_inline void _sse_metrics_k7_n2(const int16_t *val,
+SSE_TARGET __always_inline void _sse_metrics_k7_n2(const int16_t *val,
 					const int16_t *out,
 					int16_t *sums,
 					int16_t *paths,
@@ -477,7 +483,7 @@ __always_inline void _sse_metrics_k7_n2(const int16_t *val,
  * trellis. 32 butterfly operations are computed. Deinterleave path
  * metrics before computing branch metrics as in the half rate case.
  */
-__always_inline void _sse_metrics_k7_n4(const int16_t *val, const int16_t *out,
+SSE_TARGET __always_inline void _sse_metrics_k7_n4(const int16_t *val, const int16_t *out,
 					int16_t *sums, int16_t *paths, int norm)
 {
 	__m128i m0, m1, m2, m3, m4, m5, m6, m7;
@@ -561,50 +567,101 @@ __always_inline void _sse_metrics_k7_n4(const int16_t *val, const int16_t *out,
 	_mm_store_si128((__m128i *) &sums[56], m11);
 }
 
-static void gen_metrics_k5_n2(const int8_t *val, const int16_t *out,
-			      int16_t *sums, int16_t *paths, int norm)
-{
-	const int16_t _val[4] = { val[0], val[1], val[0], val[1] };
-
-	_sse_metrics_k5_n2(_val, out, sums, paths, norm);
-}
-
-static void gen_metrics_k5_n3(const int8_t *val, const int16_t *out,
+SSE_TARGET
+static void gen_metrics_k7_n3_sse(const int8_t *val, const int16_t *out,
 		       int16_t *sums, int16_t *paths, int norm)
 {
 	const int16_t _val[4] = { val[0], val[1], val[2], 0 };
 
-	_sse_metrics_k5_n4(_val, out, sums, paths, norm);
-}
-
-static void gen_metrics_k5_n4(const int8_t *val, const int16_t *out,
-		       int16_t *sums, int16_t *paths, int norm)
-{
-	const int16_t _val[4] = { val[0], val[1], val[2], val[3] };
-
-	_sse_metrics_k5_n4(_val, out, sums, paths, norm);
+	_sse_metrics_k7_n4(_val, out, sums, paths, norm);
 }
 
-static void gen_metrics_k7_n2(const int8_t *val, const int16_t *out,
-		       int16_t *sums, int16_t *paths, int norm)
-{
-	const int16_t _val[4] = { val[0], val[1], val[0], val[1] };
-
-	_sse_metrics_k7_n2(_val, out, sums, paths, norm);
+/*
+ * Select the larger of two wrapping 8-bit path metrics
+ *
+ * The comparison is on the sign of the difference, see gen_metrics8_k7_n3,
+ * and the selected metric is computed as B + (A - B) where A is larger.
+ *
+ * Input:
+ * M0 - Candidate path metrics A (packed 8-bit integers)
+ * M1 - Candidate path metrics B (packed 8-bit integers)
+ *
+ * Output:
+ * M0 - Selected path metrics
+ * M2 - Path selections, set where A was larger
+ */
+#define SSE_SELECT8(M0,M1,M2) \
+{ \
+	M0 = _mm_sub_epi8(M0, M1); \
+	M2 = _mm_cmpgt_epi8(M0, _mm_setzero_si128()); \
+	M0 = _mm_add_epi8(M1, _mm_and_si128(M0, M2)); \
 }
 
-static void gen_metrics_k7_n3(const int8_t *val, const int16_t *out,
-		       int16_t *sums, int16_t *paths, int norm)
-{
-	const int16_t _val[4] = { val[0], val[1], val[2], 0 };
-
-	_sse_metrics_k7_n4(_val, out, sums, paths, norm);
-}
+/* Byte shuffle placing even states in the low half and odd in the high half */
+#define _I8_EVEN_ODD_MASK 15, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 0
 
-static void gen_metrics_k7_n4(const int8_t *val, const int16_t *out,
-		       int16_t *sums, int16_t *paths, int norm)
+/*
+ * Combined BMU/PMU with 8-bit path metrics (K=7, N=3)
+ *
+ * 16 butterflies per register, so the 64-state trellis takes two. Packed
+ * selections are gathered with movemask.
+ */
+SSE_TARGET
+static void gen_metrics8_k7_n3_sse(const int8_t *val, const int8_t *out,
+				   int8_t *sums, uint64_t *paths)
 {
-	const int16_t _val[4] = { val[0], val[1], val[2], val[3] };
+	__m128i m0, m1, m2, m3, m4, m5, m6, m7, m8, m9;
+	uint64_t p0, p1, p2, p3;
+
+	/* (PMU) Load accumulated path metrics and split even and odd states */
+	m8 = _mm_set_epi8(_I8_EVEN_ODD_MASK);
+	m0 = _mm_shuffle_epi8(_mm_load_si128((__m128i *) &sums[0]), m8);
+	m1 = _mm_shuffle_epi8(_mm_load_si128((__m128i *) &sums[16]), m8);
+	m2 = _mm_shuffle_epi8(_mm_load_si128((__m128i *) &sums[32]), m8);
+	m3 = _mm_shuffle_epi8(_mm_load_si128((__m128i *) &sums[48]), m8);
+	m4 = _mm_unpacklo_epi64(m0, m1);
+	m5 = _mm_unpackhi_epi64(m0, m1);
+	m6 = _mm_unpacklo_epi64(m2, m3);
+	m7 = _mm_unpackhi_epi64(m2, m3);
+
+	/* (BMU) Branch metrics of butterflies 0-15 and 16-31 */
+	m0 = _mm_set1_epi8(val[0]);
+	m1 = _mm_set1_epi8(val[1]);
+	m2 = _mm_set1_epi8(val[2]);
+	m8 = _mm_add_epi8(_mm_add_epi8(
+		_mm_sign_epi8(m0, _mm_load_si128((__m128i *) &out[0])),
+		_mm_sign_epi8(m1, _mm_load_si128((__m128i *) &out[64]))),
+		_mm_sign_epi8(m2, _mm_load_si128((__m128i *) &out[128])));
+	m9 = _mm_add_epi8(_mm_add_epi8(
+		_mm_sign_epi8(m0, _mm_load_si128((__m128i *) &out[16])),
+		_mm_sign_epi8(m1, _mm_load_si128((__m128i *) &out[80]))),
+		_mm_sign_epi8(m2, _mm_load_si128((__m128i *) &out[144])));
 
-	_sse_metrics_k7_n4(_val, out, sums, paths, norm);
+	/* (PMU) Butterflies: 0-15 */
+	m0 = _mm_add_epi8(m4, m8);
+	m1 = _mm_sub_epi8(m5, m8);
+	SSE_SELECT8(m0, m1, m2)
+	p0 = (uint16_t) _mm_movemask_epi8(m2);
+	_mm_store_si128((__m128i *) &sums[0], m0);
+
+	m0 = _mm_sub_epi8(m4, m8);
+	m1 = _mm_add_epi8(m5, m8);
+	SSE_SELECT8(m0, m1, m2)
+	p2 = (uint16_t) _mm_movemask_epi8(m2);
+	_mm_store_si128((__m128i *) &sums[32], m0);
+
+	/* (PMU) Butterflies: 16-31 */
+	m0 = _mm_add_epi8(m6, m9);
+	m1 = _mm_sub_epi8(m7, m9);
+	SSE_SELECT8(m0, m1, m2)
+	p1 = (uint16_t) _mm_movemask_epi8(m2);
+	_mm_store_si128((__m128i *) &sums[16], m0);
+
+	m0 = _mm_sub_epi8(m6, m9);
+	m1 = _mm_add_epi8(m7, m9);
+	SSE_SELECT8(m0, m1, m2)
+	p3 = (uint16_t) _mm_movemask_epi8(m2);
+	_mm_store_si128((__m128i *) &sums[48], m0);
+
+	*paths = ~(p0 | p1 << 16 | p2 << 32 | p3 << 48);
 }
@@ -0,0 +1,142 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(__arm__) && defined(HAVE_GETAUXVAL)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "cpu.h"
+
+#ifdef USE_THREADS
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+#else
+static int initialized;
+#endif
+static unsigned int features;
+static char features_str[64];
+
+static const struct {
+    unsigned int flag;
+    const char *name;
+} feature_names[] = {
+    { CPU_SSE2, "sse2" },
+    { CPU_SSSE3, "ssse3" },
+    { CPU_AVX2, "avx2" },
+    { CPU_AVX512BW, "avx512bw" },
+    { CPU_NEON, "neon" },
+};
+
+static unsigned int detect(void)
+{
+    unsigned int f = 0;
+
+#if defined(HAVE_BUILTIN_CPU_SUPPORTS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        f |= CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        f |= CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        f |= CPU_AVX2;
+#ifdef HAVE_AVX512BW_TARGET
+    if (__builtin_cpu_supports("avx512bw"))
+        f |= CPU_AVX512BW;
+#endif
+#elif defined(__aarch64__)
+    f |= CPU_NEON;
+#elif defined(__arm__) && defined(HAVE_GETAUXVAL)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+        f |= CPU_NEON;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    // no way to ask the kernel, trust the compiler flags
+    f |= CPU_NEON;
+#endif
+
+    return f;
+}
+
+static void update_str(void)
+{
+    unsigned int i;
+
+    features_str[0] = 0;
+    for (i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++)
+    {
+        if (!(features & feature_names[i].flag))
+            continue;
+        if (features_str[0])
+            strcat(features_str, " ");
+        strcat(features_str, feature_names[i].name);
+    }
+    if (!features_str[0])
+        strcpy(features_str, "none");
+}
+
+// features never change once detected, so every receiver can share them
+static void init_features(void)
+{
+    features = detect();
+    update_str();
+}
+
+void cpu_init(void)
+{
+#ifdef USE_THREADS
+    pthread_once(&once, init_features);
+#else
+    if (!initialized)
+        init_features();
+    initialized = 1;
+#endif
+}
+
+unsigned int cpu_features(void)
+{
+    cpu_init();
+    return features;
+}
+
+const char *cpu_features_str(void)
+{
+    cpu_init();
+    return features_str;
+}
+
+void cpu_disable(unsigned int mask)
+{
+    cpu_init();
+    features &= ~mask;
+    update_str();
+}
+
+unsigned int cpu_feature_flag(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++)
+    {
+        if (strcmp(name, feature_names[i].name) == 0)
+            return feature_names[i].flag;
+    }
+    return 0;
+}
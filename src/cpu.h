@@ -0,0 +1,16 @@
+#pragma once
+
+// instruction set extensions usable by the SIMD kernels
+#define CPU_SSE2        (1 << 0)
+#define CPU_SSSE3       (1 << 1)
+#define CPU_AVX2        (1 << 2)
+#define CPU_AVX512BW    (1 << 3)
+#define CPU_NEON        (1 << 4)
+
+void cpu_init(void);
+unsigned int cpu_features(void);
+const char *cpu_features_str(void);
+// hide features from the kernels created afterwards, to compare them with slower ones
+void cpu_disable(unsigned int mask);
+// flag of a feature named as in cpu_features_str, 0 if unknown
+unsigned int cpu_feature_flag(const char *name);
@@ -18,7 +18,20 @@
 #include "conv.h"
 #include "decode.h"
 #include "input.h"
+#include "metrics.h"
 #include "pids.h"
+#include "timing.h"
+
+// P1 and P3 blocks waiting for deinterleaving and Viterbi decoding
+#define DECODE_QUEUE_LEN 8
+
+enum
+{
+    DECODE_JOB_P1,
+    DECODE_JOB_P3,
+    DECODE_JOB_RESET,
+    DECODE_JOB_MARK
+};
 
 // calculate channel bit error rate by re-encoding and comparing to the input
 static float calc_cber(int8_t *coded, uint8_t *decoded)
@@ -67,17 +80,33 @@ static void descramble(uint8_t *buf, unsigned int length)
     }
 }
 
-static void dump_ber(float cber)
+static void dump_ber(decode_t *st, float cber)
 {
-    static float min = 1, max = 0, sum = 0, count = 0;
-    sum += cber;
-    count += 1;
-    if (cber < min) min = cber;
-    if (cber > max) max = cber;
-    log_info("BER: %f, avg: %f, min: %f, max: %f", cber, sum / count, min, max);
+    nrsc5_event_t evt;
+
+    evt.event = NRSC5_EVENT_BER;
+    evt.ber.cber = cber;
+    input_event(st->input, &evt);
+
+    st->ber_sum += cber;
+    st->ber_count += 1;
+    if (cber < st->ber_min) st->ber_min = cber;
+    if (cber > st->ber_max) st->ber_max = cber;
+    log_info("BER: %f, avg: %f, min: %f, max: %f", cber, st->ber_sum / st->ber_count, st->ber_min, st->ber_max);
+    metrics_count(METRICS_FRAMES, 1);
+    metrics_set(METRICS_BER, cber);
 }
 
-void decode_process_p1(decode_t *st)
+// P1 bits that come from the PIDS channel instead
+#define P1_MAP_PIDS UINT32_MAX
+
+/*
+ * Build a map from each soft bit of the 16 interleaved blocks to its position
+ * in the depunctured P1 codeword. Every 20 consecutive code bits are spread
+ * over all 16 blocks, so the trellis cannot advance before the last block,
+ * but each block can be deinterleaved as soon as it arrives.
+ */
+static void init_p1_map(decode_t *st)
 {
     const int J = 20, B = 16, C = 36;
     const int8_t v[] = {
@@ -85,6 +114,11 @@ void decode_process_p1(decode_t *st)
         11, 3, 19, 7, 15, 9, 17, 1, 13, 5
     };
     unsigned int i, out = 0;
+
+    st->p1_map = input_alloc(st->input, sizeof(uint32_t) * 720 * BLKSZ * 16);
+    for (i = 0; i < 720 * BLKSZ * 16; i++)
+        st->p1_map[i] = P1_MAP_PIDS;
+
     for (i = 0; i < 365440; i++)
     {
         int partition = v[i % J];
@@ -92,18 +126,38 @@ void decode_process_p1(decode_t *st)
         int k = i / (J * B);
         int row = (k * 11) % 32;
         int column = (k * 11 + k / (32*9)) % C;
-        st->viterbi_p1[out++] = st->buffer_pm[(block * 32 + row) * 720 + partition * C + column];
+        st->p1_map[(block * 32 + row) * 720 + partition * C + column] = out++;
         if ((out % 6) == 5) // depuncture, [1, 1, 1, 1, 1, 0]
             st->viterbi_p1[out++] = 0;
     }
+}
 
-    nrsc5_conv_decode_p1(st->viterbi_p1, st->scrambler_p1);
-    dump_ber(calc_cber(st->viterbi_p1, st->scrambler_p1));
+static void process_p1(decode_t *st, unsigned int block, const int8_t *buffer)
+{
+    const uint32_t *map = &st->p1_map[block * 720 * BLKSZ];
+    uint64_t start = timing_start();
+    unsigned int i;
+
+    for (i = 0; i < 720 * BLKSZ; i++)
+    {
+        if (map[i] != P1_MAP_PIDS)
+            st->viterbi_p1[map[i]] = buffer[i];
+    }
+    timing_stop(TIMING_DEINTERLEAVE, start);
+
+    if (block != 15)
+        return;
+
+    start = timing_start();
+    nrsc5_conv_decode_p1(st->vdec_p1, st->viterbi_p1, st->scrambler_p1);
+    timing_stop(TIMING_VITERBI_P1, start);
+    dump_ber(st, calc_cber(st->viterbi_p1, st->scrambler_p1));
     descramble(st->scrambler_p1, P1_FRAME_LEN);
     frame_push(&st->input->frame, st->scrambler_p1, P1_FRAME_LEN);
 }
 
-void decode_process_pids(decode_t *st)
+// offsets of the PIDS bits within a block, in code order, with -1 for punctured bits
+static void init_pids_map(decode_t *st)
 {
     const int J = 20, B = 16, C = 36;
     const int8_t v[] = {
@@ -111,46 +165,103 @@ void decode_process_pids(decode_t *st)
         11, 3, 19, 7, 15, 9, 17, 1, 13, 5
     };
     unsigned int i, out = 0;
+
+    st->pids_map = input_alloc(st->input, sizeof(int16_t) * PIDS_FRAME_LEN * 3);
     for (i = 0; i < 200; i++)
     {
         int partition = v[i % J];
-        int block = decode_get_block(st) - 1;
         int k = ((i / J) % (200 / J)) + (365440 / (J * B));
         int row = (k * 11) % 32;
         int column = (k * 11 + k / (32*9)) % C;
-        st->viterbi_pids[out++] = st->buffer_pm[(block * 32 + row) * 720 + partition * C + column];
+        st->pids_map[out++] = row * 720 + partition * C + column;
         if ((out % 6) == 5) // depuncture, [1, 1, 1, 1, 1, 0]
-            st->viterbi_pids[out++] = 0;
+            st->pids_map[out++] = -1;
     }
+}
+
+void decode_process_pids(decode_t *st)
+{
+    const int8_t *buffer = &st->buffer_pm[(decode_get_block(st) - 1) * 720 * BLKSZ];
+    uint64_t start = timing_start();
+    unsigned int i;
 
-    nrsc5_conv_decode_pids(st->viterbi_pids, st->scrambler_pids);
+    for (i = 0; i < PIDS_FRAME_LEN * 3; i++)
+        st->viterbi_pids[i] = (st->pids_map[i] < 0) ? 0 : buffer[st->pids_map[i]];
+    timing_stop(TIMING_DEINTERLEAVE, start);
+
+    start = timing_start();
+    nrsc5_conv_decode_pids(st->vdec_pids, st->viterbi_pids, st->scrambler_pids);
+    timing_stop(TIMING_VITERBI_PIDS, start);
     descramble(st->scrambler_pids, PIDS_FRAME_LEN);
     pids_frame_push(&st->pids, st->scrambler_pids);
 }
 
-void decode_process_p3(decode_t *st)
+/*
+ * Positions in internal_p3 read for each bit of the 147456-bit interleaver
+ * cycle. Each partition advances by exactly one period of its pattern per
+ * cycle, so the positions only depend on i_p3.
+ */
+static void init_p3_map(decode_t *st)
 {
     const int J = 4, B = 32, C = 36, M = 2, N = 147456;
     const int bk_bits = 32 * C;
     const int bk_adj = 32 * C - 1;
-    unsigned int i, out = 0;
-    for (i = 0; i < 9216; i++)
+    unsigned int i, pt[4] = { 0 };
+
+    st->p3_map = input_alloc(st->input, sizeof(uint32_t) * N);
+    for (i = 0; i < N; i++)
     {
-        int partition = ((st->i_p3 + 2 * (M / 4)) / M) % J;
-        unsigned int pti = (st->pt_p3[partition])++;
+        int partition = ((i + 2 * (M / 4)) / M) % J;
+        unsigned int pti = pt[partition]++;
         int block = (pti + (partition * 7) - (bk_adj * (pti / bk_bits))) % B;
         int row = ((11 * pti) % bk_bits) / C;
         int column = (pti * 11) % C;
-        st->viterbi_p3[out++] = st->internal_p3[(block * 32 + row) * 144 + partition * C + column];
-        if ((out % 6) == 1 || (out % 6) == 4) // depuncture, [1, 0, 1, 1, 0, 1]
-            st->viterbi_p3[out++] = 0;
+        st->p3_map[i] = (block * 32 + row) * 144 + partition * C + column;
+    }
+}
+
+static void alloc_p3(decode_t *st)
+{
+    st->internal_p3 = input_alloc(st->input, P3_FRAME_LEN * 32);
+    st->viterbi_p3 = input_alloc(st->input, P3_FRAME_LEN * 3);
+    st->scrambler_p3 = input_alloc(st->input, P3_FRAME_LEN);
+    init_p3_map(st);
+}
+
+static void process_p3(decode_t *st, const int8_t *buffer_px1)
+{
+    const unsigned int N = 147456;
+    const uint32_t *map;
+    int8_t *internal, *out;
+    uint64_t start;
+    unsigned int i;
+
+    // the low-memory profile waits for a service mode with P3
+    if (st->p3_map == NULL)
+        alloc_p3(st);
+
+    map = &st->p3_map[st->i_p3];
+    internal = &st->internal_p3[st->i_p3];
+    out = st->viterbi_p3;
+    start = timing_start();
 
-        st->internal_p3[st->i_p3] = st->buffer_px1[i];
-        (st->i_p3)++;
+    for (i = 0; i < 9216; i += 2, out += 3)
+    {
+        // depuncture, [1, 0, 1, 1, 0, 1]
+        out[0] = st->internal_p3[map[i]];
+        internal[i] = buffer_px1[i];
+        out[1] = 0;
+        out[2] = st->internal_p3[map[i + 1]];
+        internal[i + 1] = buffer_px1[i + 1];
     }
+    st->i_p3 += 9216;
+    timing_stop(TIMING_DEINTERLEAVE, start);
+
     if (st->ready_p3)
     {
-        nrsc5_conv_decode_p3(st->viterbi_p3, st->scrambler_p3);
+        start = timing_start();
+        nrsc5_conv_decode_p3(st->vdec_p3, st->viterbi_p3, st->scrambler_p3);
+        timing_stop(TIMING_VITERBI_P3, start);
         descramble(st->scrambler_p3, P3_FRAME_LEN);
         frame_push(&st->input->frame, st->scrambler_p3, P3_FRAME_LEN);
     }
@@ -161,29 +272,235 @@ void decode_process_p3(decode_t *st)
     }
 }
 
+static void reset_p3(decode_t *st)
+{
+    st->i_p3 = 0;
+    st->ready_p3 = 0;
+    frame_output_begin(&st->input->frame);
+}
+
+#ifdef USE_THREADS
+static void push_job(decode_t *st, uint8_t type, uint8_t block, const int8_t *buf, unsigned int len)
+{
+    uint8_t *job = queue_reserve(&st->queue, 1);
+
+    job[0] = type;
+    job[1] = block;
+    if (len)
+        memcpy(&job[2], buf, len);
+    queue_commit(&st->queue, len + 2);
+}
+
+static void *decode_worker(void *arg)
+{
+    decode_t *st = arg;
+    unsigned int len;
+    uint8_t *job;
+
+    while ((job = queue_peek(&st->queue, &len)) != NULL)
+    {
+        switch (job[0])
+        {
+        case DECODE_JOB_P1:
+            process_p1(st, job[1], (int8_t *)&job[2]);
+            break;
+        case DECODE_JOB_P3:
+            process_p3(st, (int8_t *)&job[2]);
+            break;
+        case DECODE_JOB_RESET:
+            reset_p3(st);
+            break;
+        case DECODE_JOB_MARK:
+        {
+            uint64_t position;
+            memcpy(&position, &job[2], sizeof(position));
+            frame_mark(&st->input->frame, position);
+            break;
+        }
+        }
+        queue_pop(&st->queue);
+    }
+
+    return NULL;
+}
+
+void decode_stop_thread(decode_t *st)
+{
+    queue_close(&st->queue);
+    pthread_join(st->worker_thread, NULL);
+    queue_free(&st->queue);
+}
+#endif
+
+void decode_process_p1(decode_t *st)
+{
+    unsigned int block = decode_get_block(st) - 1;
+    const int8_t *buffer = &st->buffer_pm[block * 720 * BLKSZ];
+
+#ifdef USE_THREADS
+    push_job(st, DECODE_JOB_P1, block, buffer, 720 * BLKSZ);
+#else
+    process_p1(st, block, buffer);
+#endif
+}
+
+void decode_mark(decode_t *st, uint64_t position)
+{
+#ifdef USE_THREADS
+    push_job(st, DECODE_JOB_MARK, 0, (const int8_t *) &position, sizeof(position));
+#else
+    frame_mark(&st->input->frame, position);
+#endif
+}
+
+void decode_process_p3(decode_t *st)
+{
+#ifdef USE_THREADS
+    push_job(st, DECODE_JOB_P3, 0, st->buffer_px1, 144 * BLKSZ * 2);
+#else
+    process_p3(st, st->buffer_px1);
+#endif
+}
+
+void decode_push_pm_block(decode_t *st, const int8_t *sbits, unsigned int count)
+{
+    while (count > 0)
+    {
+        unsigned int n = 720 * BLKSZ - st->idx_pm % (720 * BLKSZ);
+        if (n > count)
+            n = count;
+
+        memcpy(&st->buffer_pm[st->idx_pm], sbits, n);
+        st->idx_pm += n;
+        sbits += n;
+        count -= n;
+
+        if (st->idx_pm % (720 * BLKSZ) == 0)
+        {
+            if (st->input->profile & INPUT_PROFILE_SIS)
+                decode_process_pids(st);
+            if (st->input->profile & INPUT_PROFILE_FRAMES)
+                decode_process_p1(st);
+        }
+        if (st->idx_pm == 720 * BLKSZ * 16)
+            st->idx_pm = 0;
+    }
+}
+
+void decode_push_px1_block(decode_t *st, const int8_t *sbits, unsigned int count)
+{
+    if (count > 0 && st->buffer_px1 == NULL)
+        st->buffer_px1 = input_alloc(st->input, 144 * BLKSZ * 2);
+
+    while (count > 0)
+    {
+        unsigned int n = 144 * BLKSZ * 2 - st->idx_px1;
+        if (n > count)
+            n = count;
+
+        memcpy(&st->buffer_px1[st->idx_px1], sbits, n);
+        st->idx_px1 += n;
+        sbits += n;
+        count -= n;
+
+        if (st->idx_px1 == 144 * BLKSZ * 2)
+        {
+            decode_process_p3(st);
+            st->idx_px1 = 0;
+        }
+    }
+}
+
 void decode_reset(decode_t *st)
 {
     st->idx_pm = 0;
     st->idx_px1 = 0;
-    st->i_p3 = 0;
-    st->ready_p3 = 0;
-    memset(st->pt_p3, 0, sizeof(unsigned int) * 4);
-    pids_init(&st->pids);
-    output_begin(st->input->output);
+    pids_init(&st->pids, st->input);
+#ifdef USE_THREADS
+    push_job(st, DECODE_JOB_RESET, 0, NULL, 0);
+#else
+    reset_p3(st);
+#endif
+}
+
+static int viterbi_metric(decode_t *st, unsigned int channel)
+{
+    return (st->viterbi_8bit & channel) ? CONV_METRIC_8 : CONV_METRIC_16;
+}
+
+static void alloc_viterbi(decode_t *st)
+{
+    nrsc5_conv_free(st->vdec_p3);
+    nrsc5_conv_free(st->vdec_pids);
+    nrsc5_conv_free(st->vdec_p1);
+
+    st->vdec_p1 = nrsc5_conv_alloc_p1(st->viterbi_window, viterbi_metric(st, DECODE_CHANNEL_P1));
+    st->vdec_pids = nrsc5_conv_alloc_pids(viterbi_metric(st, DECODE_CHANNEL_PIDS));
+    st->vdec_p3 = nrsc5_conv_alloc_p3(viterbi_metric(st, DECODE_CHANNEL_P3));
+    if (!st->vdec_p1 || !st->vdec_pids || !st->vdec_p3)
+        FATAL_EXIT("Unable to allocate Viterbi decoders.");
+}
+
+void decode_set_viterbi_window(decode_t *st, int window)
+{
+    st->viterbi_window = window;
+    alloc_viterbi(st);
+}
+
+void decode_set_viterbi_8bit(decode_t *st, unsigned int channels)
+{
+    st->viterbi_8bit = channels;
+    alloc_viterbi(st);
 }
 
 void decode_init(decode_t *st, struct input_t *input)
 {
     st->input = input;
-    st->buffer_pm = malloc(720 * BLKSZ * 16);
-    st->buffer_px1 = malloc(144 * BLKSZ * 2);
-    st->viterbi_p1 = malloc(P1_FRAME_LEN * 3);
-    st->scrambler_p1 = malloc(P1_FRAME_LEN);
-    st->viterbi_pids = malloc(PIDS_FRAME_LEN * 3);
-    st->scrambler_pids = malloc(PIDS_FRAME_LEN);
-    st->internal_p3 = malloc(P3_FRAME_LEN * 32);
-    st->viterbi_p3 = malloc(P3_FRAME_LEN * 3);
-    st->scrambler_p3 = malloc(P3_FRAME_LEN);
-
-    decode_reset(st);
+    st->ber_min = 1;
+    st->ber_max = 0;
+    st->ber_sum = 0;
+    st->ber_count = 0;
+    st->buffer_pm = input_alloc(input, 720 * BLKSZ * 16);
+    st->viterbi_p1 = input_alloc(input, P1_FRAME_LEN * 3);
+    st->scrambler_p1 = input_alloc(input, P1_FRAME_LEN);
+    st->viterbi_pids = input_alloc(input, PIDS_FRAME_LEN * 3);
+    st->scrambler_pids = input_alloc(input, PIDS_FRAME_LEN);
+    init_p1_map(st);
+    init_pids_map(st);
+    st->buffer_px1 = NULL;
+    st->p3_map = NULL;
+    if (!input->low_memory)
+    {
+        st->buffer_px1 = input_alloc(input, 144 * BLKSZ * 2);
+        alloc_p3(st);
+    }
+
+    st->vdec_p1 = NULL;
+    st->vdec_pids = NULL;
+    st->vdec_p3 = NULL;
+    st->viterbi_window = CONV_WINDOW_DEFAULT;
+    st->viterbi_8bit = 0;
+    alloc_viterbi(st);
+
+    // start out reset without queueing a job, outputs may still be added to the input
+    st->idx_pm = 0;
+    st->idx_px1 = 0;
+    st->i_p3 = 0;
+    st->ready_p3 = 0;
+    pids_init(&st->pids, input);
+
+#ifdef USE_THREADS
+    queue_init(&st->queue, "decode", DECODE_QUEUE_LEN, 2 + 720 * BLKSZ);
+    pthread_create(&st->worker_thread, NULL, decode_worker, st);
+#ifdef HAVE_PTHREAD_SETNAME_NP
+    pthread_setname_np(st->worker_thread, "decode");
+#endif
+#endif
+}
+
+void decode_free(decode_t *st)
+{
+    nrsc5_conv_free(st->vdec_p3);
+    nrsc5_conv_free(st->vdec_pids);
+    nrsc5_conv_free(st->vdec_p1);
 }
@@ -1,8 +1,16 @@
 #pragma once
 
 #include <stdint.h>
+#include "config.h"
+#include "conv.h"
 #include "defines.h"
 #include "pids.h"
+#include "queue.h"
+
+// logical channels, for choosing which Viterbi decoders use 8-bit metrics
+#define DECODE_CHANNEL_P1 (1 << 0)
+#define DECODE_CHANNEL_PIDS (1 << 1)
+#define DECODE_CHANNEL_P3 (1 << 2)
 
 typedef struct
 {
@@ -12,48 +20,56 @@ typedef struct
     int8_t *buffer_px1;
     unsigned int idx_px1;
 
+    uint32_t *p1_map;
     int8_t *viterbi_p1;
     uint8_t *scrambler_p1;
+    int16_t *pids_map;
     int8_t *viterbi_pids;
     uint8_t *scrambler_pids;
     int8_t *internal_p3;
     unsigned int i_p3;
     int ready_p3;
-    unsigned int pt_p3[4];
+    uint32_t *p3_map;
     int8_t *viterbi_p3;
     uint8_t *scrambler_p3;
 
+    struct vdecoder *vdec_p1;
+    struct vdecoder *vdec_pids;
+    struct vdecoder *vdec_p3;
+    int viterbi_window;
+    unsigned int viterbi_8bit;
+
     pids_t pids;
+
+    // BER statistics since the decoder was created
+    float ber_min, ber_max, ber_sum, ber_count;
+
+#ifdef USE_THREADS
+    // P1 and P3 blocks are decoded on their own thread
+    queue_t queue;
+    pthread_t worker_thread;
+#endif
 } decode_t;
 
 void decode_process_p1(decode_t *st);
 void decode_process_pids(decode_t *st);
 void decode_process_p3(decode_t *st);
+// pass the position of the next block on to input_mark once the blocks before it are output
+void decode_mark(decode_t *st, uint64_t position);
 static inline unsigned int decode_get_block(decode_t *st)
 {
     return st->idx_pm / (720 * BLKSZ);
 }
-static inline void decode_push_pm(decode_t *st, int8_t sbit)
-{
-    st->buffer_pm[st->idx_pm++] = sbit;
-    if (st->idx_pm % (720 * BLKSZ) == 0)
-    {
-        decode_process_pids(st);
-    }
-    if (st->idx_pm == 720 * BLKSZ * 16)
-    {
-        decode_process_p1(st);
-        st->idx_pm = 0;
-    }
-}
-static inline void decode_push_px1(decode_t *st, int8_t sbit)
-{
-    st->buffer_px1[st->idx_px1++] = sbit;
-    if (st->idx_px1 % (144 * BLKSZ * 2) == 0)
-    {
-        decode_process_p3(st);
-        st->idx_px1 = 0;
-    }
-}
+// append soft bits, decoding every block that is completed
+void decode_push_pm_block(decode_t *st, const int8_t *sbits, unsigned int count);
+void decode_push_px1_block(decode_t *st, const int8_t *sbits, unsigned int count);
 void decode_reset(decode_t *st);
+void decode_set_viterbi_window(decode_t *st, int window);
+// channels is a mask of DECODE_CHANNEL_*
+void decode_set_viterbi_8bit(decode_t *st, unsigned int channels);
 void decode_init(decode_t *st, struct input_t *input);
+void decode_free(decode_t *st);
+#ifdef USE_THREADS
+// finish decoding the queued blocks and stop the thread
+void decode_stop_thread(decode_t *st);
+#endif
@@ -66,6 +66,26 @@ static inline float normf(float complex v)
     return realf * realf + imagf * imagf;
 }
 
+// cexpf(I * phase) without the libm call, accurate to a few ulp for the
+// phases used by the tracking loops (|phase| well below 1e5)
+static inline float complex cexpf_fast(float phase)
+{
+    // reduce to [-pi/4, pi/4] around the nearest multiple of pi/2
+    int q = (int) (phase * (float) M_2_PI + (phase >= 0 ? 0.5f : -0.5f));
+    float r = phase - q * 1.5703125f - q * 4.8375129699707031e-4f - q * 7.5497901264e-8f;
+    float r2 = r * r;
+    float s = r * (1 - r2 / 6 * (1 - r2 / 20 * (1 - r2 / 42 * (1 - r2 / 72))));
+    float c = 1 - r2 / 2 * (1 - r2 / 12 * (1 - r2 / 30 * (1 - r2 / 56)));
+
+    switch (q & 3)
+    {
+    case 0: return CMPLXF(c, s);
+    case 1: return CMPLXF(-s, c);
+    case 2: return CMPLXF(-c, -s);
+    default: return CMPLXF(s, -c);
+    }
+}
+
 static inline void fftshift(float complex *x, unsigned int size)
 {
     int i, h = size / 2;
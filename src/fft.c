@@ -0,0 +1,120 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+
+#include <string.h>
+
+#include "fft.h"
+
+#ifdef USE_THREADS
+static pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int planner_flags = FFTW_MEASURE;
+
+static void lock(void)
+{
+#ifdef USE_THREADS
+    pthread_mutex_lock(&planner_lock);
+#endif
+}
+
+static void unlock(void)
+{
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&planner_lock);
+#endif
+}
+
+int fft_set_planner_effort(const char *name)
+{
+    static const struct {
+        const char *name;
+        unsigned int flags;
+    } efforts[] = {
+        { "estimate", FFTW_ESTIMATE },
+        { "measure", FFTW_MEASURE },
+        { "patient", FFTW_PATIENT },
+        { "exhaustive", FFTW_EXHAUSTIVE },
+    };
+
+    for (unsigned int i = 0; i < sizeof(efforts) / sizeof(efforts[0]); i++)
+    {
+        if (strcmp(name, efforts[i].name) == 0)
+        {
+            lock();
+            planner_flags = efforts[i].flags;
+            unlock();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int fft_import_wisdom(const char *path)
+{
+    int ok;
+
+    lock();
+    ok = fftwf_import_wisdom_from_filename(path);
+    unlock();
+
+    return ok ? 0 : 1;
+}
+
+int fft_export_wisdom(const char *path)
+{
+    int ok;
+
+    lock();
+    ok = fftwf_export_wisdom_to_filename(path);
+    unlock();
+
+    return ok ? 0 : 1;
+}
+
+fftwf_plan fft_plan_dft_1d(int n, float complex *in, float complex *out, int sign)
+{
+    fftwf_plan plan;
+
+    lock();
+    plan = fftwf_plan_dft_1d(n, in, out, sign, planner_flags);
+    unlock();
+
+    return plan;
+}
+
+fftwf_plan fft_plan_many_dft_1d(int n, int howmany, float complex *in, float complex *out, int sign)
+{
+    fftwf_plan plan;
+
+    lock();
+    plan = fftwf_plan_many_dft(1, &n, howmany, in, NULL, 1, n, out, NULL, 1, n, sign, planner_flags);
+    unlock();
+
+    return plan;
+}
+
+void fft_destroy_plan(fftwf_plan plan)
+{
+    lock();
+    fftwf_destroy_plan(plan);
+    unlock();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <complex.h>
+#include <fftw3.h>
+
+// planner settings and wisdom are shared by the whole process, set them before creating receivers
+// effort is one of estimate, measure (the default), patient or exhaustive; returns 0 on success
+int fft_set_planner_effort(const char *name);
+// returns 0 on success
+int fft_import_wisdom(const char *path);
+int fft_export_wisdom(const char *path);
+
+// the FFTW planner is not thread-safe, so receivers create and destroy plans through these
+fftwf_plan fft_plan_dft_1d(int n, float complex *in, float complex *out, int sign);
+// howmany transforms of n consecutive elements each
+fftwf_plan fft_plan_many_dft_1d(int n, int howmany, float complex *in, float complex *out, int sign);
+void fft_destroy_plan(fftwf_plan plan);
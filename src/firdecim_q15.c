@@ -2,15 +2,20 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 
 #ifdef HAVE_NEON
 #include <arm_neon.h>
 #endif
 
-#ifdef HAVE_SSE2
+#ifdef HAVE_SSE2_TARGET
 #include <emmintrin.h>
 #endif
+#ifdef HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
 
+#include "cpu.h"
 #include "firdecim_q15.h"
 
 #define WINDOW_SIZE 2048
@@ -18,22 +23,40 @@
 struct firdecim_q15 {
     int16_t * taps;
     unsigned int ntaps;
+    // halfband filters keep even and odd input samples in separate windows
     cint16_t * window;
+    cint16_t * window_odd;
+    unsigned int history;
     unsigned int idx;
+    // index into kernels, chosen when the filter is created
+    int kernel;
 };
 
+static int select_kernel(void);
+
 firdecim_q15 firdecim_q15_create(const float * taps, unsigned int ntaps)
 {
     firdecim_q15 q;
 
     q = malloc(sizeof(*q));
+    q->kernel = select_kernel();
     q->ntaps = (ntaps == 32) ? 32 : 15;
     q->taps = malloc(sizeof(int16_t) * ntaps * 2);
     q->window = calloc(sizeof(cint16_t), WINDOW_SIZE);
-    q->idx = q->ntaps - 1;
+    if (q->ntaps == 32)
+    {
+        q->window_odd = NULL;
+        q->history = q->ntaps - 1;
+    }
+    else
+    {
+        q->window_odd = calloc(sizeof(cint16_t), WINDOW_SIZE);
+        q->history = (q->ntaps - 1) / 2;
+    }
+    q->idx = q->history;
 
     // reverse order so we can push into the window
-    // duplicate for neon
+    // duplicate for the SIMD kernels
     for (int i = 0; i < ntaps; ++i)
     {
         q->taps[i*2] = taps[ntaps - 1 - i] * 32767.0f;
@@ -43,111 +66,440 @@ firdecim_q15 firdecim_q15_create(const float * taps, unsigned int ntaps)
     return q;
 }
 
-static void push(firdecim_q15 q, cint16_t x)
+void firdecim_q15_free(firdecim_q15 q)
+{
+    free(q->window_odd);
+    free(q->window);
+    free(q->taps);
+    free(q);
+}
+
+/*
+ * Block kernels compute n consecutive outputs. For the 32-tap filter, output
+ * j uses a[j] .. a[j + 31]. For the halfband filter, output j uses the even
+ * samples e[j] .. e[j + 7] and the odd sample o[j] that lines up with the
+ * center tap. All kernels produce the same results as the generic versions:
+ * each product is shifted down in 32-bit precision and the sum wraps to 16
+ * bits.
+ */
+static void fir_32_generic(const cint16_t *a, const int16_t *b, cint16_t *y, unsigned int n)
 {
-    if (q->idx == WINDOW_SIZE)
+    for (unsigned int j = 0; j < n; j++, a++)
     {
-        for (int i = 0; i < q->ntaps - 1; i++)
-            q->window[i] = q->window[q->idx - q->ntaps + 1 + i];
-        q->idx = q->ntaps - 1;
+        cint16_t sum = { 0 };
+        int i;
+
+        for (i = 1; i < 16; i++)
+        {
+            sum.r += ((a[i].r + a[32-i].r) * b[i * 2]) >> 15;
+            sum.i += ((a[i].i + a[32-i].i) * b[i * 2]) >> 15;
+        }
+        sum.r += (a[i].r * b[i * 2]) >> 15;
+        sum.i += (a[i].i * b[i * 2]) >> 15;
+
+        y[j] = sum;
+    }
+}
+
+/*
+ * Convert interleaved u8 IQ to conjugated Q15 samples, splitting even and odd
+ * samples into the halfband windows.
+ */
+static void deinterleave_u8_generic(const uint8_t *x, cint16_t *e, cint16_t *o, unsigned int n)
+{
+    for (unsigned int j = 0; j < n; j++, x += 4)
+    {
+        e[j].r = U8_Q15(x[0]);
+        e[j].i = -U8_Q15(x[1]);
+        o[j].r = U8_Q15(x[2]);
+        o[j].i = -U8_Q15(x[3]);
+    }
+}
+
+static void halfband_generic(const cint16_t *e, const cint16_t *o, const int16_t *b, cint16_t *y, unsigned int n)
+{
+    for (unsigned int j = 0; j < n; j++, e++)
+    {
+        cint16_t sum = { 0 };
+        int i;
+
+        for (i = 0; i < 4; i++)
+        {
+            sum.r += ((e[i].r + e[7-i].r) * b[i * 2]) >> 15;
+            sum.i += ((e[i].i + e[7-i].i) * b[i * 2]) >> 15;
+        }
+        sum.r += o[j].r;
+        sum.i += o[j].i;
+
+        y[j] = sum;
     }
-    q->window[q->idx++] = x;
 }
 
 #ifdef HAVE_NEON
-static cint16_t dotprod_32(cint16_t *a, int16_t *b)
+static inline void mac_neon(int32x4_t *lo, int32x4_t *hi, int16x8_t x, int16x8_t y, int16_t t)
 {
-    int16x8_t s1 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[0]), vld1q_s16(&b[0*2]));
-    int16x8_t s2 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[4]), vld1q_s16(&b[4*2]));
-    int16x8_t s3 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[8]), vld1q_s16(&b[8*2]));
-    int16x8_t s4 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[12]), vld1q_s16(&b[12*2]));
-    int16x8_t sum = vqaddq_s16(vqaddq_s16(s1, s2), vqaddq_s16(s3, s4));
+    *lo = vaddq_s32(*lo, vshrq_n_s32(vmulq_n_s32(vaddl_s16(vget_low_s16(x), vget_low_s16(y)), t), 15));
+    *hi = vaddq_s32(*hi, vshrq_n_s32(vmulq_n_s32(vaddl_s16(vget_high_s16(x), vget_high_s16(y)), t), 15));
+}
 
-    s1 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[16]), vld1q_s16(&b[16*2]));
-    s2 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[20]), vld1q_s16(&b[20*2]));
-    s3 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[24]), vld1q_s16(&b[24*2]));
-    s4 = vqdmulhq_s16(vld1q_s16((int16_t *)&a[28]), vld1q_s16(&b[28*2]));
-    sum = vqaddq_s16(vqaddq_s16(s1, s2), sum);
-    sum = vqaddq_s16(vqaddq_s16(s3, s4), sum);
+static void fir_32_neon(const cint16_t *a, const int16_t *b, cint16_t *y, unsigned int n)
+{
+    unsigned int j;
 
-    int16x4x2_t sum2 = vuzp_s16(vget_high_s16(sum), vget_low_s16(sum));
-    int16x4_t sum3 = vpadd_s16(sum2.val[0], sum2.val[1]);
-    sum3 = vpadd_s16(sum3, sum3);
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
 
-    cint16_t result[2];
-    vst1_s16((int16_t*)&result, sum3);
+        for (int i = 1; i < 16; i++)
+            mac_neon(&lo, &hi, vld1q_s16((const int16_t *)&a[j + i]), vld1q_s16((const int16_t *)&a[j + 32 - i]), b[i * 2]);
+        mac_neon(&lo, &hi, vld1q_s16((const int16_t *)&a[j + 16]), vdupq_n_s16(0), b[32]);
 
-    return result[0];
+        vst1q_s16((int16_t *)&y[j], vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+    }
+    fir_32_generic(a + j, b, y + j, n - j);
 }
-#else
-static cint16_t dotprod_32(cint16_t *a, int16_t *b)
+
+static void halfband_neon(const cint16_t *e, const cint16_t *o, const int16_t *b, cint16_t *y, unsigned int n)
 {
-    cint16_t sum = { 0 };
-    int i;
+    unsigned int j;
 
-    for (i = 1; i < 16; i++)
+    for (j = 0; j + 4 <= n; j += 4)
     {
-        sum.r += ((a[i].r + a[32-i].r) * b[i * 2]) >> 15;
-        sum.i += ((a[i].i + a[32-i].i) * b[i * 2]) >> 15;
+        int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
+        int16x8_t sum;
+
+        for (int i = 0; i < 4; i++)
+            mac_neon(&lo, &hi, vld1q_s16((const int16_t *)&e[j + i]), vld1q_s16((const int16_t *)&e[j + 7 - i]), b[i * 2]);
+
+        sum = vcombine_s16(vmovn_s32(lo), vmovn_s32(hi));
+        vst1q_s16((int16_t *)&y[j], vaddq_s16(sum, vld1q_s16((const int16_t *)&o[j])));
     }
-    sum.r += (a[i].r * b[i * 2]) >> 15;
-    sum.i += (a[i].i * b[i * 2]) >> 15;
+    halfband_generic(e + j, o + j, b, y + j, n - j);
+}
+
+static void deinterleave_u8_neon(const uint8_t *x, cint16_t *e, cint16_t *o, unsigned int n)
+{
+    const uint8x8_t bias = vdup_n_u8(127);
+    unsigned int j;
 
-    return sum;
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        // lanes: even real, even imag, odd real, odd imag
+        uint8x8x4_t v = vld4_u8(&x[j * 4]);
+        int16x8x2_t even, odd;
+
+        even.val[0] = vshlq_n_s16(vreinterpretq_s16_u16(vsubl_u8(v.val[0], bias)), 6);
+        even.val[1] = vshlq_n_s16(vreinterpretq_s16_u16(vsubl_u8(bias, v.val[1])), 6);
+        odd.val[0] = vshlq_n_s16(vreinterpretq_s16_u16(vsubl_u8(v.val[2], bias)), 6);
+        odd.val[1] = vshlq_n_s16(vreinterpretq_s16_u16(vsubl_u8(bias, v.val[3])), 6);
+
+        vst2q_s16((int16_t *)&e[j], even);
+        vst2q_s16((int16_t *)&o[j], odd);
+    }
+    deinterleave_u8_generic(x + j * 4, e + j, o + j, n - j);
 }
 #endif
 
-#ifdef HAVE_NEON
-static cint16_t dotprod_halfband_4(cint16_t *a, int16_t *b)
+#ifdef HAVE_SSE2_TARGET
+// accumulate ((x + y) * t) >> 15 in 32-bit lanes, two complex samples per register
+__attribute__((target("sse2")))
+static inline void mac_sse2(__m128i *lo, __m128i *hi, __m128i x, __m128i y, __m128i t)
 {
-    cint16_t pairs[4];
-    int i;
+    *lo = _mm_add_epi32(*lo, _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(x, y), t), 15));
+    *hi = _mm_add_epi32(*hi, _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(x, y), t), 15));
+}
+
+// wrap 32-bit sums to 16 bits, like the generic int16_t accumulators
+__attribute__((target("sse2")))
+static inline __m128i narrow_sse2(__m128i lo, __m128i hi)
+{
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    return _mm_packs_epi32(lo, hi);
+}
 
-    for (i = 0; i < 7; i += 2)
+__attribute__((target("sse2")))
+static void fir_32_sse2(const cint16_t *a, const int16_t *b, cint16_t *y, unsigned int n)
+{
+    __m128i t[17];
+    unsigned int j;
+
+    for (int i = 1; i < 17; i++)
+        t[i] = _mm_set1_epi16(b[i * 2]);
+
+    for (j = 0; j + 4 <= n; j += 4)
     {
-        pairs[i/2].r = a[i].r + a[14-i].r;
-        pairs[i/2].i = a[i].i + a[14-i].i;
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+        for (int i = 1; i < 16; i++)
+            mac_sse2(&lo, &hi, _mm_loadu_si128((__m128i *)&a[j + i]), _mm_loadu_si128((__m128i *)&a[j + 32 - i]), t[i]);
+        mac_sse2(&lo, &hi, _mm_loadu_si128((__m128i *)&a[j + 16]), _mm_setzero_si128(), t[16]);
+
+        _mm_storeu_si128((__m128i *)&y[j], narrow_sse2(lo, hi));
     }
+    fir_32_generic(a + j, b, y + j, n - j);
+}
 
-    int16x8_t prod = vqdmulhq_s16(vld1q_s16((int16_t *)pairs), vld1q_s16(b));
-    int16x4x2_t prod2 = vuzp_s16(vget_high_s16(prod), vget_low_s16(prod));
-    int16x4_t sum = vpadd_s16(prod2.val[0], prod2.val[1]);
-    sum = vpadd_s16(sum, sum);
+__attribute__((target("sse2")))
+static void halfband_sse2(const cint16_t *e, const cint16_t *o, const int16_t *b, cint16_t *y, unsigned int n)
+{
+    __m128i t[4];
+    unsigned int j;
 
-    cint16_t result[2];
-    vst1_s16((int16_t*)&result, sum);
+    for (int i = 0; i < 4; i++)
+        t[i] = _mm_set1_epi16(b[i * 2]);
 
-    result[0].r += a[7].r;
-    result[0].i += a[7].i;
-    return result[0];
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        __m128i sum;
+
+        for (int i = 0; i < 4; i++)
+            mac_sse2(&lo, &hi, _mm_loadu_si128((__m128i *)&e[j + i]), _mm_loadu_si128((__m128i *)&e[j + 7 - i]), t[i]);
+
+        sum = narrow_sse2(lo, hi);
+        _mm_storeu_si128((__m128i *)&y[j], _mm_add_epi16(sum, _mm_loadu_si128((__m128i *)&o[j])));
+    }
+    halfband_generic(e + j, o + j, b, y + j, n - j);
 }
-#else
-static cint16_t dotprod_halfband_4(cint16_t *a, int16_t *b)
+
+// (x - 127) * (64, -64) is exactly U8_Q15 on real and -U8_Q15 on imaginary parts
+__attribute__((target("sse2")))
+static void deinterleave_u8_sse2(const uint8_t *x, cint16_t *e, cint16_t *o, unsigned int n)
 {
-    cint16_t sum = { 0 };
-    int i;
+    const __m128i bias = _mm_set1_epi16(127);
+    const __m128i scale = _mm_set_epi16(-64, 64, -64, 64, -64, 64, -64, 64);
+    unsigned int j;
 
-    for (i = 0; i < 7; i += 2)
+    for (j = 0; j + 4 <= n; j += 4)
     {
-        sum.r += ((a[i].r + a[14-i].r) * b[i]) >> 15;
-        sum.i += ((a[i].i + a[14-i].i) * b[i]) >> 15;
+        __m128i v = _mm_loadu_si128((__m128i *)&x[j * 4]);
+        __m128i lo = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+        __m128i hi = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+
+        lo = _mm_mullo_epi16(_mm_sub_epi16(lo, bias), scale);
+        hi = _mm_mullo_epi16(_mm_sub_epi16(hi, bias), scale);
+
+        // group even samples in the low and odd samples in the high half
+        lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+        hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+
+        _mm_storeu_si128((__m128i *)&e[j], _mm_unpacklo_epi64(lo, hi));
+        _mm_storeu_si128((__m128i *)&o[j], _mm_unpackhi_epi64(lo, hi));
     }
-    sum.r += a[7].r;
-    sum.i += a[7].i;
+    deinterleave_u8_generic(x + j * 4, e + j, o + j, n - j);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+// as the SSE2 kernels, with the 128-bit lanes holding samples 0-3 and 4-7
+__attribute__((target("avx2")))
+static inline void mac_avx2(__m256i *lo, __m256i *hi, __m256i x, __m256i y, __m256i t)
+{
+    *lo = _mm256_add_epi32(*lo, _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(x, y), t), 15));
+    *hi = _mm256_add_epi32(*hi, _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(x, y), t), 15));
+}
 
-    return sum;
+__attribute__((target("avx2")))
+static inline __m256i narrow_avx2(__m256i lo, __m256i hi)
+{
+    lo = _mm256_srai_epi32(_mm256_slli_epi32(lo, 16), 16);
+    hi = _mm256_srai_epi32(_mm256_slli_epi32(hi, 16), 16);
+    return _mm256_packs_epi32(lo, hi);
 }
+
+__attribute__((target("avx2")))
+static void fir_32_avx2(const cint16_t *a, const int16_t *b, cint16_t *y, unsigned int n)
+{
+    __m256i t[17];
+    unsigned int j;
+
+    for (int i = 1; i < 17; i++)
+        t[i] = _mm256_set1_epi16(b[i * 2]);
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+
+        for (int i = 1; i < 16; i++)
+            mac_avx2(&lo, &hi, _mm256_loadu_si256((__m256i *)&a[j + i]), _mm256_loadu_si256((__m256i *)&a[j + 32 - i]), t[i]);
+        mac_avx2(&lo, &hi, _mm256_loadu_si256((__m256i *)&a[j + 16]), _mm256_setzero_si256(), t[16]);
+
+        _mm256_storeu_si256((__m256i *)&y[j], narrow_avx2(lo, hi));
+    }
+    fir_32_generic(a + j, b, y + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void halfband_avx2(const cint16_t *e, const cint16_t *o, const int16_t *b, cint16_t *y, unsigned int n)
+{
+    __m256i t[4];
+    unsigned int j;
+
+    for (int i = 0; i < 4; i++)
+        t[i] = _mm256_set1_epi16(b[i * 2]);
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+        __m256i sum;
+
+        for (int i = 0; i < 4; i++)
+            mac_avx2(&lo, &hi, _mm256_loadu_si256((__m256i *)&e[j + i]), _mm256_loadu_si256((__m256i *)&e[j + 7 - i]), t[i]);
+
+        sum = narrow_avx2(lo, hi);
+        _mm256_storeu_si256((__m256i *)&y[j], _mm256_add_epi16(sum, _mm256_loadu_si256((__m256i *)&o[j])));
+    }
+    halfband_generic(e + j, o + j, b, y + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_u8_avx2(const uint8_t *x, cint16_t *e, cint16_t *o, unsigned int n)
+{
+    const __m256i bias = _mm256_set1_epi16(127);
+    const __m256i scale = _mm256_set_epi16(-64, 64, -64, 64, -64, 64, -64, 64,
+                                           -64, 64, -64, 64, -64, 64, -64, 64);
+    unsigned int j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)&x[j * 4]));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)&x[j * 4 + 16]));
+
+        lo = _mm256_mullo_epi16(_mm256_sub_epi16(lo, bias), scale);
+        hi = _mm256_mullo_epi16(_mm256_sub_epi16(hi, bias), scale);
+
+        // group even samples in the low and odd samples in the high lane
+        lo = _mm256_permutevar8x32_epi32(lo, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+        hi = _mm256_permutevar8x32_epi32(hi, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+
+        _mm256_storeu_si256((__m256i *)&e[j], _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)&o[j], _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    deinterleave_u8_generic(x + j * 4, e + j, o + j, n - j);
+}
+#endif
+
+static const struct {
+    const char *name;
+    unsigned int features;
+    void (*fir_32)(const cint16_t *a, const int16_t *b, cint16_t *y, unsigned int n);
+    void (*halfband)(const cint16_t *e, const cint16_t *o, const int16_t *b, cint16_t *y, unsigned int n);
+    void (*deinterleave_u8)(const uint8_t *x, cint16_t *e, cint16_t *o, unsigned int n);
+} kernels[] = {
+#ifdef HAVE_NEON
+    { "neon", CPU_NEON, fir_32_neon, halfband_neon, deinterleave_u8_neon },
+#endif
+#ifdef HAVE_AVX2_TARGET
+    { "avx2", CPU_AVX2, fir_32_avx2, halfband_avx2, deinterleave_u8_avx2 },
+#endif
+#ifdef HAVE_SSE2_TARGET
+    { "sse2", CPU_SSE2, fir_32_sse2, halfband_sse2, deinterleave_u8_sse2 },
 #endif
+    { "generic", 0, fir_32_generic, halfband_generic, deinterleave_u8_generic },
+};
+
+// pick the first kernel supported by the running CPU
+static int select_kernel(void)
+{
+    unsigned int features = cpu_features();
+    int i = 0;
+
+    while ((kernels[i].features & features) != kernels[i].features)
+        i++;
+
+    return i;
+}
+
+const char *firdecim_q15_kernel_name(void)
+{
+    return kernels[select_kernel()].name;
+}
+
+// move the filter history back to the start of the window
+static void rewind_window(firdecim_q15 q)
+{
+    memmove(&q->window[0], &q->window[q->idx - q->history], sizeof(cint16_t) * q->history);
+    if (q->window_odd)
+        memmove(&q->window_odd[0], &q->window_odd[q->idx - q->history], sizeof(cint16_t) * q->history);
+    q->idx = q->history;
+}
+
+void fir_q15_execute_block(firdecim_q15 q, const cint16_t *x, cint16_t *y, unsigned int n)
+{
+    while (n > 0)
+    {
+        unsigned int m = WINDOW_SIZE - q->idx;
+        if (m > n)
+            m = n;
+
+        memcpy(&q->window[q->idx], x, sizeof(cint16_t) * m);
+        kernels[q->kernel].fir_32(&q->window[q->idx - q->history], q->taps, y, m);
+
+        q->idx += m;
+        if (q->idx == WINDOW_SIZE)
+            rewind_window(q);
+
+        x += m;
+        y += m;
+        n -= m;
+    }
+}
+
+void halfband_q15_execute_block(firdecim_q15 q, const cint16_t *x, cint16_t *y, unsigned int n)
+{
+    while (n > 0)
+    {
+        unsigned int m = WINDOW_SIZE - q->idx;
+        if (m > n)
+            m = n;
+
+        for (unsigned int i = 0; i < m; i++)
+        {
+            q->window[q->idx + i] = x[i * 2];
+            q->window_odd[q->idx + i] = x[i * 2 + 1];
+        }
+        // the odd sample at the center tap is four behind the newest
+        kernels[q->kernel].halfband(&q->window[q->idx - q->history], &q->window_odd[q->idx - 4], q->taps, y, m);
+
+        q->idx += m;
+        if (q->idx == WINDOW_SIZE)
+            rewind_window(q);
+
+        x += m * 2;
+        y += m;
+        n -= m;
+    }
+}
+
+void halfband_q15_execute_u8(firdecim_q15 q, const uint8_t *x, cint16_t *y, unsigned int n)
+{
+    while (n > 0)
+    {
+        unsigned int m = WINDOW_SIZE - q->idx;
+        if (m > n)
+            m = n;
+
+        // convert straight into the windows and filter while they are in cache
+        kernels[q->kernel].deinterleave_u8(x, &q->window[q->idx], &q->window_odd[q->idx], m);
+        kernels[q->kernel].halfband(&q->window[q->idx - q->history], &q->window_odd[q->idx - 4], q->taps, y, m);
+
+        q->idx += m;
+        if (q->idx == WINDOW_SIZE)
+            rewind_window(q);
+
+        x += m * 4;
+        y += m;
+        n -= m;
+    }
+}
 
 void fir_q15_execute(firdecim_q15 q, const cint16_t *x, cint16_t *y)
 {
-    push(q, x[0]);
-    *y = dotprod_32(&q->window[q->idx - q->ntaps], q->taps);
+    fir_q15_execute_block(q, x, y, 1);
 }
 
 void halfband_q15_execute(firdecim_q15 q, const cint16_t *x, cint16_t *y)
 {
-    push(q, x[0]);
-    *y = dotprod_halfband_4(&q->window[q->idx - q->ntaps], q->taps);
-    push(q, x[1]);
+    halfband_q15_execute_block(q, x, y, 1);
 }
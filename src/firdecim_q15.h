@@ -5,5 +5,13 @@
 typedef struct firdecim_q15 * firdecim_q15;
 
 firdecim_q15 firdecim_q15_create(const float * taps, unsigned int ntaps);
+void firdecim_q15_free(firdecim_q15 q);
 void fir_q15_execute(firdecim_q15 q, const cint16_t *x, cint16_t *y);
 void halfband_q15_execute(firdecim_q15 q, const cint16_t *x, cint16_t *y);
+// filter n samples from x into n outputs
+void fir_q15_execute_block(firdecim_q15 q, const cint16_t *x, cint16_t *y, unsigned int n);
+// decimate 2 * n samples from x into n outputs
+void halfband_q15_execute_block(firdecim_q15 q, const cint16_t *x, cint16_t *y, unsigned int n);
+// convert 4 * n bytes of u8 IQ to conjugated Q15 and decimate into n outputs
+void halfband_q15_execute_u8(firdecim_q15 q, const uint8_t *x, cint16_t *y, unsigned int n);
+const char *firdecim_q15_kernel_name(void);
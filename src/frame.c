@@ -18,6 +18,8 @@
 #include "defines.h"
 #include "frame.h"
 #include "input.h"
+#include "metrics.h"
+#include "timing.h"
 #include "reed-solomon.h"
 
 #define PCI_AUDIO 0x38D8D3
@@ -25,8 +27,30 @@
 #define PCI_AUDIO_FIXED_OPP 0x8D8D33
 
 #define BBM 0x42E23A7D
+#define FIXED_BLOCK_LEN 255
 #define MAX_AAS_LEN 8212
 #define MAX_AUDIO_PACKETS 64
+// decoded P1 and P3 frames waiting to be parsed
+#define FRAME_QUEUE_LEN 8
+
+enum
+{
+    FRAME_JOB_BITS,
+    FRAME_JOB_BEGIN,
+    FRAME_JOB_MARK
+};
+
+// layouts of the fixed data subchannels, by the mode sent in the CCC
+static const struct
+{
+    uint16_t mode;
+    unsigned int parity;
+    unsigned int depth;
+} fixed_modes[] = {
+    { 0x0000, 0, 1 },  // no FEC, no interleaving
+    { 0x0001, 32, 1 }, // RS(255,223)
+    { 0x0002, 32, 4 }, // RS(255,223), four blocks interleaved
+};
 
 typedef struct
 {
@@ -145,20 +169,18 @@ static int has_fixed(frame_t *st)
 
 static int fix_header(uint8_t *buf)
 {
-    uint8_t hdr[255];
-    int corrections;
-    memset(hdr, 0, sizeof(hdr));
-    memcpy(hdr, buf, 96);
-    corrections = (int)rs_decode(hdr);
+    // shortened RS(255,247), with the parity in the first eight bytes
+    int corrections = (int)rs_decode(buf, 96, 8);
     if (corrections >= 0)
     {
         if (corrections)
             log_debug("RS corrected %d symbols", corrections);
-        memcpy(buf, hdr, 96);
+        metrics_count(METRICS_RS_CORRECTED, corrections);
         return 1;
     }
     else
     {
+        metrics_count(METRICS_RS_FAILURES, 1);
         return 0;
     }
 }
@@ -306,6 +328,7 @@ static void aas_push(frame_t *st, uint8_t* psd, int length)
     else if (fcs16(psd, length) != VALIDFCS16)
     {
         log_info("psd crc mismatch");
+        metrics_count(METRICS_PSD_CRC_ERRORS, 1);
     }
     else if (psd[0] != 0x21)
     {
@@ -342,8 +365,52 @@ static void parse_hdlc(frame_t *st, void (*process)(frame_t *, uint8_t *, int),
     }
 }
 
+// set up the subchannels of a layout, modes that are not supported are left empty
+static void apply_layout(frame_t *st, const uint16_t *mode, const uint16_t *length)
+{
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        fixed_subchannel_t *subch = &st->subchannel[i];
+        subch->mode = 0;
+        subch->length = 0;
+
+        if (length[i] == 0 && mode[i] == 0)
+            continue;
+
+        unsigned int m;
+        for (m = 0; m < sizeof(fixed_modes) / sizeof(fixed_modes[0]); m++)
+            if (fixed_modes[m].mode == mode[i])
+                break;
+
+        if (m < sizeof(fixed_modes) / sizeof(fixed_modes[0]))
+        {
+            subch->mode = mode[i];
+            subch->length = length[i];
+            subch->parity = fixed_modes[m].parity;
+            subch->depth = fixed_modes[m].depth;
+            subch->block_idx = 0;
+            free(subch->blocks);
+            subch->blocks = malloc(FIXED_BLOCK_LEN + 4);
+            subch->block_count = 0;
+            free(subch->interleaved);
+            subch->interleaved = malloc(FIXED_BLOCK_LEN * subch->depth);
+            subch->idx = -1;
+            free(subch->data);
+            subch->data = malloc(MAX_AAS_LEN);
+        }
+        else
+        {
+            log_warn("Subchannel mode %04X not supported", mode[i]);
+        }
+    }
+
+    st->fixed_ready = 1;
+}
+
 static void process_fixed_ccc(frame_t *st, uint8_t *buf, int buflen)
 {
+    uint16_t mode[4] = { 0 }, length[4] = { 0 };
+
     buflen = unescape_hdlc(buf, buflen);
 
     // padding
@@ -351,7 +418,7 @@ static void process_fixed_ccc(frame_t *st, uint8_t *buf, int buflen)
         return;
 
     // ignore new CCC packets (XXX they shouldn't change)
-    if (st->fixed_ready)
+    if (st->fixed_ready && !st->fixed_seeded)
         return;
 
     if (fcs16(buf, buflen) != VALIDFCS16)
@@ -362,46 +429,82 @@ static void process_fixed_ccc(frame_t *st, uint8_t *buf, int buflen)
 
     for (unsigned int i = 0; i < 4; i++)
     {
-        fixed_subchannel_t *subch = &st->subchannel[i];
-        subch->mode = 0;
-        subch->length = 0;
-
         if (5 + i * 4 <= buflen)
         {
-            uint16_t mode = *(uint16_t *)&buf[1 + i * 4];
-            uint16_t length = *(uint16_t *)&buf[3 + i * 4];
-            log_info("Subchannel %d: mode=%d, length=%d", i, mode, length);
-
-            if (mode == 0)
-            {
-                subch->mode = mode;
-                subch->length = length;
-                subch->block_idx = 0;
-                subch->blocks = malloc(255 + 4);
-                subch->idx = -1;
-                subch->data = malloc(MAX_AAS_LEN);
-            }
-            else
-            {
-                log_warn("Subchannel mode %04X not supported", mode);
-            }
+            mode[i] = *(uint16_t *)&buf[1 + i * 4];
+            length[i] = *(uint16_t *)&buf[3 + i * 4];
+            log_info("Subchannel %d: mode=%d, length=%d", i, mode[i], length[i]);
         }
     }
 
-    st->fixed_ready = 1;
+    // a layout from the cache is kept, along with what was received with it, if the station still sends it
+    if (st->fixed_seeded)
+    {
+        st->fixed_seeded = 0;
+        if (memcmp(mode, st->layout_mode, sizeof(mode)) == 0 && memcmp(length, st->layout_length, sizeof(length)) == 0)
+            return;
+        log_info("Cached subchannel layout is stale");
+    }
+    memcpy(st->layout_mode, mode, sizeof(mode));
+    memcpy(st->layout_length, length, sizeof(length));
+    apply_layout(st, mode, length);
 }
 
 /* FIXME: We only support mode=0 (no FEC, no interleaving) */
 static void process_fixed_block(frame_t *st, int i)
 {
     fixed_subchannel_t *subch = &st->subchannel[i];
-    parse_hdlc(st, aas_push, subch->data, &subch->idx, MAX_AAS_LEN, &subch->blocks[4], 255);
+    uint8_t codeword[FIXED_BLOCK_LEN];
+    unsigned int j, k;
+
+    if (subch->parity == 0 && subch->depth == 1)
+    {
+        parse_hdlc(st, aas_push, subch->data, &subch->idx, MAX_AAS_LEN, &subch->blocks[4], FIXED_BLOCK_LEN);
+        return;
+    }
+
+    memcpy(subch->interleaved + subch->block_count * FIXED_BLOCK_LEN, &subch->blocks[4], FIXED_BLOCK_LEN);
+    if (++subch->block_count < subch->depth)
+        return;
+    subch->block_count = 0;
+
+    for (j = 0; j < subch->depth; j++)
+    {
+        // byte k of the group belongs to codeword k % depth
+        for (k = 0; k < FIXED_BLOCK_LEN; k++)
+            codeword[k] = subch->interleaved[k * subch->depth + j];
+
+        if (subch->parity)
+        {
+            int corrections = (int)rs_decode(codeword, FIXED_BLOCK_LEN, subch->parity);
+            if (corrections < 0)
+                log_debug("Subchannel %d: uncorrectable block", i);
+            else if (corrections)
+                log_debug("Subchannel %d: RS corrected %d symbols", i, corrections);
+            if (corrections < 0)
+                metrics_count(METRICS_RS_FAILURES, 1);
+            else
+                metrics_count(METRICS_RS_CORRECTED, corrections);
+        }
+
+        // a block that could not be corrected is still passed on, the HDLC checksum catches it
+        parse_hdlc(st, aas_push, subch->data, &subch->idx, MAX_AAS_LEN, codeword + subch->parity, FIXED_BLOCK_LEN - subch->parity);
+    }
 }
 
 static void process_fixed_data(frame_t *st)
 {
     unsigned int sync = st->buffer[PDU_LEN - 1];
 
+    // a cached width that the station no longer sends is forgotten along with its layout
+    if (st->fixed_seeded && (sync & 0xF) * 2 != st->sync_width)
+    {
+        log_info("Cached subchannel layout is stale");
+        st->fixed_seeded = 0;
+        st->fixed_ready = 0;
+        st->sync_count = 0;
+    }
+
     if (st->sync_count < 2)
     {
         unsigned int width = (sync & 0xF) * 2;
@@ -436,12 +539,13 @@ static void process_fixed_data(frame_t *st)
             subch->blocks[subch->block_idx++] = p[j];
             if (subch->block_idx == 4 && *(uint32_t *)subch->blocks != BBM)
             {
-                // mis-aligned, skip a byte
+                // mis-aligned, skip a byte and start a new group
                 memmove(subch->blocks, subch->blocks + 1, 3);
                 subch->block_idx--;
+                subch->block_count = 0;
             }
 
-            if (subch->block_idx == 255 + 4)
+            if (subch->block_idx == FIXED_BLOCK_LEN + 4)
             {
                 // we have a complete block, deinterleave and process
                 process_fixed_block(st, i);
@@ -451,11 +555,17 @@ static void process_fixed_data(frame_t *st)
     }
 }
 
+static void alloc_program(frame_t *st, unsigned int prog)
+{
+    st->pdu[prog] = input_alloc(st->input, 0x10000);
+    st->psd_buf[prog] = input_alloc(st->input, MAX_AAS_LEN);
+}
+
 void frame_process(frame_t *st, size_t length)
 {
     int offset = 0;
 
-    if (has_fixed(st))
+    if (has_fixed(st) && (st->input->profile & INPUT_PROFILE_DATA))
         process_fixed_data(st);
 
     while (offset < length - 96)
@@ -488,16 +598,29 @@ void frame_process(frame_t *st, size_t length)
         if (hdr.hef)
             offset += parse_hef(st->buffer + offset, length - offset, &hef);
         prog = hef.prog_num;
+        // the low-memory profile only keeps buffers for the programs that are broadcast
+        if (st->pdu[prog] == NULL)
+            alloc_program(st, prog);
 
-        parse_hdlc(st, aas_push, st->psd_buf[prog], &st->psd_idx[prog], MAX_AAS_LEN, st->buffer + offset, start + hdr.la_location + 1 - offset);
+        if (st->input->profile & (INPUT_PROFILE_PSD | INPUT_PROFILE_DATA))
+            parse_hdlc(st, aas_push, st->psd_buf[prog], &st->psd_idx[prog], MAX_AAS_LEN, st->buffer + offset, start + hdr.la_location + 1 - offset);
         offset = start + hdr.la_location + 1;
 
+        // without audio, the packets are skipped unchecked
+        if (!(st->input->profile & INPUT_PROFILE_AUDIO))
+        {
+            if (hdr.nop)
+                offset = start + locations[hdr.nop - 1] + 1;
+            continue;
+        }
+
         for (j = 0; j < hdr.nop; ++j)
         {
             unsigned int cnt = start + locations[j] - offset;
             if (crc8(st->buffer + offset, cnt + 1) != 0)
             {
                 log_warn("crc mismatch!");
+                metrics_count(METRICS_CRC_ERRORS, 1);
                 offset += cnt + 1;
                 continue;
             }
@@ -530,11 +653,33 @@ void frame_process(frame_t *st, size_t length)
 
 }
 
-void frame_push(frame_t *st, uint8_t *bits, size_t length)
+// pack one bit per byte into bytes, the bytes of each group of eight are in reverse order
+static void pack_bits(const uint8_t *bits, uint8_t *out, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        uint64_t v;
+
+        memcpy(&v, &bits[i * 8], 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        // moves the lowest bit of byte m to bit 56 + m, without carries
+        out[i] = (v * 0x0102040810204080ULL) >> 56;
+    }
+}
+
+static inline unsigned int packed_bit(const uint8_t *packed, unsigned int i)
+{
+    return (packed[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static void process_bits(frame_t *st, const uint8_t *bits, size_t length)
 {
     unsigned int start, offset;
-    unsigned int i, j = 0, h = 0, header = 0, val = 0;
-    uint8_t *ptr = st->buffer;
+    unsigned int i, k, n = 0, header = 0;
+    uint8_t *packed = st->packed;
+    uint64_t start_time = timing_start();
 
     switch (length)
     {
@@ -548,33 +693,123 @@ void frame_push(frame_t *st, uint8_t *bits, size_t length)
         break;
     default:
         log_error("Unknown frame length: %d", length);
+        return;
     }
 
-    for (i = 0; i < length; ++i)
+    pack_bits(bits, packed, length / 8);
+    packed[length / 8] = 0;
+
+    for (n = 0; n < PCI_LEN; n++)
+        header = (header << 1) | packed_bit(packed, start + n * offset);
+
+    // the PCI bits are spread through the frame, so each byte of the PDU
+    // starts n bits later in the frame, where n of them have been passed
+    n = 0;
+    for (k = 0; k < (length - PCI_LEN) / 8; k++)
     {
-        // swap bit order
-        uint8_t bit = bits[((i>>3)<<3) + 7 - (i & 7)];
-        if (i >= start && ((i - start) % offset) == 0 && h < PCI_LEN)
+        i = k * 8 + n;
+        if (n < PCI_LEN && start + n * offset < i + 8)
         {
-            header = (header << 1) | bit;
-            ++h;
+            unsigned int val = 0;
+
+            for (unsigned int j = 0; j < 8; j++, i++)
+            {
+                while (n < PCI_LEN && i == start + n * offset)
+                {
+                    n++;
+                    i++;
+                }
+                val = (val << 1) | packed_bit(packed, i);
+            }
+            st->buffer[k] = val;
         }
         else
         {
-            val |= bit << (7 - j);
-            if (++j == 8)
-            {
-                *ptr++ = val;
-                val = 0;
-                j = 0;
-            }
+            st->buffer[k] = ((packed[i >> 3] << 8 | packed[(i >> 3) + 1]) >> (8 - (i & 7))) & 0xff;
         }
     }
 
     // log_debug("PCI %x", header);
 
     st->pci = header;
-    frame_process(st, ptr - st->buffer);
+    frame_process(st, k);
+    timing_stop(TIMING_FRAME, start_time);
+}
+
+#ifdef USE_THREADS
+static void push_job(frame_t *st, uint8_t type, const uint8_t *bits, size_t length)
+{
+    uint8_t *job = queue_reserve(&st->queue, 1);
+
+    job[0] = type;
+    if (length)
+        memcpy(&job[1], bits, length);
+    queue_commit(&st->queue, length + 1);
+}
+
+static void *frame_worker(void *arg)
+{
+    frame_t *st = arg;
+    unsigned int len;
+    uint8_t *job;
+
+    while ((job = queue_peek(&st->queue, &len)) != NULL)
+    {
+        switch (job[0])
+        {
+        case FRAME_JOB_BITS:
+            process_bits(st, &job[1], len - 1);
+            break;
+        case FRAME_JOB_BEGIN:
+            input_output_begin(st->input);
+            break;
+        case FRAME_JOB_MARK:
+        {
+            uint64_t position;
+            memcpy(&position, &job[1], sizeof(position));
+            input_mark(st->input, position);
+            break;
+        }
+        }
+        queue_pop(&st->queue);
+    }
+
+    return NULL;
+}
+
+void frame_stop_thread(frame_t *st)
+{
+    queue_close(&st->queue);
+    pthread_join(st->worker_thread, NULL);
+    queue_free(&st->queue);
+}
+#endif
+
+void frame_push(frame_t *st, uint8_t *bits, size_t length)
+{
+#ifdef USE_THREADS
+    push_job(st, FRAME_JOB_BITS, bits, length);
+#else
+    process_bits(st, bits, length);
+#endif
+}
+
+void frame_output_begin(frame_t *st)
+{
+#ifdef USE_THREADS
+    push_job(st, FRAME_JOB_BEGIN, NULL, 0);
+#else
+    input_output_begin(st->input);
+#endif
+}
+
+void frame_mark(frame_t *st, uint64_t position)
+{
+#ifdef USE_THREADS
+    push_job(st, FRAME_JOB_MARK, (const uint8_t *) &position, sizeof(position));
+#else
+    input_mark(st->input, position);
+#endif
 }
 
 void frame_reset(frame_t *st)
@@ -589,24 +824,75 @@ void frame_reset(frame_t *st)
     }
 
     st->fixed_ready = 0;
+    st->fixed_seeded = 0;
     st->sync_width = 0;
     st->sync_count = 0;
     st->ccc_idx = -1;
 }
 
+void frame_seed_layout(frame_t *st, unsigned int sync_width, const uint16_t *mode, const uint16_t *length)
+{
+    st->sync_width = sync_width;
+    st->sync_count = 2;
+    memcpy(st->layout_mode, mode, sizeof(st->layout_mode));
+    memcpy(st->layout_length, length, sizeof(st->layout_length));
+    apply_layout(st, mode, length);
+    st->fixed_seeded = 1;
+}
+
+int frame_get_layout(frame_t *st, unsigned int *sync_width, uint16_t *mode, uint16_t *length)
+{
+    if (!st->fixed_ready || st->fixed_seeded)
+        return 1;
+
+    *sync_width = st->sync_width;
+    memcpy(mode, st->layout_mode, sizeof(st->layout_mode));
+    memcpy(length, st->layout_length, sizeof(st->layout_length));
+    return 0;
+}
+
 void frame_init(frame_t *st, input_t *input)
 {
     unsigned int i;
 
     st->input = input;
-    st->buffer = malloc(PDU_LEN);
+    st->buffer = input_alloc(input, PDU_LEN);
+    st->packed = input_alloc(input, P1_FRAME_LEN / 8 + 1);
     for (i = 0; i < MAX_PROGRAMS; i++)
     {
-        st->pdu[i] = malloc(0x10000);
-        st->psd_buf[i] = malloc(MAX_AAS_LEN);
+        st->pdu[i] = NULL;
+        st->psd_buf[i] = NULL;
+        if (!input->low_memory)
+            alloc_program(st, i);
+    }
+    for (i = 0; i < 4; i++)
+    {
+        st->subchannel[i].blocks = NULL;
+        st->subchannel[i].interleaved = NULL;
+        st->subchannel[i].data = NULL;
     }
 
     rs_init();
 
     frame_reset(st);
+
+#ifdef USE_THREADS
+    queue_init(&st->queue, "frame", FRAME_QUEUE_LEN, 1 + P1_FRAME_LEN);
+    pthread_create(&st->worker_thread, NULL, frame_worker, st);
+#ifdef HAVE_PTHREAD_SETNAME_NP
+    pthread_setname_np(st->worker_thread, "frame");
+#endif
+#endif
+}
+
+void frame_free(frame_t *st)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        free(st->subchannel[i].blocks);
+        free(st->subchannel[i].interleaved);
+        free(st->subchannel[i].data);
+    }
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include "config.h"
+#include "queue.h"
 
 #define MAX_PROGRAMS 8
 
@@ -8,8 +10,15 @@ typedef struct
 {
     uint16_t mode;
     uint16_t length;
+    // RS parity symbols at the start of each codeword, zero without FEC
+    unsigned int parity;
+    // number of blocks interleaved together
+    unsigned int depth;
     unsigned int block_idx;
     uint8_t *blocks;
+    // payloads of the blocks received so far from the current group
+    unsigned int block_count;
+    uint8_t *interleaved;
     int idx;
     uint8_t *data;
 } fixed_subchannel_t;
@@ -18,6 +27,10 @@ typedef struct
 {
     struct input_t *input;
     uint8_t *buffer;
+    // bits of the frame being parsed, eight to a byte in stream order
+    uint8_t *packed;
+    // only audio packets that continue in the next frame are copied here,
+    // the others are output straight from buffer
     uint8_t *pdu[MAX_PROGRAMS];
     unsigned int pdu_idx[MAX_PROGRAMS];
     unsigned int pci;
@@ -31,9 +44,33 @@ typedef struct
     int ccc_idx;
     fixed_subchannel_t subchannel[4];
     int fixed_ready;
+    // the layout came from the cache and no CCC has confirmed it yet
+    int fixed_seeded;
+    // modes and lengths of the current layout, as announced
+    uint16_t layout_mode[4];
+    uint16_t layout_length[4];
+
+#ifdef USE_THREADS
+    // frames are parsed and output on their own thread
+    queue_t queue;
+    pthread_t worker_thread;
+#endif
 } frame_t;
 
 void frame_push(frame_t *st, uint8_t *bits, size_t length);
+// call output_begin on the outputs once the frames pushed so far have been output
+void frame_output_begin(frame_t *st);
+// call input_mark once the frames pushed so far have been output
+void frame_mark(frame_t *st, uint64_t position);
 void frame_reset(frame_t *st);
 void frame_set_program(frame_t *st, unsigned int program);
+// start with a subchannel layout from the cache, until the CCC is received
+void frame_seed_layout(frame_t *st, unsigned int sync_width, const uint16_t *mode, const uint16_t *length);
+// returns 0 with the layout announced by the station, if it has been received
+int frame_get_layout(frame_t *st, unsigned int *sync_width, uint16_t *mode, uint16_t *length);
 void frame_init(frame_t *st, struct input_t *input);
+void frame_free(frame_t *st);
+#ifdef USE_THREADS
+// finish parsing the queued frames and stop the thread
+void frame_stop_thread(frame_t *st);
+#endif
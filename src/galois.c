@@ -70,7 +70,6 @@ gf_generate_field(gf_t *gf, uint8_t r, uint32_t poly)
     }
 
     /* Assign an exponent to the zero element. Use an unused value. */
-    gf->exp[gf->len - 1] = 0; /* exp(2^r - 1) = 0 */
     gf->log[0] = gf->len - 1; /* log(0) = 2^r - 1 */
     gf->exp[0] = 1;           /* exp(0) = 1 */
     gf->log[1] = 0;           /* log(1) = 0 */
@@ -87,5 +86,11 @@ gf_generate_field(gf_t *gf, uint8_t r, uint32_t poly)
         gf->log[tmp] = i;
     }
 
+    /* exp(n) = exp(n - (2^r - 1)), so no modulo is needed for n < 2 * (2^r - 1) */
+    for(i = gf->len - 1; i < 2 * GF_MAX; i++)
+    {
+        gf->exp[i] = gf->exp[i - (gf->len - 1)];
+    }
+
     return 0;
 }
@@ -49,9 +49,10 @@
 /* GF(2^8) */
 #define GF_PRIMPOLY_2_8 0x11d /* 0b100011101 */
 
-/* Log/Anti-log representation of the Galois field. */
+/* Log/Anti-log representation of the Galois field.
+ * exp is stored twice over, so the sum of two logs can index it directly. */
 typedef struct gf {
-    uint8_t exp[GF_MAX];   /* alpha ^ n */
+    uint8_t exp[2 * GF_MAX]; /* alpha ^ n */
     uint8_t log[GF_MAX];   /* log(alpha ^ n) */
     uint32_t len;
 } gf_t;
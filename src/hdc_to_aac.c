@@ -41,9 +41,15 @@
 ** For more info contact Nero AG through Mpeg4AAClicense@nero.com.
 **
 */
+#include "config.h"
+
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+
 #include "bitreader.h"
 #include "bitwriter.h"
 
@@ -188,57 +194,136 @@ static hcb_bin_pair *hcb_bin_table[] = {
 
 static uint8_t hcbN[] = { 0, 5, 5, 0, 5, 0, 5, 0, 5, 0, 6, 5 };
 
-static void huffman_scale_factor(bitreader_t *br, bitwriter_t *bw)
+// codeword bits resolved by a single lookup in the binary trees
+#define TREE_LOOKUP_BITS 8
+// trees without a 2-step table, indexed like the codebooks
+#define TREE_SF 0
+#define NUM_TREES 12
+
+/* first TREE_LOOKUP_BITS of a codeword, to the node reached after bits of them */
+typedef struct
 {
-    uint16_t offset = 0;
+    uint16_t offset;
+    uint8_t bits;
+} tree_lookup;
+
+static tree_lookup tree_table[NUM_TREES][1 << TREE_LOOKUP_BITS];
+#ifdef USE_THREADS
+static pthread_once_t tree_once = PTHREAD_ONCE_INIT;
+#else
+static int tree_initialized;
+#endif
+
+static int tree_is_leaf(unsigned int tree, unsigned int offset)
+{
+    if (tree == TREE_SF)
+        return hcb_sf[offset][1] == 0;
+    if (tree == 3)
+        return hcb3[offset].is_leaf;
+    return hcb_bin_table[tree][offset].is_leaf;
+}
 
-    while (hcb_sf[offset][1])
+static unsigned int tree_child(unsigned int tree, unsigned int offset, unsigned int b)
+{
+    if (tree == TREE_SF)
+        return offset + hcb_sf[offset][b];
+    if (tree == 3)
+        return offset + hcb3[offset].data[b];
+    return offset + hcb_bin_table[tree][offset].data[b];
+}
+
+static void build_tree_tables(void)
+{
+    static const unsigned int trees[] = { TREE_SF, 3, 5, 7, 9 };
+
+    for (unsigned int t = 0; t < sizeof(trees) / sizeof(trees[0]); t++)
     {
-        uint8_t b = br_readbits(br, 1);
-        bw_addbits(bw, b, 1);
-        offset += hcb_sf[offset][b];
+        for (unsigned int cw = 0; cw < (1 << TREE_LOOKUP_BITS); cw++)
+        {
+            unsigned int offset = 0, bits = 0;
+
+            while (bits < TREE_LOOKUP_BITS && !tree_is_leaf(trees[t], offset))
+            {
+                offset = tree_child(trees[t], offset, (cw >> (TREE_LOOKUP_BITS - 1 - bits)) & 1);
+                bits++;
+            }
+            tree_table[trees[t]][cw].offset = offset;
+            tree_table[trees[t]][cw].bits = bits;
+        }
+    }
+}
+
+void hdc_to_aac_init(void)
+{
+#ifdef USE_THREADS
+    pthread_once(&tree_once, build_tree_tables);
+#else
+    if (!tree_initialized)
+    {
+        build_tree_tables();
+        tree_initialized = 1;
     }
+#endif
+}
+
+// skip the codeword at the reader, returns the leaf of the tree
+static unsigned int huffman_tree(bitreader_t *br, unsigned int tree)
+{
+    const tree_lookup *e = &tree_table[tree][br_peekbits(br, TREE_LOOKUP_BITS)];
+    unsigned int offset = e->offset;
+
+    br_skipbits(br, e->bits);
+    while (!tree_is_leaf(tree, offset))
+        offset = tree_child(tree, offset, br_readbits(br, 1));
+    return offset;
+}
+
+// copy the bits from start up to the reader, they are the same in HDC and AAC
+static void copy_since(bitreader_t *br, bitwriter_t *bw, unsigned int start)
+{
+    bw_copybits(bw, br->begin, start, br_tell(br) - start);
 }
 
-static void huffman_sign_bits(bitreader_t *br, bitwriter_t *bw, uint8_t len)
+static void huffman_scale_factor(bitreader_t *br)
 {
-    bw_addbits(bw, br_readbits(br, len), len);
+    huffman_tree(br, TREE_SF);
 }
 
-static void huffman_getescape(bitreader_t *br, bitwriter_t *bw, int16_t sp)
+static void huffman_getescape(bitreader_t *br, int16_t sp)
 {
     if (sp != 16)
         return;
     uint8_t i;
-    for (i = 4; ; i++)
+    for (i = 4; br_readbits(br, 1); i++)
     {
-        uint8_t b = br_readbits(br, 1);
-        bw_addbits(bw, b, 1);
-        if (b == 0)
-            break;
+        // escape values have at most 13 bits
+        if (i == 12)
+        {
+            br->error = 1;
+            return;
+        }
     }
 
-    bw_addbits(bw, br_readbits(br, i), i);
+    br_skipbits(br, i);
 }
 
-static uint8_t huffman_2step_quad(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+// offset into the 2nd step table of the codeword at the reader
+static uint16_t huffman_2step_offset(bitreader_t *br, uint8_t cb)
 {
-    uint32_t cw;
-    uint16_t offset = 0;
-    uint8_t extra_bits;
-
-    cw = br_peekbits(br, hcbN[cb]);
-    offset = hcb_table[cb][cw].offset;
-    extra_bits = hcb_table[cb][cw].extra_bits;
+    uint32_t cw = br_peekbits(br, hcbN[cb]);
+    uint16_t offset = hcb_table[cb][cw].offset;
+    uint8_t extra_bits = hcb_table[cb][cw].extra_bits;
 
     if (extra_bits)
-    {
-        bw_addbits(bw, br_readbits(br, hcbN[cb]), hcbN[cb]);
-        offset += (uint16_t)br_peekbits(br, extra_bits);
-        bw_addbits(bw, br_readbits(br, hcb_2_quad_table[cb][offset].bits - hcbN[cb]), hcb_2_quad_table[cb][offset].bits - hcbN[cb]);
-    } else {
-        bw_addbits(bw, br_readbits(br, hcb_2_quad_table[cb][offset].bits), hcb_2_quad_table[cb][offset].bits);
-    }
+        offset += (uint16_t)(br_peekbits(br, hcbN[cb] + extra_bits) & ((1 << extra_bits) - 1));
+    return offset;
+}
+
+static uint8_t huffman_2step_quad(bitreader_t *br, uint8_t cb)
+{
+    uint16_t offset = huffman_2step_offset(br, cb);
+
+    br_skipbits(br, hcb_2_quad_table[cb][offset].bits);
 
     uint8_t cnt = 0;
     if (hcb_2_quad_table[cb][offset].x) cnt++;
@@ -248,30 +333,16 @@ static uint8_t huffman_2step_quad(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
     return cnt;
 }
 
-static void huffman_2step_quad_sign(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+static void huffman_2step_quad_sign(bitreader_t *br, uint8_t cb)
 {
-    uint8_t sp = huffman_2step_quad(br, bw, cb);
-    huffman_sign_bits(br, bw, sp);
+    br_skipbits(br, huffman_2step_quad(br, cb));
 }
 
-static uint8_t huffman_2step_pair(bitreader_t *br, bitwriter_t *bw, uint8_t cb, int16_t sp[2])
+static uint8_t huffman_2step_pair(bitreader_t *br, uint8_t cb, int16_t sp[2])
 {
-    uint32_t cw;
-    uint16_t offset = 0;
-    uint8_t extra_bits;
+    uint16_t offset = huffman_2step_offset(br, cb);
 
-    cw = br_peekbits(br, hcbN[cb]);
-    offset = hcb_table[cb][cw].offset;
-    extra_bits = hcb_table[cb][cw].extra_bits;
-
-    if (extra_bits)
-    {
-        bw_addbits(bw, br_readbits(br, hcbN[cb]), hcbN[cb]);
-        offset += (uint16_t)br_peekbits(br, extra_bits);
-        bw_addbits(bw, br_readbits(br, hcb_2_pair_table[cb][offset].bits - hcbN[cb]), hcb_2_pair_table[cb][offset].bits - hcbN[cb]);
-    } else {
-        bw_addbits(bw, br_readbits(br, hcb_2_pair_table[cb][offset].bits), hcb_2_pair_table[cb][offset].bits);
-    }
+    br_skipbits(br, hcb_2_pair_table[cb][offset].bits);
 
     if (sp)
     {
@@ -285,22 +356,14 @@ static uint8_t huffman_2step_pair(bitreader_t *br, bitwriter_t *bw, uint8_t cb,
     return cnt;
 }
 
-static void huffman_2step_pair_sign(bitreader_t *br, bitwriter_t *bw, uint8_t cb, int16_t sp[2])
+static void huffman_2step_pair_sign(bitreader_t *br, uint8_t cb, int16_t sp[2])
 {
-    uint8_t cnt = huffman_2step_pair(br, bw, cb, sp);
-    huffman_sign_bits(br, bw, cnt);
+    br_skipbits(br, huffman_2step_pair(br, cb, sp));
 }
 
-static uint8_t huffman_binary_quad(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+static uint8_t huffman_binary_quad(bitreader_t *br, uint8_t cb)
 {
-    uint16_t offset = 0;
-
-    while (!hcb3[offset].is_leaf)
-    {
-        uint8_t b = br_readbits(br, 1);
-        bw_addbits(bw, b, 1);
-        offset += hcb3[offset].data[b];
-    }
+    uint16_t offset = huffman_tree(br, 3);
 
     uint8_t cnt = 0;
     if (hcb3[offset].data[0]) cnt++;
@@ -310,22 +373,14 @@ static uint8_t huffman_binary_quad(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
     return cnt;
 }
 
-static void huffman_binary_quad_sign(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+static void huffman_binary_quad_sign(bitreader_t *br, uint8_t cb)
 {
-    uint8_t sp = huffman_binary_quad(br, bw, cb);
-    huffman_sign_bits(br, bw, sp);
+    br_skipbits(br, huffman_binary_quad(br, cb));
 }
 
-static uint8_t huffman_binary_pair(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+static uint8_t huffman_binary_pair(bitreader_t *br, uint8_t cb)
 {
-    uint16_t offset = 0;
-
-    while (!hcb_bin_table[cb][offset].is_leaf)
-    {
-        uint8_t b = br_readbits(br, 1);
-        bw_addbits(bw, b, 1);
-        offset += hcb_bin_table[cb][offset].data[b];
-    }
+    uint16_t offset = huffman_tree(br, cb);
 
     uint8_t cnt = 0;
     if (hcb_bin_table[cb][offset].data[0]) cnt++;
@@ -333,48 +388,47 @@ static uint8_t huffman_binary_pair(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
     return cnt;
 }
 
-static void huffman_binary_pair_sign(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+static void huffman_binary_pair_sign(bitreader_t *br, uint8_t cb)
 {
-    uint8_t sp = huffman_binary_pair(br, bw, cb);
-    huffman_sign_bits(br, bw, sp);
+    br_skipbits(br, huffman_binary_pair(br, cb));
 }
 
-static void huffman_spectral_data(bitreader_t *br, bitwriter_t *bw, uint8_t cb)
+static void huffman_spectral_data(bitreader_t *br, uint8_t cb)
 {
     switch (cb)
     {
     case 1:
     case 2:
-         huffman_2step_quad(br, bw, cb);
+         huffman_2step_quad(br, cb);
          break;
     case 3:
-         huffman_binary_quad_sign(br, bw, cb);
+         huffman_binary_quad_sign(br, cb);
          break;
     case 4:
-         huffman_2step_quad_sign(br, bw, cb);
+         huffman_2step_quad_sign(br, cb);
          break;
     case 5:
-         huffman_binary_pair(br, bw, cb);
+         huffman_binary_pair(br, cb);
          break;
     case 6:
-         huffman_2step_pair(br, bw, cb, NULL);
+         huffman_2step_pair(br, cb, NULL);
          break;
     case 7:
     case 9:
-         huffman_binary_pair_sign(br, bw, cb);
+         huffman_binary_pair_sign(br, cb);
          break;
     case 8:
     case 10:
-         huffman_2step_pair_sign(br, bw, cb, NULL);
+         huffman_2step_pair_sign(br, cb, NULL);
          break;
     case 12:
-         huffman_2step_pair(br, bw, 11, NULL);
+         huffman_2step_pair(br, 11, NULL);
          break;
     case 11: {
              int16_t sp[2];
-             huffman_2step_pair_sign(br, bw, 11, sp);
-             huffman_getescape(br, bw, sp[0]);
-             huffman_getescape(br, bw, sp[1]);
+             huffman_2step_pair_sign(br, 11, sp);
+             huffman_getescape(br, sp[0]);
+             huffman_getescape(br, sp[1]);
              break;
          }
     }
@@ -421,9 +475,7 @@ static void parse_sbr_single_channel_element(bitreader_t *br, bitwriter_t *bw, b
     br_readbits(br, 1); // FIXME HDC specific?
 
     // XXX I'm lazy copy remaining bits verbatim
-    int remaining = br->bits + (br->end - br->buf)*8;
-    while (remaining--)
-        bw_addbits(sbrbw, br_readbits(br, 1), 1);
+    bw_copybits(sbrbw, br->begin, br_tell(br), br_bits_left(br));
 }
 
 static void parse_sbr_channel_pair_element(bitreader_t *br, bitwriter_t *bw, bitwriter_t *sbrbw)
@@ -437,9 +489,7 @@ static void parse_sbr_channel_pair_element(bitreader_t *br, bitwriter_t *bw, bit
     }
 
     // XXX I'm lazy copy remaining bits verbatim
-    int remaining = br->bits + (br->end - br->buf)*8;
-    while (remaining--)
-        bw_addbits(sbrbw, br_readbits(br, 1), 1);
+    bw_copybits(sbrbw, br->begin, br_tell(br), br_bits_left(br));
 }
 
 static void parse_sbr(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
@@ -447,10 +497,8 @@ static void parse_sbr(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
     bw_addbits(bw, ID_FIL, LEN_SE_ID);
 
     uint8_t sbr[272];
-    bitreader_t sbrbr;
     bitwriter_t sbrbw;
-    br_init(&sbrbr, sbr, 272);
-    bw_init(&sbrbw, sbr);
+    bw_init(&sbrbw, sbr, sizeof(sbr));
 
     bw_addbits(&sbrbw, EXT_SBR_DATA, 4);
     uint8_t header_flag = br_readbits(br, 1);
@@ -464,6 +512,12 @@ static void parse_sbr(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
         parse_sbr_channel_pair_element(br, bw, &sbrbw);
 
     int bytes = bw_flush(&sbrbw);
+    // the fill element can hold at most 269 bytes
+    if (sbrbw.error || bytes > 269)
+    {
+        br->error = 1;
+        return;
+    }
 
     if (bytes < 15)
     {
@@ -475,8 +529,7 @@ static void parse_sbr(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
         bw_addbits(bw, bytes + 1 - 15, 8);
     }
 
-    for (int i = 0; i < bytes*8; ++i)
-        bw_addbits(bw, br_readbits(&sbrbr, 1), 1);
+    bw_copybits(bw, sbr, 0, bytes * 8);
 }
 
 static void parse_fil(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
@@ -653,6 +706,12 @@ static void parse_ics_info(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
         ics->max_sfb = br_readbits(br, 6); // max_sfb
     }
 
+    if (ics->max_sfb > ((ics->window_sequence == EIGHT_SHORT_SEQUENCE) ? num_swb_128_window[sf_index] : num_swb_1024_window[sf_index]))
+    {
+        br->error = 1;
+        ics->max_sfb = 0;
+    }
+
     switch (ics->window_sequence)
     {
     case ONLY_LONG_SEQUENCE:
@@ -769,7 +828,7 @@ static void parse_tns_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
     }
 }
 
-static void parse_section_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
+static void parse_section_data(bitreader_t *br, ics_t *ics)
 {
     uint8_t g;
     uint8_t sect_esc_val, sect_bits;
@@ -784,7 +843,7 @@ static void parse_section_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
         uint8_t k = 0;
         uint8_t i = 0;
 
-        while (k < ics->max_sfb)
+        while (k < ics->max_sfb && !br->error)
         {
             uint8_t sfb;
             uint8_t sect_len_incr;
@@ -792,19 +851,22 @@ static void parse_section_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
             uint8_t sect_cb_bits = 4;
 
             ics->sect_cb[g][i] = br_readbits(br, sect_cb_bits);
-            bw_addbits(bw, ics->sect_cb[g][i], sect_cb_bits);
 
             sect_len_incr = br_readbits(br, sect_bits);
-            bw_addbits(bw, sect_len_incr, sect_bits);
 
             sect_len += sect_len_incr;
             while (sect_len_incr == sect_esc_val)
             {
                 sect_len_incr = br_readbits(br, sect_bits);
-                bw_addbits(bw, sect_len_incr, sect_bits);
                 sect_len += sect_len_incr;
             }
 
+            if (sect_len == 0 || k + sect_len > ics->max_sfb)
+            {
+                br->error = 1;
+                return;
+            }
+
             ics->sect_start[g][i] = k;
             ics->sect_end[g][i] = k + sect_len;
 
@@ -820,7 +882,7 @@ static void parse_section_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
     }
 }
 
-static void parse_scale_factors(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
+static void parse_scale_factors(bitreader_t *br, ics_t *ics)
 {
     uint8_t g, sfb;
     int8_t noise_pcm_flag = 1;
@@ -835,21 +897,21 @@ static void parse_scale_factors(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
                 break;
             case INTENSITY_HCB: /* intensity books */
             case INTENSITY_HCB2:
-                huffman_scale_factor(br, bw);
+                huffman_scale_factor(br);
                 break;
             case NOISE_HCB:
                 if (noise_pcm_flag)
                 {
                     noise_pcm_flag = 0;
-                    bw_addbits(bw, br_readbits(br, 9), 9);
+                    br_skipbits(br, 9);
                 }
                 else
                 {
-                    huffman_scale_factor(br, bw);
+                    huffman_scale_factor(br);
                 }
                 break;
             default:
-                huffman_scale_factor(br, bw);
+                huffman_scale_factor(br);
                 break;
             }
         }
@@ -906,8 +968,10 @@ static void parse_side_info(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
     if (!ics->common_window)
         gen_ics_info(bw, ics);
 
-    parse_section_data(br, bw, ics);
-    parse_scale_factors(br, bw, ics);
+    unsigned int start = br_tell(br);
+    parse_section_data(br, ics);
+    parse_scale_factors(br, ics);
+    copy_since(br, bw, start);
 
     bw_addbits(bw, 0, 1); // pulse_data_present
     bw_addbits(bw, ics->tns.present, 1); // tns_data_present
@@ -916,7 +980,7 @@ static void parse_side_info(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
     bw_addbits(bw, 0, 1); // gain_control_data_present
 }
 
-static void parse_spectral_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
+static void parse_spectral_data(bitreader_t *br, ics_t *ics)
 {
     uint8_t i, g;
     uint16_t inc, k;
@@ -938,9 +1002,9 @@ static void parse_spectral_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
                 break;
             default:
                 for (k = ics->sect_sfb_offset[g][ics->sect_start[g][i]];
-                     k < ics->sect_sfb_offset[g][ics->sect_end[g][i]]; k += inc)
+                     k < ics->sect_sfb_offset[g][ics->sect_end[g][i]] && !br->error; k += inc)
                 {
-                    huffman_spectral_data(br, bw, sect_cb);
+                    huffman_spectral_data(br, sect_cb);
                 }
                 break;
             }
@@ -951,7 +1015,11 @@ static void parse_spectral_data(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
 static void parse_individual_channel_stream(bitreader_t *br, bitwriter_t *bw, ics_t *ics)
 {
     parse_side_info(br, bw, ics);
-    parse_spectral_data(br, bw, ics);
+
+    // only the length of the spectral data is needed, it is copied as is
+    unsigned int start = br_tell(br);
+    parse_spectral_data(br, ics);
+    copy_since(br, bw, start);
 }
 
 static void parse_sce(bitreader_t *br, bitwriter_t *bw)
@@ -992,14 +1060,15 @@ static void parse_cpe(bitreader_t *br, bitwriter_t *bw)
     bw_addbits(bw, ms_mask_present, 2);
     if (ms_mask_present == 1)
     {
-        uint8_t g, sfb;
+        // one ms_used bit per group and band, max_sfb may be above 32
+        uint8_t g;
+        unsigned int start = br_tell(br);
         for (g = 0; g < ics1.num_window_groups; g++)
         {
-            for (sfb = 0; sfb < ics1.max_sfb; sfb++)
-            {
-                bw_addbits(bw, br_readbits(br, 1), 1);
-            }
+            br_skipbits(br, ics1.max_sfb / 2);
+            br_skipbits(br, ics1.max_sfb - ics1.max_sfb / 2);
         }
+        copy_since(br, bw, start);
     }
     ics2 = ics1;
 
@@ -1029,12 +1098,14 @@ static void parse_packet(bitreader_t *br, bitwriter_t *bw)
     else
     {
         ERR("unknown type");
+        br->error = 1;
     }
 
     bw_addbits(bw, ID_END, LEN_SE_ID);
 }
 
-void hdc_to_aac(bitreader_t *br, bitwriter_t *bw)
+int hdc_to_aac(bitreader_t *br, bitwriter_t *bw)
 {
     parse_packet(br, bw);
+    return br->error || bw->error;
 }
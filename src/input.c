@@ -20,9 +20,34 @@
 #include <string.h>
 
 #include "defines.h"
+#include "fft.h"
 #include "input.h"
-
-#define INPUT_BUF_LEN (2160 * 512)
+#include "metrics.h"
+#include "timing.h"
+
+// power of two so that absolute sample positions can be masked, the low-memory
+// one still holds an acquire window and the samples of a tuner buffer
+#define INPUT_BUF_LEN (1 << 20)
+#define INPUT_BUF_LEN_LOW (1 << 18)
+// the start of the ring is repeated after its end, so any acquire window can be read in place
+#define INPUT_BUF_MIRROR (FFTCP * (ACQUIRE_SYMBOLS + 1))
+// buffers of the stages with every channel and program in use, besides the ring
+#define INPUT_ARENA_STAGES (8 << 20)
+// raw buffers waiting for the DSP thread
+#define INPUT_QUEUE_LEN 16
+#define INPUT_QUEUE_LEN_LOW 4
+#define INPUT_QUEUE_STATS 64
+// bin of the SNR power for a frequency index after fftshift
+#define SNR_BIN(i) (((i) + 32) % 64)
+// wideband samples channelized per call, at least twice the largest decimation
+#define CHANNEL_BLOCK 8192
+
+#ifdef LOW_MEMORY
+static int memory_low = 1;
+#else
+static int memory_low = 0;
+#endif
+static int memory_hugepages = 0;
 
 static float decim_taps[] = {
     0.6062333583831787,
@@ -31,28 +56,62 @@ static float decim_taps[] = {
     -0.00410953676328063
 };
 
+static void ring_put(input_t *st, unsigned int pos, cint16_t x)
+{
+    pos &= st->buf_len - 1;
+    st->buffer[pos] = x;
+    if (pos < INPUT_BUF_MIRROR)
+        st->buffer[st->buf_len + pos] = x;
+}
+
 static void input_push_to_acquire(input_t *st)
 {
+    unsigned int n;
+
     if (st->skip)
     {
-        if (st->skip > st->avail - st->used)
-        {
-            st->skip -= st->avail - st->used;
-            st->used = st->avail;
-        }
-        else
-        {
-            st->used += st->skip;
-            st->skip = 0;
-        }
+        unsigned int start = st->used - st->acq.idx;
+
+        n = st->avail - st->used;
+        if (n > st->skip)
+            n = st->skip;
+
+        // move the samples held by acquire up to the end of the skipped ones
+        for (unsigned int i = st->acq.idx; i-- > 0; )
+            ring_put(st, start + n + i, st->buffer[(start + i) & (st->buf_len - 1)]);
+
+        st->used += n;
+        st->position += n;
+        st->skip -= n;
+        if (st->skip)
+            return;
     }
 
-    st->used += acquire_push(&st->acq, &st->buffer[st->used], st->avail - st->used);
+    n = acquire_push(&st->acq, &st->buffer[(st->used - st->acq.idx) & (st->buf_len - 1)], st->avail - st->used);
+    st->used += n;
+    st->position += n;
 }
 
 void input_pdu_push(input_t *st, uint8_t *pdu, unsigned int len, unsigned int program)
 {
-    output_push(st->output, pdu, len, program);
+    unsigned int i;
+    nrsc5_event_t evt;
+
+    evt.event = NRSC5_EVENT_HDC;
+    evt.hdc.program = program;
+    evt.hdc.data = pdu;
+    evt.hdc.count = len;
+    input_event(st, &evt);
+
+    if (st->packet_cb)
+    {
+        st->packet_cb(st->capture_arg, pdu, len, program);
+        return;
+    }
+
+    // each output only keeps the program it was added for
+    for (i = 0; i < st->num_outputs; i++)
+        output_push(st->outputs[i], pdu, len, program);
 }
 
 void input_set_skip(input_t *st, unsigned int skip)
@@ -60,37 +119,56 @@ void input_set_skip(input_t *st, unsigned int skip)
     st->skip += skip;
 }
 
-static void measure_snr(input_t *st, uint8_t *buf, uint32_t len)
+// measure on up to len bytes, returns the number of them used
+static unsigned int measure_snr(input_t *st, const uint8_t *buf, unsigned int len)
 {
-    unsigned int i, j;
+    unsigned int i, j, b;
+
+    if (st->snr_wait)
+    {
+        unsigned int n = (len < st->snr_wait) ? len : st->snr_wait;
+        st->snr_wait -= n;
+        return n;
+    }
 
-    // use a small FFT to calculate magnitude of frequency ranges
-    for (j = 64; j <= len / 2; j += 64)
+    // use small FFTs to calculate magnitude of frequency ranges
+    for (j = 0; j + 128 <= len && st->snr_cnt < st->snr_length; )
     {
-        for (i = 0; i < 64; i++)
-            st->snr_fft_in[i] = CMPLXF(U8_F(buf[(i+j-64) * 2 + 0]), U8_F(buf[(i+j-64) * 2 + 1])) * pow(sinf(M_PI*i/63),2);
+        unsigned int n = (len - j) / 128;
+        float *in = (float *) st->snr_fft_in;
+
+        if (n > SNR_BATCH)
+            n = SNR_BATCH;
+        if (n > st->snr_length - st->snr_cnt)
+            n = st->snr_length - st->snr_cnt;
+
+        for (b = 0; b < n; b++, j += 128)
+            for (i = 0; i < 128; i++)
+                in[b * 128 + i] = ((float) buf[j + i] - 127) * st->snr_window[i];
+        // unused transforms of the batch add nothing to the power
+        memset(&st->snr_fft_in[n * 64], 0, sizeof(float complex) * 64 * (SNR_BATCH - n));
         fftwf_execute(st->snr_fft);
-        fftshift(st->snr_fft_out, 64);
 
-        for (i = 0; i < 64; i++)
-            st->snr_power[i] += normf(st->snr_fft_out[i]);
-        st->snr_cnt++;
+        for (b = 0; b < n; b++)
+            for (i = 0; i < 64; i++)
+                st->snr_power[i] += normf(st->snr_fft_out[b * 64 + i]);
+        st->snr_cnt += n;
     }
 
-    if (st->snr_cnt >= SNR_FFT_COUNT)
+    if (st->snr_cnt >= st->snr_length)
     {
         // noise bands are the frequncies near our signal
         float noise_lo = 0;
         for (i = 19; i < 23; i++)
-            noise_lo += st->snr_power[i];
+            noise_lo += st->snr_power[SNR_BIN(i)];
         noise_lo /= 4;
         float noise_hi = 0;
         for (i = 41; i < 45; i++)
-            noise_hi += st->snr_power[i];
+            noise_hi += st->snr_power[SNR_BIN(i)];
         noise_hi /= 4;
         // signal bands are the frequencies in our signal
-        float signal_lo = (st->snr_power[24] + st->snr_power[25]) / 2;
-        float signal_hi = (st->snr_power[39] + st->snr_power[40]) / 2;
+        float signal_lo = (st->snr_power[SNR_BIN(24)] + st->snr_power[SNR_BIN(25)]) / 2;
+        float signal_hi = (st->snr_power[SNR_BIN(39)] + st->snr_power[SNR_BIN(40)]) / 2;
 
         #if 0
         float snr_lo = noise_lo == 0 ? 0 : signal_lo / noise_lo;
@@ -102,76 +180,313 @@ static void measure_snr(input_t *st, uint8_t *buf, uint32_t len)
         float noise = (noise_lo + noise_hi) / 2 / st->snr_cnt;
         float snr = signal / noise;
 
-        if (st->snr_cb(st->snr_cb_arg, snr) == 0)
+        if (st->snr_cb(st->snr_cb_arg, snr) != 0)
+            st->snr_wait = st->snr_settle;
+        else if (st->snr_interval)
+            st->snr_wait = st->snr_interval;
+        else
             st->snr_cb = NULL;
 
         st->snr_cnt = 0;
         for (i = 0; i < 64; ++i)
             st->snr_power[i] = 0;
     }
+
+    return j;
+}
+
+// decimate cnt pairs of either u8 or Q15 samples into the ring and run acquire on them
+static void push_samples(input_t *st, const uint8_t *u8, const cint16_t *q15, unsigned int cnt)
+{
+    while (cnt > 0)
+    {
+        unsigned int pos = st->avail & (st->buf_len - 1);
+        uint64_t start;
+        // keep the samples that acquire still holds or has yet to receive
+        unsigned int n = st->buf_len - (st->avail - st->used + st->acq.idx);
+
+        if (n > st->buf_len - pos)
+            n = st->buf_len - pos;
+        if (n > cnt)
+            n = cnt;
+
+        start = timing_start();
+        if (u8)
+        {
+            halfband_q15_execute_u8(st->decim, u8, &st->buffer[pos], n);
+            u8 += n * 4;
+        }
+        else
+        {
+            halfband_q15_execute_block(st->decim, q15, &st->buffer[pos], n);
+            q15 += n * 2;
+        }
+        timing_stop(TIMING_DECIM, start);
+        if (pos < INPUT_BUF_MIRROR)
+            memcpy(&st->buffer[st->buf_len + pos], &st->buffer[pos],
+                   sizeof(cint16_t) * ((pos + n < INPUT_BUF_MIRROR) ? n : INPUT_BUF_MIRROR - pos));
+
+        st->avail += n;
+        cnt -= n;
+
+        while (st->avail - st->used >= FFTCP)
+        {
+            input_push_to_acquire(st);
+            start = timing_start();
+            acquire_process(&st->acq);
+            timing_stop(TIMING_ACQUIRE, start);
+        }
+    }
+}
+
+static void push_channel(input_t *st, const uint8_t *buf, unsigned int cnt)
+{
+    cint16_t y[CHANNEL_BLOCK / 2 + 2];
+
+    while (cnt > 0)
+    {
+        unsigned int n = (cnt < CHANNEL_BLOCK) ? cnt : CHANNEL_BLOCK;
+        unsigned int m = channelizer_execute(st->chan, buf, n, y);
+
+        push_samples(st, NULL, y, m / 2);
+        buf += n * 2;
+        cnt -= n;
+    }
 }
 
 void input_cb(uint8_t *buf, uint32_t len, void *arg)
 {
-    unsigned int i, new_avail, cnt = len / 4;
     input_t *st = arg;
 
+    metrics_count(METRICS_INPUT_SAMPLES, len / 2);
+
     if (st->snr_cb)
     {
-        measure_snr(st, buf, len);
-        return;
+        const uint8_t *p = buf;
+        unsigned int n, left = len;
+
+        while (st->snr_cb && (n = measure_snr(st, p, left)) > 0)
+        {
+            p += n;
+            left -= n;
+        }
+        // the samples of a gain search are not decoded
+        if (st->snr_interval == 0)
+            return;
     }
 
-    if (st->outfp)
-        fwrite(buf, 1, len, st->outfp);
+    if (st->recorder)
+        writer_write(st->recorder, buf, len);
 
-    if (cnt + st->avail > INPUT_BUF_LEN)
+    assert(len % 4 == 0);
+
+    if (st->chan)
+        push_channel(st, buf, len / 2);
+    else
+        push_samples(st, buf, NULL, len / 4);
+}
+
+void input_push_q15(input_t *st, const cint16_t *buf, unsigned int count)
+{
+    metrics_count(METRICS_INPUT_SAMPLES, count);
+
+    assert(count % 2 == 0);
+    push_samples(st, NULL, buf, count / 2);
+}
+
+#ifdef USE_THREADS
+static void *input_worker(void *arg)
+{
+    input_t *st = arg;
+    unsigned int len, count = 0, dropped = 0;
+    uint8_t *buf;
+
+    while ((buf = queue_peek(&st->queue, &len)) != NULL)
     {
-        if (st->avail > st->used)
+        input_cb(buf, len, st);
+        queue_pop(&st->queue);
+
+        if (atomic_load(&st->queue.dropped) != dropped)
         {
-            memmove(&st->buffer[0], &st->buffer[st->used], (st->avail - st->used) * sizeof(st->buffer[0]));
-            st->avail -= st->used;
-            st->used = 0;
+            unsigned int n = atomic_load(&st->queue.dropped);
+            log_warn("Input queue full, dropped %u buffers", n - dropped);
+            dropped = n;
         }
-        else
+
+        if (++count == INPUT_QUEUE_STATS)
         {
-            st->avail = 0;
-            st->used = 0;
+            log_debug("Input queue: depth %u, max depth %u, %u buffers dropped",
+                      queue_depth(&st->queue), atomic_exchange(&st->queue.max_depth, 0), dropped);
+            count = 0;
         }
     }
-    new_avail = st->avail;
 
-    if (cnt + new_avail > INPUT_BUF_LEN)
+    return NULL;
+}
+
+void input_start_thread(input_t *st, unsigned int buffer_size)
+{
+    queue_init(&st->queue, "input", st->low_memory ? INPUT_QUEUE_LEN_LOW : INPUT_QUEUE_LEN, buffer_size);
+    pthread_create(&st->worker_thread, NULL, input_worker, st);
+#ifdef HAVE_PTHREAD_SETNAME_NP
+    pthread_setname_np(st->worker_thread, "input");
+#endif
+}
+
+void input_stop_thread(input_t *st)
+{
+    queue_close(&st->queue);
+    pthread_join(st->worker_thread, NULL);
+    queue_free(&st->queue);
+}
+
+void input_queue_cb(uint8_t *buf, uint32_t len, void *arg)
+{
+    input_t *st = arg;
+
+    queue_push(&st->queue, buf, len);
+}
+#endif
+
+void input_set_snr_callback(input_t *st, input_snr_cb_t cb, void *arg)
+{
+    st->snr_cb = cb;
+    st->snr_cb_arg = arg;
+    st->snr_wait = 0;
+}
+
+void input_set_snr_options(input_t *st, unsigned int length, unsigned int settle)
+{
+    st->snr_length = length;
+    st->snr_settle = settle;
+}
+
+void input_set_snr_interval(input_t *st, unsigned int interval)
+{
+    st->snr_interval = interval;
+}
+
+void input_set_event_callback(input_t *st, nrsc5_callback_t cb, void *arg)
+{
+    st->event_cb = cb;
+    st->event_cb_arg = arg;
+}
+
+void input_event(input_t *st, const nrsc5_event_t *evt)
+{
+    if (st->event_cb)
+        st->event_cb(evt, st->event_cb_arg);
+}
+
+void input_set_capture(input_t *st, input_packet_cb_t packet_cb, input_mark_cb_t mark_cb, void *arg)
+{
+    st->packet_cb = packet_cb;
+    st->mark_cb = mark_cb;
+    st->capture_arg = arg;
+}
+
+void input_mark(input_t *st, uint64_t position)
+{
+    if (st->mark_cb)
+        st->mark_cb(st->capture_arg, position);
+}
+
+void input_seed(input_t *st, const cache_entry_t *entry)
+{
+    unsigned int i;
+
+    // each is checked against the signal, and replaced when the station sends something else
+    acquire_cfo_adjust(&st->acq, entry->cfo);
+    if (entry->psmi >= 0)
+        st->sync.psmi = st->sync.psmi_seed = entry->psmi;
+    if (entry->have_layout)
+        frame_seed_layout(&st->frame, entry->sync_width, entry->ccc_mode, entry->ccc_length);
+    for (i = 0; i < entry->num_ports; i++)
     {
-        log_error("input buffer overflow!");
-        return;
+        const cache_port_t *port = &entry->ports[i];
+        output_seed_port(st->output, port->port, port->pkt_size, port->type, port->service_data_type, port->program);
     }
-    assert(len % 4 == 0);
+    strcpy(st->expected_country, entry->country_code);
+    st->expected_facility = entry->fcc_facility_id;
 
-    for (i = 0; i < cnt; i++)
-    {
-        cint16_t x[2];
+    log_debug("Warm start: CFO %d, PSMI %d, %s layout, %u ports", entry->cfo, entry->psmi,
+              entry->have_layout ? "cached" : "no", entry->num_ports);
+}
+
+void input_save_state(input_t *st, cache_entry_t *entry)
+{
+    pids_t *pids = &st->decode.pids;
+    unsigned int i;
 
-        x[0].r = U8_Q15(buf[i * 4 + 0]);
-        x[0].i = -U8_Q15(buf[i * 4 + 1]);
-        x[1].r = U8_Q15(buf[i * 4 + 2]);
-        x[1].i = -U8_Q15(buf[i * 4 + 3]);
+    // another station is on the frequency, only the gain still applies
+    if (pids->fcc_facility_id && pids->fcc_facility_id != entry->fcc_facility_id)
+    {
+        int gain = entry->gain;
+        float cnr = entry->cnr;
 
-        halfband_q15_execute(st->decim, x, &st->buffer[new_avail++]);
+        cache_entry_init(entry, entry->frequency);
+        entry->gain = gain;
+        entry->cnr = cnr;
     }
 
-    st->avail = new_avail;
-    while (st->avail - st->used >= FFTCP)
+    // what was not learned this time is kept from the previous entry
+    if (st->sync.ready)
     {
-        input_push_to_acquire(st);
-        acquire_process(&st->acq);
+        entry->cfo = st->acq.cfo;
+        entry->psmi = st->sync.psmi;
+    }
+    if (frame_get_layout(&st->frame, &entry->sync_width, entry->ccc_mode, entry->ccc_length) == 0)
+        entry->have_layout = 1;
+    if (pids->fcc_facility_id)
+    {
+        strcpy(entry->country_code, pids->country_code);
+        entry->fcc_facility_id = pids->fcc_facility_id;
+    }
+    if (st->output->ports_logged)
+    {
+        entry->num_ports = 0;
+        for (i = 0; i < MAX_PORTS && entry->num_ports < CACHE_MAX_PORTS; i++)
+        {
+            const aas_port_t *port = &st->output->ports[i];
+            cache_port_t *out = &entry->ports[entry->num_ports];
+
+            if (port->port == 0)
+                continue;
+            out->port = port->port;
+            out->pkt_size = port->pkt_size;
+            out->type = port->type;
+            out->service_data_type = port->service_data_type;
+            out->program = port->program;
+            entry->num_ports++;
+        }
     }
 }
 
-void input_set_snr_callback(input_t *st, input_snr_cb_t cb, void *arg)
+void input_station_identified(input_t *st, const char *country_code, unsigned int fcc_facility_id)
 {
-    st->snr_cb = cb;
-    st->snr_cb_arg = arg;
+    if (st->expected_facility == 0)
+        return;
+    if (st->expected_facility != fcc_facility_id || strcmp(st->expected_country, country_code) != 0)
+        log_warn("Station is not the cached one (facility %u, expected %u), the cache is replaced on exit",
+                 fcc_facility_id, st->expected_facility);
+    st->expected_facility = 0;
+}
+
+void input_set_profile(input_t *st, unsigned int profile)
+{
+    st->profile = profile;
+}
+
+void input_copy_settings(input_t *st, const input_t *from)
+{
+    if (st->decode.viterbi_window != from->decode.viterbi_window
+        || st->decode.viterbi_8bit != from->decode.viterbi_8bit)
+    {
+        st->decode.viterbi_window = from->decode.viterbi_window;
+        decode_set_viterbi_8bit(&st->decode, from->decode.viterbi_8bit);
+    }
+    sync_set_equalizer(&st->sync, from->sync.equalize);
+    st->profile = from->profile;
 }
 
 void input_reset(input_t *st)
@@ -179,33 +494,140 @@ void input_reset(input_t *st)
     st->avail = 0;
     st->used = 0;
     st->skip = 0;
+    st->position = 0;
     for (int i = 0; i < 64; ++i)
         st->snr_power[i] = 0;
     st->snr_cnt = 0;
+    st->snr_wait = 0;
+}
+
+void input_set_memory_profile(int low_memory, int hugepages)
+{
+    memory_low = low_memory;
+    memory_hugepages = hugepages;
 }
 
-void input_init(input_t *st, output_t *output, double center, unsigned int program, FILE *outfp)
+void *input_alloc(input_t *st, size_t size)
 {
-    st->buffer = malloc(sizeof(cint16_t) * INPUT_BUF_LEN);
+    return arena_alloc(&st->arena, size);
+}
+
+void input_report_memory(input_t *st)
+{
+    static const char *hugepages[] = { "", ", transparent huge pages", ", reserved huge pages" };
+
+    log_info("Receiver buffers: %.1f MiB of a %.1f MiB arena%s%s",
+             arena_used(&st->arena) / 1048576.0, st->arena.size / 1048576.0,
+             st->low_memory ? ", low-memory profile" : "", hugepages[st->arena.hugepages]);
+    if (memory_hugepages && !st->arena.hugepages)
+        log_warn("Huge pages are not available for the receiver buffers.");
+}
+
+void input_init(input_t *st, output_t *output, double center, unsigned int program, writer_t *recorder)
+{
+    st->low_memory = memory_low;
+    st->buf_len = st->low_memory ? INPUT_BUF_LEN_LOW : INPUT_BUF_LEN;
+    arena_init(&st->arena, sizeof(cint16_t) * (st->buf_len + INPUT_BUF_MIRROR) + INPUT_ARENA_STAGES, memory_hugepages);
+
+    st->buffer = input_alloc(st, sizeof(cint16_t) * (st->buf_len + INPUT_BUF_MIRROR));
     st->output = output;
-    st->outfp = outfp;
+    st->num_outputs = 0;
+    st->chan = NULL;
+    st->recorder = recorder;
     st->center = center;
     st->snr_cb = NULL;
     st->snr_cb_arg = NULL;
+    st->snr_length = SNR_FFT_COUNT;
+    st->snr_settle = 0;
+    st->snr_interval = 0;
+    st->event_cb = NULL;
+    st->event_cb_arg = NULL;
+    st->packet_cb = NULL;
+    st->mark_cb = NULL;
+    st->capture_arg = NULL;
+    st->expected_facility = 0;
+    st->profile = INPUT_PROFILE_ALL;
 
     st->decim = firdecim_q15_create(decim_taps, sizeof(decim_taps) / sizeof(decim_taps[0]));
-    st->snr_fft = fftwf_plan_dft_1d(64, st->snr_fft_in, st->snr_fft_out, FFTW_FORWARD, 0);
+    st->snr_fft = fft_plan_many_dft_1d(64, SNR_BATCH, st->snr_fft_in, st->snr_fft_out, FFTW_FORWARD);
+    for (int i = 0; i < 64; i++)
+        st->snr_window[i * 2] = st->snr_window[i * 2 + 1] = powf(sinf(M_PI * i / 63), 2) / 128;
 
     input_reset(st);
 
     acquire_init(&st->acq, st);
-    decode_init(&st->decode, st);
+    // the decoder uses the frame stage, so that has to exist first
     frame_init(&st->frame, st);
-    output_set_program(st->output, program);
+    decode_init(&st->decode, st);
+    input_add_output(st, output, program);
     sync_init(&st->sync, st);
 }
 
+void input_free(input_t *st)
+{
+    sync_free(&st->sync);
+    decode_free(&st->decode);
+    frame_free(&st->frame);
+    acquire_free(&st->acq);
+
+    if (st->chan)
+    {
+        channelizer_free(st->chan);
+        free(st->chan);
+    }
+    fft_destroy_plan(st->snr_fft);
+    firdecim_q15_free(st->decim);
+    arena_free(&st->arena);
+}
+
+void input_retune(input_t *st, double center)
+{
+    st->center = center;
+    input_reset(st);
+    acquire_reset(&st->acq);
+    sync_reset(&st->sync);
+    decode_reset(&st->decode);
+}
+
+void input_set_channel(input_t *st, double sample_rate, double offset)
+{
+    unsigned int decim = lrint(sample_rate / 1488375);
+
+    if (decim < 2 || decim * 1488375 != sample_rate || decim > CHANNEL_BLOCK / 2)
+        FATAL_EXIT("Wideband sample rate must be a multiple of 1488375 Hz.");
+
+    st->chan = malloc(sizeof(channelizer_t));
+    channelizer_init(st->chan, decim, offset);
+}
+
+void input_add_output(input_t *st, output_t *output, unsigned int program)
+{
+    if (st->num_outputs == MAX_PROGRAMS)
+        FATAL_EXIT("Too many outputs.");
+
+    output_set_program(output, program);
+    output->input = st;
+    st->outputs[st->num_outputs++] = output;
+}
+
+void input_output_begin(input_t *st)
+{
+    for (unsigned int i = 0; i < st->num_outputs; i++)
+        output_begin(st->outputs[i]);
+}
+
+void input_finish(input_t *st)
+{
+#ifdef USE_THREADS
+    decode_stop_thread(&st->decode);
+    frame_stop_thread(&st->frame);
+#endif
+}
+
 void input_aas_push(input_t *st, uint8_t *psd, unsigned int len)
 {
-    output_aas_push(st->output, psd, len);
+    if (st->packet_cb)
+        st->packet_cb(st->capture_arg, psd, len, INPUT_PROGRAM_AAS);
+    else
+        output_aas_push(st->output, psd, len);
 }
@@ -5,32 +5,97 @@
 #include <complex.h>
 
 #include "acquire.h"
+#include "arena.h"
+#include "cache.h"
+#include "channelizer.h"
 #include "decode.h"
 #include "defines.h"
 #include "firdecim_q15.h"
 #include "frame.h"
+#include "nrsc5.h"
 #include "output.h"
+#include "queue.h"
 #include "sync.h"
+#include "writer.h"
+
+// SNR FFTs transformed at once
+#define SNR_BATCH 16
 
 typedef int (*input_snr_cb_t) (void *, float);
+// a packet for program, or AAS data with program INPUT_PROGRAM_AAS
+typedef void (*input_packet_cb_t) (void *, const uint8_t *, unsigned int, unsigned int);
+// the position of an L1 block, passed before the packets decoded from it
+typedef void (*input_mark_cb_t) (void *, uint64_t);
+
+#define INPUT_PROGRAM_AAS MAX_PROGRAMS
+
+// what a decode profile asks for, the stages that only feed something else are skipped
+#define INPUT_PROFILE_AUDIO (1 << 0)
+// AAS ports and files, and the fixed data subchannels
+#define INPUT_PROFILE_DATA (1 << 1)
+// ID3 tags of the programs
+#define INPUT_PROFILE_PSD (1 << 2)
+#define INPUT_PROFILE_SIS (1 << 3)
+#define INPUT_PROFILE_ALL 0xf
+// carried in the frames of P1 and P3, rather than in PIDS
+#define INPUT_PROFILE_FRAMES (INPUT_PROFILE_AUDIO | INPUT_PROFILE_DATA | INPUT_PROFILE_PSD)
 
 typedef struct input_t
 {
+    // the first output also receives AAS data
     output_t *output;
-    FILE *outfp;
+    output_t *outputs[MAX_PROGRAMS];
+    unsigned int num_outputs;
+    // raw samples are recorded here if set
+    writer_t *recorder;
 
+    // set when the input is one station of a wideband capture
+    channelizer_t *chan;
     firdecim_q15 decim;
+    // ring of decimated samples, indexed by absolute sample positions
     cint16_t *buffer;
+    unsigned int buf_len;
     double center;
     unsigned int avail, used, skip;
+    // decimated samples taken by acquire or skipped since the input was reset
+    uint64_t position;
 
     fftwf_plan snr_fft;
-    float complex snr_fft_in[64];
-    float complex snr_fft_out[64];
+    float complex snr_fft_in[64 * SNR_BATCH];
+    float complex snr_fft_out[64 * SNR_BATCH];
+    // window with the u8 scale, repeated for the I and Q of each sample
+    float snr_window[128];
+    // power of each bin before fftshift
     float snr_power[64];
     int snr_cnt;
+    // FFTs per measurement, and bytes to drop before measuring again
+    unsigned int snr_length, snr_settle;
+    // bytes between measurements when they do not take samples from the decoder
+    unsigned int snr_interval;
+    unsigned int snr_wait;
     input_snr_cb_t snr_cb;
     void *snr_cb_arg;
+    nrsc5_callback_t event_cb;
+    void *event_cb_arg;
+    // packets are captured instead of output when set
+    input_packet_cb_t packet_cb;
+    input_mark_cb_t mark_cb;
+    void *capture_arg;
+
+#ifdef USE_THREADS
+    queue_t queue;
+    pthread_t worker_thread;
+#endif
+    // station the cache expects on this frequency, until the SIS identifies it
+    char expected_country[3];
+    unsigned int expected_facility;
+
+    // mask of INPUT_PROFILE_*
+    unsigned int profile;
+
+    // holds the buffers of every stage
+    arena_t arena;
+    int low_memory;
 
     acquire_t acq;
     decode_t decode;
@@ -38,9 +103,54 @@ typedef struct input_t
     sync_t sync;
 } input_t;
 
-void input_init(input_t *st, output_t *output, double center, unsigned int program, FILE *outfp);
+// profile of the inputs initialized afterwards, hugepages is a request that may not be granted
+void input_set_memory_profile(int low_memory, int hugepages);
+void input_init(input_t *st, output_t *output, double center, unsigned int program, writer_t *recorder);
+// release the buffers of a finished input, but not its outputs
+void input_free(input_t *st);
+// start over on samples from another station, keeping the plans and settings
+void input_retune(input_t *st, double center);
+// take input samples at sample_rate and decode the station at offset Hz from their center
+void input_set_channel(input_t *st, double sample_rate, double offset);
+// decode another program into its own output
+void input_add_output(input_t *st, output_t *output, unsigned int program);
+void input_output_begin(input_t *st);
+// wait until everything pushed so far has been decoded and output
+void input_finish(input_t *st);
 void input_cb(uint8_t *, uint32_t, void *);
+// push an even number of samples at 1488375 Hz, converted as input_cb converts u8 samples
+void input_push_q15(input_t *st, const cint16_t *buf, unsigned int count);
+#ifdef USE_THREADS
+// run input_cb on a DSP thread, fed through input_queue_cb
+void input_start_thread(input_t *st, unsigned int buffer_size);
+void input_stop_thread(input_t *st);
+void input_queue_cb(uint8_t *, uint32_t, void *);
+#endif
+// the callback returns nonzero to measure again once snr_settle bytes have passed
 void input_set_snr_callback(input_t *st, input_snr_cb_t cb, void *);
+void input_set_snr_options(input_t *st, unsigned int length, unsigned int settle);
+// with an interval, measurements are repeated every interval bytes while the
+// samples are also decoded, instead of stopping when the callback returns 0
+void input_set_snr_interval(input_t *st, unsigned int interval);
+void input_set_event_callback(input_t *st, nrsc5_callback_t cb, void *);
+// both callbacks run on the thread that parses frames, in the order the blocks were received
+void input_set_capture(input_t *st, input_packet_cb_t packet_cb, input_mark_cb_t mark_cb, void *);
+void input_mark(input_t *st, uint64_t position);
+// decode only what the mask of INPUT_PROFILE_* asks for
+void input_set_profile(input_t *st, unsigned int profile);
+// use the decoder settings of another input
+void input_copy_settings(input_t *st, const input_t *from);
+void input_event(input_t *st, const nrsc5_event_t *evt);
+// start from what the cache remembers of the station, before any samples are pushed
+void input_seed(input_t *st, const cache_entry_t *entry);
+// update entry with what was learned, once the input is finished
+void input_save_state(input_t *st, cache_entry_t *entry);
+// compare the identity sent in the SIS with the one of the cache
+void input_station_identified(input_t *st, const char *country_code, unsigned int fcc_facility_id);
+// a buffer kept until the input is freed
+void *input_alloc(input_t *st, size_t size);
+// log the memory taken by the buffers so far
+void input_report_memory(input_t *st);
 void input_set_skip(input_t *st, unsigned int skip);
 void input_pdu_push(input_t *st, uint8_t *pdu, unsigned int len, unsigned int program);
 void input_aas_push(input_t *st, uint8_t *psd, unsigned int len);
@@ -0,0 +1,249 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "iqfile.h"
+
+static const struct {
+    const char *name;
+    unsigned int sample_size;
+} formats[] = {
+    [IQ_FORMAT_CU8] = { "cu8", 2 },
+    [IQ_FORMAT_CS8] = { "cs8", 2 },
+    [IQ_FORMAT_CS16] = { "cs16", 4 },
+    [IQ_FORMAT_CF32] = { "cf32", 8 },
+};
+
+int iqfile_parse_format(const char *name, iq_format_t *format)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        if (strcmp(name, formats[i].name) == 0)
+        {
+            *format = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void map_file(iqfile_t *st)
+{
+#ifdef HAVE_MMAP
+    struct stat sb;
+    void *map;
+
+    if (fstat(fileno(st->fp), &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+        return;
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(st->fp), 0);
+    if (map == MAP_FAILED)
+        return;
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+    st->map = map;
+    st->map_len = sb.st_size;
+    st->end = sb.st_size;
+#endif
+}
+
+int iqfile_open(iqfile_t *st, const char *name, iq_format_t format, double rate)
+{
+    // two samples at a time, the decoder decimates them by two
+    unsigned int samples;
+
+    memset(st, 0, sizeof(*st));
+    st->fp = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+    if (st->fp == NULL)
+        return 1;
+
+    st->format = format;
+    st->sample_size = formats[format].sample_size;
+    st->resample = rate != 0 && rate != 1488375;
+
+    map_file(st);
+    if (st->map == NULL)
+        st->buf = malloc(IQFILE_CHUNK);
+
+    if (format == IQ_FORMAT_CU8 && !st->resample)
+        return 0;
+
+    samples = IQFILE_CHUNK / st->sample_size;
+    st->converted = malloc(sizeof(float complex) * samples);
+    if (st->resample)
+    {
+        resampler_init(&st->resampler, rate, 1488375);
+        st->q15 = malloc(sizeof(cint16_t) * resampler_max_output(&st->resampler, samples));
+    }
+    else
+    {
+        st->q15 = malloc(sizeof(cint16_t) * samples);
+    }
+    return 0;
+}
+
+void iqfile_close(iqfile_t *st)
+{
+#ifdef HAVE_MMAP
+    if (st->map)
+        munmap((void *) st->map, st->map_len);
+#endif
+    if (st->fp != stdin)
+        fclose(st->fp);
+    if (st->resample)
+        resampler_free(&st->resampler);
+    free(st->q15);
+    free(st->converted);
+    free(st->buf);
+}
+
+uint64_t iqfile_samples(iqfile_t *st)
+{
+    return st->map_len / st->sample_size;
+}
+
+void iqfile_set_range(iqfile_t *st, uint64_t first, uint64_t count)
+{
+    uint64_t samples = iqfile_samples(st);
+
+    if (first > samples)
+        first = samples;
+    if (count > samples - first)
+        count = samples - first;
+    st->offset = first * st->sample_size;
+    st->end = (first + count) * st->sample_size;
+}
+
+// the same scale as u8 samples once 127 is taken away
+static void convert_cf(iq_format_t format, const uint8_t *x, float complex *y, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+    {
+        switch (format)
+        {
+        case IQ_FORMAT_CU8:
+            y[i] = CMPLXF(x[i * 2] - 127.0f, x[i * 2 + 1] - 127.0f);
+            break;
+        case IQ_FORMAT_CS8:
+            y[i] = CMPLXF((int8_t) x[i * 2], (int8_t) x[i * 2 + 1]);
+            break;
+        case IQ_FORMAT_CS16:
+        {
+            const int16_t *s = (const int16_t *) x;
+            y[i] = CMPLXF(s[i * 2] / 256.0f, s[i * 2 + 1] / 256.0f);
+            break;
+        }
+        case IQ_FORMAT_CF32:
+        {
+            const float *f = (const float *) x;
+            y[i] = CMPLXF(f[i * 2] * 128.0f, f[i * 2 + 1] * 128.0f);
+            break;
+        }
+        }
+    }
+}
+
+// straight to the conjugated Q15 of input_cb when no resampling is needed
+static void convert_q15(iq_format_t format, const uint8_t *x, cint16_t *y, unsigned int n)
+{
+    const int16_t *s = (const int16_t *) x;
+    const float *f = (const float *) x;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+    {
+        switch (format)
+        {
+        case IQ_FORMAT_CU8:
+            y[i].r = U8_Q15(x[i * 2]);
+            y[i].i = -U8_Q15(x[i * 2 + 1]);
+            break;
+        case IQ_FORMAT_CS8:
+            y[i].r = (int8_t) x[i * 2] * 64;
+            y[i].i = -(int8_t) x[i * 2 + 1] * 64;
+            break;
+        case IQ_FORMAT_CS16:
+            y[i].r = s[i * 2] >> 2;
+            y[i].i = -(s[i * 2 + 1] >> 2);
+            break;
+        case IQ_FORMAT_CF32:
+            y[i].r = lrintf(fminf(fmaxf(f[i * 2] * 8192, -32768), 32767));
+            y[i].i = lrintf(fminf(fmaxf(-f[i * 2 + 1] * 8192, -32768), 32767));
+            break;
+        }
+    }
+}
+
+void iqfile_read(iqfile_t *st, iqfile_u8_cb_t u8_cb, iqfile_q15_cb_t q15_cb, void *arg)
+{
+    // whole pairs of samples only
+    const unsigned int pair = st->sample_size * 2;
+
+    while (1)
+    {
+        const uint8_t *data;
+        size_t len;
+        unsigned int n;
+
+        if (st->map)
+        {
+            len = st->end - st->offset;
+            if (len > IQFILE_CHUNK)
+                len = IQFILE_CHUNK;
+            len -= len % pair;
+            data = st->map + st->offset;
+            st->offset += len;
+        }
+        else
+        {
+            len = fread(st->buf, pair, IQFILE_CHUNK / pair, st->fp) * pair;
+            data = st->buf;
+        }
+        if (len == 0)
+            break;
+
+        n = len / st->sample_size;
+        if (st->converted == NULL)
+        {
+            // input_cb only reads the samples
+            u8_cb((uint8_t *) data, len, arg);
+        }
+        else if (st->resample)
+        {
+            convert_cf(st->format, data, st->converted, n);
+            n = resampler_execute(&st->resampler, st->converted, n, st->q15);
+            if (n)
+                q15_cb(st->q15, n, arg);
+        }
+        else
+        {
+            convert_q15(st->format, data, st->q15, n);
+            q15_cb(st->q15, n, arg);
+        }
+    }
+}
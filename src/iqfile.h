@@ -0,0 +1,62 @@
+#pragma once
+
+#include <complex.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "defines.h"
+#include "resampler.h"
+
+// bytes handed to the decoder at once, as a tuner delivers them
+#define IQFILE_CHUNK (512 * 1024)
+
+// complex sample formats, interleaved I and Q
+typedef enum
+{
+    IQ_FORMAT_CU8,
+    IQ_FORMAT_CS8,
+    // native byte order
+    IQ_FORMAT_CS16,
+    IQ_FORMAT_CF32
+} iq_format_t;
+
+// u8 samples as read, with the signature of input_cb
+typedef void (*iqfile_u8_cb_t)(uint8_t *, uint32_t, void *);
+// an even number of conjugated Q15 samples at 1488375 Hz, see input_push_q15
+typedef void (*iqfile_q15_cb_t)(const cint16_t *, unsigned int, void *);
+
+/*
+ * Read a file of IQ samples as fast as the decoder takes them. Regular files
+ * are memory-mapped, so u8 samples at the decoder's rate go to it without a
+ * copy. Other formats and rates are converted and resampled to 1488375 Hz.
+ */
+typedef struct
+{
+    FILE *fp;
+    iq_format_t format;
+    unsigned int sample_size;
+    int resample;
+    resampler_t resampler;
+
+    // the whole file if it could be mapped, otherwise buf is read into
+    const uint8_t *map;
+    size_t map_len;
+    // the part of the map that is read
+    size_t offset, end;
+    uint8_t *buf;
+
+    float complex *converted;
+    cint16_t *q15;
+} iqfile_t;
+
+// returns 0 on success
+int iqfile_parse_format(const char *name, iq_format_t *format);
+// name is a path or - for stdin, samples are resampled if rate is not 1488375
+int iqfile_open(iqfile_t *st, const char *name, iq_format_t format, double rate);
+// u8 samples at 1488375 Hz, or of a wideband capture read with rate 0, go to u8_cb
+void iqfile_read(iqfile_t *st, iqfile_u8_cb_t u8_cb, iqfile_q15_cb_t q15_cb, void *arg);
+// number of samples in a mapped file, 0 if it could not be mapped
+uint64_t iqfile_samples(iqfile_t *st);
+// read only count samples from first on, first and count must be even
+void iqfile_set_range(iqfile_t *st, uint64_t first, uint64_t count);
+void iqfile_close(iqfile_t *st);
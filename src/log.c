@@ -25,17 +25,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
 
 #include "log.h"
 
+/* nrsc5: queued messages are cut to this length */
+#define LOG_MSG_LEN 512
+/* nrsc5: records queued by each thread, a power of two */
+#define LOG_RING_LEN 128
+/* nrsc5: call sites that can be rate limited at once, a power of two */
+#define LOG_RATE_SLOTS 256
+/* nrsc5: how long the logger thread sleeps when there is nothing to write */
+#define LOG_IDLE_NS 5000000
+
 static struct {
   void *udata;
   log_LockFn lock;
   FILE *fp;
   int level;
   int quiet;
+  unsigned int rate_limit;
 } L;
 
 
@@ -50,10 +65,21 @@ static const char *level_colors[] = {
 #endif
 
 
+#ifdef USE_THREADS
+/* nrsc5: receivers log from several threads, so serialize by default */
+static pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
 static void lock(void)   {
   if (L.lock) {
     L.lock(L.udata, 1);
   }
+#ifdef USE_THREADS
+  else {
+    pthread_mutex_lock(&default_lock);
+  }
+#endif
 }
 
 
@@ -61,9 +87,314 @@ static void unlock(void) {
   if (L.lock) {
     L.lock(L.udata, 0);
   }
+#ifdef USE_THREADS
+  else {
+    pthread_mutex_unlock(&default_lock);
+  }
+#endif
+}
+
+
+/* nrsc5: a second of messages from one call site, found by its format string */
+#ifdef USE_THREADS
+static struct {
+  _Atomic(const char *) fmt;
+  atomic_llong second;
+  atomic_uint count;
+  atomic_uint suppressed;
+} rate_slots[LOG_RATE_SLOTS];
+#else
+static struct {
+  const char *fmt;
+  long long second;
+  unsigned int count;
+  unsigned int suppressed;
+} rate_slots[LOG_RATE_SLOTS];
+#endif
+
+
+/* nrsc5: returns 0 to drop the message, or sets the number dropped before it */
+static int rate_check(const char *fmt, time_t now, unsigned int *suppressed) {
+  unsigned int i = ((uintptr_t) fmt >> 3) & (LOG_RATE_SLOTS - 1);
+#ifdef USE_THREADS
+  const char *expected = NULL;
+  long long second;
+
+  if (!atomic_compare_exchange_strong(&rate_slots[i].fmt, &expected, fmt) && expected != fmt) {
+    /* another call site has the slot, so this one is not limited */
+    return 1;
+  }
+
+  second = atomic_load(&rate_slots[i].second);
+  if (second != now && atomic_compare_exchange_strong(&rate_slots[i].second, &second, now)) {
+    atomic_store(&rate_slots[i].count, 0);
+    *suppressed = atomic_exchange(&rate_slots[i].suppressed, 0);
+  }
+  if (atomic_fetch_add(&rate_slots[i].count, 1) >= L.rate_limit) {
+    atomic_fetch_add(&rate_slots[i].suppressed, 1);
+    return 0;
+  }
+#else
+  if (rate_slots[i].fmt == NULL) {
+    rate_slots[i].fmt = fmt;
+  } else if (rate_slots[i].fmt != fmt) {
+    return 1;
+  }
+
+  if (rate_slots[i].second != now) {
+    rate_slots[i].second = now;
+    rate_slots[i].count = 0;
+    *suppressed = rate_slots[i].suppressed;
+    rate_slots[i].suppressed = 0;
+  }
+  if (rate_slots[i].count++ >= L.rate_limit) {
+    rate_slots[i].suppressed++;
+    return 0;
+  }
+#endif
+  return 1;
+}
+
+
+static void write_entry(time_t t, int level, const char *file, int line,
+                        unsigned int suppressed, const char *fmt, va_list args) {
+  struct tm *lt = localtime(&t);
+
+  /* Log to stderr */
+  if (!L.quiet) {
+    va_list copy;
+    char buf[16];
+    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
+#ifdef USE_COLOR
+    fprintf(
+      stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+      buf, level_colors[level], level_names[level], file, line);
+#else
+    fprintf(stderr, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+#endif
+    va_copy(copy, args);
+    vfprintf(stderr, fmt, copy);
+    va_end(copy);
+    if (suppressed) {
+      fprintf(stderr, " (%u similar messages suppressed)", suppressed);
+    }
+    fprintf(stderr, "\n");
+    /* XXX required for correct output on Windows */
+    fflush(stderr);
+  }
+
+  /* Log to file */
+  if (L.fp) {
+    va_list copy;
+    char buf[32];
+    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
+    fprintf(L.fp, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+    va_copy(copy, args);
+    vfprintf(L.fp, fmt, copy);
+    va_end(copy);
+    if (suppressed) {
+      fprintf(L.fp, " (%u similar messages suppressed)", suppressed);
+    }
+    fprintf(L.fp, "\n");
+  }
+}
+
+
+#ifdef USE_THREADS
+/*
+ * nrsc5: in async mode each thread queues its messages in its own ring,
+ * which only it writes and only the logger thread reads, so logging takes
+ * no lock. The message is formatted when it is queued, because the
+ * arguments cannot be kept, but the time stamp, prefix and output are
+ * left to the logger thread. Records are written in the order of seq.
+ */
+typedef struct {
+  uint64_t seq;
+  time_t time;
+  int level;
+  const char *file;
+  int line;
+  unsigned int suppressed;
+  char msg[LOG_MSG_LEN];
+} log_record_t;
+
+typedef struct log_ring {
+  log_record_t records[LOG_RING_LEN];
+  atomic_uint head, tail;
+  atomic_uint dropped;
+  unsigned int dropped_reported;
+  /* set when the thread has exited, the ring is freed once it is empty */
+  atomic_int closed;
+  struct log_ring *next;
+} log_ring_t;
+
+static struct {
+  atomic_int enabled;
+  atomic_int stopping;
+  atomic_ullong seq;
+  pthread_t thread;
+  /* guards the list of rings, which only changes when a thread first logs */
+  pthread_mutex_t rings_lock;
+  log_ring_t *rings;
+  pthread_once_t key_once;
+  pthread_key_t key;
+} A = { .rings_lock = PTHREAD_MUTEX_INITIALIZER, .key_once = PTHREAD_ONCE_INIT };
+
+static __thread log_ring_t *thread_ring;
+
+
+static void write_entryf(time_t t, int level, const char *file, int line,
+                         unsigned int suppressed, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  write_entry(t, level, file, line, suppressed, fmt, args);
+  va_end(args);
+}
+
+
+static void ring_release(void *arg) {
+  log_ring_t *ring = arg;
+  atomic_store(&ring->closed, 1);
+}
+
+
+static void create_key(void) {
+  pthread_key_create(&A.key, ring_release);
+}
+
+
+static log_ring_t *get_ring(void) {
+  log_ring_t *ring = thread_ring;
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL) {
+      return NULL;
+    }
+    pthread_once(&A.key_once, create_key);
+    pthread_setspecific(A.key, ring);
+
+    pthread_mutex_lock(&A.rings_lock);
+    ring->next = A.rings;
+    A.rings = ring;
+    pthread_mutex_unlock(&A.rings_lock);
+    thread_ring = ring;
+  }
+  return ring;
 }
 
 
+static void async_push(time_t t, int level, const char *file, int line,
+                       unsigned int suppressed, const char *fmt, va_list args) {
+  log_ring_t *ring = get_ring();
+  log_record_t *rec;
+  unsigned int head;
+
+  if (ring == NULL) {
+    return;
+  }
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_LEN) {
+    atomic_fetch_add(&ring->dropped, 1);
+    return;
+  }
+
+  rec = &ring->records[head & (LOG_RING_LEN - 1)];
+  rec->seq = atomic_fetch_add(&A.seq, 1);
+  rec->time = t;
+  rec->level = level;
+  rec->file = file;
+  rec->line = line;
+  rec->suppressed = suppressed;
+  vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+/* write everything queued so far, oldest first, returns the number of records */
+static unsigned int drain(void) {
+  unsigned int count = 0;
+  log_ring_t **link;
+
+  pthread_mutex_lock(&A.rings_lock);
+  while (1) {
+    log_ring_t *oldest = NULL, *ring;
+    log_record_t *rec = NULL;
+
+    for (ring = A.rings; ring; ring = ring->next) {
+      unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      log_record_t *r;
+
+      if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        continue;
+      }
+      r = &ring->records[tail & (LOG_RING_LEN - 1)];
+      if (rec == NULL || r->seq < rec->seq) {
+        oldest = ring;
+        rec = r;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+
+    lock();
+    write_entryf(rec->time, rec->level, rec->file, rec->line, rec->suppressed, "%s", rec->msg);
+    unlock();
+    atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+    count++;
+  }
+
+  for (link = &A.rings; *link; ) {
+    log_ring_t *ring = *link;
+    unsigned int dropped = atomic_load(&ring->dropped);
+
+    if (dropped != ring->dropped_reported) {
+      lock();
+      write_entryf(time(NULL), LOG_WARN, "log.c", __LINE__, 0,
+                   "%u log messages dropped", dropped - ring->dropped_reported);
+      unlock();
+      ring->dropped_reported = dropped;
+    }
+
+    if (atomic_load(&ring->closed) && atomic_load(&ring->tail) == atomic_load(&ring->head)) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+  pthread_mutex_unlock(&A.rings_lock);
+
+  if (count) {
+    lock();
+    if (L.fp) {
+      fflush(L.fp);
+    }
+    unlock();
+  }
+  return count;
+}
+
+
+static void *logger_worker(void *arg) {
+  struct timespec idle = { 0, LOG_IDLE_NS };
+
+  while (1) {
+    int stopping = atomic_load(&A.stopping);
+
+    if (drain() == 0) {
+      if (stopping) {
+        break;
+      }
+      nanosleep(&idle, NULL);
+    }
+  }
+  return NULL;
+}
+#endif
+
+
 void log_set_udata(void *udata) {
   L.udata = udata;
 }
@@ -89,7 +420,67 @@ void log_set_quiet(int enable) {
 }
 
 
+void log_set_rate_limit(unsigned int count) {
+  L.rate_limit = count;
+}
+
+
+int log_set_async(int enable) {
+#ifdef USE_THREADS
+  if (enable == atomic_load(&A.enabled)) {
+    return 0;
+  }
+  if (enable) {
+    atomic_store(&A.stopping, 0);
+    if (pthread_create(&A.thread, NULL, logger_worker, NULL) != 0) {
+      return 1;
+    }
+#ifdef HAVE_PTHREAD_SETNAME_NP
+    pthread_setname_np(A.thread, "log");
+#endif
+    atomic_store(&A.enabled, 1);
+  } else {
+    /* messages still being queued are written by the logger before it stops */
+    atomic_store(&A.enabled, 0);
+    atomic_store(&A.stopping, 1);
+    pthread_join(A.thread, NULL);
+    drain();
+  }
+  return 0;
+#else
+  return enable ? 1 : 0;
+#endif
+}
+
+
+void log_flush(void) {
+#ifdef USE_THREADS
+  struct timespec wait = { 0, 1000000 };
+
+  while (atomic_load(&A.enabled)) {
+    int empty = 1;
+
+    pthread_mutex_lock(&A.rings_lock);
+    for (log_ring_t *ring = A.rings; ring; ring = ring->next) {
+      if (atomic_load(&ring->tail) != atomic_load(&ring->head)) {
+        empty = 0;
+      }
+    }
+    pthread_mutex_unlock(&A.rings_lock);
+
+    if (empty) {
+      break;
+    }
+    nanosleep(&wait, NULL);
+  }
+#endif
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  unsigned int suppressed = 0;
+  va_list args;
+
   if (level < L.level) {
     return;
   }
@@ -100,44 +491,32 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     file += slash + 1;
   }
 
-  /* Acquire lock */
-  lock();
-
   /* Get current time */
   time_t t = time(NULL);
-  struct tm *lt = localtime(&t);
 
-  /* Log to stderr */
-  if (!L.quiet) {
-    va_list args;
-    char buf[16];
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-#ifdef USE_COLOR
-    fprintf(
-      stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-      buf, level_colors[level], level_names[level], file, line);
-#else
-    fprintf(stderr, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
-#endif
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-    /* XXX required for correct output on Windows */
-    fflush(stderr);
+  /* nrsc5: fatal messages are never dropped or queued, the program is about to exit */
+  if (L.rate_limit && level < LOG_FATAL && !rate_check(fmt, t, &suppressed)) {
+    return;
   }
 
-  /* Log to file */
-  if (L.fp) {
-    va_list args;
-    char buf[32];
-    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    fprintf(L.fp, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
-    va_start(args, fmt);
-    vfprintf(L.fp, fmt, args);
-    va_end(args);
-    fprintf(L.fp, "\n");
+#ifdef USE_THREADS
+  if (atomic_load_explicit(&A.enabled, memory_order_relaxed)) {
+    if (level < LOG_FATAL) {
+      va_start(args, fmt);
+      async_push(t, level, file, line, suppressed, fmt, args);
+      va_end(args);
+      return;
+    }
+    log_flush();
   }
+#endif
+
+  /* Acquire lock */
+  lock();
+
+  va_start(args, fmt);
+  write_entry(t, level, file, line, suppressed, fmt, args);
+  va_end(args);
 
   /* Release lock */
   unlock();
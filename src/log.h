@@ -17,11 +17,19 @@ typedef void (*log_LockFn)(void *udata, int lock);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+/* nrsc5: messages below LOG_MIN_LEVEL are compiled out, arguments and all */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_TRACE
+#endif
+
+#define log_at(level, ...) \
+  (((level) >= LOG_MIN_LEVEL) ? log_log(level, __FILE__, __LINE__, __VA_ARGS__) : (void) 0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
 #define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
 
 void log_set_udata(void *udata);
@@ -29,6 +37,12 @@ void log_set_lock(log_LockFn fn);
 void log_set_fp(FILE *fp);
 void log_set_level(int level);
 void log_set_quiet(int enable);
+/* nrsc5: at most count messages per second from each call site, 0 for no limit */
+void log_set_rate_limit(unsigned int count);
+/* nrsc5: queue messages and write them on a logger thread, returns 0 on success */
+int log_set_async(int enable);
+/* nrsc5: wait until the queued messages have been written */
+void log_flush(void);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
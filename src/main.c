@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <string.h>
 
 #ifdef USE_THREADS
@@ -31,88 +32,622 @@
 
 #include <rtl-sdr.h>
 
+#include "cpu.h"
 #include "defines.h"
+#include "fft.h"
+#include "batch.h"
+#include "cache.h"
 #include "input.h"
+#include "iqfile.h"
+#include "metrics.h"
+#include "mixer.h"
+#include "rtltcp.h"
 
 #define RADIO_BUFCNT (8)
 #define RADIO_BUFFER (512 * 1024)
+#define MAX_CHANNELS 8
+#define MAX_SCAN 256
+// FM channel spacing, for frequency ranges in the scan list
+#define SCAN_STEP 200000
+// distance between the gains tried first by the fast gain search
+#define GAIN_COARSE_STEP 4
+// bytes dropped after a gain change when the buffer is not reset
+#define GAIN_SETTLE (8 * 1024)
+// gains between the current one and the trial of the AGC, neighbours are too close to tell apart
+#define AGC_STEP 2
+// a trial gain of the AGC has to improve the CNR by this factor
+#define AGC_HYSTERESIS 1.1f
+// samples that are queued in USB transfers and the input queue were taken at the previous gain
+#define AGC_SETTLE (2 * RADIO_BUFFER)
+// a cached gain is kept while its CNR stays within this factor of the one it gave before
+#define CACHE_GAIN_MARGIN 0.5f
 
-static int gain_list[128];
-static int gain_index, gain_count;
+// automatic gain selection steps through the tuner gains while measuring SNR
+typedef struct
+{
+    rtlsdr_dev_t *dev;
+    int gain_list[128];
+    int gain_index, gain_count;
+    int best_gain;
+    float best_snr;
+    int searching;
+    // coarse to fine search: every step-th gain, then the neighbours of
+    // the best one at half the distance, until the step reaches zero
+    int fast;
+    int coarse, step;
+    // 0 until measured
+    float snr[128];
+    // continuous AGC, the direction of the next trial and whether one is running
+    int agc_dir, agc_trial;
+    // the gain from the cache is measured first, and the search skipped if it still fits
+    int cached;
+    float cached_snr;
+} gain_search_t;
+
+// one input per station of the capture
+static input_t *inputs;
+static unsigned int num_inputs;
+
+// set by SIGINT or SIGTERM, so that the cache is saved on the way out
+static volatile sig_atomic_t stopping;
+static rtlsdr_dev_t *stop_dev;
+static rtltcp_t *stop_tcp;
+
+static void stop_handler(int sig)
+{
+    stopping = 1;
+    // a second signal ends the program straight away
+    signal(sig, SIG_DFL);
+    if (stop_dev)
+        rtlsdr_cancel_async(stop_dev);
+    if (stop_tcp)
+        rtltcp_cancel(stop_tcp);
+}
+
+// start a search over the gains of the tuner, returns the number found
+static int gain_search_init(gain_search_t *gs, rtlsdr_dev_t *dev, int fast)
+{
+    memset(gs, 0, sizeof(*gs));
+    gs->dev = dev;
+    gs->gain_count = rtlsdr_get_tuner_gains(dev, gs->gain_list);
+    if (gs->gain_count > 128)
+        gs->gain_count = 128;
+    gs->searching = gs->gain_count > 0;
+    gs->fast = fast;
+    gs->coarse = 1;
+    gs->step = GAIN_COARSE_STEP;
+    gs->agc_dir = 1;
+    return gs->gain_count;
+}
+
+// measure gain first, cnr is what it gave in dB
+static void gain_search_cached(gain_search_t *gs, int gain, float cnr)
+{
+    for (int i = 0; i < gs->gain_count; i++)
+    {
+        if (gs->gain_list[i] == gain)
+        {
+            gs->gain_index = i;
+            gs->cached = 1;
+            gs->cached_snr = powf(10, cnr / 20);
+            return;
+        }
+    }
+}
+
+// next gain of the coarse to fine search, or -1 when it is done
+static int next_gain(gain_search_t *gs)
+{
+    while (gs->step > 0)
+    {
+        int i;
+
+        if (gs->coarse)
+        {
+            for (i = 0; i < gs->gain_count; i += gs->step)
+                if (gs->snr[i] == 0)
+                    return i;
+            if (gs->snr[gs->gain_count - 1] == 0)
+                return gs->gain_count - 1;
+            gs->coarse = 0;
+        }
+        else
+        {
+            i = gs->best_gain - gs->step;
+            if (i >= 0 && gs->snr[i] == 0)
+                return i;
+            i = gs->best_gain + gs->step;
+            if (i < gs->gain_count && gs->snr[i] == 0)
+                return i;
+        }
+        gs->step /= 2;
+    }
+    return -1;
+}
 
 // signal and noise are squared magnitudes
 static int snr_callback(void *arg, float snr)
 {
-    static int best_gain;
-    static float best_snr;
+    gain_search_t *gs = arg;
     int result = 0;
-    rtlsdr_dev_t *dev = arg;
 
-    if (gain_count == 0)
+    if (!gs->searching)
         return result;
 
+    if (gs->cached)
+    {
+        gs->cached = 0;
+        if (snr >= gs->cached_snr * CACHE_GAIN_MARGIN)
+        {
+            log_info("Gain: %.1f dB from the cache, CNR: %.1f dB", gs->gain_list[gs->gain_index] / 10.0, 20 * log10f(snr));
+            gs->best_gain = gs->gain_index;
+            gs->best_snr = snr;
+            gs->searching = 0;
+            return result;
+        }
+
+        // the measurement is not counted, so the search runs as it would have without the cache
+        log_info("Cached gain gives a CNR of %.1f dB instead of %.1f dB, searching", 20 * log10f(snr), 20 * log10f(gs->cached_snr));
+        gs->gain_index = 0;
+        rtlsdr_set_tuner_gain(gs->dev, gs->gain_list[gs->gain_index]);
+        if (!gs->fast)
+            rtlsdr_reset_buffer(gs->dev);
+        return 1;
+    }
+
     // choose the best gain level
-    if (snr >= best_snr)
+    if (snr >= gs->best_snr)
     {
-        best_gain = gain_index;
-        best_snr = snr;
+        gs->best_gain = gs->gain_index;
+        gs->best_snr = snr;
     }
+    // a zero measurement still counts as done
+    gs->snr[gs->gain_index] = fmaxf(snr, 1e-9f);
 
-    log_info("Gain: %.1f dB, CNR: %.1f dB", gain_list[gain_index] / 10.0, 20 * log10f(snr));
+    log_info("Gain: %.1f dB, CNR: %.1f dB", gs->gain_list[gs->gain_index] / 10.0, 20 * log10f(snr));
 
-    if (gain_index + 1 >= gain_count || snr < best_snr * 0.5)
+    if (gs->fast)
     {
-        log_debug("Best gain: %d", gain_list[best_gain]);
-        gain_index = best_gain;
-        gain_count = 0;
+        int next = next_gain(gs);
+
+        if (next >= 0)
+        {
+            gs->gain_index = next;
+            result = 1;
+        }
     }
-    else
+    else if (gs->gain_index + 1 < gs->gain_count && snr >= gs->best_snr * 0.5)
     {
-        gain_index++;
+        gs->gain_index++;
         // continue searching
         result = 1;
     }
 
-    rtlsdr_set_tuner_gain(dev, gain_list[gain_index]);
-    rtlsdr_reset_buffer(dev);
+    if (result == 0)
+    {
+        log_debug("Best gain: %d", gs->gain_list[gs->best_gain]);
+        gs->gain_index = gs->best_gain;
+        gs->searching = 0;
+    }
+
+    rtlsdr_set_tuner_gain(gs->dev, gs->gain_list[gs->gain_index]);
+    // the fast search drops the samples taken while the gain settles instead
+    if (!gs->fast)
+        rtlsdr_reset_buffer(gs->dev);
     return result;
 }
 
-#ifdef USE_THREADS
-static void log_lock(void *udata, int lock)
+static int cnr_callback(void *arg, float snr)
 {
-    pthread_mutex_t *mutex = udata;
-    if (lock)
-        pthread_mutex_lock(mutex);
-    else
-        pthread_mutex_unlock(mutex);
+    log_info("CNR: %.1f dB", 20 * log10f(snr));
+    return 0;
 }
-#endif
 
-unsigned int parse_freq(char *s)
+// after the search, try a neighbouring gain every interval and keep it when it is better
+static int agc_callback(void *arg, float snr)
+{
+    gain_search_t *gs = arg;
+    int next;
+
+    if (gs->agc_trial)
+    {
+        gs->agc_trial = 0;
+        if (snr > gs->best_snr * AGC_HYSTERESIS)
+        {
+            log_info("AGC: gain %.1f dB, CNR: %.1f dB", gs->gain_list[gs->gain_index] / 10.0, 20 * log10f(snr));
+            gs->best_gain = gs->gain_index;
+            gs->best_snr = snr;
+        }
+        else
+        {
+            gs->gain_index = gs->best_gain;
+            gs->agc_dir = -gs->agc_dir;
+            rtlsdr_set_tuner_gain(gs->dev, gs->gain_list[gs->gain_index]);
+        }
+        return 0;
+    }
+
+    // the conditions may have changed since the last check
+    gs->best_snr = snr;
+    next = gs->gain_index + gs->agc_dir * AGC_STEP;
+    if (next < 0 || next >= gs->gain_count)
+    {
+        gs->agc_dir = -gs->agc_dir;
+        next = gs->gain_index + gs->agc_dir * AGC_STEP;
+        if (next < 0 || next >= gs->gain_count)
+            return 0;
+    }
+
+    gs->best_gain = gs->gain_index;
+    gs->gain_index = next;
+    gs->agc_trial = 1;
+    rtlsdr_set_tuner_gain(gs->dev, gs->gain_list[gs->gain_index]);
+    return 1;
+}
+
+// values below 10000 are in MHz
+static unsigned int freq_hz(double d)
 {
-    double d = strtod(s, NULL);
     if (d < 10000) d *= 1e6;
-    return (unsigned int) d;
+    return (unsigned int) lrint(d);
+}
+
+unsigned int parse_freq(char *s)
+{
+    return freq_hz(strtod(s, NULL));
+}
+
+static void read_gain_search(gain_search_t *gs, input_t *input)
+{
+    // use a smaller buffer during auto gain
+    int len = 128 * input->snr_length;
+    uint8_t *buf = malloc(len);
+
+    // special loop for modifying gain (we can't use async transfers)
+    while (gs->searching && !stopping)
+    {
+        int n, err;
+
+        err = rtlsdr_read_sync(gs->dev, buf, len, &n);
+        if (err) FATAL_EXIT("rtlsdr_read_sync error: %d", err);
+
+        input_cb(buf, n, input);
+    }
+    free(buf);
+}
+
+static rtlsdr_dev_t *open_device(unsigned int index, double sample_rate, int ppm_error)
+{
+    rtlsdr_dev_t *dev;
+    int err;
+
+    err = rtlsdr_open(&dev, index);
+    if (err) FATAL_EXIT("rtlsdr_open error: %d", err);
+    err = rtlsdr_set_sample_rate(dev, sample_rate);
+    if (err) FATAL_EXIT("rtlsdr_set_sample_rate error: %d", err);
+    err = rtlsdr_set_tuner_gain_mode(dev, 1);
+    if (err) FATAL_EXIT("rtlsdr_set_tuner_gain_mode error: %d", err);
+    err = rtlsdr_set_freq_correction(dev, ppm_error);
+    if (err && err != -2) FATAL_EXIT("rtlsdr_set_freq_correction error: %d", err);
+
+    return dev;
+}
+
+static void scan_event_cb(const nrsc5_event_t *evt, void *opaque)
+{
+    int *found = opaque;
+
+    if (evt->event == NRSC5_EVENT_SYNC)
+        *found = 1;
 }
 
+// report the CNR of each frequency and whether an HD signal is found within timeout seconds
+static void scan(rtlsdr_dev_t *dev, input_t *input, const unsigned int *freqs, unsigned int count, int gain, int fast_gain, double timeout)
+{
+    uint8_t *buf = malloc(RADIO_BUFFER);
+    unsigned int limit = timeout * NRSC5_SAMPLE_RATE * 2;
+    int found, err;
+
+    input_set_event_callback(input, scan_event_cb, &found);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        gain_search_t gs;
+        unsigned int total = 0;
+
+        err = rtlsdr_set_center_freq(dev, freqs[i]);
+        if (err) FATAL_EXIT("rtlsdr_set_center_freq error: %d", err);
+        input_retune(input, freqs[i]);
+
+        if (gain_search_init(&gs, dev, fast_gain) <= 0)
+            FATAL_EXIT("rtlsdr_get_tuner_gains error: %d", gs.gain_count);
+        // with a manual gain, the search makes a single measurement
+        if (gain != INT_MIN)
+        {
+            gs.gain_list[0] = gain;
+            gs.gain_count = 1;
+        }
+        err = rtlsdr_set_tuner_gain(dev, gs.gain_list[0]);
+        if (err) FATAL_EXIT("rtlsdr_set_tuner_gain error: %d", err);
+        err = rtlsdr_reset_buffer(dev);
+        if (err) FATAL_EXIT("rtlsdr_reset_buffer error: %d", err);
+
+        input_set_snr_callback(input, snr_callback, &gs);
+        read_gain_search(&gs, input);
+
+        found = 0;
+        while (!found && total < limit)
+        {
+            int n;
+
+            err = rtlsdr_read_sync(dev, buf, RADIO_BUFFER, &n);
+            if (err) FATAL_EXIT("rtlsdr_read_sync error: %d", err);
+
+            input_cb(buf, n, input);
+            total += n;
+        }
+
+        if (found)
+            printf("%.1f MHz: CNR %.1f dB, HD (MP%d) after %.1f s\n", freqs[i] / 1e6, 20 * log10f(gs.best_snr),
+                   input->sync.psmi, total / 2.0 / NRSC5_SAMPLE_RATE);
+        else
+            printf("%.1f MHz: CNR %.1f dB, no HD\n", freqs[i] / 1e6, 20 * log10f(gs.best_snr));
+        fflush(stdout);
+    }
+
+    input_set_event_callback(input, NULL, NULL);
+    free(buf);
+}
+
+static void log_cpu_features(int level)
+{
+    log_log(level, __FILE__, __LINE__, "CPU features: %s (viterbi: %s, fir: %s, mixer: %s)",
+            cpu_features_str(), nrsc5_conv_kernel_name(), firdecim_q15_kernel_name(), mixer_kernel_name());
+}
+
+static int init_output(output_t *output, const char *name, const char *format_name, unsigned int latency)
+{
+    if (name != NULL)
+    {
+        if (format_name == NULL)
+        {
+            log_fatal("Must specify an output format.");
+            return 1;
+        }
+        else if (strcmp(format_name, "wav") == 0)
+        {
+#ifdef USE_FAAD2
+            output_init_wav(output, name);
+#else
+            log_fatal("WAV output requires FAAD2.");
+            return 1;
+#endif
+        }
+        else if (strcmp(format_name, "adts") == 0)
+        {
+            output_init_adts(output, name);
+        }
+        else if (strcmp(format_name, "hdc") == 0)
+        {
+            output_init_hdc(output, name);
+        }
+        else
+        {
+            log_fatal("Unknown output format.");
+            return 1;
+        }
+    }
+    else
+    {
+#ifdef USE_FAAD2
+        output_init_live(output, latency);
+#else
+        log_fatal("Live output requires FAAD2.");
+        return 1;
+#endif
+    }
+
+    return 0;
+}
+
+// parse a comma separated list of numbers, returns the number of values or 0 on error
+static unsigned int parse_list(const char *s, double *values, unsigned int max)
+{
+    unsigned int count = 0;
+    char *end;
+
+    do
+    {
+        if (count == max)
+            return 0;
+        values[count++] = strtod(s, &end);
+        if (end == s || (*end != ',' && *end != 0))
+            return 0;
+        s = end + 1;
+    } while (*end == ',');
+
+    return count;
+}
+
+// parse a comma separated list of logical channels into a mask of DECODE_CHANNEL_*, returns 0 on error
+static unsigned int parse_channel_list(const char *s)
+{
+    unsigned int mask = 0;
+    size_t len;
+
+    do
+    {
+        len = strcspn(s, ",");
+        if (len == 2 && strncmp(s, "p1", 2) == 0)
+            mask |= DECODE_CHANNEL_P1;
+        else if (len == 4 && strncmp(s, "pids", 4) == 0)
+            mask |= DECODE_CHANNEL_PIDS;
+        else if (len == 2 && strncmp(s, "p3", 2) == 0)
+            mask |= DECODE_CHANNEL_P3;
+        else if (len == 3 && strncmp(s, "all", 3) == 0)
+            mask |= DECODE_CHANNEL_P1 | DECODE_CHANNEL_PIDS | DECODE_CHANNEL_P3;
+        else
+            return 0;
+        s += len + 1;
+    } while (s[-1] == ',');
+
+    return mask;
+}
+
+// parse a comma separated list of decode profiles into a mask of INPUT_PROFILE_*, returns 0 on error
+static unsigned int parse_profile_list(const char *s)
+{
+    unsigned int mask = 0;
+    size_t len;
+
+    do
+    {
+        len = strcspn(s, ",");
+        if (len == 5 && strncmp(s, "audio", 5) == 0)
+            mask |= INPUT_PROFILE_AUDIO;
+        else if (len == 4 && strncmp(s, "data", 4) == 0)
+            mask |= INPUT_PROFILE_DATA;
+        else if (len == 8 && strncmp(s, "metadata", 8) == 0)
+            mask |= INPUT_PROFILE_PSD | INPUT_PROFILE_SIS;
+        else if (len == 3 && strncmp(s, "sis", 3) == 0)
+            mask |= INPUT_PROFILE_SIS;
+        else if (len == 3 && strncmp(s, "all", 3) == 0)
+            mask |= INPUT_PROFILE_ALL;
+        else
+            return 0;
+        s += len + 1;
+    } while (s[-1] == ',');
+
+    return mask;
+}
+
+// parse a comma separated list of frequencies and start:stop ranges, returns the number of frequencies or 0 on error
+static unsigned int parse_scan_list(const char *s, unsigned int *freqs, unsigned int max)
+{
+    unsigned int count = 0;
+    char *end;
+
+    do
+    {
+        unsigned int start, stop;
+
+        start = stop = freq_hz(strtod(s, &end));
+        if (end == s)
+            return 0;
+        if (*end == ':')
+        {
+            s = end + 1;
+            stop = freq_hz(strtod(s, &end));
+            if (end == s || stop < start)
+                return 0;
+        }
+        if (*end != ',' && *end != 0)
+            return 0;
+
+        for (unsigned int f = start; f <= stop; f += SCAN_STEP)
+        {
+            if (count == max)
+                return 0;
+            freqs[count++] = f;
+        }
+        s = end + 1;
+    } while (*end == ',');
+
+    return count;
+}
+
+// replace the first occurrence of token in the audio output name with a number
+static char *replace_token(const char *pattern, const char *token, unsigned int value)
+{
+    const char *p = strstr(pattern, token);
+    char *name = malloc(strlen(pattern) + 16);
+
+    sprintf(name, "%.*s%u%s", (int)(p - pattern), pattern, value, p + strlen(token));
+    return name;
+}
+
+static void samples_cb(uint8_t *buf, uint32_t len, void *arg)
+{
+    for (unsigned int i = 0; i < num_inputs; i++)
+        input_cb(buf, len, &inputs[i]);
+}
+
+static void samples_q15_cb(const cint16_t *buf, unsigned int count, void *arg)
+{
+    for (unsigned int i = 0; i < num_inputs; i++)
+        input_push_q15(&inputs[i], buf, count);
+}
+
+#ifdef USE_THREADS
+static void samples_queue_cb(uint8_t *buf, uint32_t len, void *arg)
+{
+    for (unsigned int i = 0; i < num_inputs; i++)
+        input_queue_cb(buf, len, &inputs[i]);
+}
+#endif
+
 static void help(const char *progname)
 {
-    fprintf(stderr, "Usage: %s [-v] [-q] [-l log-level] [-d device-index] [-g gain] [-p ppm-error] [-r samples-input] [-w samples-output] [-o audio-output -f adts|hdc|wav] [--dump-aas-files directory] frequency program\n", progname);
+    fprintf(stderr, "Usage: %s [-v] [-q] [-l log-level] [--log-async] [--log-rate-limit count] [--low-memory] [--hugepages] [-d device-index | --rtltcp host[:port]] [--cache file] [-g gain] [-p ppm-error] [-r samples-input] [--input-format cu8|cs8|cs16|cf32] [--jobs threads] [-w samples-output] [-o audio-output -f adts|hdc|wav] [--dump-aas-files directory] [--viterbi-window bits] [--viterbi-8bit p1|pids|p3|all[,...]] [--metrics-file file] [--metrics-interval seconds] [--metrics-port port] [--equalizer] [--profile audio|data|metadata|sis|all[,...]] [--fftw-effort effort] [--fftw-wisdom file] [--gain-search linear|fast] [--gain-measure ffts] [--agc seconds] [--cnr-interval seconds] [--latency frames] [--cpu-features] [--sample-rate rate --channels offset[,offset...]] frequency program[,program...]\n", progname);
+    fprintf(stderr, "       %s [-l log-level] [-d device-index] [-g gain] [-p ppm-error] [--gain-search linear|fast] [--gain-measure ffts] [--scan-timeout seconds] --scan frequency[,frequency|start:stop...]\n", progname);
 }
 
 int main(int argc, char *argv[])
 {
     static const struct option long_opts[] = {
         { "dump-aas-files", required_argument, NULL, 1 },
+        { "viterbi-window", required_argument, NULL, 2 },
+        { "cpu-features", no_argument, NULL, 3 },
+        { "sample-rate", required_argument, NULL, 4 },
+        { "channels", required_argument, NULL, 5 },
+        { "equalizer", no_argument, NULL, 6 },
+        { "fftw-effort", required_argument, NULL, 7 },
+        { "fftw-wisdom", required_argument, NULL, 8 },
+        { "scan", required_argument, NULL, 9 },
+        { "scan-timeout", required_argument, NULL, 10 },
+        { "gain-search", required_argument, NULL, 11 },
+        { "gain-measure", required_argument, NULL, 12 },
+        { "agc", required_argument, NULL, 13 },
+        { "cnr-interval", required_argument, NULL, 14 },
+        { "latency", required_argument, NULL, 15 },
+        { "viterbi-8bit", required_argument, NULL, 16 },
+        { "metrics-file", required_argument, NULL, 17 },
+        { "metrics-interval", required_argument, NULL, 18 },
+        { "metrics-port", required_argument, NULL, 19 },
+        { "input-format", required_argument, NULL, 20 },
+        { "jobs", required_argument, NULL, 21 },
+        { "log-async", no_argument, NULL, 22 },
+        { "log-rate-limit", required_argument, NULL, 23 },
+        { "low-memory", no_argument, NULL, 24 },
+        { "hugepages", no_argument, NULL, 25 },
+        { "rtltcp", required_argument, NULL, 26 },
+        { "cache", required_argument, NULL, 27 },
+        { "profile", required_argument, NULL, 28 },
         { 0 }
     };
-    int err, opt, gain = INT_MIN, ppm_error = 0;
-    unsigned int count, i, frequency = 0, program = 0, device_index = 0;
-    char *input_name = NULL, *output_name = NULL, *audio_name = NULL, *format_name = NULL, *files_path = NULL;
-    FILE *infp = NULL, *outfp = NULL;
-    input_t input;
-    output_t output;
+    int err, opt, gain = INT_MIN, ppm_error = 0, viterbi_window = -1, equalizer = 0, fast_gain = 0;
+    unsigned int viterbi_8bit = 0, profile = INPUT_PROFILE_ALL;
+    unsigned int count, i, j, frequency = 0, num_programs, num_channels = 0, device_index = 0, gain_length = SNR_FFT_COUNT, latency = LATENCY_FRAMES;
+    unsigned int programs[MAX_PROGRAMS], scan_freqs[MAX_SCAN], num_scan = 0;
+    unsigned int metrics_port = 0;
+    double values[MAX_PROGRAMS], channels[MAX_CHANNELS], sample_rate = 1488375, scan_timeout = 5, agc_interval = 0, cnr_interval = 0;
+    double metrics_interval = 10;
+    char *input_name = NULL, *output_name = NULL, *audio_name = NULL, *format_name = NULL, *files_path = NULL, *wisdom_path = NULL;
+    char *metrics_name = NULL, *rtltcp_address = NULL, *cache_name = NULL;
+    cache_entry_t *cache = NULL;
+    iq_format_t input_format = IQ_FORMAT_CU8;
+    iqfile_t iqfile;
+    unsigned int jobs = 0;
+    int log_async = 0;
+#ifdef LOW_MEMORY
+    int low_memory = 1;
+#else
+    int low_memory = 0;
+#endif
+    int hugepages = 0;
+    FILE *infp = NULL, *outfp = NULL, *metrics_fp = NULL;
+    writer_t recorder;
+    output_t *outputs;
 
     while ((opt = getopt_long(argc, argv, "r:w:d:p:o:f:g:ql:v", long_opts, NULL)) != -1)
     {
@@ -121,6 +656,148 @@ int main(int argc, char *argv[])
         case 1:
             files_path = optarg;
             break;
+        case 2:
+            viterbi_window = atoi(optarg);
+            break;
+        case 3:
+            log_cpu_features(LOG_INFO);
+            return 0;
+        case 4:
+            sample_rate = strtod(optarg, NULL);
+            break;
+        case 5:
+            num_channels = parse_list(optarg, channels, MAX_CHANNELS);
+            if (num_channels == 0)
+            {
+                log_fatal("Invalid channel list.");
+                return 1;
+            }
+            break;
+        case 6:
+            equalizer = 1;
+            break;
+        case 7:
+            if (fft_set_planner_effort(optarg) != 0)
+            {
+                log_fatal("Invalid FFTW planner effort: %s", optarg);
+                return 1;
+            }
+            break;
+        case 8:
+            wisdom_path = optarg;
+            break;
+        case 9:
+            num_scan = parse_scan_list(optarg, scan_freqs, MAX_SCAN);
+            if (num_scan == 0)
+            {
+                log_fatal("Invalid scan list.");
+                return 1;
+            }
+            break;
+        case 10:
+            scan_timeout = strtod(optarg, NULL);
+            break;
+        case 11:
+            if (strcmp(optarg, "fast") == 0)
+                fast_gain = 1;
+            else if (strcmp(optarg, "linear") == 0)
+                fast_gain = 0;
+            else
+            {
+                log_fatal("Invalid gain search: %s", optarg);
+                return 1;
+            }
+            break;
+        case 12:
+            gain_length = atoi(optarg);
+            if (gain_length == 0 || gain_length > 128 * 1024)
+            {
+                log_fatal("Invalid gain measurement length.");
+                return 1;
+            }
+            break;
+        case 13:
+            agc_interval = strtod(optarg, NULL);
+            break;
+        case 14:
+            cnr_interval = strtod(optarg, NULL);
+            break;
+        case 15:
+            latency = atoi(optarg);
+            if (latency < 1 || latency > AUDIO_QUEUE_FRAMES / 2)
+            {
+                log_fatal("Latency must be between 1 and %d frames.", AUDIO_QUEUE_FRAMES / 2);
+                return 1;
+            }
+            break;
+        case 16:
+            viterbi_8bit = parse_channel_list(optarg);
+            if (viterbi_8bit == 0)
+            {
+                log_fatal("Invalid channel list: %s", optarg);
+                return 1;
+            }
+            break;
+        case 17:
+            metrics_name = optarg;
+            break;
+        case 18:
+            metrics_interval = strtod(optarg, NULL);
+            if (metrics_interval <= 0)
+            {
+                log_fatal("Invalid metrics interval.");
+                return 1;
+            }
+            break;
+        case 19:
+            metrics_port = atoi(optarg);
+            if (metrics_port == 0 || metrics_port > 65535)
+            {
+                log_fatal("Invalid metrics port.");
+                return 1;
+            }
+            break;
+        case 20:
+            if (iqfile_parse_format(optarg, &input_format) != 0)
+            {
+                log_fatal("Invalid input format.");
+                return 1;
+            }
+            break;
+        case 21:
+            jobs = atoi(optarg);
+            if (jobs == 0)
+            {
+                log_fatal("Invalid number of jobs.");
+                return 1;
+            }
+            break;
+        case 22:
+            log_async = 1;
+            break;
+        case 23:
+            log_set_rate_limit(atoi(optarg));
+            break;
+        case 24:
+            low_memory = 1;
+            break;
+        case 25:
+            hugepages = 1;
+            break;
+        case 26:
+            rtltcp_address = optarg;
+            break;
+        case 27:
+            cache_name = optarg;
+            break;
+        case 28:
+            profile = parse_profile_list(optarg);
+            if (profile == 0)
+            {
+                log_fatal("Invalid decode profile: %s", optarg);
+                return 1;
+            }
+            break;
         case 'r':
             input_name = optarg;
             break;
@@ -157,12 +834,78 @@ int main(int argc, char *argv[])
         }
     }
 
-#ifdef USE_THREADS
-    pthread_mutex_t log_mutex;
-    pthread_mutex_init(&log_mutex, NULL);
-    log_set_lock(log_lock);
-    log_set_udata(&log_mutex);
-#endif
+    cpu_init();
+    log_cpu_features(LOG_DEBUG);
+
+    if (input_format != IQ_FORMAT_CU8 && input_name == NULL)
+    {
+        log_fatal("An input format can only be given for a samples input file.");
+        return 1;
+    }
+
+    if (agc_interval > 0 && (gain != INT_MIN || input_name != NULL || num_scan > 0 || rtltcp_address != NULL))
+    {
+        log_fatal("AGC requires automatic gain selection while decoding from a tuner.");
+        return 1;
+    }
+    if (rtltcp_address != NULL && (input_name != NULL || num_scan > 0))
+    {
+        log_fatal("An rtl_tcp server cannot be combined with an input file or scanning.");
+        return 1;
+    }
+    if (cnr_interval > 0 && (agc_interval > 0 || num_channels > 0 || num_scan > 0))
+    {
+        log_fatal("CNR monitoring cannot be combined with AGC, wideband capture or scanning.");
+        return 1;
+    }
+    if (cache_name != NULL && (num_scan > 0 || jobs > 0))
+    {
+        log_fatal("The cache cannot be combined with scanning or parallel decoding.");
+        return 1;
+    }
+
+    if (num_scan > 0)
+    {
+        output_t output;
+        input_t *input;
+        rtlsdr_dev_t *dev;
+
+        if (optind != argc || input_name != NULL || num_channels > 0)
+        {
+            help(argv[0]);
+            return 0;
+        }
+        if (rtlsdr_get_device_count() <= device_index)
+        {
+            log_fatal("Selected device does not exist.");
+            return 1;
+        }
+
+        if (wisdom_path && fft_import_wisdom(wisdom_path) != 0)
+            log_debug("No FFTW wisdom loaded from %s", wisdom_path);
+
+        // the plans and buffers of one input are reused for every frequency
+        output_init_callback(&output);
+        input = calloc(1, sizeof(input_t));
+        input_set_memory_profile(low_memory, hugepages);
+        input_init(input, &output, 0, 0, NULL);
+        input_set_snr_options(input, gain_length, fast_gain ? GAIN_SETTLE : 0);
+        sync_set_scan(&input->sync, 1);
+
+        if (wisdom_path && fft_export_wisdom(wisdom_path) != 0)
+            log_warn("Unable to save FFTW wisdom to %s", wisdom_path);
+
+        dev = open_device(device_index, sample_rate, ppm_error);
+        scan(dev, input, scan_freqs, num_scan, gain, fast_gain, scan_timeout);
+        err = rtlsdr_close(dev);
+        if (err) FATAL_EXIT("rtlsdr error: %d", err);
+
+        input_finish(input);
+        input_free(input);
+        free(input);
+        output_free(&output);
+        return 0;
+    }
 
     if (input_name == NULL)
     {
@@ -172,22 +915,25 @@ int main(int argc, char *argv[])
             return 0;
         }
         frequency = parse_freq(argv[optind]);
-        program = strtoul(argv[optind+1], NULL, 0);
+        num_programs = parse_list(argv[optind+1], values, MAX_PROGRAMS);
 
-        count = rtlsdr_get_device_count();
-        if (count == 0)
+        if (rtltcp_address == NULL)
         {
-            log_fatal("No devices found!");
-            return 1;
-        }
+            count = rtlsdr_get_device_count();
+            if (count == 0)
+            {
+                log_fatal("No devices found!");
+                return 1;
+            }
 
-        for (i = 0; i < count; ++i)
-            log_info("[%d] %s", i, rtlsdr_get_device_name(i));
+            for (i = 0; i < count; ++i)
+                log_info("[%d] %s", i, rtlsdr_get_device_name(i));
 
-        if (device_index >= count)
-        {
-            log_fatal("Selected device does not exist.");
-            return 1;
+            if (device_index >= count)
+            {
+                log_fatal("Selected device does not exist.");
+                return 1;
+            }
         }
     }
     else
@@ -197,18 +943,59 @@ int main(int argc, char *argv[])
             help(argv[0]);
             return 0;
         }
-        program = strtoul(argv[optind], NULL, 0);
+        num_programs = parse_list(argv[optind], values, MAX_PROGRAMS);
 
-        if (strcmp(input_name, "-") == 0)
-            infp = stdin;
-        else
-            infp = fopen(input_name, "rb");
+        if (num_channels > 0 && input_format != IQ_FORMAT_CU8)
+        {
+            log_fatal("Wideband capture requires cu8 samples.");
+            return 1;
+        }
+        // other formats and rates are converted before the decoder sees them
+        if ((input_format != IQ_FORMAT_CU8 || (num_channels == 0 && sample_rate != 1488375))
+            && (output_name != NULL || cnr_interval > 0))
+        {
+            log_fatal("Writing samples and CNR monitoring require cu8 samples at 1488375 Hz.");
+            return 1;
+        }
 
-        if (infp == NULL)
+        if (jobs > 0 && (strcmp(input_name, "-") == 0 || num_channels > 0 || output_name != NULL || cnr_interval > 0))
+        {
+            log_fatal("Parallel decoding requires a sample file, without wideband capture, sample output or CNR monitoring.");
+            return 1;
+        }
+#ifndef USE_THREADS
+        if (jobs > 0)
+        {
+            log_fatal("Parallel decoding requires multithreading.");
+            return 1;
+        }
+#endif
+
+        if (iqfile_open(&iqfile, input_name, input_format, num_channels ? 0 : sample_rate) != 0)
         {
             log_fatal("Unable to open input file.");
             return 1;
         }
+        infp = iqfile.fp;
+    }
+
+    if (num_programs == 0)
+    {
+        log_fatal("Invalid program list.");
+        return 1;
+    }
+    for (i = 0; i < num_programs; i++)
+        programs[i] = values[i];
+
+    if (num_channels == 0 && sample_rate != 1488375 && input_name == NULL)
+    {
+        log_fatal("A wideband sample rate requires a channel list.");
+        return 1;
+    }
+    if (num_channels > 0 && input_name == NULL && gain == INT_MIN)
+    {
+        log_fatal("Wideband capture requires a manual gain.");
+        return 1;
     }
 
     if (output_name != NULL)
@@ -219,86 +1006,221 @@ int main(int argc, char *argv[])
             log_fatal("Unable to open output file.");
             return 1;
         }
+        // samples from a tuner keep coming, drop them rather than stall the decoder
+        writer_init(&recorder, outfp, infp == NULL);
     }
 
-    if (audio_name != NULL)
+    num_inputs = num_channels ? num_channels : 1;
+    if (num_programs > 1 && (audio_name == NULL || strstr(audio_name, "%d") == NULL))
     {
-        if (format_name == NULL)
+        log_fatal("Decoding several programs requires an audio output name containing %%d.");
+        return 1;
+    }
+    if (num_inputs > 1 && (audio_name == NULL || strstr(audio_name, "%c") == NULL))
+    {
+        log_fatal("Decoding several channels requires an audio output name containing %%c.");
+        return 1;
+    }
+
+    outputs = calloc(num_inputs * num_programs, sizeof(output_t));
+    for (i = 0; i < num_inputs; i++)
+    {
+        for (j = 0; j < num_programs; j++)
         {
-            log_fatal("Must specify an output format.");
-            return 1;
+            char *name = audio_name ? strdup(audio_name) : NULL;
+
+            if (num_inputs > 1)
+            {
+                char *tmp = replace_token(name, "%c", i);
+                free(name);
+                name = tmp;
+            }
+            if (num_programs > 1)
+            {
+                char *tmp = replace_token(name, "%d", programs[j]);
+                free(name);
+                name = tmp;
+            }
+
+            // nothing is played when the profile has no audio
+            if (name == NULL && !(profile & INPUT_PROFILE_AUDIO))
+            {
+                output_init_callback(&outputs[i * num_programs + j]);
+                err = 0;
+            }
+            else
+            {
+                err = init_output(&outputs[i * num_programs + j], name, format_name, latency);
+            }
+            free(name);
+            if (err)
+                return 1;
         }
-        else if (strcmp(format_name, "wav") == 0)
+    }
+
+    output_set_aas_files_path(&outputs[0], files_path);
+
+    // a missing wisdom file is created once the plans have been made
+    if (wisdom_path && fft_import_wisdom(wisdom_path) != 0)
+        log_debug("No FFTW wisdom loaded from %s", wisdom_path);
+
+    input_set_memory_profile(low_memory, hugepages);
+    inputs = calloc(num_inputs, sizeof(input_t));
+    for (i = 0; i < num_inputs; i++)
+    {
+        input_t *input = &inputs[i];
+        double offset = num_channels ? channels[i] : 0;
+
+        // only the first input writes raw samples, which are the same for all
+        input_init(input, &outputs[i * num_programs], frequency ? frequency + offset : 0, programs[0], i == 0 && outfp ? &recorder : NULL);
+        for (j = 1; j < num_programs; j++)
+            input_add_output(input, &outputs[i * num_programs + j], programs[j]);
+        if (num_channels)
+            input_set_channel(input, sample_rate, offset);
+        if (viterbi_window >= 0)
+            decode_set_viterbi_window(&input->decode, viterbi_window);
+        if (viterbi_8bit)
+            decode_set_viterbi_8bit(&input->decode, viterbi_8bit);
+        if (equalizer)
+            sync_set_equalizer(&input->sync, 1);
+        input_set_profile(input, profile);
+        input_set_snr_options(input, gain_length, fast_gain ? GAIN_SETTLE : 0);
+        input_report_memory(input);
+    }
+
+    if (cache_name)
+    {
+        cache = calloc(num_inputs, sizeof(cache_entry_t));
+        for (i = 0; i < num_inputs; i++)
         {
-#ifdef USE_FAAD2
-            output_init_wav(&output, audio_name);
-#else
-            log_fatal("WAV output requires FAAD2.");
-            return 1;
-#endif
+            double offset = num_channels ? channels[i] : 0;
+
+            cache_entry_init(&cache[i], lrint(frequency + offset));
+            if (cache_load(cache_name, &cache[i]) == 0)
+                input_seed(&inputs[i], &cache[i]);
+            else
+                log_debug("Nothing cached for %ld Hz", cache[i].frequency);
         }
-        else if (strcmp(format_name, "adts") == 0)
+
+        // the tuner is stopped on a signal so that what was learned can be saved
+        if (infp == NULL)
         {
-            output_init_adts(&output, audio_name);
+            signal(SIGINT, stop_handler);
+            signal(SIGTERM, stop_handler);
         }
-        else if (strcmp(format_name, "hdc") == 0)
+    }
+
+    if (wisdom_path && fft_export_wisdom(wisdom_path) != 0)
+        log_warn("Unable to save FFTW wisdom to %s", wisdom_path);
+
+    if (metrics_name || metrics_port)
+    {
+#ifdef USE_THREADS
+        if (metrics_name)
         {
-            output_init_hdc(&output, audio_name);
+            metrics_fp = strcmp(metrics_name, "-") == 0 ? stdout : fopen(metrics_name, "a");
+            if (metrics_fp == NULL)
+            {
+                log_fatal("Unable to open metrics file.");
+                return 1;
+            }
         }
-        else
+        if (metrics_start(metrics_fp, metrics_interval, metrics_port) != 0)
         {
-            log_fatal("Unknown output format.");
+            log_fatal("Unable to start exporting metrics.");
             return 1;
         }
-    }
-    else
-    {
-#ifdef USE_FAAD2
-        output_init_live(&output);
 #else
-        log_fatal("Live output requires FAAD2.");
+        log_fatal("Exporting metrics requires multithreading.");
         return 1;
 #endif
     }
 
-    output_set_aas_files_path(&output, files_path);
-
-    input_init(&input, &output, frequency, program, outfp);
+    // messages from setting up are written straight away, in case it fails
+    if (log_async && log_set_async(1) != 0)
+    {
+        log_fatal("Asynchronous logging requires multithreading.");
+        return 1;
+    }
 
     if (infp)
     {
-        while (!feof(infp))
+        if (cnr_interval > 0)
+        {
+            input_set_snr_interval(&inputs[0], cnr_interval * sample_rate * 2);
+            input_set_snr_callback(&inputs[0], cnr_callback, NULL);
+        }
+
+#ifdef USE_THREADS
+        if (jobs > 0)
+        {
+            iqfile_close(&iqfile);
+            // inputs[0] only holds the settings and outputs for the segments
+            if (batch_decode(input_name, input_format, sample_rate, jobs, &inputs[0]) != 0)
+            {
+                log_fatal("Parallel decoding requires a sample file that can be memory-mapped.");
+                return 1;
+            }
+        }
+        else
+#endif
+        {
+            iqfile_read(&iqfile, samples_cb, samples_q15_cb, NULL);
+            iqfile_close(&iqfile);
+        }
+    }
+    else if (rtltcp_address)
+    {
+        rtltcp_t tcp;
+
+        if (rtltcp_open(&tcp, rtltcp_address, RADIO_BUFFER) != 0)
+        {
+            log_fatal("Unable to connect to the rtl_tcp server.");
+            return 1;
+        }
+        stop_tcp = &tcp;
+        // without a list of gains, automatic gain selection is left to the tuner
+        if (rtltcp_set_sample_rate(&tcp, sample_rate) != 0
+            || rtltcp_set_freq_correction(&tcp, ppm_error) != 0
+            || rtltcp_set_center_freq(&tcp, frequency) != 0
+            || rtltcp_set_tuner_gain(&tcp, gain) != 0)
+            FATAL_EXIT("Unable to configure the rtl_tcp server.");
+
+        if (cnr_interval > 0)
         {
-            uint8_t tmp[RADIO_BUFFER];
-            size_t cnt;
-            cnt = fread(tmp, 4, sizeof(tmp) / 4, infp);
-            if (cnt > 0)
-                input_cb(tmp, cnt * 4, &input);
+            input_set_snr_interval(&inputs[0], cnr_interval * sample_rate * 2);
+            input_set_snr_callback(&inputs[0], cnr_callback, NULL);
         }
+
+#ifdef USE_THREADS
+        // the socket is drained while the stations decode, so its buffer does not overflow
+        for (i = 0; i < num_inputs; i++)
+            input_start_thread(&inputs[i], RADIO_BUFFER);
+        rtltcp_read(&tcp, samples_queue_cb, NULL);
+        for (i = 0; i < num_inputs; i++)
+            input_stop_thread(&inputs[i]);
+#else
+        rtltcp_read(&tcp, samples_cb, NULL);
+#endif
+        stop_tcp = NULL;
+        rtltcp_close(&tcp);
     }
     else
     {
-        uint8_t *buf = malloc(128 * SNR_FFT_COUNT);
-        rtlsdr_dev_t *dev;
+        rtlsdr_dev_t *dev = open_device(device_index, sample_rate, ppm_error);
+        gain_search_t gs = { 0 };
 
-        err = rtlsdr_open(&dev, 0);
-        if (err) FATAL_EXIT("rtlsdr_open error: %d", err);
-        err = rtlsdr_set_sample_rate(dev, 1488375);
-        if (err) FATAL_EXIT("rtlsdr_set_sample_rate error: %d", err);
-        err = rtlsdr_set_tuner_gain_mode(dev, 1);
-        if (err) FATAL_EXIT("rtlsdr_set_tuner_gain_mode error: %d", err);
-        err = rtlsdr_set_freq_correction(dev, ppm_error);
-        if (err && err != -2) FATAL_EXIT("rtlsdr_set_freq_correction error: %d", err);
         err = rtlsdr_set_center_freq(dev, frequency);
         if (err) FATAL_EXIT("rtlsdr_set_center_freq error: %d", err);
 
         if (gain == INT_MIN)
         {
-            gain_count = rtlsdr_get_tuner_gains(dev, gain_list);
-            if (gain_count > 0)
+            if (gain_search_init(&gs, dev, fast_gain) > 0)
             {
-                input_set_snr_callback(&input, snr_callback, dev);
-                err = rtlsdr_set_tuner_gain(dev, gain_list[0]);
+                if (cache && cache[0].gain != INT_MIN)
+                    gain_search_cached(&gs, cache[0].gain, cache[0].cnr);
+                input_set_snr_callback(&inputs[0], snr_callback, &gs);
+                err = rtlsdr_set_tuner_gain(dev, gs.gain_list[gs.gain_index]);
                 if (err) FATAL_EXIT("rtlsdr_set_tuner_gain error: %d", err);
             }
         }
@@ -311,24 +1233,71 @@ int main(int argc, char *argv[])
         err = rtlsdr_reset_buffer(dev);
         if (err) FATAL_EXIT("rtlsdr_reset_buffer error: %d", err);
 
-        // special loop for modifying gain (we can't use async transfers)
-        while (gain_count)
-        {
-            // use a smaller buffer during auto gain
-            int len = 128 * SNR_FFT_COUNT;
-
-            err = rtlsdr_read_sync(dev, buf, len, &len);
-            if (err) FATAL_EXIT("rtlsdr_read_sync error: %d", err);
+        read_gain_search(&gs, &inputs[0]);
 
-            input_cb(buf, len, &input);
+        // measured alongside decoding once the gain search is done with the input
+        if (cnr_interval > 0)
+        {
+            input_set_snr_interval(&inputs[0], cnr_interval * sample_rate * 2);
+            input_set_snr_callback(&inputs[0], cnr_callback, NULL);
+        }
+        if (agc_interval > 0 && gs.gain_count > 0)
+        {
+            input_set_snr_options(&inputs[0], gain_length, AGC_SETTLE);
+            input_set_snr_interval(&inputs[0], agc_interval * sample_rate * 2);
+            input_set_snr_callback(&inputs[0], agc_callback, &gs);
         }
-        free(buf);
 
-        err = rtlsdr_read_async(dev, input_cb, &input, RADIO_BUFCNT, RADIO_BUFFER);
+        stop_dev = dev;
+#ifdef USE_THREADS
+        // keep the USB callback short so that transfers are not dropped
+        // and run each station on its own thread
+        for (i = 0; i < num_inputs; i++)
+            input_start_thread(&inputs[i], RADIO_BUFFER);
+        err = stopping ? 0 : rtlsdr_read_async(dev, samples_queue_cb, NULL, RADIO_BUFCNT, RADIO_BUFFER);
         if (err) FATAL_EXIT("rtlsdr_read_async error: %d", err);
+        for (i = 0; i < num_inputs; i++)
+            input_stop_thread(&inputs[i]);
+#else
+        err = stopping ? 0 : rtlsdr_read_async(dev, samples_cb, NULL, RADIO_BUFCNT, RADIO_BUFFER);
+        if (err) FATAL_EXIT("rtlsdr_read_async error: %d", err);
+#endif
+        stop_dev = NULL;
+
+        // the gain that was settled on, by the search or the AGC
+        if (cache && gs.gain_count > 0 && !gs.searching)
+        {
+            cache[0].gain = gs.gain_list[gs.best_gain];
+            cache[0].cnr = 20 * log10f(gs.best_snr);
+        }
         err = rtlsdr_close(dev);
         if (err) FATAL_EXIT("rtlsdr error: %d", err);
     }
 
+    for (i = 0; i < num_inputs; i++)
+        input_finish(&inputs[i]);
+    if (cache)
+    {
+        for (i = 0; i < num_inputs; i++)
+        {
+            input_save_state(&inputs[i], &cache[i]);
+            if (cache_save(cache_name, &cache[i]) != 0)
+                log_warn("Unable to save the cache to %s", cache_name);
+        }
+        free(cache);
+    }
+    for (i = 0; i < num_inputs * num_programs; i++)
+        output_free(&outputs[i]);
+    if (outfp)
+    {
+        writer_free(&recorder);
+        fclose(outfp);
+    }
+#ifdef USE_THREADS
+    metrics_stop();
+#endif
+    if (metrics_fp && metrics_fp != stdout)
+        fclose(metrics_fp);
+    log_set_async(0);
     return 0;
 }
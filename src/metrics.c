@@ -0,0 +1,397 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "defines.h"
+#include "metrics.h"
+#include "queue.h"
+#include "timing.h"
+
+// queues of every receiver, with the threads of its decoder, frames and outputs
+#define MAX_QUEUES 64
+
+static const char *counter_names[METRICS_COUNTERS] = {
+    "input_samples",
+    "sync_lost",
+    "frames",
+    "crc_errors",
+    "psd_crc_errors",
+    "rs_corrected",
+    "rs_failures",
+    "audio_packets",
+    "audio_underruns",
+    "audio_dropped",
+};
+
+static const char *gauge_names[METRICS_GAUGES] = {
+    "sync",
+    "mer_lower_db",
+    "mer_upper_db",
+    "ber",
+    "cfo_hz",
+};
+
+atomic_uint_fast64_t metrics_counters[METRICS_COUNTERS];
+// float bits of each gauge, and which ones were ever set
+static atomic_uint gauges[METRICS_GAUGES];
+static atomic_uint gauges_set;
+
+void metrics_set(metrics_gauge_t gauge, float value)
+{
+    unsigned int bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    atomic_store_explicit(&gauges[gauge], bits, memory_order_relaxed);
+    atomic_fetch_or_explicit(&gauges_set, 1u << gauge, memory_order_relaxed);
+}
+
+static int get_gauge(metrics_gauge_t gauge, float *value)
+{
+    unsigned int bits = atomic_load_explicit(&gauges[gauge], memory_order_relaxed);
+
+    memcpy(value, &bits, sizeof(bits));
+    return (atomic_load_explicit(&gauges_set, memory_order_relaxed) >> gauge) & 1;
+}
+
+#ifdef USE_THREADS
+typedef struct
+{
+    struct queue_t *q;
+    const char *name;
+} queue_entry_t;
+
+static pthread_mutex_t queues_mutex = PTHREAD_MUTEX_INITIALIZER;
+static queue_entry_t queues[MAX_QUEUES];
+static unsigned int num_queues;
+
+void metrics_add_queue(struct queue_t *q, const char *name)
+{
+    pthread_mutex_lock(&queues_mutex);
+    if (num_queues < MAX_QUEUES)
+    {
+        queues[num_queues].q = q;
+        queues[num_queues].name = name;
+        num_queues++;
+    }
+    pthread_mutex_unlock(&queues_mutex);
+}
+
+void metrics_remove_queue(struct queue_t *q)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&queues_mutex);
+    for (i = 0; i < num_queues; i++)
+    {
+        if (queues[i].q == q)
+        {
+            queues[i] = queues[--num_queues];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queues_mutex);
+}
+
+// index of the queue among those with the same name, for telling receivers apart
+static unsigned int queue_index(unsigned int i)
+{
+    unsigned int j, index = 0;
+
+    for (j = 0; j < i; j++)
+    {
+        if (strcmp(queues[j].name, queues[i].name) == 0)
+            index++;
+    }
+    return index;
+}
+#endif
+
+void metrics_write_json(FILE *fp)
+{
+    timing_stats_t stats;
+    unsigned int i;
+    float value;
+
+    fprintf(fp, "{\"time\": %lld, \"counters\": {", (long long) time(NULL));
+    for (i = 0; i < METRICS_COUNTERS; i++)
+        fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", counter_names[i], (unsigned long long) atomic_load(&metrics_counters[i]));
+
+    fprintf(fp, "}, \"gauges\": {");
+    for (i = 0; i < METRICS_GAUGES; i++)
+    {
+        if (get_gauge(i, &value))
+            fprintf(fp, "%s\"%s\": %g", i ? ", " : "", gauge_names[i], value);
+        else
+            fprintf(fp, "%s\"%s\": null", i ? ", " : "", gauge_names[i]);
+    }
+
+    fprintf(fp, "}, \"stages\": {");
+    for (i = 0; i < TIMING_STAGES; i++)
+    {
+        timing_get(i, &stats);
+        fprintf(fp, "%s\"%s\": {\"calls\": %llu, \"seconds\": %.6f}", i ? ", " : "",
+                timing_stage_name(i), (unsigned long long) stats.count, stats.total / 1e9);
+    }
+
+    fprintf(fp, "}, \"queues\": [");
+#ifdef USE_THREADS
+    pthread_mutex_lock(&queues_mutex);
+    for (i = 0; i < num_queues; i++)
+    {
+        queue_t *q = queues[i].q;
+
+        fprintf(fp, "%s{\"name\": \"%s\", \"index\": %u, \"depth\": %u, \"capacity\": %u, \"dropped\": %u}",
+                i ? ", " : "", queues[i].name, queue_index(i), queue_depth(q), q->count, atomic_load(&q->dropped));
+    }
+    pthread_mutex_unlock(&queues_mutex);
+#endif
+    fprintf(fp, "]}\n");
+}
+
+void metrics_write_prometheus(FILE *fp)
+{
+    timing_stats_t stats;
+    unsigned int i;
+    float value;
+
+    for (i = 0; i < METRICS_COUNTERS; i++)
+    {
+        fprintf(fp, "# TYPE nrsc5_%s_total counter\n", counter_names[i]);
+        fprintf(fp, "nrsc5_%s_total %llu\n", counter_names[i], (unsigned long long) atomic_load(&metrics_counters[i]));
+    }
+    for (i = 0; i < METRICS_GAUGES; i++)
+    {
+        if (!get_gauge(i, &value))
+            continue;
+        fprintf(fp, "# TYPE nrsc5_%s gauge\n", gauge_names[i]);
+        fprintf(fp, "nrsc5_%s %g\n", gauge_names[i], value);
+    }
+
+    fprintf(fp, "# TYPE nrsc5_stage_calls_total counter\n");
+    for (i = 0; i < TIMING_STAGES; i++)
+    {
+        timing_get(i, &stats);
+        fprintf(fp, "nrsc5_stage_calls_total{stage=\"%s\"} %llu\n", timing_stage_name(i), (unsigned long long) stats.count);
+    }
+    fprintf(fp, "# TYPE nrsc5_stage_seconds_total counter\n");
+    for (i = 0; i < TIMING_STAGES; i++)
+    {
+        timing_get(i, &stats);
+        fprintf(fp, "nrsc5_stage_seconds_total{stage=\"%s\"} %.6f\n", timing_stage_name(i), stats.total / 1e9);
+    }
+
+#ifdef USE_THREADS
+    pthread_mutex_lock(&queues_mutex);
+    fprintf(fp, "# TYPE nrsc5_queue_depth gauge\n");
+    for (i = 0; i < num_queues; i++)
+        fprintf(fp, "nrsc5_queue_depth{queue=\"%s\",index=\"%u\"} %u\n", queues[i].name, queue_index(i), queue_depth(queues[i].q));
+    fprintf(fp, "# TYPE nrsc5_queue_capacity gauge\n");
+    for (i = 0; i < num_queues; i++)
+        fprintf(fp, "nrsc5_queue_capacity{queue=\"%s\",index=\"%u\"} %u\n", queues[i].name, queue_index(i), queues[i].q->count);
+    fprintf(fp, "# TYPE nrsc5_queue_dropped_total counter\n");
+    for (i = 0; i < num_queues; i++)
+        fprintf(fp, "nrsc5_queue_dropped_total{queue=\"%s\",index=\"%u\"} %u\n", queues[i].name, queue_index(i), atomic_load(&queues[i].q->dropped));
+    pthread_mutex_unlock(&queues_mutex);
+#endif
+}
+
+#ifdef USE_THREADS
+typedef struct
+{
+    FILE *fp;
+    double interval;
+    int listen_fd;
+    // written to wake the thread when stopping
+    int wake_fd[2];
+    pthread_t thread;
+} exporter_t;
+
+static exporter_t exporter;
+static atomic_int running;
+
+#ifdef HAVE_SYS_SOCKET_H
+static int listen_http(unsigned int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// answer one request, whatever its path, then close the connection
+static void serve_http(int listen_fd)
+{
+    struct timeval timeout = { 1, 0 };
+    char request[1024], header[128];
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *fp;
+    int fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // only the request line matters, the rest is not waited for
+    if (recv(fd, request, sizeof(request) - 1, 0) > 0 && (fp = open_memstream(&body, &body_len)) != NULL)
+    {
+        metrics_write_prometheus(fp);
+        fclose(fp);
+
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+        if (send(fd, header, strlen(header), MSG_NOSIGNAL) > 0)
+            send(fd, body, body_len, MSG_NOSIGNAL);
+        free(body);
+    }
+    close(fd);
+}
+#endif
+
+static void *exporter_worker(void *arg)
+{
+    exporter_t *st = arg;
+    uint64_t next = timing_now();
+
+    while (running)
+    {
+        int timeout = -1;
+
+        if (st->fp)
+        {
+            uint64_t now = timing_now();
+
+            if (now >= next)
+            {
+                metrics_write_json(st->fp);
+                fflush(st->fp);
+                next += st->interval * 1e9;
+                if (next < now)
+                    next = now + st->interval * 1e9;
+            }
+            timeout = (next - now) / 1000000 + 1;
+        }
+
+#ifdef HAVE_SYS_SOCKET_H
+        struct pollfd fds[2] = {
+            { st->wake_fd[0], POLLIN, 0 },
+            { st->listen_fd, POLLIN, 0 },
+        };
+
+        if (poll(fds, st->listen_fd >= 0 ? 2 : 1, timeout) > 0 && (fds[1].revents & POLLIN))
+            serve_http(st->listen_fd);
+#else
+        // without a wake-up pipe, check for metrics_stop ten times a second
+        struct timespec ts = { 0, 100000000 };
+
+        if (timeout >= 0 && timeout < 100)
+            ts.tv_nsec = timeout * 1000000;
+        nanosleep(&ts, NULL);
+#endif
+    }
+
+    return NULL;
+}
+
+int metrics_start(FILE *fp, double interval, unsigned int port)
+{
+    exporter.fp = fp;
+    exporter.interval = interval;
+    exporter.listen_fd = -1;
+
+#ifdef HAVE_SYS_SOCKET_H
+    if (pipe(exporter.wake_fd) != 0)
+        return -1;
+    if (port && (exporter.listen_fd = listen_http(port)) < 0)
+    {
+        log_error("Unable to listen on port %u", port);
+        close(exporter.wake_fd[0]);
+        close(exporter.wake_fd[1]);
+        return -1;
+    }
+#else
+    if (port)
+    {
+        log_error("Metrics over HTTP are not supported on this platform");
+        return -1;
+    }
+#endif
+
+    timing_enable(1);
+    running = 1;
+    pthread_create(&exporter.thread, NULL, exporter_worker, &exporter);
+#ifdef HAVE_PTHREAD_SETNAME_NP
+    pthread_setname_np(exporter.thread, "metrics");
+#endif
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (!running)
+        return;
+
+    running = 0;
+#ifdef HAVE_SYS_SOCKET_H
+    if (write(exporter.wake_fd[1], "", 1) < 0)
+        log_warn("Unable to wake the metrics thread");
+#endif
+    pthread_join(exporter.thread, NULL);
+
+    // the final values, once every receiver has finished
+    if (exporter.fp)
+    {
+        metrics_write_json(exporter.fp);
+        fflush(exporter.fp);
+    }
+#ifdef HAVE_SYS_SOCKET_H
+    if (exporter.listen_fd >= 0)
+        close(exporter.listen_fd);
+    close(exporter.wake_fd[0]);
+    close(exporter.wake_fd[1]);
+#endif
+}
+#endif
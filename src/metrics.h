@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+
+// events counted since the process started
+typedef enum
+{
+    METRICS_INPUT_SAMPLES,
+    METRICS_SYNC_LOST,
+    METRICS_FRAMES,
+    METRICS_CRC_ERRORS,
+    METRICS_PSD_CRC_ERRORS,
+    METRICS_RS_CORRECTED,
+    METRICS_RS_FAILURES,
+    METRICS_AUDIO_PACKETS,
+    METRICS_AUDIO_UNDERRUNS,
+    METRICS_AUDIO_DROPPED,
+    METRICS_COUNTERS
+} metrics_counter_t;
+
+// last reported values, from whichever receiver reported last
+typedef enum
+{
+    METRICS_SYNC,
+    METRICS_MER_LOWER,
+    METRICS_MER_UPPER,
+    METRICS_BER,
+    METRICS_CFO,
+    METRICS_GAUGES
+} metrics_gauge_t;
+
+extern atomic_uint_fast64_t metrics_counters[METRICS_COUNTERS];
+
+/*
+ * Process-wide counters, gauges and stage timings of every receiver, with
+ * the depth of the thread queues. Updates are single atomic operations, so
+ * they are always made. An exporter thread writes them as JSON lines and
+ * serves them over HTTP in the Prometheus text format.
+ */
+static inline void metrics_count(metrics_counter_t counter, unsigned int n)
+{
+    atomic_fetch_add_explicit(&metrics_counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_set(metrics_gauge_t gauge, float value);
+// one JSON object on a line
+void metrics_write_json(FILE *fp);
+void metrics_write_prometheus(FILE *fp);
+
+#ifdef USE_THREADS
+struct queue_t;
+
+// queues report their depth while registered, done by queue_init and queue_free
+void metrics_add_queue(struct queue_t *q, const char *name);
+void metrics_remove_queue(struct queue_t *q);
+
+// write to fp every interval seconds if fp is set, and listen for HTTP on
+// port if it is not 0, enabling the stage timings; returns 0 on success
+int metrics_start(FILE *fp, double interval, unsigned int port);
+void metrics_stop(void);
+#endif
@@ -0,0 +1,189 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef HAVE_SSE2_TARGET
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+#include "cpu.h"
+#include "mixer.h"
+
+static void mix_generic(const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate)
+{
+    const float *wf = (const float *) w;
+    float *yf = (float *) y;
+    float pr = crealf(phase), pi = cimagf(phase);
+
+    for (unsigned int j = 0; j < n; j++)
+    {
+        float xr = x[j].r, xi = x[j].i;
+        float ar = xr * wf[j * 2] - xi * wf[j * 2 + 1];
+        float ai = xr * wf[j * 2 + 1] + xi * wf[j * 2];
+        float br = ar * pr - ai * pi;
+        float bi = ar * pi + ai * pr;
+
+        if (accumulate)
+        {
+            yf[j * 2] += br;
+            yf[j * 2 + 1] += bi;
+        }
+        else
+        {
+            yf[j * 2] = br;
+            yf[j * 2 + 1] = bi;
+        }
+    }
+}
+
+#ifdef HAVE_NEON
+static void mix_neon(const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate)
+{
+    float pr = crealf(phase), pi = cimagf(phase);
+    unsigned int j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        int16x4x2_t v = vld2_s16((const int16_t *)&x[j]);
+        float32x4_t xr = vcvtq_f32_s32(vmovl_s16(v.val[0]));
+        float32x4_t xi = vcvtq_f32_s32(vmovl_s16(v.val[1]));
+        float32x4x2_t t = vld2q_f32((const float *)&w[j]);
+        float32x4_t ar = vmlsq_f32(vmulq_f32(xr, t.val[0]), xi, t.val[1]);
+        float32x4_t ai = vmlaq_f32(vmulq_f32(xr, t.val[1]), xi, t.val[0]);
+        float32x4x2_t out;
+
+        out.val[0] = vmlsq_n_f32(vmulq_n_f32(ar, pr), ai, pi);
+        out.val[1] = vmlaq_n_f32(vmulq_n_f32(ar, pi), ai, pr);
+        if (accumulate)
+        {
+            float32x4x2_t prev = vld2q_f32((const float *)&y[j]);
+            out.val[0] = vaddq_f32(out.val[0], prev.val[0]);
+            out.val[1] = vaddq_f32(out.val[1], prev.val[1]);
+        }
+        vst2q_f32((float *)&y[j], out);
+    }
+    mix_generic(x + j, w + j, phase, y + j, n - j, accumulate);
+}
+#endif
+
+#ifdef HAVE_SSE2_TARGET
+// multiply two complex samples per register
+__attribute__((target("sse2")))
+static inline __m128 cmul_sse2(__m128 a, __m128 b)
+{
+    __m128 br = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128 bi = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128 swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+
+    swapped = _mm_xor_ps(swapped, _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f));
+    return _mm_add_ps(_mm_mul_ps(a, br), _mm_mul_ps(swapped, bi));
+}
+
+__attribute__((target("sse2")))
+static void mix_sse2(const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate)
+{
+    __m128 p = _mm_set_ps(cimagf(phase), crealf(phase), cimagf(phase), crealf(phase));
+    unsigned int j;
+
+    for (j = 0; j + 2 <= n; j += 2)
+    {
+        __m128i v = _mm_loadl_epi64((const __m128i *)&x[j]);
+        __m128 xf = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        __m128 out = cmul_sse2(cmul_sse2(xf, _mm_loadu_ps((const float *)&w[j])), p);
+
+        if (accumulate)
+            out = _mm_add_ps(out, _mm_loadu_ps((const float *)&y[j]));
+        _mm_storeu_ps((float *)&y[j], out);
+    }
+    mix_generic(x + j, w + j, phase, y + j, n - j, accumulate);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+// multiply four complex samples per register
+__attribute__((target("avx2")))
+static inline __m256 cmul_avx2(__m256 a, __m256 b)
+{
+    __m256 swapped = _mm256_permute_ps(a, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm256_addsub_ps(_mm256_mul_ps(a, _mm256_moveldup_ps(b)),
+                            _mm256_mul_ps(swapped, _mm256_movehdup_ps(b)));
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate)
+{
+    __m256 p = _mm256_setr_ps(crealf(phase), cimagf(phase), crealf(phase), cimagf(phase),
+                              crealf(phase), cimagf(phase), crealf(phase), cimagf(phase));
+    unsigned int j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&x[j]);
+        __m256 xf = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        __m256 out = cmul_avx2(cmul_avx2(xf, _mm256_loadu_ps((const float *)&w[j])), p);
+
+        if (accumulate)
+            out = _mm256_add_ps(out, _mm256_loadu_ps((const float *)&y[j]));
+        _mm256_storeu_ps((float *)&y[j], out);
+    }
+    mix_generic(x + j, w + j, phase, y + j, n - j, accumulate);
+}
+#endif
+
+static const struct {
+    const char *name;
+    unsigned int features;
+    void (*mix)(const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate);
+} kernels[] = {
+#ifdef HAVE_NEON
+    { "neon", CPU_NEON, mix_neon },
+#endif
+#ifdef HAVE_AVX2_TARGET
+    { "avx2", CPU_AVX2, mix_avx2 },
+#endif
+#ifdef HAVE_SSE2_TARGET
+    { "sse2", CPU_SSE2, mix_sse2 },
+#endif
+    { "generic", 0, mix_generic },
+};
+
+int mixer_select_kernel(void)
+{
+    unsigned int features = cpu_features();
+    int i = 0;
+
+    while ((kernels[i].features & features) != kernels[i].features)
+        i++;
+
+    return i;
+}
+
+const char *mixer_kernel_name(void)
+{
+    return kernels[mixer_select_kernel()].name;
+}
+
+void mixer_execute(int kernel, const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate)
+{
+    kernels[kernel].mix(x, w, phase, y, n, accumulate);
+}
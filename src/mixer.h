@@ -0,0 +1,9 @@
+#pragma once
+
+#include "defines.h"
+
+// index of the mixer kernel for the running CPU, passed to mixer_execute
+int mixer_select_kernel(void);
+const char *mixer_kernel_name(void);
+// y = phase * w * x for n Q15 samples, or added to y when accumulate is set
+void mixer_execute(int kernel, const cint16_t *x, const float complex *w, float complex phase, float complex *y, unsigned int n, int accumulate);
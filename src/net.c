@@ -0,0 +1,219 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "defines.h"
+#include "net.h"
+
+// Icecast's default port
+#define HTTP_DEFAULT_PORT "8000"
+// how long an Icecast server may take to accept the stream
+#define HTTP_TIMEOUT 5
+
+int net_is_url(const char *name)
+{
+    return strncmp(name, "udp://", 6) == 0 || strncmp(name, "http://", 7) == 0;
+}
+
+#ifdef HAVE_SYS_SOCKET_H
+// split host:port or [host]:port, the result has to be freed
+static char *split_address(const char *address, const char **port)
+{
+    const char *end, *colon;
+    char *host;
+
+    if (address[0] == '[' && (end = strchr(address, ']')) != NULL)
+    {
+        host = strndup(address + 1, end - address - 1);
+        if (end[1] == ':')
+            *port = end + 2;
+        return host;
+    }
+
+    // more than one colon is a bare IPv6 address
+    colon = strchr(address, ':');
+    if (colon && strchr(colon + 1, ':') == NULL)
+    {
+        *port = colon + 1;
+        return strndup(address, colon - address);
+    }
+    return strdup(address);
+}
+
+int net_connect(const char *address, const char *default_port, int datagram)
+{
+    struct addrinfo hints, *res, *ai;
+    const char *port = default_port;
+    char *host = split_address(address, &port);
+    int fd = -1, size = NET_SOCKET_BUFFER, err;
+
+    if (port == NULL)
+    {
+        log_error("No port given for %s", address);
+        free(host);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = datagram ? SOCK_DGRAM : SOCK_STREAM;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0)
+    {
+        log_error("Unable to resolve %s: %s", host, gai_strerror(err));
+        free(host);
+        return -1;
+    }
+    free(host);
+
+    for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        // the kernel may cap these, which is not an error
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        log_error("Unable to connect to %s", address);
+    return fd;
+}
+
+static void base64_encode(const char *in, char *out)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i, len = strlen(in);
+
+    for (i = 0; i < len; i += 3)
+    {
+        unsigned int v = (uint8_t) in[i] << 16;
+        if (i + 1 < len) v |= (uint8_t) in[i + 1] << 8;
+        if (i + 2 < len) v |= (uint8_t) in[i + 2];
+
+        *out++ = table[(v >> 18) & 63];
+        *out++ = table[(v >> 12) & 63];
+        *out++ = (i + 1 < len) ? table[(v >> 6) & 63] : '=';
+        *out++ = (i + 2 < len) ? table[v & 63] : '=';
+    }
+    *out = 0;
+}
+
+// the PUT of Icecast 2.4, the body is the stream and is never finished
+static int http_push(const char *url, const char *content_type)
+{
+    struct timeval timeout = { HTTP_TIMEOUT, 0 };
+    const char *p = url + 7, *at, *slash;
+    char *address, *request, response[512];
+    char credentials[256], auth[512] = "";
+    size_t len = 0;
+    int fd, status = 0;
+
+    slash = strchr(p, '/');
+    if (slash == NULL)
+        slash = p + strlen(p);
+    at = memchr(p, '@', slash - p);
+    if (at)
+    {
+        // a password alone is the one of the source user
+        if (memchr(p, ':', at - p))
+            snprintf(credentials, sizeof(credentials), "%.*s", (int) (at - p), p);
+        else
+            snprintf(credentials, sizeof(credentials), "source:%.*s", (int) (at - p), p);
+        strcpy(auth, "Authorization: Basic ");
+        base64_encode(credentials, auth + strlen(auth));
+        strcat(auth, "\r\n");
+        p = at + 1;
+    }
+    address = strndup(p, slash - p);
+    fd = net_connect(address, HTTP_DEFAULT_PORT, 0);
+    if (fd < 0)
+    {
+        free(address);
+        return -1;
+    }
+
+    request = malloc(strlen(address) + strlen(slash) + strlen(auth) + strlen(content_type) + 128);
+    sprintf(request,
+            "PUT %s HTTP/1.1\r\nHost: %s\r\n%sContent-Type: %s\r\nUser-Agent: nrsc5\r\nIce-Public: 0\r\n\r\n",
+            *slash ? slash : "/", address, auth, content_type);
+    free(address);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (send(fd, request, strlen(request), MSG_NOSIGNAL) > 0)
+    {
+        // only the status line matters, the server sends nothing else before the stream
+        while (len < sizeof(response) - 1)
+        {
+            ssize_t n = recv(fd, response + len, sizeof(response) - 1 - len, 0);
+            if (n <= 0)
+                break;
+            len += n;
+            response[len] = 0;
+            if (strstr(response, "\r\n\r\n"))
+                break;
+        }
+        response[len] = 0;
+        sscanf(response, "HTTP/%*s %d", &status);
+    }
+    free(request);
+
+    if (status != 200)
+    {
+        log_error("Icecast server refused the stream (%d)", status);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int net_open_stream(const char *url, const char *content_type)
+{
+    if (strncmp(url, "udp://", 6) == 0)
+        return net_connect(url + 6, NULL, 1);
+    if (strncmp(url, "http://", 7) == 0)
+        return http_push(url, content_type);
+    return -1;
+}
+#else
+int net_connect(const char *address, const char *default_port, int datagram)
+{
+    log_error("Network connections are not supported on this platform");
+    return -1;
+}
+
+int net_open_stream(const char *url, const char *content_type)
+{
+    log_error("Network connections are not supported on this platform");
+    return -1;
+}
+#endif
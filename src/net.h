@@ -0,0 +1,17 @@
+#pragma once
+
+#include "config.h"
+
+// kernel buffer asked for on sample and audio sockets, so bursts survive a busy decoder
+#define NET_SOCKET_BUFFER (8 * 1024 * 1024)
+
+// connect to host:port, or [host]:port for IPv6, over TCP or UDP, returns -1 on error
+int net_connect(const char *address, const char *default_port, int datagram);
+// whether name is a udp:// or http:// address instead of a path
+int net_is_url(const char *name);
+/*
+ * Open an audio stream to udp://host:port, one ADTS frame per datagram, or
+ * push it to an Icecast mount at http://[user:password@]host:port/mount.
+ * Returns the connected socket, or -1 on error.
+ */
+int net_open_stream(const char *url, const char *content_type);
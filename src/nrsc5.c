@@ -0,0 +1,76 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "input.h"
+#include "nrsc5.h"
+
+struct nrsc5_t
+{
+    input_t input;
+    output_t outputs[MAX_PROGRAMS];
+    unsigned int num_outputs;
+};
+
+int nrsc5_open(nrsc5_t **pst, unsigned int program)
+{
+    nrsc5_t *st = calloc(1, sizeof(*st));
+
+    if (st == NULL)
+        return 1;
+
+    output_init_callback(&st->outputs[0]);
+    input_init(&st->input, &st->outputs[0], 0, program, NULL);
+    st->num_outputs = 1;
+
+    *pst = st;
+    return 0;
+}
+
+int nrsc5_add_program(nrsc5_t *st, unsigned int program)
+{
+    output_t *output;
+
+    if (st->num_outputs == MAX_PROGRAMS)
+        return 1;
+
+    output = &st->outputs[st->num_outputs++];
+    output_init_callback(output);
+    input_add_output(&st->input, output, program);
+    return 0;
+}
+
+void nrsc5_set_callback(nrsc5_t *st, nrsc5_callback_t callback, void *opaque)
+{
+    input_set_event_callback(&st->input, callback, opaque);
+}
+
+void nrsc5_push_samples(nrsc5_t *st, const uint8_t *samples, unsigned int length)
+{
+    // input_cb only reads the samples, its signature comes from librtlsdr
+    input_cb((uint8_t *) samples, length, &st->input);
+}
+
+void nrsc5_close(nrsc5_t *st)
+{
+    unsigned int i;
+
+    input_finish(&st->input);
+    input_free(&st->input);
+    for (i = 0; i < st->num_outputs; i++)
+        output_free(&st->outputs[i]);
+    free(st);
+}
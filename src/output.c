@@ -16,14 +16,17 @@
 #include "config.h"
 
 #include <assert.h>
-#include <errno.h>
+#include <limits.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "bitreader.h"
 #include "bitwriter.h"
 #include "defines.h"
+#include "input.h"
+#include "metrics.h"
+#include "net.h"
 #include "output.h"
+#include "timing.h"
 
 #ifdef USE_FAAD2
 static ao_sample_format sample_format = {
@@ -35,14 +38,16 @@ static ao_sample_format sample_format = {
 };
 #endif
 
-void hdc_to_aac(bitreader_t *br, bitwriter_t *bw);
+void hdc_to_aac_init(void);
+int hdc_to_aac(bitreader_t *br, bitwriter_t *bw);
+static void release_port(output_t *st, aas_port_t *port);
 
-static void write_adts_header(FILE *fp, unsigned int len)
+static void write_adts_header(writer_t *w, unsigned int len)
 {
     uint8_t hdr[7];
     bitwriter_t bw;
 
-    bw_init(&bw, hdr);
+    bw_init(&bw, hdr, sizeof(hdr));
     bw_addbits(&bw, 0xFFF, 12); // sync word
     bw_addbits(&bw, 0, 1); // MPEG-4
     bw_addbits(&bw, 0, 2); // Layer
@@ -59,50 +64,38 @@ static void write_adts_header(FILE *fp, unsigned int len)
     bw_addbits(&bw, 0x7FF, 11); // buffer fullness (VBR)
     bw_addbits(&bw, 0, 2); // 1 AAC frame per ADTS frame
 
-    fwrite(hdr, 7, 1, fp);
+    writer_write(w, hdr, sizeof(hdr));
 }
 
-static void dump_adts(FILE *fp, uint8_t *pkt, unsigned int len)
+static void dump_adts(writer_t *w, uint8_t *pkt, unsigned int len)
 {
     uint8_t tmp[1024];
     bitreader_t br;
     bitwriter_t bw;
 
+    uint64_t start = timing_start();
+
     br_init(&br, pkt, len);
-    bw_init(&bw, tmp);
-    hdc_to_aac(&br, &bw);
+    bw_init(&bw, tmp, sizeof(tmp));
+    int error = hdc_to_aac(&br, &bw);
     len = bw_flush(&bw);
+    timing_stop(TIMING_HDC_TO_AAC, start);
+    if (error || bw.error)
+    {
+        log_debug("Dropping invalid audio packet.");
+        return;
+    }
 
-    write_adts_header(fp, len);
-    fwrite(tmp, len, 1, fp);
-    fflush(fp);
+    write_adts_header(w, len);
+    writer_write(w, tmp, len);
+    writer_flush(w);
 }
 
-static void dump_hdc(FILE *fp, uint8_t *pkt, unsigned int len)
+static void dump_hdc(writer_t *w, uint8_t *pkt, unsigned int len)
 {
-    write_adts_header(fp, len);
-    fwrite(pkt, len, 1, fp);
-    fflush(fp);
-}
-
-void output_reset_buffers(output_t *st)
-{
-#ifdef USE_THREADS
-    output_buffer_t *ob;
-
-    // find the end of the head list
-    for (ob = st->head; ob && ob->next; ob = ob->next) { }
-
-    // if the head list is non-empty, prepend to free list
-    if (ob != NULL)
-    {
-        ob->next = st->free;
-        st->free = st->head;
-    }
-
-    st->head = NULL;
-    st->tail = NULL;
-#endif
+    write_adts_header(w, len);
+    writer_write(w, pkt, len);
+    writer_flush(w);
 }
 
 void audio_play(output_t *st, void *buffer)
@@ -112,7 +105,7 @@ void audio_play(output_t *st, void *buffer)
     {
         uint8_t silence[AUDIO_FRAME_BYTES];
         memset(silence, 0, sizeof(silence));
-        for (i = 0; i < LATENCY_FRAMES; i++)
+        for (i = 0; i < st->latency; i++)
             ao_play(st->dev, (void *)silence, sizeof(silence));
         st->first_audio_packet = 0;
     }
@@ -123,6 +116,7 @@ void output_push(output_t *st, uint8_t *pkt, unsigned int len, unsigned int prog
 {
     if (program != st->program) return;
 
+    metrics_count(METRICS_AUDIO_PACKETS, 1);
     st->audio_packets++;
     st->audio_bytes += len;
     if (st->audio_packets >= 32) {
@@ -133,12 +127,12 @@ void output_push(output_t *st, uint8_t *pkt, unsigned int len, unsigned int prog
 
     if (st->method == OUTPUT_ADTS)
     {
-        dump_adts(st->outfp, pkt, len);
+        dump_adts(&st->writer, pkt, len);
         return;
     }
     else if (st->method == OUTPUT_HDC)
     {
-        dump_hdc(st->outfp, pkt, len);
+        dump_hdc(&st->writer, pkt, len);
         return;
     }
 
@@ -146,7 +140,10 @@ void output_push(output_t *st, uint8_t *pkt, unsigned int len, unsigned int prog
     void *buffer;
     NeAACDecFrameInfo info;
 
+    uint64_t start = timing_start();
+
     buffer = NeAACDecDecode(st->handle, &info, pkt, len);
+    timing_stop(TIMING_AAC, start);
     if (info.error > 0)
     {
         log_error("Decode error: %s", NeAACDecGetErrorMessage(info.error));
@@ -155,46 +152,34 @@ void output_push(output_t *st, uint8_t *pkt, unsigned int len, unsigned int prog
     if (info.error == 0 && info.samples > 0)
     {
         unsigned int bytes = info.samples * sample_format.bits / 8;
-        output_buffer_t *ob;
+        nrsc5_event_t evt;
 
         assert(bytes == AUDIO_FRAME_BYTES);
 
-#ifdef USE_THREADS
-        struct timespec ts;
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        ts.tv_sec = now.tv_sec;
-        ts.tv_nsec = (now.tv_usec + 100000) * 1000;
-        if (ts.tv_nsec >= 1000000000)
-        {
-            ts.tv_nsec -= 1000000000;
-            ts.tv_sec += 1;
-        }
+        evt.event = NRSC5_EVENT_AUDIO;
+        evt.audio.program = program;
+        evt.audio.data = buffer;
+        evt.audio.count = info.samples;
+        input_event(st->input, &evt);
+
+        if (st->method == OUTPUT_CALLBACK)
+            return;
 
-        pthread_mutex_lock(&st->mutex);
-        while (st->free == NULL)
+#ifdef USE_THREADS
+        // a live device plays at its own pace, drop the frame rather than stall the decoder
+        uint8_t *slot = queue_reserve(&st->audio_queue, st->method != OUTPUT_LIVE);
+        if (slot == NULL)
         {
-            if (pthread_cond_timedwait(&st->cond, &st->mutex, &ts) == ETIMEDOUT)
-            {
-                log_warn("Audio output timed out, dropping samples");
-                output_reset_buffers(st);
-            }
+            if (!st->dropping)
+                log_warn("Audio output is behind, dropping samples");
+            st->dropping = 1;
+            metrics_count(METRICS_AUDIO_DROPPED, 1);
+            return;
         }
-        ob = st->free;
-        st->free = ob->next;
-        pthread_mutex_unlock(&st->mutex);
+        st->dropping = 0;
 
-        memcpy(ob->data, buffer, bytes);
-
-        pthread_mutex_lock(&st->mutex);
-        ob->next = NULL;
-        if (st->tail)
-            st->tail->next = ob;
-        else
-            st->head = ob;
-        st->tail = ob;
-        pthread_mutex_unlock(&st->mutex);
-        pthread_cond_signal(&st->cond);
+        memcpy(slot, buffer, bytes);
+        queue_commit(&st->audio_queue, bytes);
 #else
         audio_play(st, buffer);
 #endif
@@ -203,32 +188,86 @@ void output_push(output_t *st, uint8_t *pkt, unsigned int len, unsigned int prog
 }
 
 #if defined(USE_FAAD2) && defined(USE_THREADS)
+// frames of live audio between adjustments of the latency, about 6 seconds
+#define LATENCY_WINDOW 128
+// queued frames above the target that are left alone
+#define LATENCY_HYSTERESIS 2
+// windows without an underrun before the target is lowered again
+#define LATENCY_DECAY 16
+
 static void *output_worker(void *arg)
 {
     output_t *st = arg;
+    uint8_t silence[AUDIO_FRAME_BYTES];
+    unsigned int target = st->latency, low = UINT_MAX, frames = 0, windows = 0;
+    int started = 0;
+    uint8_t *data;
+    unsigned int len;
+
+    memset(silence, 0, sizeof(silence));
 
     while (1)
     {
-        output_buffer_t *ob;
+        unsigned int depth = queue_depth(&st->audio_queue);
 
-        pthread_mutex_lock(&st->mutex);
-        while (st->head == NULL)
-            pthread_cond_wait(&st->cond, &st->mutex);
-        // unlink from head list
-        ob = st->head;
-        st->head = ob->next;
-        if (st->head == NULL)
-            st->tail = NULL;
-        pthread_mutex_unlock(&st->mutex);
+        if (st->method == OUTPUT_LIVE && depth == 0)
+        {
+            // the device is about to run dry, start over with more buffered frames
+            data = queue_peek(&st->audio_queue, &len);
+            if (data == NULL)
+                break;
+            if (started)
+            {
+                target = target + target / 2 + 1;
+                if (target > AUDIO_QUEUE_FRAMES / 2)
+                    target = AUDIO_QUEUE_FRAMES / 2;
+                log_debug("Audio underrun, latency now %u frames", target);
+                metrics_count(METRICS_AUDIO_UNDERRUNS, 1);
+            }
+            started = 1;
+            windows = 0;
+            frames = 0;
+            low = UINT_MAX;
+
+            for (unsigned int i = 0; i < target; i++)
+                ao_play(st->dev, (void *)silence, sizeof(silence));
+        }
+        else
+        {
+            data = queue_peek(&st->audio_queue, &len);
+            if (data == NULL)
+                break;
+        }
 
-        audio_play(st, ob->data);
+        if (st->method == OUTPUT_LIVE)
+        {
+            // the lowest level between two bursts of the decoder is the spare latency
+            if (depth < low)
+                low = depth;
+            if (++frames == LATENCY_WINDOW)
+            {
+                int drop = low > target + LATENCY_HYSTERESIS;
+
+                if (++windows == LATENCY_DECAY)
+                {
+                    if (target > st->latency)
+                        target--;
+                    windows = 0;
+                }
+                frames = 0;
+                low = UINT_MAX;
+
+                // skip one frame to bring the latency down
+                if (drop)
+                {
+                    queue_pop(&st->audio_queue);
+                    continue;
+                }
+            }
+        }
 
-        pthread_mutex_lock(&st->mutex);
-        // add to free list
-        ob->next = st->free;
-        st->free = ob;
-        pthread_mutex_unlock(&st->mutex);
-        pthread_cond_signal(&st->cond);
+        ao_play(st->dev, (void *)data, len);
+        queue_pop(&st->audio_queue);
     }
 
     return NULL;
@@ -255,42 +294,102 @@ void output_reset(output_t *st)
 
     unsigned long samprate = 22050;
     NeAACDecInitHDC(&st->handle, &samprate);
-
-    output_reset_buffers(st);
 #endif
 }
 
-void output_init_adts(output_t *st, const char *name)
+// a file, stdout, or a network stream, like a pipe its audio is sent on every writer_flush
+static void open_stream(output_t *st, const char *name, const char *content_type)
 {
-    st->method = OUTPUT_ADTS;
-
     if (strcmp(name, "-") == 0)
+    {
         st->outfp = stdout;
+    }
+    else if (net_is_url(name))
+    {
+        int fd = net_open_stream(name, content_type);
+
+        st->outfp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    }
     else
+    {
         st->outfp = fopen(name, "wb");
+    }
+    if (st->outfp)
+        writer_init(&st->writer, st->outfp, 0);
+}
+
+void output_init_adts(output_t *st, const char *name)
+{
+    st->method = OUTPUT_ADTS;
+    hdc_to_aac_init();
+
+    open_stream(st, name, "audio/aac");
     if (st->outfp == NULL)
         FATAL_EXIT("Unable to open output adts file.");
+
+    st->aas_files_path = NULL;
+    st->ports_logged = 0;
 }
 
 void output_init_hdc(output_t *st, const char *name)
 {
     st->method = OUTPUT_HDC;
 
-    if (strcmp(name, "-") == 0)
-        st->outfp = stdout;
-    else
-        st->outfp = fopen(name, "wb");
+    open_stream(st, name, "application/octet-stream");
     if (st->outfp == NULL)
         FATAL_EXIT("Unable to open output adts-hdc file.");
 
     st->aas_files_path = NULL;
+    st->ports_logged = 0;
 }
 
+void output_init_callback(output_t *st)
+{
+    st->method = OUTPUT_CALLBACK;
+
 #ifdef USE_FAAD2
-static void output_init_ao(output_t *st, int driver, const char *name)
+    st->handle = NULL;
+#endif
+    output_reset(st);
+
+    st->aas_files_path = NULL;
+    st->ports_logged = 0;
+}
+
+void output_free(output_t *st)
 {
     unsigned int i;
 
+    if (st->method == OUTPUT_ADTS || st->method == OUTPUT_HDC)
+    {
+        writer_free(&st->writer);
+        if (st->outfp != stdout)
+            fclose(st->outfp);
+    }
+    for (i = 0; i < MAX_PORTS; i++)
+        release_port(st, &st->ports[i]);
+    if (st->aas_files_path)
+        writer_free(&st->aas_writer);
+#ifdef USE_FAAD2
+    if (st->method == OUTPUT_WAV || st->method == OUTPUT_LIVE)
+    {
+#ifdef USE_THREADS
+        // play what is queued before closing the device
+        queue_close(&st->audio_queue);
+        pthread_join(st->worker_thread, NULL);
+        queue_free(&st->audio_queue);
+#endif
+        ao_close(st->dev);
+    }
+    if (st->method != OUTPUT_ADTS && st->method != OUTPUT_HDC && st->handle)
+        NeAACDecClose(st->handle);
+#endif
+    free(st->aas_files_path);
+}
+
+#ifdef USE_FAAD2
+static void output_init_ao(output_t *st, int driver, const char *name)
+{
     if (name)
         st->dev = ao_open_file(driver, name, 1, &sample_format, NULL);
     else
@@ -299,19 +398,8 @@ static void output_init_ao(output_t *st, int driver, const char *name)
         FATAL_EXIT("Unable to open output wav file.");
 
 #ifdef USE_THREADS
-    st->head = NULL;
-    st->tail = NULL;
-    st->free = NULL;
-
-    for (i = 0; i < 32; ++i)
-    {
-        output_buffer_t *ob = malloc(sizeof(output_buffer_t));
-        ob->next = st->free;
-        st->free = ob;
-    }
-
-    pthread_cond_init(&st->cond, NULL);
-    pthread_mutex_init(&st->mutex, NULL);
+    queue_init(&st->audio_queue, "audio", AUDIO_QUEUE_FRAMES, AUDIO_FRAME_BYTES);
+    st->dropping = 0;
     pthread_create(&st->worker_thread, NULL, output_worker, st);
 #ifdef HAVE_PTHREAD_SETNAME_NP
     pthread_setname_np(st->worker_thread, "output");
@@ -321,22 +409,44 @@ static void output_init_ao(output_t *st, int driver, const char *name)
     st->handle = NULL;
     output_reset(st);
 
+    st->first_audio_packet = 1;
     st->aas_files_path = NULL;
+    st->ports_logged = 0;
+}
+
+// several outputs may use libao, which only needs to be initialized once
+#ifdef USE_THREADS
+static pthread_once_t ao_once = PTHREAD_ONCE_INIT;
+#else
+static int ao_initialized;
+#endif
+
+static void init_ao_library(void)
+{
+#ifdef USE_THREADS
+    pthread_once(&ao_once, ao_initialize);
+#else
+    if (!ao_initialized)
+        ao_initialize();
+    ao_initialized = 1;
+#endif
 }
 
 void output_init_wav(output_t *st, const char *name)
 {
     st->method = OUTPUT_WAV;
+    st->latency = 0;
 
-    ao_initialize();
+    init_ao_library();
     output_init_ao(st, ao_driver_id("wav"), name);
 }
 
-void output_init_live(output_t *st)
+void output_init_live(output_t *st, unsigned int latency)
 {
     st->method = OUTPUT_LIVE;
+    st->latency = latency;
 
-    ao_initialize();
+    init_ao_library();
     output_init_ao(st, ao_default_driver_id(), NULL);
 }
 #endif
@@ -365,9 +475,12 @@ static char *id3_text(uint8_t *buf, unsigned int frame_len)
     }
 }
 
-static void output_id3(uint8_t *buf, unsigned int len)
+static void output_id3(output_t *st, uint8_t *buf, unsigned int len)
 {
     unsigned int off = 0, id3_len;
+    char *title = NULL, *artist = NULL, *album = NULL, *genre = NULL;
+    nrsc5_event_t evt;
+
     if (len < 10 || memcmp(buf + off, "ID3\x03\x00", 5) || buf[off+5]) return;
     id3_len = id3_length(buf + 6) + 10;
     if (id3_len > len) return;
@@ -376,31 +489,31 @@ static void output_id3(uint8_t *buf, unsigned int len)
     while (off + 10 <= id3_len)
     {
         unsigned int frame_len = id3_length(buf + off + 4);
-        if (off + 10 + frame_len > id3_len) return;
+        if (off + 10 + frame_len > id3_len) break;
 
         if (memcmp(buf + off, "TIT2", 4) == 0)
         {
-            char *title = id3_text(buf + off + 10, frame_len);
-            log_debug("Title: %s", title);
             free(title);
+            title = id3_text(buf + off + 10, frame_len);
+            log_debug("Title: %s", title);
         }
         else if (memcmp(buf + off, "TPE1", 4) == 0)
         {
-            char *artist = id3_text(buf + off + 10, frame_len);
-            log_debug("Artist: %s", artist);
             free(artist);
+            artist = id3_text(buf + off + 10, frame_len);
+            log_debug("Artist: %s", artist);
         }
         else if (memcmp(buf + off, "TALB", 4) == 0)
         {
-            char *album = id3_text(buf + off + 10, frame_len);
-            log_debug("Album: %s", album);
             free(album);
+            album = id3_text(buf + off + 10, frame_len);
+            log_debug("Album: %s", album);
         }
         else if (memcmp(buf + off, "TCON", 4) == 0)
         {
-            char *genre = id3_text(buf + off + 10, frame_len);
-            log_debug("Genre: %s", genre);
             free(genre);
+            genre = id3_text(buf + off + 10, frame_len);
+            log_debug("Genre: %s", genre);
         }
         else if (memcmp(buf + off, "UFID", 4) == 0)
         {
@@ -465,12 +578,114 @@ static void output_id3(uint8_t *buf, unsigned int len)
 
         off += 10 + frame_len;
     }
+
+    evt.event = NRSC5_EVENT_ID3;
+    evt.id3.program = st->program;
+    evt.id3.title = title;
+    evt.id3.artist = artist;
+    evt.id3.album = album;
+    evt.id3.genre = genre;
+    input_event(st->input, &evt);
+
+    free(title);
+    free(artist);
+    free(album);
+    free(genre);
+}
+
+static unsigned int port_hash(uint16_t port_id)
+{
+    return (port_id ^ (port_id >> 6)) & (PORT_HASH_SIZE - 1);
+}
+
+static aas_port_t *find_port(output_t *st, uint16_t port_id)
+{
+    unsigned int h = port_hash(port_id);
+
+    while (st->port_hash[h])
+    {
+        aas_port_t *port = &st->ports[st->port_hash[h] - 1];
+        if (port->port == port_id)
+            return port;
+        h = (h + 1) & (PORT_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+static void rebuild_port_hash(output_t *st)
+{
+    memset(st->port_hash, 0, sizeof(st->port_hash));
+    for (unsigned int i = 0; i < MAX_PORTS; i++)
+    {
+        unsigned int h;
+
+        if (st->ports[i].port == 0)
+            continue;
+        for (h = port_hash(st->ports[i].port); st->port_hash[h]; h = (h + 1) & (PORT_HASH_SIZE - 1)) { }
+        st->port_hash[h] = i + 1;
+    }
+}
+
+void output_seed_port(output_t *st, uint16_t port_id, uint16_t pkt_size, uint8_t type, unsigned int service_data_type, unsigned int program)
+{
+    aas_port_t *port = find_port(st, port_id);
+
+    for (unsigned int i = 0; port == NULL && i < MAX_PORTS; i++)
+    {
+        if (st->ports[i].port == 0)
+            port = &st->ports[i];
+    }
+    if (port == NULL)
+        return;
+
+    port->port = port_id;
+    port->pkt_size = pkt_size;
+    port->type = type;
+    port->service_data_type = service_data_type;
+    port->program = program;
+    rebuild_port_hash(st);
+}
+
+static char *aas_path(output_t *st, const char *fname, const char *suffix)
+{
+#if defined(WIN32) || defined(_WIN32)
+#define PATH_SEPARATOR "\\"
+#else
+#define PATH_SEPARATOR "/"
+#endif
+    char *path = malloc(strlen(st->aas_files_path) + strlen(fname) + strlen(suffix) + 2);
+
+    sprintf(path, "%s" PATH_SEPARATOR "%s%s", st->aas_files_path, fname, suffix);
+    return path;
+}
+
+// give up on a file that is still being received
+static void abort_file(output_t *st, aas_port_t *port)
+{
+    if (port->u.file.streaming)
+    {
+        char *path = aas_path(st, port->u.file.name, ".part");
+        writer_remove_file(&st->aas_writer, path);
+        free(path);
+        port->u.file.streaming = 0;
+    }
+    port->u.file.seq = 0;
+    port->u.file.used = 0;
+}
+
+static void release_port(output_t *st, aas_port_t *port)
+{
+    abort_file(st, port);
+    free(port->u.file.name);
+    free(port->u.file.data);
+    memset(port, 0, sizeof(*port));
 }
 
 static void parse_port_info(output_t *st, uint8_t *buf, unsigned int len)
 {
-    static int dump = 1;
-    unsigned int idx = 0;
+    int dump = !st->ports_logged;
+    int announced[MAX_PORTS] = { 0 };
+    unsigned int i;
     unsigned int service_data_type = 0, program = 0;
     uint8_t *p = buf;
     while (p < buf + len)
@@ -501,8 +716,25 @@ static void parse_port_info(output_t *st, uint8_t *buf, unsigned int len)
             }
             else if (type == 0x67)
             {
-                aas_port_t *port = &st->ports[idx++];
-                port->port = *(uint16_t*)&p[1];
+                uint16_t port_id = *(uint16_t*)&p[1];
+                aas_port_t *port = find_port(st, port_id);
+
+                // a port keeps its slot, and the file it is receiving, while it is announced
+                for (i = 0; port == NULL && i < MAX_PORTS; i++)
+                {
+                    if (st->ports[i].port == 0 && !announced[i])
+                        port = &st->ports[i];
+                }
+                if (port == NULL)
+                {
+                    if (dump)
+                        log_warn("Too many AAS ports");
+                    p += l - 1;
+                    break;
+                }
+
+                announced[port - st->ports] = 1;
+                port->port = port_id;
                 port->pkt_size = *(uint16_t*)&p[3];
                 port->type = p[5];
                 port->service_data_type = service_data_type;
@@ -521,47 +753,93 @@ static void parse_port_info(output_t *st, uint8_t *buf, unsigned int len)
     }
 
 done:
-    // clear unused port structures
-    while (idx < MAX_PORTS)
+    // release ports that are no longer announced
+    for (i = 0; i < MAX_PORTS; i++)
     {
-        st->ports[idx++].port = 0;
+        if (!announced[i] && st->ports[i].port != 0)
+            release_port(st, &st->ports[i]);
     }
+    rebuild_port_hash(st);
 
     // only write to log once (contents should not change often)
-    if (dump)
-        dump = 0;
+    st->ports_logged = 1;
 }
 
-static void write_file(const char *dirpath, const char *fname, const uint8_t *buf, unsigned int len)
+// write the buffered part of a streamed file
+static void flush_file(output_t *st, aas_port_t *port)
 {
-#if defined(WIN32) || defined(_WIN32)
-#define PATH_SEPARATOR "\\"
-#else
-#define PATH_SEPARATOR "/"
-#endif
-    char fullpath[strlen(dirpath) + strlen(fname) + 2];
-    FILE *fp;
+    char *path = aas_path(st, port->u.file.name, ".part");
 
-    sprintf(fullpath, "%s" PATH_SEPARATOR "%s", dirpath, fname);
-    fp = fopen(fullpath, "wb");
-    if (fp == NULL)
+    if (port->u.file.idx == port->u.file.used)
+        writer_write_file(&st->aas_writer, path, port->u.file.data, port->u.file.used);
+    else
+        writer_append_file(&st->aas_writer, path, port->u.file.data, port->u.file.used);
+    free(path);
+    port->u.file.used = 0;
+}
+
+static void file_data(output_t *st, aas_port_t *port, const uint8_t *buf, unsigned int len)
+{
+    if (!port->u.file.streaming)
     {
-        log_warn("Failed to open %s (%d)", fullpath, errno);
+        if (port->u.file.used + len <= port->u.file.capacity)
+            memcpy(port->u.file.data + port->u.file.used, buf, len);
+        port->u.file.used += len;
+        port->u.file.idx += len;
         return;
     }
-    fwrite(buf, 1, len, fp);
-    fclose(fp);
+
+    while (len > 0)
+    {
+        unsigned int n = port->u.file.capacity - port->u.file.used;
+        if (n > len)
+            n = len;
+        memcpy(port->u.file.data + port->u.file.used, buf, n);
+        port->u.file.used += n;
+        port->u.file.idx += n;
+        buf += n;
+        len -= n;
+        if (port->u.file.used == port->u.file.capacity)
+            flush_file(st, port);
+    }
 }
 
-static aas_port_t *find_port(output_t *st, uint16_t port_id)
+static void file_complete(output_t *st, aas_port_t *port)
 {
-    unsigned int i;
-    for (i = 0; i < MAX_PORTS; i++)
+    log_info("Received %s, port %04X", port->u.file.name, port->port);
+
+    if (port->u.file.streaming)
     {
-        if (st->ports[i].port == port_id)
-            return &st->ports[i];
+        char *part = aas_path(st, port->u.file.name, ".part");
+        char *path = aas_path(st, port->u.file.name, "");
+
+        if (port->u.file.used)
+            flush_file(st, port);
+        writer_rename_file(&st->aas_writer, part, path);
+        free(part);
+        free(path);
+        port->u.file.streaming = 0;
     }
-    return NULL;
+    else if (st->method == OUTPUT_CALLBACK)
+    {
+        nrsc5_event_t evt;
+
+        evt.event = NRSC5_EVENT_AAS_FILE;
+        evt.aas_file.port = port->port;
+        evt.aas_file.name = port->u.file.name;
+        evt.aas_file.type = port->u.file.type;
+        evt.aas_file.data = port->u.file.data;
+        evt.aas_file.size = port->u.file.size;
+        input_event(st->input, &evt);
+
+        if (st->aas_files_path && (port->service_data_type != 0x40 || port->program == st->program))
+        {
+            char *path = aas_path(st, port->u.file.name, "");
+            writer_write_file(&st->aas_writer, path, port->u.file.data, port->u.file.idx);
+            free(path);
+        }
+    }
+    port->u.file.used = 0;
 }
 
 static void process_port(output_t *st, uint16_t port_id, uint8_t *buf, unsigned int len)
@@ -584,14 +862,16 @@ static void process_port(output_t *st, uint16_t port_id, uint8_t *buf, unsigned
         if (seq == 0)
         {
             uint8_t *p;
-            unsigned int namelen;
+            unsigned int namelen, capacity;
+
+            abort_file(st, port);
 
             p32 = (uint32_t *)buf;
             // unk (4 bytes)
             // unk (4 bytes)
             port->u.file.size = p32[2];
-            port->u.file.data = malloc(port->u.file.size);
             port->u.file.type = p32[3];
+            port->u.file.idx = 0;
             log_debug("%08X %08X %08X", p32[0], p32[1], p32[3]);
             buf += 16;
             len -= 16;
@@ -602,7 +882,11 @@ static void process_port(output_t *st, uint16_t port_id, uint8_t *buf, unsigned
             if (p == NULL)
             {
                 log_debug("File has invalid name");
-                port->u.file.seq = 0;
+                break;
+            }
+            if (port->u.file.size > AAS_MAX_FILE_SIZE)
+            {
+                log_debug("File too large (%u bytes)", port->u.file.size);
                 break;
             }
 
@@ -612,8 +896,23 @@ static void process_port(output_t *st, uint16_t port_id, uint8_t *buf, unsigned
             buf += namelen;
             len -= namelen;
 
-            memcpy(port->u.file.data, buf, len);
-            port->u.file.idx = len;
+            // only the API's event needs the whole file, otherwise it is streamed to disk
+            if (st->method == OUTPUT_CALLBACK)
+            {
+                capacity = port->u.file.size;
+            }
+            else
+            {
+                port->u.file.streaming = st->aas_files_path && (port->service_data_type != 0x40 || port->program == st->program);
+                capacity = port->u.file.streaming ? AAS_CHUNK : 0;
+            }
+            // the buffer of a port is kept for the next file
+            if (capacity > port->u.file.capacity)
+            {
+                free(port->u.file.data);
+                port->u.file.data = malloc(capacity);
+                port->u.file.capacity = capacity;
+            }
             port->u.file.seq = 1;
 
             log_info("File %s, size %d, port %04X", port->u.file.name, port->u.file.size, port->port);
@@ -621,29 +920,26 @@ static void process_port(output_t *st, uint16_t port_id, uint8_t *buf, unsigned
         else if (seq == port->u.file.seq)
         {
             port->u.file.seq++;
-            if (port->u.file.idx + len > port->u.file.size)
-            {
-                log_info("Port %04X (%d) overflowed", port->port, port->type);
-                break;
-            }
-            memcpy(port->u.file.data + port->u.file.idx, buf, len);
-            port->u.file.idx += len;
+        }
+        else
+        {
+            if (port->u.file.seq)
+                log_debug("%s expected %d, got %d", port->u.file.name, port->u.file.seq, seq);
+            break;
+        }
 
-            if (port->u.file.idx == port->u.file.size)
-            {
-                log_info("Received %s, port %04X", port->u.file.name, port->port);
-                if (st->aas_files_path)
-                {
-                    if (port->service_data_type != 0x40 || port->program == st->program)
-                    {
-                        write_file(st->aas_files_path, port->u.file.name, port->u.file.data, port->u.file.idx);
-                    }
-                }
-            }
+        if (port->u.file.idx + len > port->u.file.size)
+        {
+            log_info("Port %04X (%d) overflowed", port->port, port->type);
+            abort_file(st, port);
+            break;
         }
-        else if (port->u.file.size)
+        file_data(st, port, buf, len);
+
+        if (port->u.file.idx == port->u.file.size)
         {
-            log_debug("%s expected %d, got %d", port->u.file.name, port->u.file.seq, seq);
+            file_complete(st, port);
+            port->u.file.seq = 0;
         }
         break;
     }
@@ -659,10 +955,16 @@ void output_aas_push(output_t *st, uint8_t *buf, unsigned int len)
     if (port == 0x5100 || (port >= 0x5201 && port <= 0x5207))
     {
         // PSD ports
-        if ((port & 0x7) == st->program)
-            output_id3(buf + 4, len - 4);
+        if ((port & 0x7) == st->program && (st->input->profile & INPUT_PROFILE_PSD))
+            output_id3(st, buf + 4, len - 4);
+        return;
     }
-    else if (port == 0x20)
+
+    // the PSD stream also carries AAS packets, which the profile does not need
+    if (!(st->input->profile & INPUT_PROFILE_DATA))
+        return;
+
+    if (port == 0x20)
     {
         // AAS port information
         // FIXME: what is the last byte for?
@@ -686,6 +988,10 @@ void output_set_program(output_t *st, unsigned int program)
 
 void output_set_aas_files_path(output_t *st, const char *path)
 {
+    if (st->aas_files_path)
+        writer_free(&st->aas_writer);
     free(st->aas_files_path);
     st->aas_files_path = path == NULL ? NULL : strdup(path);
+    if (st->aas_files_path)
+        writer_init(&st->aas_writer, NULL, 0);
 }
@@ -9,26 +9,34 @@
 
 #ifdef USE_THREADS
 #include <pthread.h>
+
+#include "queue.h"
 #endif
+#include "writer.h"
 
 #define AUDIO_FRAME_BYTES 8192
+// default and minimum number of frames buffered ahead of live playback
 #define LATENCY_FRAMES 10
+// decoded frames waiting for the audio device, must be a power of two
+#define AUDIO_QUEUE_FRAMES 64
 #define MAX_PORTS 32
+// slots of the port id hash, a power of two above MAX_PORTS
+#define PORT_HASH_SIZE 64
+// AAS files are written to disk in pieces of this size
+#define AAS_CHUNK (64 * 1024)
+// larger announced files are ignored
+#define AAS_MAX_FILE_SIZE (16 * 1024 * 1024)
 
 typedef enum
 {
     OUTPUT_ADTS,
     OUTPUT_HDC,
     OUTPUT_WAV,
-    OUTPUT_LIVE
+    OUTPUT_LIVE,
+    // audio is only passed to the event callback
+    OUTPUT_CALLBACK
 } output_method_t;
 
-typedef struct output_buffer_t
-{
-    struct output_buffer_t *next;
-    uint8_t data[AUDIO_FRAME_BYTES];
-} output_buffer_t;
-
 typedef struct
 {
     uint16_t port;
@@ -43,34 +51,46 @@ typedef struct
         {
             char *name;
             uint32_t type;
+            // the whole file, or the part not yet written when streaming
             uint8_t *data;
+            unsigned int capacity;
+            unsigned int used;
             unsigned int size;
+            // bytes received
             unsigned int idx;
             unsigned int seq;
+            // the file is being appended to its .part file on disk
+            int streaming;
         } file;
     } u;
 } aas_port_t;
 
 typedef struct
 {
+    struct input_t *input;
     output_method_t method;
 
     FILE *outfp;
+    writer_t writer;
 
 #ifdef HAVE_FAAD2
     ao_device *dev;
     NeAACDecHandle handle;
 #endif
 #ifdef USE_THREADS
-    output_buffer_t *head, *tail, *free;
+    queue_t audio_queue;
     pthread_t worker_thread;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    int dropping;
 #endif
+    unsigned int latency;
 
     unsigned int program;
     char *aas_files_path;
-    aas_port_t ports[32];
+    writer_t aas_writer;
+    aas_port_t ports[MAX_PORTS];
+    // index + 1 of the port with that hash, 0 if empty
+    uint8_t port_hash[PORT_HASH_SIZE];
+    int ports_logged;
     unsigned int first_audio_packet;
     unsigned int audio_packets;
     unsigned int audio_bytes;
@@ -81,10 +101,14 @@ void output_begin(output_t *st);
 void output_reset(output_t *st);
 void output_init_adts(output_t *st, const char *name);
 void output_init_hdc(output_t *st, const char *name);
+void output_init_callback(output_t *st);
+void output_free(output_t *st);
 #ifdef HAVE_FAAD2
 void output_init_wav(output_t *st, const char *name);
-void output_init_live(output_t *st);
+void output_init_live(output_t *st, unsigned int latency);
 #endif
 void output_aas_push(output_t *st, uint8_t *psd, unsigned int len);
+// a port from the cache, used until the station announces its ports
+void output_seed_port(output_t *st, uint16_t port_id, uint16_t pkt_size, uint8_t type, unsigned int service_data_type, unsigned int program);
 void output_set_program(output_t *st, unsigned int program);
 void output_set_aas_files_path(output_t *st, const char *path);
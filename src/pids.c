@@ -16,6 +16,7 @@
 #include <string.h>
 
 #include "defines.h"
+#include "input.h"
 #include "pids.h"
 
 static char *chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ?-*$ ";
@@ -83,9 +84,28 @@ char decode_char7(uint8_t *bits, int *off)
     return (char) decode_int(bits, off, 7);
 }
 
+static void report(pids_t *st)
+{
+    nrsc5_event_t evt;
+
+    evt.event = NRSC5_EVENT_SIS;
+    evt.sis.country_code = st->country_code[0] ? st->country_code : NULL;
+    evt.sis.fcc_facility_id = st->fcc_facility_id;
+    evt.sis.name = st->short_name[0] ? st->short_name : NULL;
+    evt.sis.long_name = st->long_name_displayed ? st->long_name : NULL;
+    evt.sis.slogan = (st->slogan_displayed && st->slogan_encoding == 0) ? st->slogan : NULL;
+    evt.sis.message = (st->message_displayed && st->message_encoding == 0) ? st->message : NULL;
+    evt.sis.alert = (st->alert_displayed && st->alert_encoding == 0) ? st->alert + 1 + (2 * st->alert_cnt_len) : NULL;
+    evt.sis.latitude = st->latitude;
+    evt.sis.longitude = st->longitude;
+    evt.sis.altitude = st->altitude;
+    input_event(st->input, &evt);
+}
+
 void decode_sis(pids_t *st, uint8_t *bits)
 {
     int payloads, off, i;
+    int changed = 0;
 
     if (bits[0] != 0) return;
     payloads = bits[1] + 1;
@@ -125,6 +145,8 @@ void decode_sis(pids_t *st, uint8_t *bits)
                 log_debug("Country: %s, FCC facility ID: %d", country_code, fcc_facility_id);
                 strcpy(st->country_code, country_code);
                 st->fcc_facility_id = fcc_facility_id;
+                input_station_identified(st->input, country_code, fcc_facility_id);
+                changed = 1;
             }
             break;
         case 1:
@@ -141,6 +163,7 @@ void decode_sis(pids_t *st, uint8_t *bits)
             {
                 log_debug("Station Name: %s", short_name);
                 strcpy(st->short_name, short_name);
+                changed = 1;
             }
             break;
         case 2:
@@ -174,6 +197,7 @@ void decode_sis(pids_t *st, uint8_t *bits)
                 {
                     log_debug("Long station name: %s", st->long_name);
                     st->long_name_displayed = 1;
+                    changed = 1;
                 }
             }
 
@@ -189,7 +213,10 @@ void decode_sis(pids_t *st, uint8_t *bits)
                 latitude = decode_signed_int(bits, &off, 22) / 8192.0;
                 st->altitude = (st->altitude & 0x0f0) | (decode_int(bits, &off, 4) << 8);
                 if ((latitude != st->latitude) && !isnan(st->longitude))
+                {
                     log_debug("Station location: %f, %f, %dm", latitude, st->longitude, st->altitude);
+                    changed = 1;
+                }
                 st->latitude = latitude;
             }
             else
@@ -197,7 +224,10 @@ void decode_sis(pids_t *st, uint8_t *bits)
                 longitude = decode_signed_int(bits, &off, 22) / 8192.0;
                 st->altitude = (st->altitude & 0xf00) | (decode_int(bits, &off, 4) << 4);
                 if ((longitude != st->longitude) && !isnan(st->latitude))
+                {
                     log_debug("Station location: %f, %f, %dm", st->latitude, longitude, st->altitude);
+                    changed = 1;
+                }
                 st->longitude = longitude;
             }
             break;
@@ -243,6 +273,7 @@ void decode_sis(pids_t *st, uint8_t *bits)
                     else
                         log_debug("Unsupported encoding: %d", st->message_encoding);
                     st->message_displayed = 1;
+                    changed = 1;
                 }
             }
             break;
@@ -403,6 +434,7 @@ void decode_sis(pids_t *st, uint8_t *bits)
                         else
                             log_warn("Unsupported encoding: %d", st->slogan_encoding);
                         st->slogan_displayed = 1;
+                        changed = 1;
                     }
                 }
             }
@@ -449,6 +481,7 @@ void decode_sis(pids_t *st, uint8_t *bits)
                     else
                         log_warn("Unsupported encoding: %d", st->alert_encoding);
                     st->alert_displayed = 1;
+                    changed = 1;
                 }
             }
             break;
@@ -456,6 +489,9 @@ void decode_sis(pids_t *st, uint8_t *bits)
             log_error("unexpected msg_id: %d", msg_id);
         }
     }
+
+    if (changed)
+        report(st);
 }
 
 void pids_frame_push(pids_t *st, uint8_t *bits)
@@ -471,10 +507,11 @@ void pids_frame_push(pids_t *st, uint8_t *bits)
         decode_sis(st, reversed);
 }
 
-void pids_init(pids_t *st)
+void pids_init(pids_t *st, struct input_t *input)
 {
     int i;
 
+    st->input = input;
     memset(st->country_code, 0, sizeof(st->country_code));
     st->fcc_facility_id = 0;
 
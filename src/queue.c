@@ -0,0 +1,170 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef USE_THREADS
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "queue.h"
+
+void queue_init(queue_t *q, const char *name, unsigned int count, unsigned int size)
+{
+    assert((count & (count - 1)) == 0);
+
+    q->data = malloc(count * size);
+    q->len = malloc(count * sizeof(unsigned int));
+    q->count = count;
+    q->size = size;
+
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->dropped, 0);
+    atomic_init(&q->max_depth, 0);
+    atomic_init(&q->closed, 0);
+    atomic_init(&q->waiting, 0);
+
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+    metrics_add_queue(q, name);
+}
+
+void queue_free(queue_t *q)
+{
+    metrics_remove_queue(q);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->len);
+    free(q->data);
+}
+
+// the index stores and the waiting count are sequentially consistent, so either a
+// waiter sees the new index before sleeping or this sees the waiter and signals it
+static void queue_wake(queue_t *q)
+{
+    if (atomic_load(&q->waiting) == 0)
+        return;
+
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+uint8_t *queue_reserve(queue_t *q, int wait)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == q->count)
+    {
+        if (!wait)
+        {
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&q->mutex);
+        atomic_fetch_add(&q->waiting, 1);
+        while (tail - atomic_load(&q->head) == q->count)
+            pthread_cond_wait(&q->cond, &q->mutex);
+        atomic_fetch_sub(&q->waiting, 1);
+        pthread_mutex_unlock(&q->mutex);
+    }
+
+    return &q->data[(tail % q->count) * q->size];
+}
+
+void queue_commit(queue_t *q, unsigned int len)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int depth = tail + 1 - atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    q->len[tail % q->count] = len;
+    atomic_store(&q->tail, tail + 1);
+
+    if (depth > atomic_load_explicit(&q->max_depth, memory_order_relaxed))
+        atomic_store_explicit(&q->max_depth, depth, memory_order_relaxed);
+
+    queue_wake(q);
+}
+
+int queue_push(queue_t *q, const uint8_t *buf, unsigned int len)
+{
+    uint8_t *slot;
+
+    if (len > q->size)
+    {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    slot = queue_reserve(q, 0);
+    if (slot == NULL)
+        return 0;
+
+    memcpy(slot, buf, len);
+    queue_commit(q, len);
+    return 1;
+}
+
+uint8_t *queue_peek(queue_t *q, unsigned int *len)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int slot = head % q->count;
+
+    if (atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+    {
+        pthread_mutex_lock(&q->mutex);
+        atomic_fetch_add(&q->waiting, 1);
+        while (atomic_load(&q->tail) == head)
+        {
+            if (atomic_load(&q->closed))
+            {
+                atomic_fetch_sub(&q->waiting, 1);
+                pthread_mutex_unlock(&q->mutex);
+                return NULL;
+            }
+            pthread_cond_wait(&q->cond, &q->mutex);
+        }
+        atomic_fetch_sub(&q->waiting, 1);
+        pthread_mutex_unlock(&q->mutex);
+    }
+
+    *len = q->len[slot];
+    return &q->data[slot * q->size];
+}
+
+void queue_pop(queue_t *q)
+{
+    atomic_fetch_add(&q->head, 1);
+    queue_wake(q);
+}
+
+void queue_close(queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    atomic_store(&q->closed, 1);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+unsigned int queue_depth(queue_t *q)
+{
+    return atomic_load(&q->tail) - atomic_load(&q->head);
+}
+#endif
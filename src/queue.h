@@ -0,0 +1,50 @@
+#pragma once
+
+#include "config.h"
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Single-producer single-consumer queue of fixed size buffers.
+ *
+ * The slots are allocated once and reused. Slots are handed over through
+ * the atomic indices. The mutex and condition variable only let an idle
+ * consumer, or a producer waiting for a free slot, sleep, and are only
+ * taken by the other side while one of them is waiting.
+ */
+typedef struct queue_t
+{
+    uint8_t *data;
+    unsigned int *len;
+    unsigned int count, size;
+
+    // head is the next slot to read, tail the next slot to write
+    atomic_uint head, tail;
+    atomic_uint dropped, max_depth;
+    atomic_int closed;
+    // number of threads sleeping on cond
+    atomic_int waiting;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} queue_t;
+
+// count must be a power of two, name is shown with the metrics of the queue
+void queue_init(queue_t *q, const char *name, unsigned int count, unsigned int size);
+void queue_free(queue_t *q);
+// get the next free slot, or NULL and count a drop if the queue is full and wait is 0
+uint8_t *queue_reserve(queue_t *q, int wait);
+// publish the reserved slot holding len bytes
+void queue_commit(queue_t *q, unsigned int len);
+// copy len bytes into the next slot without waiting, returns 0 if dropped
+int queue_push(queue_t *q, const uint8_t *buf, unsigned int len);
+// wait for the oldest slot, returns NULL once the queue is closed and empty
+uint8_t *queue_peek(queue_t *q, unsigned int *len);
+// release the slot returned by queue_peek
+void queue_pop(queue_t *q);
+void queue_close(queue_t *q);
+unsigned int queue_depth(queue_t *q);
+#endif
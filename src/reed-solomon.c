@@ -23,7 +23,18 @@
  * SOFTWARE.
  */
 
+#include "config.h"
+
 #include <stdint.h>
+#include <string.h>
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SSSE3_TARGET
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
 
 /* Define the characteristics of the Reed-Solomon codec. */
 #define M 8     /* symbol size */
@@ -36,47 +47,90 @@
 #define K (N - D)          /* length of message (K < N) */
 #define A0 N               /* field.log[A0] = 0 */
 
+#include "cpu.h"
 #include "reed-solomon.h"
 #include "galois.h"
 
-#ifdef MIN
-#undef MIN
-#endif /* MIN */
-#define MIN(a,b) \
-    ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-       _a < _b ? _a : _b; })
-
-#ifdef MAX
-#undef MAX
-#endif /* MAX */
-#define MAX(a,b) \
-    ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-       _a > _b ? _a : _b; })
+/* Syndromes use the first roots of the generator, alpha^1 to alpha^nroots. */
+typedef uint32_t (*syndrome_func_t)(const uint8_t *msg, uint32_t len, uint32_t nroots, uint8_t syndromes[]);
 
+/* Shared by all decoders, and only written once by rs_init. */
 static gf_t field;
 static uint8_t gen[D+1];
+static syndrome_func_t calculate_syndromes;
+static int32_t init_status;
+#ifdef USE_THREADS
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+#else
+static int initialized;
+#endif
 
 static void rs_generate_generator_polynomial();
-static uint32_t rs_calculate_syndromes(const uint8_t msg[N], uint8_t syndromes[D]);
-static uint32_t rs_calculate_error_locator_polynomial(const uint8_t syndromes[D], uint8_t errpoly[D + 1]);
-static int32_t rs_calculate_error_values(uint32_t errdeg, const uint8_t errpoly[D + 1], uint8_t roots[D + 1], uint8_t locpoly[E]);
-static uint32_t rs_generate_error_evaluator_polynomial(const uint8_t syndromes[D], uint32_t errdeg, const uint8_t *errpoly, uint8_t evalpoly[D]);
+static uint32_t rs_calculate_syndromes(const uint8_t *msg, uint32_t len, uint32_t nroots, uint8_t syndromes[]);
+
+#ifdef HAVE_SSSE3_TARGET
+#define SSE_TARGET __attribute__((target("ssse3")))
+
+/* Products of each nibble with alpha^(16 * (j + 1)), for multiplying 16 symbols at once. */
+static uint8_t mul_lo[RS_MAX_ROOTS][16] __attribute__((aligned(16)));
+static uint8_t mul_hi[RS_MAX_ROOTS][16] __attribute__((aligned(16)));
+
+static uint32_t rs_calculate_syndromes_sse(const uint8_t *msg, uint32_t len, uint32_t nroots, uint8_t syndromes[]);
+
+static void
+rs_generate_mul_tables(void)
+{
+    uint32_t i, j, beta;
+
+    for(j = 0; j < RS_MAX_ROOTS; j++)
+    {
+        beta = (16 * (j + 1)) % N;
+        for(i = 0; i < 16; i++)
+        {
+            mul_lo[j][i] = i ? field.exp[field.log[i] + beta] : 0;
+            mul_hi[j][i] = i ? field.exp[field.log[i << 4] + beta] : 0;
+        }
+    }
+}
+#endif
+
+static void
+rs_init_tables(void)
+{
+    if(gf_generate_field(&field, M, GF_PRIMPOLY_2_8)) {
+        init_status = -1;
+        return;
+    }
+
+    rs_generate_generator_polynomial();
+
+    calculate_syndromes = rs_calculate_syndromes;
+#ifdef HAVE_SSSE3_TARGET
+    rs_generate_mul_tables();
+    if(cpu_features() & CPU_SSSE3)
+    {
+        calculate_syndromes = rs_calculate_syndromes_sse;
+    }
+#endif
+}
 
 /**
  * Main program function.
+ * Safe to call from several threads, the tables are only generated once.
  */
 int32_t
 rs_init(void)
 {
-    if(gf_generate_field(&field, M, GF_PRIMPOLY_2_8)) {
-		return -1;
+#ifdef USE_THREADS
+    pthread_once(&init_once, rs_init_tables);
+#else
+    if(!initialized) {
+        rs_init_tables();
+        initialized = 1;
     }
+#endif
 
-    rs_generate_generator_polynomial();
-
-    return 0;
+    return init_status;
 }
 
 /* Find the generator polynomial for the BCH/RS code. */
@@ -94,14 +148,14 @@ rs_generate_generator_polynomial()
         {
             if(gen[j])
             {
-                gen[j] = gen[j - 1] ^ field.exp[(field.log[gen[j]] + i + 1) % N];
+                gen[j] = gen[j - 1] ^ field.exp[field.log[gen[j]] + i + 1];
             }
             else
             {
                 gen[j] = gen[j - 1];
             }
         }
-        gen[0] = field.exp[(field.log[gen[0]] + i + 1) % N];
+        gen[0] = field.exp[field.log[gen[0]] + i + 1];
     }
 
     for(i = 0; i <= D; i++)
@@ -144,10 +198,10 @@ rs_encode(const uint8_t msg[], uint32_t len, uint8_t parity[D])
                 parity[j] = parity[j - 1];
                 if(gen[j] != A0)
                 {
-                    parity[j] ^= field.exp[(gen[j] + fb) % N];
+                    parity[j] ^= field.exp[gen[j] + fb];
                 }
             }
-            parity[0] = field.exp[(gen[0] + fb) % N];
+            parity[0] = field.exp[gen[0] + fb];
         }
         else
         {
@@ -163,285 +217,263 @@ rs_encode(const uint8_t msg[], uint32_t len, uint8_t parity[D])
 }
 
 /* Decode a message.
- * msg will be modified in-place if there are recoverable errors.
+ * msg[i] is the coefficient of x^i, and symbols from len up to N are taken to
+ * be zero, so shortened codes need no padding. The generator has roots alpha^1
+ * to alpha^nroots, leaving the parity in the first nroots symbols.
+ * msg will be modified in-place if there are recoverable errors, and is left
+ * untouched otherwise.
  * Returns the number of errors in the message or -1 if it was unrecoverable.
  */
 int32_t
-rs_decode(uint8_t msg[N])
+rs_decode(uint8_t *msg, uint32_t len, uint32_t nroots)
 {
-    int32_t i, j, cnt;
-    uint8_t syndromes[D];
-    uint8_t errpoly[D + 1];
-    uint8_t roots[D + 1];
-    uint8_t locpoly[E];
-    uint8_t evalpoly[D];
-    uint32_t errdeg;
-    int32_t rootscnt;
-    uint32_t evaldeg;
-    uint8_t n1, n2, tmp;
-
-    if(!rs_calculate_syndromes(msg, syndromes))
+    uint8_t syndromes[RS_MAX_ROOTS];
+    uint8_t lambda[RS_MAX_ROOTS + 1];
+    uint8_t b[RS_MAX_ROOTS + 1];
+    uint8_t t[RS_MAX_ROOTS + 1];
+    uint8_t omega[RS_MAX_ROOTS];
+    uint8_t reg[RS_MAX_ROOTS + 1];
+    uint8_t loc[RS_MAX_ROOTS / 2];
+    uint8_t val[RS_MAX_ROOTS / 2];
+    uint32_t i, j, r, el, m, pos, cnt, lx, lx2, lp;
+    uint8_t discr, prev, q, num, den;
+
+    if(len > N || nroots > RS_MAX_ROOTS || nroots >= len)
     {
-        return 0;
+        return -1;
     }
-    /* FIXME: Berlekamp-Massey algorithm implementation is BROKEN! */
-    errdeg = rs_calculate_error_locator_polynomial(syndromes, errpoly);
-    /* FIXME: Chien search might be broken, too. */
-    rootscnt = rs_calculate_error_values(errdeg, errpoly, roots, locpoly);
-    if(rootscnt < 0)
+
+    if(!calculate_syndromes(msg, len, nroots, syndromes))
     {
-        return -1;
+        return 0;
     }
-    evaldeg = rs_generate_error_evaluator_polynomial(syndromes, errdeg, errpoly, evalpoly);
 
-    cnt = rootscnt;
-    for(j = cnt - 1; j >= 0; j--)
+    /* Berlekamp-Massey: find the shortest LFSR, lambda, generating the syndromes. */
+    memset(lambda, 0, sizeof(lambda));
+    memset(b, 0, sizeof(b));
+    lambda[0] = b[0] = 1;
+    el = 0;
+    m = 1;
+    prev = 1;
+    for(r = 0; r < nroots; r++)
     {
-        n1 = 0;
-        for(i = evaldeg; i >= 0; i--)
+        discr = syndromes[r];
+        for(i = 1; i <= el; i++)
         {
-            if(evalpoly[i] != A0)
+            if(lambda[i] && syndromes[r - i])
             {
-                n1 ^= field.exp[(evalpoly[i] + i * roots[j]) % N];
+                discr ^= field.exp[field.log[lambda[i]] + field.log[syndromes[r - i]]];
             }
         }
-        n2 = field.exp[(N - roots[j]) % N];
-        tmp = 0;
-        for(i = MIN(errdeg, D - 1) & ((unsigned int)-1 << 1); i >= 0; i -= 2)
+
+        if(!discr)
+        {
+            m++;
+            continue;
+        }
+
+        /* lambda -= discr / prev * x^m * b */
+        lp = field.log[discr] + N - field.log[prev];
+        if(lp >= N)
+        {
+            lp -= N;
+        }
+        memcpy(t, lambda, sizeof(t));
+        for(i = 0; i + m <= nroots; i++)
         {
-            if(errpoly[i + 1] != A0)
+            if(b[i])
             {
-                tmp ^= field.exp[(evalpoly[i] + i * roots[j]) % N];
+                lambda[i + m] ^= field.exp[field.log[b[i]] + lp];
             }
         }
 
-        if(!tmp)
+        if(2 * el <= r)
         {
-            return (cnt = -1);
+            el = r + 1 - el;
+            memcpy(b, t, sizeof(b));
+            prev = discr;
+            m = 1;
         }
-
-        if(n1 && j < E)
+        else
         {
-            msg[locpoly[j]] ^= field.exp[(field.log[n1] + field.log[n2] + N - field.log[tmp]) % N];
+            m++;
         }
     }
 
-    return cnt;
-}
-
-/* Calculate the syndromes of the message.
- * Returns zero if there are no errors in the message.
- */
-static uint32_t
-rs_calculate_syndromes(const uint8_t msg[N], uint8_t syndromes[D])
-{
-    int32_t i, j, err;
-    uint8_t tmp;
-
-    for(i = 0; i < D; i++)
+    if(el > nroots / 2 || !lambda[el])
     {
-        syndromes[i] = msg[0];
+        return -1;
     }
 
-    for(i = 1; i < N; i++)
+    /* Chien search: each error location pos is a root of lambda at alpha^-pos.
+     * reg[j] holds the log of lambda[j] * alpha^(-j * pos). */
+    for(j = 1; j <= el; j++)
     {
-        if(!msg[i])
+        reg[j] = field.log[lambda[j]];
+    }
+    cnt = 0;
+    for(pos = 0; pos < len; pos++)
+    {
+        q = 1;
+        for(j = 1; j <= el; j++)
+        {
+            if(lambda[j])
+            {
+                q ^= field.exp[reg[j]];
+                /* step to the next position */
+                reg[j] = (reg[j] >= j) ? reg[j] - j : reg[j] + N - j;
+            }
+        }
+
+        if(q)
         {
             continue;
         }
-        tmp = field.log[msg[i]];
-        for(j = 0; j < D; j++)
+        if(cnt == el)
         {
-            syndromes[j] ^= field.exp[(tmp + j * i) % N];
+            return -1;
         }
+        loc[cnt++] = pos;
     }
 
-    err = 0;
-    for(i = 0; i < D; i++)
+    /* Roots outside the message mean more errors than we can correct. */
+    if(cnt != el)
     {
-        err += !!syndromes[i];
-        syndromes[i] = field.log[syndromes[i]];
+        return -1;
     }
 
-    return err;
-}
-
-/* Calculate the error locator polynomial for the BCH/RS code.
- * Uses the Berlekamp-Massey Algorithm.
- * Returns the degree of the error polynomial (the number of errors in the message).
- */
-static uint32_t
-rs_calculate_error_locator_polynomial(const uint8_t syndromes[D], uint8_t errpoly[D + 1])
-{
-    int32_t i, r, el, discr_r;
-    uint32_t deg = 0;
-    uint8_t b[D + 1];
-    uint8_t t[D + 1];
-
-    errpoly[0] = 1;
-    b[0] = field.log[1];
-    for(i = 1; i <= D; i++)
+    /* Error evaluator polynomial, omega = syndromes * lambda mod x^nroots. */
+    for(i = 0; i < el; i++)
     {
-        errpoly[i] = 0;
-        b[i] = field.log[0];
+        omega[i] = 0;
+        for(j = 0; j <= i; j++)
+        {
+            if(syndromes[i - j] && lambda[j])
+            {
+                omega[i] ^= field.exp[field.log[syndromes[i - j]] + field.log[lambda[j]]];
+            }
+        }
     }
 
-    el = 0;
-    for(r = 0; r < D; r++)
+    /* Forney: the error value is omega(X^-1) / lambda'(X^-1) for X = alpha^pos. */
+    for(i = 0; i < cnt; i++)
     {
-        discr_r = 0;
+        lx = loc[i] ? N - loc[i] : 0;
+        lx2 = (2 * lx >= N) ? 2 * lx - N : 2 * lx;
 
-        for(i = 0; i < r; i++)
+        num = 0;
+        lp = 0;
+        for(j = 0; j < el; j++)
         {
-            if(errpoly[i] && syndromes[r - i] != A0)
+            if(omega[j])
             {
-                discr_r ^= field.exp[(errpoly[i] + syndromes[r - i]) % N];
+                num ^= field.exp[field.log[omega[j]] + lp];
             }
-        }
-        discr_r = field.log[discr_r];
-
-        if(discr_r == A0)
-        {
-            for(i = D - 1; i >= 0; i--)
+            lp += lx;
+            if(lp >= N)
             {
-                b[i + 1] = b[i];
+                lp -= N;
             }
-            b[0] = A0;
         }
-        else
+
+        /* only the odd terms survive differentiation in GF(2^m) */
+        den = 0;
+        lp = 0;
+        for(j = 1; j <= el; j += 2)
         {
-            t[0] = errpoly[0];
-            for(i = 0; i < D; i++)
+            if(lambda[j])
             {
-                t[i + 1] = errpoly[i + 1];
-                if(b[i] != A0)
-                {
-                    t[i + 1] ^= field.exp[(discr_r + b[i]) % N];
-                }
-            }
-            if(2 * el <= r)
-            {
-                el = r - el;
-                for(i = 0; i <= D; i++)
-                {
-                    if(errpoly[i])
-                    {
-                        b[i] = (field.log[errpoly[i]] - discr_r + N) % N;
-                    }
-                    else
-                    {
-                        b[i] = A0;
-                    }
-                }
-            }
-            else
-            {
-                for(i = D - 1; i >= 0; i--)
-                {
-                    b[i + 1] = b[i];
-                }
-                b[0] = A0;
+                den ^= field.exp[field.log[lambda[j]] + lp];
             }
-            for(i = 0; i <= D; i++)
+            lp += lx2;
+            if(lp >= N)
             {
-                errpoly[i] = t[i];
+                lp -= N;
             }
         }
-    }
 
-    for(i = 0; i <= D; i++)
-    {
-        if(errpoly[i])
+        if(!num || !den)
         {
-            deg = i;
+            return -1;
         }
-        errpoly[i] = field.log[errpoly[i]];
+        val[i] = field.exp[field.log[num] + N - field.log[den]];
+    }
+
+    for(i = 0; i < cnt; i++)
+    {
+        msg[loc[i]] ^= val[i];
     }
 
-    return deg;
+    return cnt;
 }
 
-/* Calculate the roots of the error locator polynomial given an error locator polynomial and its degree.
- * Also calculate the error values at each location.
- * Uses the Chien search and Forney algoritms.
- * Returns the number of roots of the error polynomial.
+/* Calculate the syndromes of the message by Horner's method.
+ * Returns zero if there are no errors in the message.
  */
-static int32_t
-rs_calculate_error_values(uint32_t errdeg, const uint8_t errpoly[D + 1], uint8_t roots[D + 1], uint8_t locpoly[E])
+static uint32_t
+rs_calculate_syndromes(const uint8_t *msg, uint32_t len, uint32_t nroots, uint8_t syndromes[])
 {
-    int32_t i, j, k, q;
-    uint8_t reg[D + 1];
-    int32_t rootscnt = 0;
+    uint32_t j, err = 0;
+    int32_t k;
+    uint8_t s;
 
-    for(i = 1; i <= D; i++)
-    {
-        reg[i] = errpoly[i];
-    }
-    k = N - 1;
-    for(i = 1; i <= N; i++)
+    for(j = 0; j < nroots; j++)
     {
-        q = 1;
-        for(j = errdeg; j > 0; j--)
+        s = 0;
+        for(k = len - 1; k >= 0; k--)
         {
-            if(reg[j] != A0)
-            {
-                reg[j] = (reg[j] + j) % N;
-                q ^= field.exp[reg[j]];
-            }
+            s = (s ? field.exp[field.log[s] + j + 1] : 0) ^ msg[k];
         }
-
-        if(q)
-        {
-            k = (N + k - 1) % N;
-            continue;
-        }
-        roots[rootscnt] = i;
-        if(rootscnt < E)
-        {
-            locpoly[rootscnt] = k;
-        }
-
-        if(++rootscnt == errdeg)
-        {
-            break;
-        }
-        k = (N + k - 1) % N;
-    }
-
-    if(rootscnt != errdeg)
-    {
-        rootscnt = -1;
+        syndromes[j] = s;
+        err |= s;
     }
 
-    return rootscnt;
+    return err;
 }
 
-/* Generate the error evaluator polynomial.
- * Returns the degree of the error evaluator polynomial.
+#ifdef HAVE_SSSE3_TARGET
+/* Calculate the syndromes 16 symbols at a time.
+ * Lane l sums msg[16 * c + l] * beta^c by Horner's method, with beta =
+ * alpha^(16 * (j + 1)), and the lanes are then combined with alpha^(l * (j + 1)).
+ * Returns zero if there are no errors in the message.
  */
-static uint32_t
-rs_generate_error_evaluator_polynomial(const uint8_t syndromes[D], uint32_t errdeg, const uint8_t *errpoly, uint8_t evalpoly[D])
+static SSE_TARGET uint32_t
+rs_calculate_syndromes_sse(const uint8_t *msg, uint32_t len, uint32_t nroots, uint8_t syndromes[])
 {
-    int32_t i, j;
-    uint32_t deg = 0;
-    uint8_t tmp;
-
-    for(i = 0; i < D; i++)
+    uint8_t tail[16] __attribute__((aligned(16)));
+    uint8_t lanes[16] __attribute__((aligned(16)));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    uint32_t j, c, chunks = (len + 15) / 16, err = 0;
+    int32_t l;
+    uint8_t s;
+
+    /* the last chunk is zero padded */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, msg + (chunks - 1) * 16, len - (chunks - 1) * 16);
+
+    for(j = 0; j < nroots; j++)
     {
-        tmp = 0;
-        for(j = (deg < i) ? deg : i; j >= 0; j--)
+        __m128i lo = _mm_load_si128((const __m128i *) mul_lo[j]);
+        __m128i hi = _mm_load_si128((const __m128i *) mul_hi[j]);
+        __m128i acc = _mm_load_si128((const __m128i *) tail);
+
+        for(c = chunks - 1; c-- > 0; )
         {
-            if(syndromes[i-j] != A0 && errpoly[j] != A0)
-            {
-                tmp ^= field.exp[(syndromes[i-j] + errpoly[j]) % N];
-            }
+            __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(acc, mask)),
+                                      _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(acc, 4), mask)));
+            acc = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *) (msg + c * 16)));
         }
-        if(tmp)
+        _mm_store_si128((__m128i *) lanes, acc);
+
+        s = 0;
+        for(l = 15; l >= 0; l--)
         {
-            deg = i;
+            s = (s ? field.exp[field.log[s] + j + 1] : 0) ^ lanes[l];
         }
-        evalpoly[i] = field.log[tmp];
+        syndromes[j] = s;
+        err |= s;
     }
 
-    return deg;
+    return err;
 }
+#endif
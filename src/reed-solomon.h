@@ -27,7 +27,10 @@
 
 #include <stdint.h>
 
+/* Most parity symbols a codeword may have. */
+#define RS_MAX_ROOTS 32
+
 int32_t rs_init(void);
-int32_t rs_decode(uint8_t *msg);
+int32_t rs_decode(uint8_t *msg, uint32_t len, uint32_t nroots);
 
 #endif /* REED_SOLOMON_H */
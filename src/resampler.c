@@ -0,0 +1,138 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "resampler.h"
+
+#define WINDOW_SIZE 4096
+// fractional delays of the filter, close enough that picking the nearest
+// one adds timing jitter far below the noise of an 8-bit capture
+#define RESAMPLER_PHASES 256
+#define TAPS_PER_OUTPUT 24
+
+void resampler_init(resampler_t *st, double in_rate, double out_rate)
+{
+    double ratio = in_rate / out_rate;
+    // cutoff below the Nyquist frequency of the slower rate, in cycles per input sample
+    double fc = 0.45 * (ratio > 1 ? 1 / ratio : 1);
+    unsigned int p, k;
+
+    st->ntaps = TAPS_PER_OUTPUT * (ratio > 1 ? (unsigned int) ceil(ratio) : 1);
+    st->taps = malloc(sizeof(float) * st->ntaps * (RESAMPLER_PHASES + 1));
+    st->window_r = calloc(sizeof(float), WINDOW_SIZE + st->ntaps);
+    st->window_i = calloc(sizeof(float), WINDOW_SIZE + st->ntaps);
+    st->idx = st->ntaps - 1;
+
+    // windowed sinc centered between the taps, delayed by p / RESAMPLER_PHASES
+    for (p = 0; p <= RESAMPLER_PHASES; p++)
+    {
+        float *taps = &st->taps[p * st->ntaps];
+        double sum = 0;
+
+        for (k = 0; k < st->ntaps; k++)
+        {
+            double t = k - (st->ntaps - 1) / 2.0 + (double) p / RESAMPLER_PHASES;
+            double x = t / st->ntaps + 0.5;
+            double w = 0.42 - 0.5 * cos(2 * M_PI * x) + 0.08 * cos(4 * M_PI * x);
+            double h = (t == 0) ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+
+            taps[k] = h * w;
+            sum += taps[k];
+        }
+        // unity gain for every delay
+        for (k = 0; k < st->ntaps; k++)
+            taps[k] /= sum;
+    }
+
+    st->step = ratio;
+    st->wait = 0;
+    st->have_pending = 0;
+}
+
+void resampler_free(resampler_t *st)
+{
+    free(st->window_i);
+    free(st->window_r);
+    free(st->taps);
+}
+
+unsigned int resampler_max_output(resampler_t *st, unsigned int n)
+{
+    return (unsigned int) ceil(n / st->step) + 2;
+}
+
+static cint16_t filter(resampler_t *st, unsigned int start, unsigned int phase)
+{
+    const float *r = &st->window_r[start], *i = &st->window_i[start];
+    const float *taps = &st->taps[phase * st->ntaps];
+    float sum_r = 0, sum_i = 0;
+    cint16_t y;
+
+    for (unsigned int k = 0; k < st->ntaps; k++)
+    {
+        sum_r += r[k] * taps[k];
+        sum_i += i[k] * taps[k];
+    }
+
+    // same scale and conjugation as input_cb applies to u8 samples
+    y.r = lrintf(fminf(fmaxf(sum_r * 64, -32768), 32767));
+    y.i = lrintf(fminf(fmaxf(-sum_i * 64, -32768), 32767));
+    return y;
+}
+
+unsigned int resampler_execute(resampler_t *st, const float complex *x, unsigned int n, cint16_t *y)
+{
+    unsigned int i, count = 0;
+
+    if (st->have_pending)
+    {
+        y[count++] = st->pending;
+        st->have_pending = 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        st->window_r[st->idx] = crealf(x[i]);
+        st->window_i[st->idx] = cimagf(x[i]);
+        st->idx++;
+
+        // outputs fall between the previous sample and this one, -wait before this one
+        st->wait -= 1;
+        while (st->wait <= 0)
+        {
+            unsigned int phase = lrint(-st->wait * RESAMPLER_PHASES);
+
+            y[count++] = filter(st, st->idx - st->ntaps, phase);
+            st->wait += st->step;
+        }
+
+        if (st->idx == WINDOW_SIZE + st->ntaps)
+        {
+            memmove(st->window_r, &st->window_r[WINDOW_SIZE + 1], sizeof(float) * (st->ntaps - 1));
+            memmove(st->window_i, &st->window_i[WINDOW_SIZE + 1], sizeof(float) * (st->ntaps - 1));
+            st->idx = st->ntaps - 1;
+        }
+    }
+
+    if (count % 2)
+    {
+        st->pending = y[--count];
+        st->have_pending = 1;
+    }
+
+    return count;
+}
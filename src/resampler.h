@@ -0,0 +1,36 @@
+#pragma once
+
+#include <complex.h>
+#include <stdint.h>
+
+#include "defines.h"
+
+/*
+ * Resample complex samples from any rate to another with a windowed sinc
+ * filter, picking the nearest of RESAMPLER_PHASES fractional delays for
+ * each output. Inputs are centered on zero with the range of u8 samples,
+ * outputs have the same scale and conjugation as input_cb gives u8 samples.
+ */
+typedef struct
+{
+    unsigned int ntaps;
+    // [RESAMPLER_PHASES + 1][ntaps], reversed so the newest sample comes last
+    float *taps;
+    float *window_r, *window_i;
+    unsigned int idx;
+
+    // input samples per output, and input samples left until the next output
+    double step;
+    double wait;
+
+    // an odd output waiting for its pair
+    int have_pending;
+    cint16_t pending;
+} resampler_t;
+
+void resampler_init(resampler_t *st, double in_rate, double out_rate);
+void resampler_free(resampler_t *st);
+// most outputs for n inputs
+unsigned int resampler_max_output(resampler_t *st, unsigned int n);
+// resample n samples from x into y, returns an even number of outputs
+unsigned int resampler_execute(resampler_t *st, const float complex *x, unsigned int n, cint16_t *y);
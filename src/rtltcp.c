@@ -0,0 +1,192 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "defines.h"
+#include "net.h"
+#include "rtltcp.h"
+
+// commands of rtl_tcp, each followed by a big-endian 32-bit parameter
+enum
+{
+    RTLTCP_SET_FREQ = 0x01,
+    RTLTCP_SET_SAMPLE_RATE = 0x02,
+    RTLTCP_SET_GAIN_MODE = 0x03,
+    RTLTCP_SET_GAIN = 0x04,
+    RTLTCP_SET_FREQ_CORRECTION = 0x05,
+    RTLTCP_SET_AGC_MODE = 0x08
+};
+
+#ifdef HAVE_SYS_SOCKET_H
+static const char *tuner_names[] = { "unknown", "E4000", "FC0012", "FC0013", "FC2580", "R820T", "R828D" };
+
+static uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// fill len bytes, returns the number received before the server disconnected
+static size_t recv_all(int fd, uint8_t *buf, size_t len)
+{
+    size_t used = 0;
+
+    while (used < len)
+    {
+        ssize_t n = recv(fd, buf + used, len - used, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+    }
+    return used;
+}
+
+static int send_command(rtltcp_t *st, uint8_t cmd, uint32_t param)
+{
+    uint8_t buf[5] = { cmd, param >> 24, param >> 16, param >> 8, param };
+
+    return send(st->fd, buf, sizeof(buf), MSG_NOSIGNAL) == sizeof(buf) ? 0 : -1;
+}
+
+int rtltcp_open(rtltcp_t *st, const char *address, unsigned int buf_len)
+{
+    uint8_t header[12];
+
+    memset(st, 0, sizeof(*st));
+    st->fd = net_connect(address, RTLTCP_DEFAULT_PORT, 0);
+    if (st->fd < 0)
+        return 1;
+
+    // the magic, the tuner and its number of gains
+    if (recv_all(st->fd, header, sizeof(header)) != sizeof(header) || memcmp(header, "RTL0", 4) != 0)
+    {
+        log_error("%s is not an rtl_tcp server", address);
+        close(st->fd);
+        return 1;
+    }
+    st->tuner_type = read_be32(&header[4]);
+    st->gain_count = read_be32(&header[8]);
+    log_info("Connected to rtl_tcp at %s, %s tuner with %u gains", address,
+             st->tuner_type < sizeof(tuner_names) / sizeof(tuner_names[0]) ? tuner_names[st->tuner_type] : tuner_names[0],
+             st->gain_count);
+
+    st->buf_len = buf_len;
+    st->buf = malloc(buf_len);
+    return 0;
+}
+
+void rtltcp_close(rtltcp_t *st)
+{
+    close(st->fd);
+    free(st->buf);
+}
+
+void rtltcp_cancel(rtltcp_t *st)
+{
+    shutdown(st->fd, SHUT_RDWR);
+}
+
+int rtltcp_set_center_freq(rtltcp_t *st, uint32_t freq)
+{
+    return send_command(st, RTLTCP_SET_FREQ, freq);
+}
+
+int rtltcp_set_sample_rate(rtltcp_t *st, uint32_t rate)
+{
+    return send_command(st, RTLTCP_SET_SAMPLE_RATE, rate);
+}
+
+int rtltcp_set_freq_correction(rtltcp_t *st, int ppm)
+{
+    return send_command(st, RTLTCP_SET_FREQ_CORRECTION, (uint32_t) ppm);
+}
+
+int rtltcp_set_tuner_gain(rtltcp_t *st, int gain)
+{
+    // the AGC of the RTL2832 only confuses the gain of the tuner
+    if (send_command(st, RTLTCP_SET_AGC_MODE, 0) != 0)
+        return -1;
+    if (gain == INT_MIN)
+        return send_command(st, RTLTCP_SET_GAIN_MODE, 0);
+    if (send_command(st, RTLTCP_SET_GAIN_MODE, 1) != 0)
+        return -1;
+    return send_command(st, RTLTCP_SET_GAIN, (uint32_t) gain);
+}
+
+void rtltcp_read(rtltcp_t *st, rtltcp_cb_t cb, void *arg)
+{
+    while (1)
+    {
+        size_t len = recv_all(st->fd, st->buf, st->buf_len);
+
+        // whole pairs of samples only, as the decoder decimates them by two
+        len &= ~(size_t) 3;
+        if (len)
+            cb(st->buf, len, arg);
+        if (len < st->buf_len)
+            break;
+    }
+    log_info("rtl_tcp server disconnected");
+}
+#else
+int rtltcp_open(rtltcp_t *st, const char *address, unsigned int buf_len)
+{
+    log_error("rtl_tcp is not supported on this platform");
+    return 1;
+}
+
+void rtltcp_close(rtltcp_t *st)
+{
+}
+
+void rtltcp_cancel(rtltcp_t *st)
+{
+}
+
+int rtltcp_set_center_freq(rtltcp_t *st, uint32_t freq)
+{
+    return -1;
+}
+
+int rtltcp_set_sample_rate(rtltcp_t *st, uint32_t rate)
+{
+    return -1;
+}
+
+int rtltcp_set_freq_correction(rtltcp_t *st, int ppm)
+{
+    return -1;
+}
+
+int rtltcp_set_tuner_gain(rtltcp_t *st, int gain)
+{
+    return -1;
+}
+
+void rtltcp_read(rtltcp_t *st, rtltcp_cb_t cb, void *arg)
+{
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define RTLTCP_DEFAULT_PORT "1234"
+
+// u8 samples as received, with the signature of input_cb
+typedef void (*rtltcp_cb_t)(uint8_t *, uint32_t, void *);
+
+/*
+ * Client of an rtl_tcp server, which streams the samples of a remote
+ * RTL-SDR and takes the tuner commands of librtlsdr.
+ */
+typedef struct
+{
+    int fd;
+    uint32_t tuner_type;
+    uint32_t gain_count;
+    uint8_t *buf;
+    unsigned int buf_len;
+} rtltcp_t;
+
+// address is host[:port], returns 0 on success
+int rtltcp_open(rtltcp_t *st, const char *address, unsigned int buf_len);
+void rtltcp_close(rtltcp_t *st);
+// make rtltcp_read return, safe to call from a signal handler
+void rtltcp_cancel(rtltcp_t *st);
+// the commands return 0 if they were sent, the server does not answer them
+int rtltcp_set_center_freq(rtltcp_t *st, uint32_t freq);
+int rtltcp_set_sample_rate(rtltcp_t *st, uint32_t rate);
+int rtltcp_set_freq_correction(rtltcp_t *st, int ppm);
+// gain in tenths of a dB, or the automatic gain of the tuner with INT_MIN
+int rtltcp_set_tuner_gain(rtltcp_t *st, int gain);
+// pass whole buffers of buf_len bytes to cb until the server disconnects
+void rtltcp_read(rtltcp_t *st, rtltcp_cb_t cb, void *arg);
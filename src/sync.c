@@ -16,15 +16,66 @@
 #include "config.h"
 
 #include <math.h>
+#include <string.h>
 
 #include "defines.h"
 #include "input.h"
+#include "metrics.h"
 #include "sync.h"
+#include "timing.h"
+
+// squared distance from the nearest QPSK point for the 18 data subcarriers of
+// the partition starting at the reference subcarrier
+static void demod_error(const float complex *partition, float *err)
+{
+    const float *x = (const float *) &partition[1];
+
+    for (int k = 0; k < 18; k++)
+    {
+        float dr = (x[2 * k] >= 0 ? 1 : -1) - x[2 * k];
+        float di = (x[2 * k + 1] >= 0 ? 1 : -1) - x[2 * k + 1];
+        err[k] = dr * dr + di * di;
+    }
+}
+
+// hard decisions of the data subcarriers in consecutive partitions, as soft
+// bits of the given magnitude
+static int8_t *demod_partitions(const float complex *row, unsigned int count, int8_t mult, int8_t *out)
+{
+    for (unsigned int p = 0; p < count; p++)
+    {
+        const float *x = (const float *) &row[p * 19 + 1];
+
+        for (int k = 0; k < 36; k++)
+            out[k] = x[k] >= 0 ? mult : -mult;
+        out += 36;
+    }
+    return out;
+}
+
+// as demod_partitions, with the magnitude scaled by each subcarrier's weight
+static int8_t *demod_partitions_weighted(const float complex *row, const float *weights, unsigned int count, float mult, int8_t *out)
+{
+    for (unsigned int p = 0; p < count; p++)
+    {
+        const float *x = (const float *) &row[p * 19 + 1];
+        const float *w = &weights[p * 19 + 1];
+
+        for (int k = 0; k < 36; k++)
+        {
+            int8_t m = fmaxf(fminf(mult * w[k / 2], 127), 1);
+            out[k] = x[k] >= 0 ? m : -m;
+        }
+        out += 36;
+    }
+    return out;
+}
 
 static void adjust_ref(sync_t *st, unsigned int ref, int cfo)
 {
     unsigned int n;
     float cfo_freq = 2 * M_PI * cfo * CP / FFTCP;
+    float *phases = st->phases[ref - LB_START];
 
     // sync bits (after DBPSK)
     static const signed char sync[] = {
@@ -33,10 +84,13 @@ static void adjust_ref(sync_t *st, unsigned int ref, int cfo)
 
     for (n = 0; n < BLKSZ; n++)
     {
-        float error = cargf(st->buffer[ref][n] * st->buffer[ref][n] * cexpf(-I * 2 * st->costas_phase[ref])) * 0.5;
+        float complex *c = &st->buffer[n][ref - SYNC_FIRST];
+
+        // squaring removes the BPSK modulation from the corrected sample
+        *c *= conjf(cexpf_fast(st->costas_phase[ref]));
+        float error = cargf(*c * *c) * 0.5;
 
-        st->phases[ref][n] = st->costas_phase[ref];
-        st->buffer[ref][n] *= cexpf(-I * st->costas_phase[ref]);
+        phases[n] = st->costas_phase[ref];
 
         st->costas_freq[ref] += st->beta * error;
         if (st->costas_freq[ref] > 0.5) st->costas_freq[ref] = 0.5;
@@ -49,26 +103,26 @@ static void adjust_ref(sync_t *st, unsigned int ref, int cfo)
     // compare to sync bits
     float x = 0;
     for (n = 0; n < sizeof(sync); n++)
-        x += crealf(st->buffer[ref][n]) * sync[n];
+        x += crealf(st->buffer[n][ref - SYNC_FIRST]) * sync[n];
     if (x < 0)
     {
         // adjust phase by pi to compensate
         for (n = 0; n < BLKSZ; n++)
         {
-            st->phases[ref][n] += M_PI;
-            st->buffer[ref][n] *= -1;
+            phases[n] += M_PI;
+            st->buffer[n][ref - SYNC_FIRST] *= -1;
         }
         st->costas_phase[ref] += M_PI;
     }
 }
 
-static void decode_dbpsk(const float complex *buf, unsigned char *data, int size)
+static void decode_dbpsk(sync_t *st, unsigned int ref, unsigned char *data, int size)
 {
     unsigned char prev = 0;
 
     for (int n = 0; n < size; n++)
     {
-        unsigned char bit = crealf(buf[n]) <= 0 ? 0 : 1;
+        unsigned char bit = crealf(st->buffer[n][ref - SYNC_FIRST]) <= 0 ? 0 : 1;
         data[n] = bit ^ prev;
         prev = bit;
     }
@@ -103,23 +157,146 @@ static int find_first_block(sync_t *st, unsigned int ref, int *psmi)
     unsigned char data[BLKSZ];
     int n;
 
-    *psmi = -1;
-    decode_dbpsk(st->buffer[ref], data, BLKSZ);
+    *psmi = st->psmi_seed;
+    decode_dbpsk(st, ref, data, BLKSZ);
     n = fuzzy_match(needle, sizeof(needle), data, BLKSZ);
     if (n == 0)
+    {
         *psmi = (data[25] << 5) | (data[26] << 4) | (data[27] << 3) | (data[28] << 2) | (data[29] << 1) | data[30];
+        st->psmi_seed = -1;
+    }
     return n;
 }
 
-static int find_ref(sync_t *st, unsigned int ref, unsigned int rsid)
+// rotation of the reference bits of the subcarrier within the block, and the L1 block count they carry
+static int find_block_count(sync_t *st, int ref, unsigned int *count)
 {
-    signed char needle[] = {
-        0, 1, 1, 0, 0, 1, 0, -1, -1, 1, rsid >> 1, rsid & 1, 0, (rsid >> 1) ^ (rsid & 1), 0, -1, -1, -1, -1, -1, -1, 1, 1, 1
+    // as for find_first_block, with any block count
+    static const signed char needle[] = {
+        0, 1, 1, 0, 0, 1, 0, -1, -1, 1, 1, 0, 0, 1, 0, -1, -1, -1, -1, -1, -1, 1, 1, 1
     };
+    const float complex *prev = &st->buffer[BLKSZ - 1][ref - SYNC_FIRST];
     unsigned char data[BLKSZ];
+    int n;
 
-    decode_dbpsk(st->buffer[ref], data, BLKSZ);
-    return fuzzy_match(needle, sizeof(needle), data, BLKSZ);
+    // differential bits straight from the symbols, as the phase of a neighbouring subcarrier is not tracked
+    for (n = 0; n < BLKSZ; n++)
+    {
+        const float complex *x = &st->buffer[n][ref - SYNC_FIRST];
+        data[n] = crealf(*x * conjf(*prev)) < 0;
+        prev = x;
+    }
+
+    n = fuzzy_match(needle, sizeof(needle), data, BLKSZ);
+    if (n >= 0)
+        *count = (data[(n + 16) % BLKSZ] << 3) | (data[(n + 17) % BLKSZ] << 2) | (data[(n + 18) % BLKSZ] << 1) | data[(n + 19) % BLKSZ];
+    return n;
+}
+
+/*
+ * Estimate the integer CFO and the block alignment together, from all
+ * reference subcarriers of the primary main partitions. Products of
+ * consecutive symbols remove each reference's channel phase and the CFO
+ * rotation, so they can be correlated against the known reference bits
+ * without tracking, and the magnitudes are combined over references.
+ * Returns the alignment, or -1 if no candidate matches well enough.
+ */
+static int find_cfo(sync_t *st, int *cfo)
+{
+    // known reference subcarrier bits, except for the rsid
+    static const signed char fixed[] = {
+        0, 1, 1, 0, 0, 1, 0, -1, -1, 1, -1, -1, 0, -1, 0, -1, -1, -1, -1, -1, -1, 1, 1, 1
+    };
+    // magnitude of the correlation for each candidate and alignment
+    static const unsigned int candidates = CFO_MARGIN * 2;
+    float score[CFO_MARGIN * 2][BLKSZ], energy[CFO_MARGIN * 2];
+    float best = 0;
+    int best_cfo = 0, best_offset = -1;
+
+    memset(score, 0, sizeof(score));
+    memset(energy, 0, sizeof(energy));
+
+    for (int s = 0; s < 2; s++)
+    {
+        // lowest subcarrier that any candidate reads on this sideband
+        int first = (s == 0 ? LB_START : UB_END - PM_PARTITIONS * 19) - CFO_MARGIN;
+
+        for (int k = first; k < first + PM_PARTITIONS * 19 + 2 * CFO_MARGIN; k++)
+        {
+            float complex d[BLKSZ], f[BLKSZ], r[BLKSZ][3];
+            float mag[4][BLKSZ], mean = 0;
+
+            for (int n = 1; n < BLKSZ; n++)
+            {
+                d[n] = st->buffer[n][k - SYNC_FIRST] * conjf(st->buffer[n - 1][k - SYNC_FIRST]);
+                mean += cabsf(d[n]);
+            }
+            // the first symbol has no predecessor in the block
+            d[0] = 0;
+            mean /= BLKSZ - 1;
+
+            for (int n0 = 0; n0 < BLKSZ; n0++)
+            {
+                f[n0] = 0;
+                for (unsigned int m = 0; m < sizeof(fixed); m++)
+                {
+                    if (fixed[m] >= 0)
+                        f[n0] += fixed[m] ? -d[(n0 + m) % BLKSZ] : d[(n0 + m) % BLKSZ];
+                }
+                r[n0][0] = d[(n0 + 10) % BLKSZ];
+                r[n0][1] = d[(n0 + 11) % BLKSZ];
+                r[n0][2] = d[(n0 + 13) % BLKSZ];
+            }
+
+            // rsid bits are 10 and 11, with their parity in bit 13
+            for (int rsid = 0; rsid < 4; rsid++)
+            {
+                for (int n0 = 0; n0 < BLKSZ; n0++)
+                {
+                    float complex v = f[n0];
+                    v += (rsid >> 1) ? -r[n0][0] : r[n0][0];
+                    v += (rsid & 1) ? -r[n0][1] : r[n0][1];
+                    v += ((rsid >> 1) ^ (rsid & 1)) ? -r[n0][2] : r[n0][2];
+                    mag[rsid][n0] = cabsf(v);
+                }
+            }
+
+            // add to every candidate that puts a reference here
+            for (unsigned int p = 0; p <= PM_PARTITIONS; p++)
+            {
+                int ref = s == 0 ? LB_START + p * 19 : UB_END - p * 19;
+                int i = k - ref;
+                // rsid counts down from 2 at the outer edge of each sideband
+                int rsid = (6 - p % 4) % 4;
+
+                if (i < -CFO_MARGIN || i >= CFO_MARGIN)
+                    continue;
+                for (int n0 = 0; n0 < BLKSZ; n0++)
+                    score[i + CFO_MARGIN][n0] += mag[rsid][n0];
+                energy[i + CFO_MARGIN] += mean;
+            }
+        }
+    }
+
+    for (unsigned int c = 0; c < candidates; c++)
+    {
+        for (int n0 = 0; n0 < BLKSZ; n0++)
+        {
+            if (score[c][n0] > best)
+            {
+                best = score[c][n0];
+                best_cfo = c - CFO_MARGIN;
+                best_offset = n0;
+            }
+        }
+    }
+
+    // a perfect match is the 16 known bits on every reference
+    if (best_offset < 0 || best < 0.5f * 16 * energy[best_cfo + CFO_MARGIN])
+        return -1;
+
+    *cfo = best_cfo;
+    return best_offset;
 }
 
 static float calc_smag(sync_t *st, unsigned int ref)
@@ -127,10 +304,74 @@ static float calc_smag(sync_t *st, unsigned int ref)
     float sum = 0;
     // phase was already corrected, so imaginary component is zero
     for (int n = 0; n < BLKSZ; n++)
-        sum += fabsf(crealf(st->buffer[ref][n]));
+        sum += fabsf(crealf(st->buffer[n][ref - SYNC_FIRST]));
     return sum / BLKSZ;
 }
 
+// reference amplitude of each symbol, smoothed over time within the block and
+// across blocks, then over neighbouring references of the same sideband
+static void estimate_channel(sync_t *st, unsigned int partitions_per_band)
+{
+    const float lambda = 0.25;
+    float raw[MAX_PARTITIONS + 1][BLKSZ];
+
+    for (int s = 0; s < 2; s++)
+    {
+        float sum = 0;
+
+        for (unsigned int p = 0; p <= partitions_per_band; p++)
+        {
+            unsigned int ref = s == 0 ? LB_START + p * 19 : UB_END - p * 19;
+            float g = st->eq_gain[s][p];
+
+            if (g == 0)
+                g = calc_smag(st, ref);
+            for (int n = 0; n < BLKSZ; n++)
+            {
+                // the phase is already corrected, see calc_smag
+                g += lambda * (fabsf(crealf(st->buffer[n][ref - SYNC_FIRST])) - g);
+                raw[p][n] = g;
+            }
+            st->eq_gain[s][p] = g;
+        }
+
+        for (unsigned int p = 0; p <= partitions_per_band; p++)
+        {
+            unsigned int prev = p > 0 ? p - 1 : p + 1;
+            unsigned int next = p < partitions_per_band ? p + 1 : p - 1;
+
+            for (int n = 0; n < BLKSZ; n++)
+            {
+                float a = (raw[prev][n] + 2 * raw[p][n] + raw[next][n]) / 4;
+                st->eq_amp[s][p][n] = a;
+                sum += a * a;
+            }
+        }
+        st->eq_norm[s] = (partitions_per_band + 1) * BLKSZ / sum;
+    }
+}
+
+static void equalize_data(sync_t *st, unsigned int lower, unsigned int upper, const float *amp_lower, const float *amp_upper)
+{
+    for (int n = 0; n < BLKSZ; n++)
+    {
+        float complex upper_phase = amp_upper[n] * cexpf_fast(st->phases[upper - LB_START][n]);
+        float complex lower_phase = amp_lower[n] * cexpf_fast(st->phases[lower - LB_START][n]);
+        float complex *row = &st->buffer[n][lower - SYNC_FIRST];
+        float *weights = &st->weights[n][lower - LB_START];
+
+        for (int k = 1; k < 19; k++)
+        {
+            // channel gain interpolated between the references
+            float complex H = (k * upper_phase + (19 - k) * lower_phase) * (1.0f / 19);
+            float h2 = normf(H);
+
+            row[k] *= CMPLXF(1, 1) * conjf(H) * (1 / h2);
+            weights[k] = h2;
+        }
+    }
+}
+
 static void adjust_data(sync_t *st, unsigned int lower, unsigned int upper)
 {
     float smag0, smag19;
@@ -139,15 +380,17 @@ static void adjust_data(sync_t *st, unsigned int lower, unsigned int upper)
 
     for (int n = 0; n < BLKSZ; n++)
     {
-        float complex upper_phase = cexpf(st->phases[upper][n] * I);
-        float complex lower_phase = cexpf(st->phases[lower][n] * I);
+        float complex upper_phase = smag19 * cexpf_fast(st->phases[upper - LB_START][n]);
+        float complex lower_phase = smag0 * cexpf_fast(st->phases[lower - LB_START][n]);
+        float complex *row = &st->buffer[n][lower - SYNC_FIRST];
 
         for (int k = 1; k < 19; k++)
         {
-            // average phase difference
-            float complex C = CMPLXF(19,19) / (k * smag19 * upper_phase + (19 - k) * smag0 * lower_phase);
+            // average phase difference, inverted by multiplying with the conjugate
+            float complex D = k * upper_phase + (19 - k) * lower_phase;
+            float complex C = CMPLXF(19,19) * conjf(D) * (1 / normf(D));
             // adjust sample
-            st->buffer[lower + k][n] *= C;
+            row[k] *= C;
         }
     }
 }
@@ -160,13 +403,89 @@ float phase_diff(float a, float b)
     return diff;
 }
 
+// blocks of soft bits that carry nothing, so the decoder keeps its place in the interleavers
+static void push_erasures(sync_t *st, unsigned int blocks)
+{
+    int p3 = st->psmi == 3 && (st->input->profile & INPUT_PROFILE_FRAMES);
+
+    memset(st->soft_pm, 0, sizeof(st->soft_pm));
+    memset(st->soft_px1, 0, sizeof(st->soft_px1));
+    while (blocks--)
+    {
+        if (st->input->mark_cb)
+            decode_mark(&st->input->decode, st->position);
+        decode_push_pm_block(&st->input->decode, st->soft_pm, sizeof(st->soft_pm));
+        if (p3)
+            decode_push_px1_block(&st->input->decode, st->soft_px1, sizeof(st->soft_px1));
+    }
+}
+
+/*
+ * Look for the reference bits within a few symbols and subcarriers of the
+ * last lock, and line the decoder up with the block count they carry.
+ * Returns 1 when the block in the buffer is the one the decoder expects.
+ */
+static int reacquire(sync_t *st)
+{
+    unsigned int expected = decode_get_block(&st->input->decode), count = 0, missing = 1;
+    int i, n = -1, cfo = 0;
+
+    // a skip or CFO correction only reaches the acquisition window after the
+    // one this block came from, so the block that follows may not have it yet
+    if (st->track_wait)
+    {
+        st->track_wait--;
+        push_erasures(st, 1);
+        if (--st->tracking == 0)
+            log_info("Fast reacquisition failed, searching again");
+        return 0;
+    }
+
+    for (i = 0; i <= 2 * SYNC_TRACK_CFO && n < 0; i++)
+    {
+        // 0, -1, 1, -2, 2...
+        cfo = (i & 1) ? -(i + 1) / 2 : i / 2;
+        n = find_block_count(st, LB_START + cfo, &count);
+        if (n < 0)
+            n = find_block_count(st, UB_END + cfo, &count);
+        if (n > SYNC_TRACK_SYMBOLS && n < BLKSZ - SYNC_TRACK_SYMBOLS)
+            n = -1;
+    }
+
+    if (n == 0 && cfo == 0 && count == expected)
+        return 1;
+
+    // count is the block that fills most of the buffer, which starts at n, or
+    // n - BLKSZ when it began in the previous buffer. Skipping n symbols puts
+    // the next block start on a buffer start, one block after count or two.
+    if (n >= 0 && ((count - expected) & 15) <= SYNC_TRACK_SLIP)
+    {
+        unsigned int next = (count + (n < BLKSZ - SYNC_TRACK_SYMBOLS ? 1 : 2)) % 16;
+
+        // this block is lost, and so are any the decoder has fallen behind by
+        missing = (next - expected) & 15;
+        log_debug("Reacquiring: block %u @ %d, CFO %d", count, n, cfo);
+        if (n > 0 || cfo != 0)
+        {
+            acquire_cfo_adjust(&st->input->acq, cfo);
+            if (n > 0)
+                input_set_skip(st->input, n * FFTCP);
+            st->track_wait = 1;
+        }
+    }
+    push_erasures(st, missing);
+
+    if (--st->tracking == 0)
+        log_info("Fast reacquisition failed, searching again");
+    return 0;
+}
+
 void sync_process(sync_t *st)
 {
     int i;
-    static int psmi = 1;
     unsigned int partitions_per_band;
 
-    switch (psmi) {
+    switch (st->psmi) {
         case 2:
             partitions_per_band = 11;
             break;
@@ -191,22 +510,55 @@ void sync_process(sync_t *st)
     // check if we lost synchronization or now have it
     if (st->ready)
     {
-        if (decode_get_block(&st->input->decode) == 0 && find_first_block(st, LB_START, &psmi) != 0)
+        if (decode_get_block(&st->input->decode) == 0 && find_first_block(st, LB_START, &st->psmi) != 0)
         {
-            if (find_first_block(st, UB_END, &psmi) != 0)
+            if (find_first_block(st, UB_END, &st->psmi) != 0)
             {
-                log_debug("lost sync (%d, %d)!", find_first_block(st, LB_START, &psmi), find_first_block(st, UB_END, &psmi));
+                nrsc5_event_t evt;
+
+                log_debug("lost sync (%d, %d)!", find_first_block(st, LB_START, &st->psmi), find_first_block(st, UB_END, &st->psmi));
                 st->ready = 0;
+                memset(st->eq_gain, 0, sizeof(st->eq_gain));
+                metrics_count(METRICS_SYNC_LOST, 1);
+                metrics_set(METRICS_SYNC, 0);
+
+                evt.event = NRSC5_EVENT_LOST_SYNC;
+                input_event(st->input, &evt);
+
+                // a short fade is bridged with erasures, keeping the state of the decoder and outputs
+                if (!st->scan)
+                {
+                    st->tracking = SYNC_TRACK_BLOCKS;
+                    st->lost_blocks = 0;
+                    st->track_wait = 0;
+                    push_erasures(st, 1);
+                }
             }
         }
     }
+    else if (st->tracking)
+    {
+        st->lost_blocks++;
+        if (reacquire(st))
+        {
+            nrsc5_event_t evt;
+
+            log_info("Synchronized again after %u blocks", st->lost_blocks);
+            st->tracking = 0;
+            st->ready = 1;
+            metrics_set(METRICS_SYNC, 1);
+
+            evt.event = NRSC5_EVENT_SYNC;
+            input_event(st->input, &evt);
+        }
+    }
     else
     {
         // First and last reference subcarriers have the same data. Try both
         // in case one of the sidebands is too corrupted.
-        int offset = find_first_block(st, LB_START, &psmi);
+        int offset = find_first_block(st, LB_START, &st->psmi);
         if (offset < 0)
-            offset = find_first_block(st, UB_END, &psmi);
+            offset = find_first_block(st, UB_END, &st->psmi);
 
         if (offset > 0)
         {
@@ -215,34 +567,30 @@ void sync_process(sync_t *st)
         }
         else if (offset == 0)
         {
+            nrsc5_event_t evt;
+
             log_info("Synchronized!");
             decode_reset(&st->input->decode);
             st->ready = 1;
+            metrics_set(METRICS_SYNC, 1);
+
+            evt.event = NRSC5_EVENT_SYNC;
+            input_event(st->input, &evt);
         }
         else if (st->cfo_wait == 0)
         {
-            for (i = -38; i < 38; ++i)
+            int cfo;
+
+            offset = find_cfo(st, &cfo);
+            if (offset > 0 || (offset == 0 && cfo != 0))
             {
-                int offset2;
-                adjust_ref(st, LB_START + (PM_PARTITIONS * 19) + i, i);
-                offset = find_ref(st, LB_START + (PM_PARTITIONS * 19) + i, 0);
-                if (offset < 0)
-                    continue;
-                // We think we found the start. Check upperband to confirm.
-                adjust_ref(st, UB_END - (PM_PARTITIONS * 19) + i, i);
-                offset2 = find_ref(st, UB_END - (PM_PARTITIONS * 19) + i, 0);
-                if (offset2 == offset)
-                {
-                    // The offsets matched, so 'i' is likely the CFO.
-                    input_set_skip(st->input, offset * FFTCP);
-                    acquire_cfo_adjust(&st->input->acq, i);
+                input_set_skip(st->input, offset * FFTCP);
+                acquire_cfo_adjust(&st->input->acq, cfo);
 
-                    log_debug("Block @ %d", offset);
+                log_debug("Block @ %d", offset);
 
-                    // Wait until the buffers have cleared before measuring again.
-                    st->cfo_wait = 8;
-                    break;
-                }
+                // Wait until the buffers have cleared before measuring again.
+                st->cfo_wait = 8;
             }
         }
         else
@@ -252,18 +600,33 @@ void sync_process(sync_t *st)
         }
     }
 
+    // a scan only needs to know that the station was found
+    if (st->scan)
+        return;
+
     // if we are still synchronized
     if (st->ready)
     {
         float samperr = 0, angle = 0;
         float sum_xy = 0, sum_x2 = 0;
+        if (st->equalize)
+            estimate_channel(st, partitions_per_band);
         for (i = 0; i < partitions_per_band * 19; i += 19)
         {
-            adjust_data(st, LB_START + i, LB_START + i + 19);
-            adjust_data(st, UB_END - i - 19, UB_END - i);
+            if (st->equalize)
+            {
+                unsigned int p = i / 19;
+                equalize_data(st, LB_START + i, LB_START + i + 19, st->eq_amp[0][p], st->eq_amp[0][p + 1]);
+                equalize_data(st, UB_END - i - 19, UB_END - i, st->eq_amp[1][p + 1], st->eq_amp[1][p]);
+            }
+            else
+            {
+                adjust_data(st, LB_START + i, LB_START + i + 19);
+                adjust_data(st, UB_END - i - 19, UB_END - i);
+            }
 
-            samperr += phase_diff(st->phases[LB_START + i][0], st->phases[LB_START + i + 19][0]);
-            samperr += phase_diff(st->phases[UB_END - i - 19][0], st->phases[UB_END - i][0]);
+            samperr += phase_diff(st->phases[i][0], st->phases[i + 19][0]);
+            samperr += phase_diff(st->phases[UB_END - LB_START - i - 19][0], st->phases[UB_END - LB_START - i][0]);
         }
         samperr = samperr / (partitions_per_band * 2) * 2048 / 19 / (2 * M_PI);
 
@@ -293,20 +656,19 @@ void sync_process(sync_t *st)
         float error_lb = 0, error_ub = 0;
         for (int n = 0; n < BLKSZ; n++)
         {
-            float complex c, ideal;
-            for (i = 0; i < partitions_per_band * 19; i += 19)
-            {
-                unsigned int j;
-                for (j = 1; j < 19; j++)
-                {
-                    c = st->buffer[LB_START + i + j][n];
-                    ideal = CMPLXF(crealf(c) >= 0 ? 1 : -1, cimagf(c) >= 0 ? 1 : -1);
-                    error_lb += normf(ideal - c);
+            const float complex *row = &st->buffer[n][LB_START - SYNC_FIRST];
+            float err_lb[MAX_PARTITIONS * 18], err_ub[MAX_PARTITIONS * 18];
 
-                    c = st->buffer[UB_END - i - 19 + j][n];
-                    ideal = CMPLXF(crealf(c) >= 0 ? 1 : -1, cimagf(c) >= 0 ? 1 : -1);
-                    error_ub += normf(ideal - c);
-                }
+            for (i = 0; i < partitions_per_band; i++)
+            {
+                demod_error(&row[i * 19], &err_lb[i * 18]);
+                demod_error(&row[UB_END - LB_START - (i + 1) * 19], &err_ub[i * 18]);
+            }
+            // summed in order, so the result does not depend on vectorization
+            for (i = 0; i < partitions_per_band * 18; i++)
+            {
+                error_lb += err_lb[i];
+                error_ub += err_ub[i];
             }
         }
 
@@ -319,7 +681,15 @@ void sync_process(sync_t *st)
             float signal = 2 * BLKSZ * (partitions_per_band * 18) * st->mer_cnt;
             float mer_db_lb = 10 * log10f(signal / st->error_lb);
             float mer_db_ub = 10 * log10f(signal / st->error_ub);
+            nrsc5_event_t evt;
+
             log_info("MER: %.1f dB (lower), %.1f dB (upper)", mer_db_lb, mer_db_ub);
+            metrics_set(METRICS_MER_LOWER, mer_db_lb);
+            metrics_set(METRICS_MER_UPPER, mer_db_ub);
+            evt.event = NRSC5_EVENT_MER;
+            evt.mer.lower = mer_db_lb;
+            evt.mer.upper = mer_db_ub;
+            input_event(st->input, &evt);
             st->mer_cnt = 0;
             st->error_lb = 0;
             st->error_ub = 0;
@@ -331,53 +701,42 @@ void sync_process(sync_t *st)
         float mult_lb = fmaxf(fminf(mer_lb * 10, 127), 1);
         float mult_ub = fmaxf(fminf(mer_ub * 10, 127), 1);
 
-#define DEMOD(x) ((x) >= 0 ? 1 : -1)
+        int8_t *pm = st->soft_pm, *px1 = st->soft_px1;
+        // P3 only carries frames, which the profile may not need
+        int p3 = st->psmi == 3 && (st->input->profile & INPUT_PROFILE_FRAMES);
+        unsigned int ub = UB_END - LB_START - (PM_PARTITIONS * 19);
         for (int n = 0; n < BLKSZ; n++)
         {
-            float complex c;
-            for (i = LB_START; i < LB_START + (PM_PARTITIONS * 19); i += 19)
+            const float complex *row = &st->buffer[n][LB_START - SYNC_FIRST];
+
+            if (st->equalize)
             {
-                unsigned int j;
-                for (j = 1; j < 19; j++)
+                // soft bits follow the channel gain of each subcarrier
+                const float *weights = st->weights[n];
+                float w_lb = mult_lb * st->eq_norm[0], w_ub = mult_ub * st->eq_norm[1];
+
+                pm = demod_partitions_weighted(row, weights, PM_PARTITIONS, w_lb, pm);
+                pm = demod_partitions_weighted(&row[ub], &weights[ub], PM_PARTITIONS, w_ub, pm);
+                if (p3)
                 {
-                    c = st->buffer[i + j][n];
-                    decode_push_pm(&st->input->decode, DEMOD(crealf(c)) * mult_lb);
-                    decode_push_pm(&st->input->decode, DEMOD(cimagf(c)) * mult_lb);
+                    px1 = demod_partitions_weighted(&row[PM_PARTITIONS * 19], &weights[PM_PARTITIONS * 19], 2, w_lb, px1);
+                    px1 = demod_partitions_weighted(&row[ub - 38], &weights[ub - 38], 2, w_ub, px1);
                 }
+                continue;
             }
-            for (i = UB_END - (PM_PARTITIONS * 19); i < UB_END; i += 19)
+
+            pm = demod_partitions(row, PM_PARTITIONS, mult_lb, pm);
+            pm = demod_partitions(&row[ub], PM_PARTITIONS, mult_ub, pm);
+            if (p3)
             {
-                unsigned int j;
-                for (j = 1; j < 19; j++)
-                {
-                    c = st->buffer[i + j][n];
-                    decode_push_pm(&st->input->decode, DEMOD(crealf(c)) * mult_ub);
-                    decode_push_pm(&st->input->decode, DEMOD(cimagf(c)) * mult_ub);
-                }
-            }
-            if (psmi == 3) {
-                for (i = LB_START + (PM_PARTITIONS * 19); i < LB_START + (PM_PARTITIONS * 19) + 38; i += 19)
-                {
-                    unsigned int j;
-                    for (j = 1; j < 19; j++)
-                    {
-                        c = st->buffer[i + j][n];
-                        decode_push_px1(&st->input->decode, DEMOD(crealf(c)) * mult_lb);
-                        decode_push_px1(&st->input->decode, DEMOD(cimagf(c)) * mult_lb);
-                    }
-                }
-                for (i = UB_END - (PM_PARTITIONS * 19) - 38; i < UB_END - (PM_PARTITIONS * 19); i += 19)
-                {
-                    unsigned int j;
-                    for (j = 1; j < 19; j++)
-                    {
-                        c = st->buffer[i + j][n];
-                        decode_push_px1(&st->input->decode, DEMOD(crealf(c)) * mult_ub);
-                        decode_push_px1(&st->input->decode, DEMOD(cimagf(c)) * mult_ub);
-                    }
-                }
+                px1 = demod_partitions(&row[PM_PARTITIONS * 19], 2, mult_lb, px1);
+                px1 = demod_partitions(&row[ub - 38], 2, mult_ub, px1);
             }
         }
+        if (st->input->mark_cb)
+            decode_mark(&st->input->decode, st->position);
+        decode_push_pm_block(&st->input->decode, st->soft_pm, pm - st->soft_pm);
+        decode_push_px1_block(&st->input->decode, st->soft_px1, px1 - st->soft_px1);
     }
 }
 
@@ -388,40 +747,79 @@ void sync_adjust(sync_t *st, int sample_adj)
         st->costas_phase[i] -= sample_adj * (i - 1024) * 2 * M_PI / FFT;
 }
 
+void sync_set_equalizer(sync_t *st, int enable)
+{
+    st->equalize = enable;
+    if (enable && st->weights == NULL)
+        st->weights = input_alloc(st->input, sizeof(float) * BLKSZ * SYNC_CARRIERS);
+}
+
+void sync_set_scan(sync_t *st, int enable)
+{
+    st->scan = enable;
+}
+
 void sync_push(sync_t *st, float complex *fftout)
 {
-    unsigned int i;
-    for (i = 0; i < FFT; ++i)
-        st->buffer[i][st->idx] = fftout[i];
+    // only the active subcarriers are kept, one contiguous row per symbol,
+    // and the halves of the unshifted FFT are swapped while copying
+    memcpy(st->buffer[st->idx], &fftout[SYNC_FIRST + FFT / 2], sizeof(float complex) * (FFT / 2 - SYNC_FIRST));
+    memcpy(&st->buffer[st->idx][FFT / 2 - SYNC_FIRST], fftout, sizeof(float complex) * (SYNC_LAST - FFT / 2 + 1));
 
     if (++st->idx == BLKSZ)
     {
+        uint64_t start = timing_start();
+
         st->idx = 0;
 
         sync_process(st);
+        timing_stop(TIMING_SYNC, start);
     }
 }
 
-void sync_init(sync_t *st, input_t *input)
+void sync_reset(sync_t *st)
 {
     unsigned int i;
-    float loop_bw = 0.05, damping = 0.70710678;
-    float denom = 1 + (2 * damping * loop_bw) + (loop_bw * loop_bw);
-    st->alpha = (4 * damping * loop_bw) / denom;
-    st->beta = (4 * loop_bw * loop_bw) / denom;
+
     for (i = 0; i < FFT; i++)
     {
         st->costas_freq[i] = 0;
         st->costas_phase[i] = 0;
     }
 
-    st->input = input;
-    st->buffer = malloc(sizeof(float complex) * BLKSZ * FFT);
-    st->phases = malloc(sizeof(float) * BLKSZ * FFT);
     st->ready = 0;
+    st->tracking = 0;
+    st->track_wait = 0;
     st->idx = 0;
-    st->cfo_wait = 0;
+    // symbol timing is only settled after the first acquisition window
+    st->cfo_wait = 2;
+    st->samperr = 0;
+    st->angle = 0;
     st->mer_cnt = 0;
     st->error_lb = 0;
     st->error_ub = 0;
+    st->psmi = 1;
+    st->psmi_seed = -1;
+    memset(st->eq_gain, 0, sizeof(st->eq_gain));
+}
+
+void sync_init(sync_t *st, input_t *input)
+{
+    float loop_bw = 0.05, damping = 0.70710678;
+    float denom = 1 + (2 * damping * loop_bw) + (loop_bw * loop_bw);
+    st->alpha = (4 * damping * loop_bw) / denom;
+    st->beta = (4 * loop_bw * loop_bw) / denom;
+
+    st->input = input;
+    st->buffer = input_alloc(input, sizeof(float complex) * BLKSZ * SYNC_WIDTH);
+    st->phases = input_alloc(input, sizeof(float) * SYNC_CARRIERS * BLKSZ);
+    st->equalize = 0;
+    st->scan = 0;
+    st->weights = NULL;
+    sync_reset(st);
+}
+
+void sync_free(sync_t *st)
+{
+    // the buffers are released with the arena of the input
 }
@@ -3,16 +3,48 @@
 #include "config.h"
 
 #include <complex.h>
+#include <stdint.h>
+
+// subcarriers from LB_START to UB_END
+#define SYNC_CARRIERS (UB_END - LB_START + 1)
+// range of the CFO search, in subcarriers either way
+#define CFO_MARGIN 76
+// sync keeps the subcarriers the CFO search can reach
+#define SYNC_FIRST (LB_START - CFO_MARGIN)
+#define SYNC_LAST (UB_END + CFO_MARGIN)
+#define SYNC_WIDTH (SYNC_LAST - SYNC_FIRST + 1)
+// partitions per sideband in the widest service mode
+#define MAX_PARTITIONS 14
+// blocks after a loss of sync that are searched near the last lock, about 4.5 s
+#define SYNC_TRACK_BLOCKS 48
+// symbols and subcarriers either way that the reference bits may have moved by during a fade
+#define SYNC_TRACK_SYMBOLS 2
+#define SYNC_TRACK_CFO 1
+// blocks that may go missing when the timing slips
+#define SYNC_TRACK_SLIP 1
 
 typedef struct
 {
     struct input_t *input;
-    float complex (*buffer)[BLKSZ];
+    // buffer[symbol][subcarrier - SYNC_FIRST]
+    float complex (*buffer)[SYNC_WIDTH];
+    // phases[subcarrier - LB_START][symbol]
     float (*phases)[BLKSZ];
     unsigned int idx;
     int ready;
+    // blocks left to search near the last lock before a full acquisition
+    int tracking;
+    unsigned int lost_blocks;
+    // blocks to let through before a skip or CFO correction can be checked
+    int track_wait;
+    // primary service mode from the last system control data sequence
+    int psmi;
+    // cached mode to assume until the first sequence is decoded, -1 if none
+    int psmi_seed;
     int cfo_wait;
     int samperr;
+    // input position of the symbol being pushed, set by acquire
+    uint64_t position;
     float angle;
 
     float alpha;
@@ -23,8 +55,32 @@ typedef struct
     int mer_cnt;
     float error_lb;
     float error_ub;
+
+    // channel equalizer, the amplitude of each reference subcarrier is
+    // smoothed over time and frequency instead of averaged over the block
+    int equalize;
+    // amplitude tracked across blocks, [sideband][partition boundary]
+    float eq_gain[2][MAX_PARTITIONS + 1];
+    float eq_amp[2][MAX_PARTITIONS + 1][BLKSZ];
+    // inverse of the mean squared amplitude of each sideband
+    float eq_norm[2];
+    // weights[symbol][subcarrier - LB_START], squared channel gain
+    float (*weights)[SYNC_CARRIERS];
+
+    // stop once the first block is found, without demodulating for the decoder
+    int scan;
+
+    // soft bits of the last block, handed to the decoder in one piece
+    int8_t soft_pm[720 * BLKSZ];
+    int8_t soft_px1[144 * BLKSZ];
 } sync_t;
 
 void sync_adjust(sync_t *st, int sample_adj);
+void sync_set_equalizer(sync_t *st, int enable);
+void sync_set_scan(sync_t *st, int enable);
+// fft is the output of the symbol's FFT before fftshift
 void sync_push(sync_t *st, float complex *fft);
 void sync_init(sync_t *st, struct input_t *input);
+// forget the signal being tracked, keeping the buffers and settings
+void sync_reset(sync_t *st);
+void sync_free(sync_t *st);
@@ -0,0 +1,139 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+
+#include "timing.h"
+
+// sub-buckets per power of two, so a bucket spans at most 1/16 of its value
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct
+{
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total;
+    // complement of the minimum, so that zero means no calls
+    atomic_uint_fast64_t inv_min;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[BUCKETS];
+} stage_t;
+
+static const char *stage_names[TIMING_STAGES] = {
+    "decim",
+    "acquire",
+    "sync",
+    "deinterleave",
+    "viterbi_p1",
+    "viterbi_pids",
+    "viterbi_p3",
+    "frame",
+    "hdc_to_aac",
+    "aac",
+};
+
+int timing_enabled;
+static stage_t stages[TIMING_STAGES];
+
+static unsigned int bucket_index(uint64_t ns)
+{
+    unsigned int e;
+
+    if (ns < SUB_COUNT)
+        return ns;
+
+    e = 63 - __builtin_clzll(ns);
+    return (e - SUB_BITS + 1) * SUB_COUNT + ((ns >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// largest duration that falls into the bucket
+static uint64_t bucket_limit(unsigned int b)
+{
+    unsigned int e;
+
+    if (b < SUB_COUNT)
+        return b;
+
+    e = b / SUB_COUNT + SUB_BITS - 1;
+    return ((uint64_t) (SUB_COUNT + b % SUB_COUNT + 1) << (e - SUB_BITS)) - 1;
+}
+
+void timing_enable(int enable)
+{
+    timing_enabled = enable;
+}
+
+void timing_reset(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < TIMING_STAGES; i++)
+    {
+        atomic_store(&stages[i].count, 0);
+        atomic_store(&stages[i].total, 0);
+        atomic_store(&stages[i].inv_min, 0);
+        atomic_store(&stages[i].max, 0);
+        for (j = 0; j < BUCKETS; j++)
+            atomic_store(&stages[i].buckets[j], 0);
+    }
+}
+
+const char *timing_stage_name(timing_stage_t stage)
+{
+    return stage_names[stage];
+}
+
+void timing_record(timing_stage_t stage, uint64_t ns)
+{
+    stage_t *st = &stages[stage];
+    uint_fast64_t old;
+
+    atomic_fetch_add_explicit(&st->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->total, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+
+    old = atomic_load_explicit(&st->inv_min, memory_order_relaxed);
+    while (~ns > old && !atomic_compare_exchange_weak(&st->inv_min, &old, ~ns))
+        ;
+    old = atomic_load_explicit(&st->max, memory_order_relaxed);
+    while (ns > old && !atomic_compare_exchange_weak(&st->max, &old, ns))
+        ;
+}
+
+void timing_get(timing_stage_t stage, timing_stats_t *stats)
+{
+    stage_t *st = &stages[stage];
+
+    stats->count = atomic_load(&st->count);
+    stats->total = atomic_load(&st->total);
+    stats->min = stats->count ? ~atomic_load(&st->inv_min) : 0;
+    stats->max = atomic_load(&st->max);
+}
+
+uint64_t timing_percentile(timing_stage_t stage, double fraction)
+{
+    stage_t *st = &stages[stage];
+    uint64_t count = atomic_load(&st->count), seen = 0, max = atomic_load(&st->max);
+    unsigned int b;
+
+    for (b = 0; b < BUCKETS; b++)
+    {
+        seen += atomic_load(&st->buckets[b]);
+        if (seen > 0 && seen >= fraction * count)
+            return bucket_limit(b) < max ? bucket_limit(b) : max;
+    }
+    return max;
+}
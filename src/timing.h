@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// stages of the receive chain that can be timed
+typedef enum
+{
+    TIMING_DECIM,
+    TIMING_ACQUIRE,
+    TIMING_SYNC,
+    TIMING_DEINTERLEAVE,
+    TIMING_VITERBI_P1,
+    TIMING_VITERBI_PIDS,
+    TIMING_VITERBI_P3,
+    TIMING_FRAME,
+    TIMING_HDC_TO_AAC,
+    TIMING_AAC,
+    TIMING_STAGES
+} timing_stage_t;
+
+// durations of the calls to a stage, in nanoseconds
+typedef struct
+{
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} timing_stats_t;
+
+// nonzero while stages are being timed, checked before reading the clock
+extern int timing_enabled;
+
+/*
+ * Latency histograms of each stage, shared by every receiver of the process.
+ * Disabled timing costs one branch per call, so the stages are always
+ * instrumented. Calls are recorded with atomic counters and may come from
+ * any thread.
+ */
+void timing_enable(int enable);
+void timing_reset(void);
+const char *timing_stage_name(timing_stage_t stage);
+void timing_get(timing_stage_t stage, timing_stats_t *stats);
+// duration below which the given fraction of the calls finished, within 1/16
+uint64_t timing_percentile(timing_stage_t stage, double fraction);
+void timing_record(timing_stage_t stage, uint64_t ns);
+
+static inline uint64_t timing_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// returns 0 if timing is disabled
+static inline uint64_t timing_start(void)
+{
+    return timing_enabled ? timing_now() : 0;
+}
+
+static inline void timing_stop(timing_stage_t stage, uint64_t start)
+{
+    if (start)
+        timing_record(stage, timing_now() - start);
+}
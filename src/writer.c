@@ -0,0 +1,289 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "defines.h"
+#include "writer.h"
+
+// buffers are page aligned, like the blocks of the disk
+#define WRITER_ALIGN 4096
+
+typedef enum
+{
+    JOB_STREAM,
+    JOB_CREATE,
+    JOB_APPEND,
+    // data holds the new path
+    JOB_RENAME,
+    JOB_REMOVE
+} writer_op_t;
+
+typedef struct
+{
+    writer_op_t op;
+    // NULL for data of the stream
+    char *path;
+    uint8_t *data;
+    unsigned int len;
+} writer_job_t;
+
+static void write_data(writer_t *w, const uint8_t *buf, unsigned int len)
+{
+#ifdef HAVE_SYS_SOCKET_H
+    // straight from the batch, a datagram socket gets each flushed batch as one datagram
+    if (w->datagram)
+    {
+        // nobody listening to a datagram yet is not an error
+        if (send(fileno(w->fp), buf, len, MSG_NOSIGNAL) < 0 && errno != ECONNREFUSED)
+            log_warn("Failed to send output (%d)", errno);
+        return;
+    }
+    if (w->socket)
+    {
+        while (len > 0)
+        {
+            ssize_t sent = send(fileno(w->fp), buf, len, MSG_NOSIGNAL);
+
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                // includes EAGAIN once a send timeout runs out
+                log_warn("Failed to send output (%d)", errno);
+                return;
+            }
+            buf += sent;
+            len -= sent;
+        }
+        return;
+    }
+#endif
+    if (fwrite(buf, 1, len, w->fp) != len)
+        log_warn("Failed to write output (%d)", errno);
+    if (w->stream)
+        fflush(w->fp);
+}
+
+static void write_whole_file(const char *path, const uint8_t *buf, unsigned int len, const char *mode)
+{
+    FILE *fp = fopen(path, mode);
+    if (fp == NULL)
+    {
+        log_warn("Failed to open %s (%d)", path, errno);
+        return;
+    }
+    fwrite(buf, 1, len, fp);
+    fclose(fp);
+}
+
+static void run_job(writer_t *w, writer_op_t op, const char *path, const uint8_t *data, unsigned int len)
+{
+    switch (op)
+    {
+    case JOB_STREAM:
+        write_data(w, data, len);
+        break;
+    case JOB_CREATE:
+        write_whole_file(path, data, len, "wb");
+        break;
+    case JOB_APPEND:
+        write_whole_file(path, data, len, "ab");
+        break;
+    case JOB_RENAME:
+        if (rename(path, (const char *) data) != 0)
+            log_warn("Failed to rename %s (%d)", path, errno);
+        break;
+    case JOB_REMOVE:
+        remove(path);
+        break;
+    }
+}
+
+#ifdef USE_THREADS
+static void *writer_worker(void *arg)
+{
+    writer_t *w = arg;
+    unsigned int len, dropped = 0;
+    uint8_t *slot;
+
+    while ((slot = queue_peek(&w->queue, &len)) != NULL)
+    {
+        writer_job_t *job = (writer_job_t *) slot;
+
+        run_job(w, job->op, job->path, job->data, job->len);
+        free(job->path);
+        free(job->data);
+        queue_pop(&w->queue);
+
+        if (atomic_load(&w->queue.dropped) != dropped)
+        {
+            unsigned int n = atomic_load(&w->queue.dropped);
+            log_warn("Output file is too slow, dropped %u buffers", n - dropped);
+            dropped = n;
+        }
+    }
+
+    return NULL;
+}
+
+static void submit(writer_t *w, writer_op_t op, char *path, uint8_t *data, unsigned int len)
+{
+    writer_job_t *job = (writer_job_t *) queue_reserve(&w->queue, !w->drop);
+
+    if (job == NULL)
+    {
+        free(path);
+        free(data);
+        return;
+    }
+    job->op = op;
+    job->path = path;
+    job->data = data;
+    job->len = len;
+    queue_commit(&w->queue, sizeof(*job));
+}
+#endif
+
+static void submit_batch(writer_t *w)
+{
+    if (w->used == 0)
+        return;
+
+#ifdef USE_THREADS
+    submit(w, JOB_STREAM, NULL, w->batch, w->used);
+    w->batch = NULL;
+#else
+    write_data(w, w->batch, w->used);
+#endif
+    w->used = 0;
+}
+
+void writer_init(writer_t *w, FILE *fp, int drop)
+{
+    struct stat sb;
+    int known = fp && fstat(fileno(fp), &sb) == 0;
+
+    w->fp = fp;
+    w->drop = drop;
+    w->stream = fp && (!known || !S_ISREG(sb.st_mode));
+    w->socket = known && S_ISSOCK(sb.st_mode);
+    w->datagram = 0;
+#ifdef HAVE_SYS_SOCKET_H
+    if (w->socket)
+    {
+        int type;
+        socklen_t type_len = sizeof(type);
+
+        if (getsockopt(fileno(fp), SOL_SOCKET, SO_TYPE, &type, &type_len) == 0)
+            w->datagram = type == SOCK_DGRAM;
+    }
+#endif
+    w->batch = NULL;
+    w->used = 0;
+
+#ifdef USE_THREADS
+    queue_init(&w->queue, "writer", WRITER_QUEUE_LEN, sizeof(writer_job_t));
+    pthread_create(&w->worker_thread, NULL, writer_worker, w);
+#ifdef HAVE_PTHREAD_SETNAME_NP
+    pthread_setname_np(w->worker_thread, "writer");
+#endif
+#endif
+}
+
+void writer_free(writer_t *w)
+{
+    submit_batch(w);
+#ifdef USE_THREADS
+    queue_close(&w->queue);
+    pthread_join(w->worker_thread, NULL);
+    queue_free(&w->queue);
+#endif
+    free(w->batch);
+    if (w->fp)
+        fflush(w->fp);
+}
+
+void writer_write(writer_t *w, const void *buf, unsigned int len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0)
+    {
+        unsigned int n;
+
+        if (w->batch == NULL && posix_memalign((void **) &w->batch, WRITER_ALIGN, WRITER_BATCH) != 0)
+            FATAL_EXIT("Unable to allocate output buffer.");
+
+        n = WRITER_BATCH - w->used;
+        if (n > len)
+            n = len;
+        memcpy(w->batch + w->used, p, n);
+        w->used += n;
+        p += n;
+        len -= n;
+
+        if (w->used == WRITER_BATCH)
+            submit_batch(w);
+    }
+}
+
+void writer_flush(writer_t *w)
+{
+    if (w->stream)
+        submit_batch(w);
+}
+
+static void file_job(writer_t *w, writer_op_t op, const char *path, const void *buf, unsigned int len)
+{
+#ifdef USE_THREADS
+    uint8_t *data = malloc(len);
+
+    if (len)
+        memcpy(data, buf, len);
+    submit(w, op, strdup(path), data, len);
+#else
+    run_job(w, op, path, buf, len);
+#endif
+}
+
+void writer_write_file(writer_t *w, const char *path, const uint8_t *buf, unsigned int len)
+{
+    file_job(w, JOB_CREATE, path, buf, len);
+}
+
+void writer_append_file(writer_t *w, const char *path, const uint8_t *buf, unsigned int len)
+{
+    file_job(w, JOB_APPEND, path, buf, len);
+}
+
+void writer_rename_file(writer_t *w, const char *from, const char *to)
+{
+    file_job(w, JOB_RENAME, from, to, strlen(to) + 1);
+}
+
+void writer_remove_file(writer_t *w, const char *path)
+{
+    file_job(w, JOB_REMOVE, path, NULL, 0);
+}
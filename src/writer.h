@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+
+#ifdef USE_THREADS
+#include <pthread.h>
+
+#include "queue.h"
+#endif
+
+// bytes collected before a regular file is written
+#define WRITER_BATCH (256 * 1024)
+// batches waiting for the disk, must be a power of two
+#define WRITER_QUEUE_LEN 32
+
+/*
+ * Writes files from a background thread, so a slow disk does not stall the
+ * decoder. Data for the stream is copied into aligned batches, whose
+ * ownership moves to the thread once full. Pipes, terminals and sockets get
+ * their data on every writer_flush instead.
+ */
+typedef struct
+{
+    FILE *fp;
+    // drop data instead of waiting when the disk falls behind
+    int drop;
+    int stream;
+    // sent without stdio, and without a signal when the peer is gone
+    int socket;
+    // each send is one packet, a short send of one is not finished later
+    int datagram;
+    uint8_t *batch;
+    unsigned int used;
+
+#ifdef USE_THREADS
+    queue_t queue;
+    pthread_t worker_thread;
+#endif
+} writer_t;
+
+// fp may be NULL if only whole files are written
+void writer_init(writer_t *w, FILE *fp, int drop);
+// writes everything still queued, does not close fp
+void writer_free(writer_t *w);
+void writer_write(writer_t *w, const void *buf, unsigned int len);
+// hand over a pipe or terminal's data now, regular files are written in batches
+void writer_flush(writer_t *w);
+// create the file at path holding a copy of buf
+void writer_write_file(writer_t *w, const char *path, const uint8_t *buf, unsigned int len);
+void writer_append_file(writer_t *w, const char *path, const uint8_t *buf, unsigned int len);
+void writer_rename_file(writer_t *w, const char *from, const char *to);
+void writer_remove_file(writer_t *w, const char *path);